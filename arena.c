@@ -8,12 +8,19 @@ static arena_t *get_local_arena() {
   return &arena;
 }
 
+#ifdef ARENA_STATS
+static arena_stats_t stats;
+#endif // ARENA_STATS
+
 static void *a_malloc(size_t size) {
   void *ptr = malloc(size);
   if (ptr == NULL) {
     perror("malloc() failed");
     exit(-1);
   }
+#ifdef ARENA_STATS
+  stats.reserved += size;
+#endif // ARENA_STATS
   return ptr;
 }
 
@@ -27,15 +34,18 @@ void _a_init(size_t capacity) {
 
 void *a_alloc(size_t size) {
   arena_t *a = get_local_arena(), *curr = a;
-  assert(curr->capacity >= size);
+  assert(a->data != NULL);
 
   while (!(curr->size + size <= curr->capacity)) {
     if (curr->next == NULL) {
+      // A block of its own for what is bigger than the blocks a_init sized,
+      // kept for the next such allocation after a_reset like any other.
+      size_t capacity = size > a->capacity ? size : a->capacity;
       arena_t *next = (arena_t *)a_malloc(sizeof(arena_t));
-      next->capacity = a->capacity;
+      next->capacity = capacity;
       next->size = 0;
       next->next = NULL;
-      next->data = (uint8_t *)a_malloc(a->capacity);
+      next->data = (uint8_t *)a_malloc(capacity);
       curr->next = next;
     }
     curr = curr->next;
@@ -43,6 +53,12 @@ void *a_alloc(size_t size) {
 
   uint8_t *data = &curr->data[curr->size];
   curr->size += size;
+#ifdef ARENA_STATS
+  stats.allocated += size;
+  stats.in_use += size;
+  if (stats.in_use > stats.high_water)
+    stats.high_water = stats.in_use;
+#endif // ARENA_STATS
   return data;
 }
 
@@ -57,6 +73,9 @@ void *a_realloc(void *old_ptr, size_t old_size, size_t new_size) {
 }
 
 void a_reset() {
+#ifdef ARENA_STATS
+  stats.in_use = stats.high_water = 0;
+#endif // ARENA_STATS
   arena_t *curr = get_local_arena();
   while (curr != NULL) {
     curr->size = 0;
@@ -64,7 +83,19 @@ void a_reset() {
   }
 }
 
+// All zero without ARENA_STATS.
+arena_stats_t a_stats() {
+#ifdef ARENA_STATS
+  return stats;
+#else
+  return (arena_stats_t){0, 0, 0, 0};
+#endif // ARENA_STATS
+}
+
 void a_free() {
+#ifdef ARENA_STATS
+  stats.in_use = stats.reserved = 0;
+#endif // ARENA_STATS
   arena_t *a = get_local_arena();
   free(a->data);
   a->capacity = 0;
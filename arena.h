@@ -5,6 +5,8 @@
 #include <stdint.h>
 
 #define ARENA_DEBUG
+// Comment out to stop a_alloc from keeping count for a_stats.
+#define ARENA_STATS
 
 typedef struct arena {
   struct arena *next;
@@ -12,10 +14,18 @@ typedef struct arena {
   uint8_t *data;
 } arena_t;
 
+typedef struct arena_stats {
+  size_t allocated;  // bytes handed out since a_init.
+  size_t in_use;     // bytes handed out since the last a_reset.
+  size_t high_water; // most bytes in use at once since the last a_reset.
+  size_t reserved;   // bytes of all blocks malloc'd.
+} arena_stats_t;
+
 void _a_init(size_t);
 void *a_alloc(size_t);
 void *a_realloc(void *, size_t, size_t);
 void a_reset();
+arena_stats_t a_stats();
 void a_free();
 
 #define a_init(size)                                                           \
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times the corpus of bench/inline.c compiled without and with inlining,
+// after checking that both agree. See that file for how to build it.
+
+#define LENGTH 4096
+#define RUNS 20000
+
+int poly_off(int), poly_on(int);
+int dot_off(int *, int *, long), dot_on(int *, int *, long);
+int saturate_off(int *, long), saturate_on(int *, long);
+int fib_off(int), fib_on(int);
+
+static int a[LENGTH], b[LENGTH];
+static volatile int sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int poly_off_all(void) {
+  int sum = 0;
+  for (int i = 0; i < LENGTH; i++)
+    sum += poly_off(a[i]);
+  return sum;
+}
+
+static int poly_on_all(void) {
+  int sum = 0;
+  for (int i = 0; i < LENGTH; i++)
+    sum += poly_on(a[i]);
+  return sum;
+}
+
+static int dot_off_all(void) { return dot_off(a, b, LENGTH); }
+static int dot_on_all(void) { return dot_on(a, b, LENGTH); }
+static int saturate_off_all(void) { return saturate_off(a, LENGTH); }
+static int saturate_on_all(void) { return saturate_on(a, LENGTH); }
+static int fib_off_all(void) { return fib_off(20); }
+static int fib_on_all(void) { return fib_on(20); }
+
+static const struct {
+  const char *name;
+  int (*off)(void), (*on)(void);
+  int runs;
+} kernels[] = {
+    {"poly", poly_off_all, poly_on_all, RUNS},
+    {"dot", dot_off_all, dot_on_all, RUNS},
+    {"saturate", saturate_off_all, saturate_on_all, RUNS},
+    {"fib", fib_off_all, fib_on_all, RUNS / 20},
+};
+
+static double measure(int (*kernel)(void), int runs) {
+  double start = now();
+  for (int run = 0; run < runs; run++)
+    sink = kernel();
+  return (now() - start) * 1e9 / runs;
+}
+
+int main(void) {
+  srand(1);
+  for (int i = 0; i < LENGTH; i++) {
+    a[i] = rand() % 401 - 200;
+    b[i] = rand() % 401 - 200;
+  }
+
+  printf("%-10s %12s %12s %8s\n", "ns/run", "off", "on", "speedup");
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    if (kernels[i].off() != kernels[i].on()) {
+      printf("%s: results differ\n", kernels[i].name);
+      return 1;
+    }
+    double off = measure(kernels[i].off, kernels[i].runs);
+    double on = measure(kernels[i].on, kernels[i].runs);
+    printf("%-10s %12.0f %12.0f %7.2fx\n", kernels[i].name, off, on, off / on);
+  }
+  return 0;
+}
@@ -0,0 +1,416 @@
+#define _DEFAULT_SOURCE
+#include "../cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Compiles a corpus of kernels under every configuration of options below
+// into execution_<config>.s, links each with bench/reference.c into
+// execution_<config> using $CC (cc by default), and runs it to check the
+// kernels against C and time them. Prints, for every configuration and
+// kernel, the time per element, in ns and in tsc ticks, that of the C
+// reference at -O2, the bytes of the kernel's code and the instructions
+// storing and loading its spilled values. Over int arrays of length n:
+//
+//   void scale(int *out, int *a, int *b, int k, long n)
+//       a loop, out[i] = a[i] * k + b[i]
+//   int sum(int *a, long n)
+//       a reduction, the sum of the a[i]
+//   long chase(long *next, long p, long steps)
+//       pointer chasing, p = next[p] steps times
+//   int calls(int *a, int *b, long n)
+//       a call per element, the sum of mix(a[i], b[i]), where
+//       int mix(int x, int y) is (x * 3 + y) ^ (x >> 2)
+//
+// Build and run from the repository root with
+//
+//   gcc -o execution bench/execution.c $(ls *.c | grep -v test.c)
+//   ./execution [--avx2]
+
+static const cstr kernels[] = {"scale", "sum", "chase", "calls"};
+
+// Options on top of those cbe_init sets, except for "none".
+static const struct {
+  cstr name;
+  u32 options;
+} configs[] = {
+    {"none", 0},
+    {"default", 0},
+    {"inline", CBE_OPT_INLINE},
+    {"schedule", CBE_OPT_SCHEDULE},
+    {"vectorize", CBE_OPT_VECTORIZE},
+    {"all", CBE_OPT_INLINE | CBE_OPT_SCHEDULE | CBE_OPT_VECTORIZE},
+};
+
+struct bench_builder {
+  struct cbe_context *ctx;
+  cbe_type_id int_type, long_type, int_ptr_type, long_ptr_type, void_type;
+  struct cbe_function fn;
+  struct cbe_block *block; // being appended to.
+};
+
+// for (i = 0; i < n; i++), with an accumulator if the kernel has one.
+struct bench_loop {
+  struct cbe_value i, acc, counter;
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Every kernel is compiled into a program of its own, so names need no
+// suffix, and equal names have to be the same symbol.
+static usz name(struct bench_builder *builder, cstr text) {
+  return cbe_find_or_add_symbol(builder->ctx, text);
+}
+
+static void push(struct bench_builder *builder, struct cbe_instruction inst) {
+  slice_push(&builder->block->instructions, inst);
+}
+
+static void function(struct bench_builder *builder, cstr text,
+                     cbe_type_id type_id) {
+  builder->fn = (struct cbe_function){.name_index = name(builder, text),
+                                      .type_id = type_id};
+  slice_init(&builder->fn.parameters);
+  slice_init(&builder->fn.blocks);
+}
+
+static void block(struct bench_builder *builder, cstr text) {
+  struct cbe_block block = {.name_index = name(builder, text)};
+  slice_init(&block.instructions);
+  slice_push(&builder->fn.blocks, block);
+  builder->block = &builder->fn.blocks.items[builder->fn.blocks.size - 1];
+}
+
+static struct cbe_value parameter(struct bench_builder *builder, cstr text,
+                                  cbe_type_id type_id) {
+  usz name_index = name(builder, text);
+  slice_push(&builder->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+  return variable(type_id, name_index);
+}
+
+static struct cbe_value binary(struct bench_builder *builder,
+                               enum cbe_instruction_tag tag, cstr text,
+                               struct cbe_value lhs, struct cbe_value rhs) {
+  usz name_index = name(builder, text);
+  push(builder, (struct cbe_instruction){.tag = tag,
+                                         .has_temporary = true,
+                                         .temporary = {name_index, lhs.type_id},
+                                         .binary = {lhs, rhs}});
+  return variable(lhs.type_id, name_index);
+}
+
+static struct cbe_value load(struct bench_builder *builder, cstr text,
+                             struct cbe_value pointer) {
+  usz name_index = name(builder, text);
+  cbe_type_id type_id = builder->ctx->types.items[pointer.type_id].ptr;
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                         .has_temporary = true,
+                                         .temporary = {name_index, type_id},
+                                         .load = {pointer}});
+  return variable(type_id, name_index);
+}
+
+static void store(struct bench_builder *builder, struct cbe_value value,
+                  struct cbe_value pointer) {
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_STORE,
+                                         .store = {value, pointer}});
+}
+
+static struct cbe_value alloc(struct bench_builder *builder, cstr text,
+                              cbe_type_id type_id) {
+  usz name_index = name(builder, text);
+  cbe_type_id ptr_type = type_id == builder->int_type
+                             ? builder->int_ptr_type
+                             : builder->long_ptr_type;
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                         .has_temporary = true,
+                                         .temporary = {name_index, ptr_type},
+                                         .alloc = {type_id}});
+  return variable(ptr_type, name_index);
+}
+
+// array[index], loaded.
+static struct cbe_value element(struct bench_builder *builder, cstr text,
+                                struct cbe_value array,
+                                struct cbe_value index) {
+  usz size = strlen(text) + sizeof(".address");
+  char *address = CBE_ALLOC(size);
+  snprintf(address, size, "%s.address", text);
+  usz name_index = name(builder, address);
+  push(builder, (struct cbe_instruction){
+                    .tag = CBE_INST_ELEMPTR,
+                    .has_temporary = true,
+                    .temporary = {name_index, array.type_id},
+                    .elemptr = {array, index}});
+  return load(builder, text, variable(array.type_id, name_index));
+}
+
+static void ret(struct bench_builder *builder, struct cbe_value *result) {
+  struct cbe_value *value = NULL;
+  if (result != NULL) {
+    value = CBE_ALLOC(sizeof(struct cbe_value));
+    *value = *result;
+  }
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_RET, .ret = {value}});
+}
+
+// Opens the body of `for (i = 0; i < n; i++)`, with an accumulator set to
+// `initial` unless it is NULL.
+static struct bench_loop begin(struct bench_builder *builder,
+                               struct cbe_value n,
+                               struct cbe_value *initial) {
+  cbe_type_id long_type = builder->long_type;
+  struct bench_loop loop = {0};
+  block(builder, "entry");
+  loop.i = alloc(builder, "i", long_type);
+  store(builder, integer(long_type, 0), loop.i);
+  if (initial != NULL) {
+    loop.acc = alloc(builder, "acc", initial->type_id);
+    store(builder, *initial, loop.acc);
+  }
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                         .jmp = {name(builder, "loop")}});
+
+  block(builder, "loop");
+  loop.counter = load(builder, "counter", loop.i);
+  usz more = name(builder, "more");
+  push(builder, (struct cbe_instruction){
+                    .tag = CBE_INST_CMP,
+                    .has_temporary = true,
+                    .temporary = {more, builder->int_type},
+                    .cmp = {CBE_PRED_LT, loop.counter, n}});
+  push(builder, (struct cbe_instruction){
+                    .tag = CBE_INST_BR,
+                    .br = {variable(builder->int_type, more),
+                           name(builder, "body"), name(builder, "done")}});
+  block(builder, "body");
+  return loop;
+}
+
+// acc += value
+static void accumulate(struct bench_builder *builder, struct bench_loop *loop,
+                       struct cbe_value value) {
+  struct cbe_value current = load(builder, "current", loop->acc);
+  store(builder, binary(builder, CBE_INST_ADD, "next", current, value),
+        loop->acc);
+}
+
+// Closes the loop and opens the block after it, returning the accumulator
+// if there is one.
+static void end(struct bench_builder *builder, struct bench_loop *loop) {
+  store(builder,
+        binary(builder, CBE_INST_ADD, "step", loop->counter,
+               integer(builder->long_type, 1)),
+        loop->i);
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                         .jmp = {name(builder, "loop")}});
+  block(builder, "done");
+  if (loop->acc.tag == CBE_VALUE_NIL) {
+    ret(builder, NULL);
+  } else {
+    struct cbe_value total = load(builder, "total", loop->acc);
+    ret(builder, &total);
+  }
+  slice_push(&builder->ctx->functions, builder->fn);
+}
+
+static void scale(struct bench_builder *builder) {
+  function(builder, "scale", builder->void_type);
+  struct cbe_value out = parameter(builder, "out", builder->int_ptr_type);
+  struct cbe_value a = parameter(builder, "a", builder->int_ptr_type);
+  struct cbe_value b = parameter(builder, "b", builder->int_ptr_type);
+  struct cbe_value k = parameter(builder, "k", builder->int_type);
+  struct cbe_value n = parameter(builder, "n", builder->long_type);
+  struct bench_loop loop = begin(builder, n, NULL);
+  struct cbe_value x = element(builder, "x", a, loop.counter);
+  struct cbe_value y = element(builder, "y", b, loop.counter);
+  struct cbe_value result =
+      binary(builder, CBE_INST_ADD, "result",
+             binary(builder, CBE_INST_MUL, "scaled", x, k), y);
+  usz target = name(builder, "target");
+  push(builder, (struct cbe_instruction){
+                    .tag = CBE_INST_ELEMPTR,
+                    .has_temporary = true,
+                    .temporary = {target, builder->int_ptr_type},
+                    .elemptr = {out, loop.counter}});
+  store(builder, result, variable(builder->int_ptr_type, target));
+  end(builder, &loop);
+}
+
+static void sum(struct bench_builder *builder) {
+  function(builder, "sum", builder->int_type);
+  struct cbe_value a = parameter(builder, "a", builder->int_ptr_type);
+  struct cbe_value n = parameter(builder, "n", builder->long_type);
+  struct cbe_value zero = integer(builder->int_type, 0);
+  struct bench_loop loop = begin(builder, n, &zero);
+  accumulate(builder, &loop, element(builder, "value", a, loop.counter));
+  end(builder, &loop);
+}
+
+static void chase(struct bench_builder *builder) {
+  function(builder, "chase", builder->long_type);
+  struct cbe_value next = parameter(builder, "next", builder->long_ptr_type);
+  struct cbe_value p = parameter(builder, "p", builder->long_type);
+  struct cbe_value steps = parameter(builder, "steps", builder->long_type);
+  struct bench_loop loop = begin(builder, steps, &p);
+  struct cbe_value current = load(builder, "current", loop.acc);
+  store(builder, element(builder, "successor", next, current), loop.acc);
+  end(builder, &loop);
+}
+
+static void mix(struct bench_builder *builder) {
+  cbe_type_id int_type = builder->int_type;
+  function(builder, "mix", int_type);
+  struct cbe_value x = parameter(builder, "x", int_type);
+  struct cbe_value y = parameter(builder, "y", int_type);
+  block(builder, "entry");
+  struct cbe_value tripled =
+      binary(builder, CBE_INST_MUL, "tripled", x, integer(int_type, 3));
+  struct cbe_value quarter =
+      binary(builder, CBE_INST_SAR, "quarter", x, integer(int_type, 2));
+  struct cbe_value mixed =
+      binary(builder, CBE_INST_XOR, "mixed",
+             binary(builder, CBE_INST_ADD, "sum", tripled, y), quarter);
+  ret(builder, &mixed);
+  slice_push(&builder->ctx->functions, builder->fn);
+}
+
+static void calls(struct bench_builder *builder) {
+  cbe_type_id int_type = builder->int_type;
+  function(builder, "calls", int_type);
+  struct cbe_value a = parameter(builder, "a", builder->int_ptr_type);
+  struct cbe_value b = parameter(builder, "b", builder->int_ptr_type);
+  struct cbe_value n = parameter(builder, "n", builder->long_type);
+  struct cbe_value zero = integer(int_type, 0);
+  struct bench_loop loop = begin(builder, n, &zero);
+  usz mixed = name(builder, "mixed");
+  struct cbe_instruction inst = {.tag = CBE_INST_CALL,
+                                 .has_temporary = true,
+                                 .temporary = {mixed, int_type},
+                                 .call = {.function = name(builder, "mix")}};
+  slice_init(&inst.call.arguments);
+  slice_push(&inst.call.arguments, element(builder, "x", a, loop.counter));
+  slice_push(&inst.call.arguments, element(builder, "y", b, loop.counter));
+  push(builder, inst);
+  accumulate(builder, &loop, variable(int_type, mixed));
+  end(builder, &loop);
+}
+
+// Writes execution_<config>.s and the spill counts of every kernel.
+static void generate(usz config, u32 target_features, usz (*spills)[2]) {
+  a_reset();
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  if (config == 0)
+    ctx.options = 0;
+  ctx.options |= configs[config].options;
+  ctx.target_features |= target_features;
+
+  struct bench_builder builder = {.ctx = &ctx};
+  builder.int_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_INT});
+  builder.long_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_LONG});
+  builder.int_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.int_type});
+  builder.long_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.long_type});
+  builder.void_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_VOID});
+  mix(&builder);
+  scale(&builder);
+  sum(&builder);
+  chase(&builder);
+  calls(&builder);
+
+  cbe_optimize(&ctx);
+  cbe_validate(&ctx);
+  char path[64];
+  snprintf(path, sizeof(path), "execution_%s.s", configs[config].name);
+  FILE *fp = fopen(path, "w");
+  cbe_generate(&ctx, fp);
+  fclose(fp);
+
+  for (usz i = 0; i < ctx.functions.size; i++) {
+    struct cbe_function *fn = &ctx.functions.items[i];
+    for (usz k = 0; k < CBE_ARRAY_LEN(kernels); k++) {
+      if (strcmp(ctx.symbol_table.items[fn->name_index], kernels[k]) == 0) {
+        spills[k][0] = fn->spill_stores;
+        spills[k][1] = fn->spill_loads;
+      }
+    }
+  }
+}
+
+// The bytes of code of every kernel in `program`, as nm sees them.
+static void measure_sizes(cstr program, usz *sizes) {
+  char command[128], line[256], symbol[64];
+  snprintf(command, sizeof(command), "nm -S --defined-only %s", program);
+  FILE *nm = popen(command, "r");
+  unsigned long size;
+  while (nm != NULL && fgets(line, sizeof(line), nm) != NULL) {
+    if (sscanf(line, "%*s %lx %*s %63s", &size, symbol) != 2)
+      continue;
+    for (usz k = 0; k < CBE_ARRAY_LEN(kernels); k++) {
+      if (strcmp(symbol, kernels[k]) == 0)
+        sizes[k] = size;
+    }
+  }
+  if (nm != NULL)
+    pclose(nm);
+}
+
+int main(int argc, char **argv) {
+  a_init(64 * 1024 * 1024);
+  u32 target_features = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--avx2") == 0)
+      target_features |= CBE_TARGET_AVX2;
+  }
+  cstr cc = getenv("CC") != NULL ? getenv("CC") : "cc";
+
+  bool failed = false;
+  printf("%-10s %-6s %9s %9s %9s %6s %7s %7s\n", "config", "kernel",
+         "ns/elem", "tsc/elem", "C -O2", "bytes", "stores", "loads");
+  for (usz c = 0; c < CBE_ARRAY_LEN(configs); c++) {
+    usz spills[CBE_ARRAY_LEN(kernels)][2] = {{0}};
+    usz sizes[CBE_ARRAY_LEN(kernels)] = {0};
+    generate(c, target_features, spills);
+
+    char program[64], command[256];
+    snprintf(program, sizeof(program), "execution_%s", configs[c].name);
+    snprintf(command, sizeof(command),
+             "%s -O2 -o %s bench/reference.c %s.s", cc, program, program);
+    if (system(command) != 0) {
+      printf("%-10s could not be linked\n", configs[c].name);
+      failed = true;
+      continue;
+    }
+    measure_sizes(program, sizes);
+
+    snprintf(command, sizeof(command), "./%s", program);
+    FILE *run = popen(command, "r");
+    char kernel[32], status[8];
+    double ns, ticks, reference;
+    while (run != NULL && fscanf(run, "%31s %lf %lf %lf %7s", kernel, &ns,
+                                 &ticks, &reference, status) == 5) {
+      for (usz k = 0; k < CBE_ARRAY_LEN(kernels); k++) {
+        if (strcmp(kernel, kernels[k]) != 0)
+          continue;
+        printf("%-10s %-6s %9.3f %9.3f %9.3f %6zu %7zu %7zu%s\n",
+               configs[c].name, kernel, ns, ticks, reference, sizes[k],
+               spills[k][0], spills[k][1],
+               strcmp(status, "ok") == 0 ? "" : "  WRONG");
+      }
+    }
+    if (run == NULL || pclose(run) != 0)
+      failed = true;
+  }
+  return failed;
+}
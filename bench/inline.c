@@ -0,0 +1,390 @@
+#include "../cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates a corpus of programs built from small helpers twice, without and
+// with CBE_OPT_INLINE, into inline_off.s and inline_on.s, and prints the
+// number of instructions of every function in both. Over int values:
+//
+//   int mad_*(int a, int b, int c)        a * b + c
+//   int clamp_*(int x, int lo, int hi)    x limited to [lo, hi], three rets
+//   int poly_*(int x)                     ((x * 3 + 5) * x + 7) * x + 11
+//   int dot_*(int *a, int *b, long n)     mad over two arrays
+//   int saturate_*(int *a, long n)        sum of the a[i] clamped to 100
+//   int fib_*(int n)                      recursive, never inlined
+//
+// Build and run from the repository root with
+//
+//   gcc -o inline bench/inline.c $(ls *.c | grep -v test.c)
+//   ./inline
+//   gcc -O2 -o calls bench/calls.c inline_*.s
+//   ./calls
+
+struct bench_builder {
+  struct cbe_context *ctx;
+  cstr suffix;
+  cbe_type_id int_type, long_type, int_ptr_type, long_ptr_type;
+  struct cbe_function fn;
+  struct cbe_block *block; // being appended to.
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Blocks and functions are referred to by symbol, so equal names have to be
+// the same symbol.
+static usz name(struct bench_builder *builder, cstr text) {
+  usz size = strlen(text) + strlen(builder->suffix) + 2;
+  char *symbol = CBE_ALLOC(size);
+  snprintf(symbol, size, "%s_%s", text, builder->suffix);
+  return cbe_find_or_add_symbol(builder->ctx, symbol);
+}
+
+static void push(struct bench_builder *builder, struct cbe_instruction inst) {
+  slice_push(&builder->block->instructions, inst);
+}
+
+static void function(struct bench_builder *builder, cstr text,
+                     cbe_type_id type_id) {
+  builder->fn = (struct cbe_function){.name_index = name(builder, text),
+                                      .type_id = type_id};
+  slice_init(&builder->fn.parameters);
+  slice_init(&builder->fn.blocks);
+}
+
+// Starts block `text` of the current function; the function keeps its own
+// copy once it is finished.
+static void block(struct bench_builder *builder, cstr text) {
+  struct cbe_block block = {.name_index = name(builder, text)};
+  slice_init(&block.instructions);
+  slice_push(&builder->fn.blocks, block);
+  builder->block = &builder->fn.blocks.items[builder->fn.blocks.size - 1];
+}
+
+static struct cbe_value parameter(struct bench_builder *builder, cstr text,
+                                  cbe_type_id type_id) {
+  usz name_index = name(builder, text);
+  slice_push(&builder->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+  return variable(type_id, name_index);
+}
+
+static struct cbe_value binary(struct bench_builder *builder,
+                               enum cbe_instruction_tag tag, cstr text,
+                               struct cbe_value lhs, struct cbe_value rhs) {
+  usz name_index = name(builder, text);
+  push(builder, (struct cbe_instruction){.tag = tag,
+                                         .has_temporary = true,
+                                         .temporary = {name_index, lhs.type_id},
+                                         .binary = {lhs, rhs}});
+  return variable(lhs.type_id, name_index);
+}
+
+static struct cbe_value compare(struct bench_builder *builder,
+                                enum cbe_predicate predicate, cstr text,
+                                struct cbe_value lhs, struct cbe_value rhs) {
+  usz name_index = name(builder, text);
+  push(builder,
+       (struct cbe_instruction){
+           .tag = CBE_INST_CMP,
+           .has_temporary = true,
+           .temporary = {name_index, builder->int_type},
+           .cmp = {predicate, lhs, rhs}});
+  return variable(builder->int_type, name_index);
+}
+
+static struct cbe_value load(struct bench_builder *builder, cstr text,
+                             cbe_type_id type_id, struct cbe_value pointer) {
+  usz name_index = name(builder, text);
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                         .has_temporary = true,
+                                         .temporary = {name_index, type_id},
+                                         .load = {pointer}});
+  return variable(type_id, name_index);
+}
+
+static void store(struct bench_builder *builder, struct cbe_value value,
+                  struct cbe_value pointer) {
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_STORE,
+                                         .store = {value, pointer}});
+}
+
+static struct cbe_value alloc(struct bench_builder *builder, cstr text,
+                              cbe_type_id type_id, cbe_type_id ptr_type) {
+  usz name_index = name(builder, text);
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                         .has_temporary = true,
+                                         .temporary = {name_index, ptr_type},
+                                         .alloc = {type_id}});
+  return variable(ptr_type, name_index);
+}
+
+static struct cbe_value element(struct bench_builder *builder, cstr text,
+                                struct cbe_value array,
+                                struct cbe_value index) {
+  usz name_index = name(builder, text);
+  push(builder, (struct cbe_instruction){
+                    .tag = CBE_INST_ELEMPTR,
+                    .has_temporary = true,
+                    .temporary = {name_index, builder->int_ptr_type},
+                    .elemptr = {array, index}});
+  return variable(builder->int_ptr_type, name_index);
+}
+
+static struct cbe_value call(struct bench_builder *builder, cstr text,
+                             cstr callee, struct cbe_value *arguments,
+                             usz count) {
+  usz name_index = name(builder, text);
+  struct cbe_instruction inst = {
+      .tag = CBE_INST_CALL,
+      .has_temporary = true,
+      .temporary = {name_index, builder->int_type},
+      .call = {.function = name(builder, callee)}};
+  slice_init(&inst.call.arguments);
+  for (usz i = 0; i < count; i++)
+    slice_push(&inst.call.arguments, arguments[i]);
+  push(builder, inst);
+  return variable(builder->int_type, name_index);
+}
+
+static void br(struct bench_builder *builder, struct cbe_value condition,
+               cstr then_block, cstr else_block) {
+  push(builder, (struct cbe_instruction){
+                    .tag = CBE_INST_BR,
+                    .br = {condition, name(builder, then_block),
+                           name(builder, else_block)}});
+}
+
+static void jmp(struct bench_builder *builder, cstr target) {
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                         .jmp = {name(builder, target)}});
+}
+
+static void ret(struct bench_builder *builder, struct cbe_value result) {
+  struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+  *value = result;
+  push(builder, (struct cbe_instruction){.tag = CBE_INST_RET, .ret = {value}});
+}
+
+static void finish(struct bench_builder *builder) {
+  slice_push(&builder->ctx->functions, builder->fn);
+}
+
+// for (i = 0; i < n; i++) acc += <body>; return acc, where `body` computes
+// the addend of element i.
+static void reduce(struct bench_builder *builder, struct cbe_value n,
+                   struct cbe_value (*body)(struct bench_builder *,
+                                            struct cbe_value *,
+                                            struct cbe_value),
+                   struct cbe_value *arrays) {
+  cbe_type_id int_type = builder->int_type, long_type = builder->long_type;
+  block(builder, "entry");
+  struct cbe_value i =
+      alloc(builder, "i", long_type, builder->long_ptr_type);
+  struct cbe_value acc =
+      alloc(builder, "acc", int_type, builder->int_ptr_type);
+  store(builder, integer(long_type, 0), i);
+  store(builder, integer(int_type, 0), acc);
+  jmp(builder, "loop");
+
+  block(builder, "loop");
+  struct cbe_value counter = load(builder, "counter", long_type, i);
+  br(builder, compare(builder, CBE_PRED_LT, "more", counter, n), "body",
+     "done");
+
+  block(builder, "body");
+  struct cbe_value addend = body(builder, arrays, counter);
+  struct cbe_value current = load(builder, "current", int_type, acc);
+  store(builder, binary(builder, CBE_INST_ADD, "next", current, addend), acc);
+  store(builder,
+        binary(builder, CBE_INST_ADD, "step", counter, integer(long_type, 1)),
+        i);
+  jmp(builder, "loop");
+
+  block(builder, "done");
+  ret(builder, load(builder, "total", int_type, acc));
+}
+
+static struct cbe_value dot_body(struct bench_builder *builder,
+                                 struct cbe_value *arrays,
+                                 struct cbe_value counter) {
+  cbe_type_id int_type = builder->int_type;
+  struct cbe_value arguments[] = {
+      load(builder, "x", int_type,
+           element(builder, "ax", arrays[0], counter)),
+      load(builder, "y", int_type,
+           element(builder, "ay", arrays[1], counter)),
+      integer(int_type, 0)};
+  return call(builder, "product", "mad", arguments, 3);
+}
+
+static struct cbe_value saturate_body(struct bench_builder *builder,
+                                      struct cbe_value *arrays,
+                                      struct cbe_value counter) {
+  cbe_type_id int_type = builder->int_type;
+  struct cbe_value arguments[] = {
+      load(builder, "x", int_type,
+           element(builder, "ax", arrays[0], counter)),
+      integer(int_type, -100), integer(int_type, 100)};
+  return call(builder, "clamped", "clamp", arguments, 3);
+}
+
+static void generate(cstr suffix, u32 options) {
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  ctx.options |= options;
+
+  struct bench_builder builder = {.ctx = &ctx, .suffix = suffix};
+  cbe_type_id int_type = builder.int_type =
+      cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_INT});
+  cbe_type_id long_type = builder.long_type =
+      cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_LONG});
+  cbe_type_id int_ptr_type = builder.int_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = int_type});
+  builder.long_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = long_type});
+
+  {
+    function(&builder, "mad", int_type);
+    struct cbe_value a = parameter(&builder, "a", int_type);
+    struct cbe_value b = parameter(&builder, "b", int_type);
+    struct cbe_value c = parameter(&builder, "c", int_type);
+    block(&builder, "entry");
+    struct cbe_value product = binary(&builder, CBE_INST_MUL, "product", a, b);
+    ret(&builder, binary(&builder, CBE_INST_ADD, "sum", product, c));
+    finish(&builder);
+  }
+
+  {
+    function(&builder, "clamp", int_type);
+    struct cbe_value x = parameter(&builder, "x", int_type);
+    struct cbe_value lo = parameter(&builder, "lo", int_type);
+    struct cbe_value hi = parameter(&builder, "hi", int_type);
+    block(&builder, "entry");
+    br(&builder, compare(&builder, CBE_PRED_LT, "below", x, lo), "low",
+       "check");
+    block(&builder, "low");
+    ret(&builder, lo);
+    block(&builder, "check");
+    br(&builder, compare(&builder, CBE_PRED_GT, "above", x, hi), "high",
+       "inside");
+    block(&builder, "high");
+    ret(&builder, hi);
+    block(&builder, "inside");
+    ret(&builder, x);
+    finish(&builder);
+  }
+
+  {
+    function(&builder, "poly", int_type);
+    struct cbe_value x = parameter(&builder, "x", int_type);
+    block(&builder, "entry");
+    struct cbe_value first[] = {x, integer(int_type, 3), integer(int_type, 5)};
+    struct cbe_value t = call(&builder, "t1", "mad", first, 3);
+    struct cbe_value second[] = {t, x, integer(int_type, 7)};
+    t = call(&builder, "t2", "mad", second, 3);
+    struct cbe_value third[] = {t, x, integer(int_type, 11)};
+    ret(&builder, call(&builder, "t3", "mad", third, 3));
+    finish(&builder);
+  }
+
+  {
+    function(&builder, "dot", int_type);
+    struct cbe_value arrays[] = {parameter(&builder, "a", int_ptr_type),
+                                 parameter(&builder, "b", int_ptr_type)};
+    struct cbe_value n = parameter(&builder, "n", long_type);
+    reduce(&builder, n, dot_body, arrays);
+    finish(&builder);
+  }
+
+  {
+    function(&builder, "saturate", int_type);
+    struct cbe_value arrays[] = {parameter(&builder, "a", int_ptr_type)};
+    struct cbe_value n = parameter(&builder, "n", long_type);
+    reduce(&builder, n, saturate_body, arrays);
+    finish(&builder);
+  }
+
+  {
+    function(&builder, "fib", int_type);
+    struct cbe_value n = parameter(&builder, "n", int_type);
+    block(&builder, "entry");
+    br(&builder,
+       compare(&builder, CBE_PRED_LT, "small", n, integer(int_type, 2)),
+       "base", "recurse");
+    block(&builder, "base");
+    ret(&builder, n);
+    block(&builder, "recurse");
+    struct cbe_value first[] = {
+        binary(&builder, CBE_INST_SUB, "n1", n, integer(int_type, 1))};
+    struct cbe_value f1 = call(&builder, "f1", "fib", first, 1);
+    struct cbe_value second[] = {
+        binary(&builder, CBE_INST_SUB, "n2", n, integer(int_type, 2))};
+    struct cbe_value f2 = call(&builder, "f2", "fib", second, 1);
+    ret(&builder, binary(&builder, CBE_INST_ADD, "f", f1, f2));
+    finish(&builder);
+  }
+
+  cbe_optimize(&ctx);
+  cbe_validate(&ctx);
+  char path[64];
+  snprintf(path, sizeof(path), "inline_%s.s", suffix);
+  FILE *fp = fopen(path, "w");
+  cbe_generate(&ctx, fp);
+  fclose(fp);
+}
+
+// Counts the instructions of every function in `path`, in order.
+static usz count_instructions(cstr path, char names[][32], usz *counts) {
+  FILE *fp = fopen(path, "r");
+  char line[256];
+  usz functions = 0;
+  bool inside = false;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    usz length = strcspn(line, "\n");
+    if (length > 1 && line[0] != '.' && line[0] != ' ' &&
+        line[length - 1] == ':') {
+      // Without the _off or _on suffix.
+      snprintf(names[functions], 32, "%.*s", (int)(length - 1), line);
+      char *suffix = strrchr(names[functions], '_');
+      if (suffix != NULL)
+        *suffix = '\0';
+      counts[functions++] = 0;
+      inside = true;
+    } else if (strncmp(line, ".size", 5) == 0) {
+      inside = false;
+    } else if (inside && line[0] == ' ' && line[2] != '.') {
+      counts[functions - 1]++;
+    }
+  }
+  fclose(fp);
+  return functions;
+}
+
+int main(void) {
+  a_init(64 * 1024 * 1024);
+  generate("off", 0);
+  generate("on", CBE_OPT_INLINE);
+
+  char names[2][16][32];
+  usz counts[2][16];
+  usz functions = count_instructions("inline_off.s", names[0], counts[0]);
+  count_instructions("inline_on.s", names[1], counts[1]);
+  usz total[2] = {0, 0};
+  printf("%-16s %8s %8s\n", "instructions", "off", "on");
+  for (usz i = 0; i < functions; i++) {
+    printf("%-16s %8zu %8zu\n", names[0][i], counts[0][i], counts[1][i]);
+    total[0] += counts[0][i];
+    total[1] += counts[1][i];
+  }
+  printf("%-16s %8zu %8zu\n", "total", total[0], total[1]);
+  return 0;
+}
@@ -0,0 +1,235 @@
+#include "../cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Builds modules that cbe_validate has to reject, each with one thing wrong,
+// and checks that it does, with the result expected, after cbe_optimize,
+// which has to leave them alone, under every configuration of options below,
+// instead of tripping an assertion or reading out of bounds. Prints a line
+// per case and configuration, "ok" or "wrong" and the result, followed by
+// the diagnostics cbe_write_diagnostics makes of it, and exits with 1 if any
+// case went wrong: a result, or the operand of the first diagnostic, other
+// than expected.
+//
+// Build and run from the repository root with
+//
+//   gcc -o invalid bench/invalid.c $(ls *.c | grep -v test.c)
+//   ./invalid
+
+// Options on top of those cbe_init sets, except for "none".
+static const struct {
+  cstr name;
+  u32 options;
+} configs[] = {
+    {"none", 0},
+    {"default", 0},
+    {"inline", CBE_OPT_INLINE},
+    {"schedule", CBE_OPT_SCHEDULE},
+    {"vectorize", CBE_OPT_VECTORIZE},
+    {"all", CBE_OPT_INLINE | CBE_OPT_SCHEDULE | CBE_OPT_VECTORIZE},
+};
+
+#define UNKNOWN 999
+
+struct bench_builder {
+  struct cbe_context *ctx;
+  cbe_type_id int_type;
+  struct cbe_function fn;
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+// int invalid(<parameters>) { entry: ret 0 }, with its parameters left to the
+// case.
+static void function(struct bench_builder *builder) {
+  struct cbe_context *ctx = builder->ctx;
+  builder->int_type = cbe_add_type(ctx, (struct cbe_type){CBE_TYPE_INT});
+  usz name_index = cbe_add_symbol(ctx, "invalid");
+  builder->fn = (struct cbe_function){.name_index = name_index,
+                                      .type_id = builder->int_type};
+  slice_init(&builder->fn.parameters);
+  slice_init(&builder->fn.blocks);
+  struct cbe_block entry = {.name_index = cbe_add_symbol(ctx, "entry")};
+  slice_init(&entry.instructions);
+  struct cbe_value *zero = CBE_ALLOC(sizeof(struct cbe_value));
+  *zero = integer(builder->int_type, 0);
+  slice_push(&entry.instructions,
+             ((struct cbe_instruction){.tag = CBE_INST_RET, .ret = {zero}}));
+  slice_push(&builder->fn.blocks, entry);
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Appends %text = add lhs, rhs to the entry block.
+static struct cbe_value add(struct bench_builder *builder, cstr text,
+                            struct cbe_value lhs, struct cbe_value rhs) {
+  struct cbe_block *entry = &builder->fn.blocks.items[0];
+  usz name_index = cbe_find_or_add_symbol(builder->ctx, text);
+  slice_push(&entry->instructions,
+             ((struct cbe_instruction){.tag = CBE_INST_ADD,
+                                       .has_temporary = true,
+                                       .temporary = {name_index, lhs.type_id},
+                                       .binary = {lhs, rhs}}));
+  return variable(lhs.type_id, name_index);
+}
+
+static void ret(struct bench_builder *builder, struct cbe_value result) {
+  struct cbe_block *entry = &builder->fn.blocks.items[0];
+  struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+  *value = result;
+  slice_push(&entry->instructions,
+             ((struct cbe_instruction){.tag = CBE_INST_RET, .ret = {value}}));
+}
+
+static void parameter(struct bench_builder *builder, cstr text,
+                      cbe_type_id type_id) {
+  usz name_index = cbe_add_symbol(builder->ctx, text);
+  slice_push(&builder->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+}
+
+// Eight ints, two more than there are argument registers.
+static void too_many_parameters(struct bench_builder *builder) {
+  static const cstr names[] = {"a", "b", "c", "d", "e", "f", "g", "h"};
+  for (usz i = 0; i < CBE_ARRAY_LEN(names); i++)
+    parameter(builder, names[i], builder->int_type);
+}
+
+// A <3 x int>, which fills no vector register.
+static void odd_vector_parameter(struct bench_builder *builder) {
+  cbe_type_id vector = cbe_add_type(
+      builder->ctx, (struct cbe_type){.tag = CBE_TYPE_VECTOR,
+                                      .element = builder->int_type,
+                                      .lanes = 3});
+  parameter(builder, "v", vector);
+}
+
+static void unknown_parameter_name(struct bench_builder *builder) {
+  slice_push(&builder->fn.parameters,
+             ((struct cbe_temporary){UNKNOWN, builder->int_type}));
+}
+
+static void unknown_parameter_type(struct bench_builder *builder) {
+  parameter(builder, "x", UNKNOWN);
+}
+
+// A few adds, for the scheduler to reorder, and no ret after them.
+static void missing_terminator(struct bench_builder *builder) {
+  builder->fn.blocks.items[0].instructions.size = 0;
+  struct cbe_value one = integer(builder->int_type, 1);
+  struct cbe_value a = add(builder, "a", one, one);
+  struct cbe_value b = add(builder, "b", one, one);
+  add(builder, "c", a, b);
+}
+
+// Returns a + x, where x is no symbol of the module.
+static void unknown_symbol(struct bench_builder *builder) {
+  builder->fn.blocks.items[0].instructions.size = 0;
+  struct cbe_value one = integer(builder->int_type, 1);
+  struct cbe_value a = add(builder, "a", one, one);
+  ret(builder, add(builder, "b", a, variable(builder->int_type, UNKNOWN)));
+}
+
+// Returns a + ghost, where ghost is a symbol, but nothing defines it.
+static void undefined_symbol(struct bench_builder *builder) {
+  builder->fn.blocks.items[0].instructions.size = 0;
+  struct cbe_value one = integer(builder->int_type, 1);
+  struct cbe_value a = add(builder, "a", one, one);
+  usz ghost = cbe_add_symbol(builder->ctx, "ghost");
+  ret(builder, add(builder, "b", a, variable(builder->int_type, ghost)));
+}
+
+// Returns 1 + invalid, the function itself, as if it were a value.
+static void function_operand(struct bench_builder *builder) {
+  builder->fn.blocks.items[0].instructions.size = 0;
+  struct cbe_value one = integer(builder->int_type, 1);
+  struct cbe_value self = variable(builder->int_type, builder->fn.name_index);
+  ret(builder, add(builder, "a", one, self));
+}
+
+// a is an int, added to 2 as a long.
+static void definition_type(struct bench_builder *builder) {
+  builder->fn.blocks.items[0].instructions.size = 0;
+  cbe_type_id long_type =
+      cbe_add_type(builder->ctx, (struct cbe_type){CBE_TYPE_LONG});
+  struct cbe_value one = integer(builder->int_type, 1);
+  struct cbe_value a = add(builder, "a", one, one);
+  add(builder, "b", variable(long_type, a.variable), integer(long_type, 2));
+  ret(builder, a);
+}
+
+// b = a + 1 comes before a = 1 + 1.
+static void use_before_definition(struct bench_builder *builder) {
+  builder->fn.blocks.items[0].instructions.size = 0;
+  struct cbe_value one = integer(builder->int_type, 1);
+  usz a = cbe_find_or_add_symbol(builder->ctx, "a");
+  struct cbe_value b =
+      add(builder, "b", variable(builder->int_type, a), one);
+  add(builder, "a", one, one);
+  ret(builder, b);
+}
+
+// With the operand, or parameter, of the first diagnostic, SIZE_MAX for
+// none.
+static const struct {
+  cstr name;
+  void (*build)(struct bench_builder *);
+  enum cbe_validation_result expected;
+  usz operand;
+} cases[] = {
+    {"too_many_parameters", too_many_parameters, CBE_VALID_ARGUMENT_COUNT, 6},
+    {"odd_vector_parameter", odd_vector_parameter, CBE_VALID_UNSUPPORTED_TYPE,
+     0},
+    {"unknown_parameter_name", unknown_parameter_name,
+     CBE_VALID_UNKNOWN_SYMBOL, 0},
+    {"unknown_parameter_type", unknown_parameter_type, CBE_VALID_UNKNOWN_TYPE,
+     0},
+    {"missing_terminator", missing_terminator, CBE_VALID_MISSING_TERMINATOR,
+     SIZE_MAX},
+    {"unknown_symbol", unknown_symbol, CBE_VALID_UNKNOWN_SYMBOL, 1},
+    {"undefined_symbol", undefined_symbol, CBE_VALID_UNDEFINED_SYMBOL, 1},
+    {"function_operand", function_operand, CBE_VALID_UNDEFINED_SYMBOL, 1},
+    {"definition_type", definition_type, CBE_VALID_TYPE_MISMATCH, 0},
+    {"use_before_definition", use_before_definition,
+     CBE_VALID_USED_BEFORE_DEFINED, 0},
+};
+
+static bool reject(usz i, usz config) {
+  a_reset();
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  if (config == 0)
+    ctx.options = 0;
+  ctx.options |= configs[config].options;
+  struct bench_builder builder = {.ctx = &ctx};
+  function(&builder);
+  cases[i].build(&builder);
+  slice_push(&ctx.functions, builder.fn);
+
+  cbe_optimize(&ctx);
+  enum cbe_validation_result result = cbe_validate(&ctx);
+  bool ok = result == cases[i].expected && ctx.diagnostics.size > 0 &&
+            ctx.diagnostics.items[0].result == result &&
+            ctx.diagnostics.items[0].operand == cases[i].operand;
+  printf("%-24s %-10s %s %d\n", cases[i].name, configs[config].name,
+         ok ? "ok" : "wrong", result);
+  cbe_write_diagnostics(&ctx, stdout);
+  return ok;
+}
+
+int main(void) {
+  a_init(16 * 1024 * 1024);
+  int wrong = 0;
+  for (usz i = 0; i < CBE_ARRAY_LEN(cases); i++) {
+    for (usz c = 0; c < CBE_ARRAY_LEN(configs); c++)
+      wrong += !reject(i, c);
+  }
+  return wrong > 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times the kernels of bench/schedule.c compiled without and with the
+// scheduler, after checking that both agree. See that file for how to build
+// it.
+
+#define LENGTH 100003
+#define RUNS 2000
+
+void blend_off(int *, int *, int *, int *, long);
+void blend_on(int *, int *, int *, int *, long);
+void ratio_off(int *, int *, int *, long), ratio_on(int *, int *, int *, long);
+void stencil_off(int *, int *, long), stencil_on(int *, int *, long);
+
+static int a[LENGTH + 2], b[LENGTH], c[LENGTH], off[LENGTH], on[LENGTH];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void blend(int run, int *out, void (*kernel)(int *, int *, int *,
+                                                    int *, long)) {
+  (void)run;
+  kernel(out, a, b, c, LENGTH);
+}
+
+static void blend_off_all(int run, int *out) { blend(run, out, blend_off); }
+static void blend_on_all(int run, int *out) { blend(run, out, blend_on); }
+static void ratio_off_all(int run, int *out) { ratio_off(out, a, b, LENGTH); }
+static void ratio_on_all(int run, int *out) { ratio_on(out, a, b, LENGTH); }
+static void stencil_off_all(int run, int *out) { stencil_off(out, a, LENGTH); }
+static void stencil_on_all(int run, int *out) { stencil_on(out, a, LENGTH); }
+
+static const struct {
+  const char *name;
+  void (*off)(int, int *), (*on)(int, int *);
+} kernels[] = {
+    {"blend", blend_off_all, blend_on_all},
+    {"ratio", ratio_off_all, ratio_on_all},
+    {"stencil", stencil_off_all, stencil_on_all},
+};
+
+static double measure(void (*kernel)(int, int *), int *out) {
+  double start = now();
+  for (int run = 0; run < RUNS; run++)
+    kernel(run, out);
+  return (now() - start) * 1e9 / RUNS / LENGTH;
+}
+
+int main(void) {
+  srand(1);
+  for (int i = 0; i < LENGTH + 2; i++)
+    a[i] = rand() % 2001 - 1000;
+  for (int i = 0; i < LENGTH; i++) {
+    b[i] = rand() % 2001 - 1000;
+    c[i] = rand() % 2001 - 1000;
+  }
+
+  printf("%-10s %10s %10s %8s\n", "ns/elem", "off", "on", "speedup");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    kernels[k].off(0, off);
+    kernels[k].on(0, on);
+    for (int i = 0; i < LENGTH; i++) {
+      if (off[i] != on[i]) {
+        printf("%s: out[%d] is %d, expected %d\n", kernels[k].name, i, on[i],
+               off[i]);
+        return 1;
+      }
+    }
+    double before = measure(kernels[k].off, off);
+    double after = measure(kernels[k].on, on);
+    printf("%-10s %10.3f %10.3f %7.2fx\n", kernels[k].name, before, after,
+           before / after);
+  }
+  return 0;
+}
@@ -0,0 +1,445 @@
+#define _DEFAULT_SOURCE
+#include "../cbe.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Load test of the compile server. Builds a module of a few dozen loops,
+// writes it to load.cbe and compiles it over and over, from several clients
+// at once: once by a server of its own, each client pipelining requests over
+// one connection, and once by starting ./a.out --module load.cbe for every
+// compile. Prints requests per second and median and 99th percentile
+// latencies of both, after checking that they produce the same assembly.
+// Build and run from the repository root with
+//
+//   gcc -o a.out $(ls *.c)
+//   gcc -o load bench/load.c $(ls *.c | grep -v test.c)
+//   ./load [--workers n] [--clients n] [--requests n] [--depth n] [--object]
+//
+// where --requests is per client and --depth the requests a client keeps in
+// flight. --object asks the server for object files and has every process
+// run as on its output too.
+
+#define FUNCTIONS 32
+#define SOCKET_PATH "load.sock"
+#define MODULE_PATH "load.cbe"
+
+struct bench_kernel {
+  struct cbe_context *ctx;
+  cbe_type_id int_type, long_type, int_ptr_type, long_ptr_type;
+  usz index;
+  struct cbe_function fn;
+  struct cbe_block *block;
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Blocks and functions are referred to by symbol, so equal names have to be
+// the same symbol.
+static usz name(struct bench_kernel *kernel, cstr text) {
+  char symbol[64];
+  snprintf(symbol, sizeof(symbol), "%s_%zu", text, kernel->index);
+  usz size = strlen(symbol) + 1;
+  char *copy = CBE_ALLOC(size);
+  memcpy(copy, symbol, size);
+  return cbe_find_or_add_symbol(kernel->ctx, copy);
+}
+
+static void push(struct bench_kernel *kernel, struct cbe_instruction inst) {
+  slice_push(&kernel->block->instructions, inst);
+}
+
+static void block(struct bench_kernel *kernel, cstr text) {
+  struct cbe_block block = {.name_index = name(kernel, text)};
+  slice_init(&block.instructions);
+  slice_push(&kernel->fn.blocks, block);
+  kernel->block = &kernel->fn.blocks.items[kernel->fn.blocks.size - 1];
+}
+
+static struct cbe_value parameter(struct bench_kernel *kernel, cstr text,
+                                  cbe_type_id type_id) {
+  usz name_index = name(kernel, text);
+  slice_push(&kernel->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+  return variable(type_id, name_index);
+}
+
+static struct cbe_value binary(struct bench_kernel *kernel,
+                               enum cbe_instruction_tag tag, cstr text,
+                               struct cbe_value lhs, struct cbe_value rhs) {
+  usz name_index = name(kernel, text);
+  push(kernel, (struct cbe_instruction){.tag = tag,
+                                        .has_temporary = true,
+                                        .temporary = {name_index, lhs.type_id},
+                                        .binary = {lhs, rhs}});
+  return variable(lhs.type_id, name_index);
+}
+
+static struct cbe_value load(struct bench_kernel *kernel, cstr text,
+                             cbe_type_id type_id, struct cbe_value pointer) {
+  usz name_index = name(kernel, text);
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                        .has_temporary = true,
+                                        .temporary = {name_index, type_id},
+                                        .load = {pointer}});
+  return variable(type_id, name_index);
+}
+
+static void store(struct bench_kernel *kernel, struct cbe_value value,
+                  struct cbe_value pointer) {
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_STORE,
+                                        .store = {value, pointer}});
+}
+
+// a[index], loaded.
+static struct cbe_value element(struct bench_kernel *kernel, cstr text,
+                                struct cbe_value array,
+                                struct cbe_value index) {
+  char address[64];
+  snprintf(address, sizeof(address), "%s.address", text);
+  usz name_index = name(kernel, address);
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_ELEMPTR,
+                   .has_temporary = true,
+                   .temporary = {name_index, kernel->int_ptr_type},
+                   .elemptr = {array, index}});
+  return load(kernel, text, kernel->int_type,
+              variable(kernel->int_ptr_type, name_index));
+}
+
+// void mix_<index>(int *out, int *a, int *b, int s, long n):
+// for (i = 0; i < n; i++)
+//   out[i] = (a[i] * s + b[i] * index) ^ (a[i] - b[i]) * (s + index)
+static void kernel(struct bench_kernel *kernel) {
+  cbe_type_id int_type = kernel->int_type, long_type = kernel->long_type;
+  kernel->fn = (struct cbe_function){
+      .name_index = name(kernel, "mix"),
+      .type_id = cbe_add_type(kernel->ctx, (struct cbe_type){CBE_TYPE_VOID})};
+  slice_init(&kernel->fn.parameters);
+  slice_init(&kernel->fn.blocks);
+  struct cbe_value out = parameter(kernel, "out", kernel->int_ptr_type);
+  struct cbe_value a = parameter(kernel, "a", kernel->int_ptr_type);
+  struct cbe_value b = parameter(kernel, "b", kernel->int_ptr_type);
+  struct cbe_value s = parameter(kernel, "s", int_type);
+  struct cbe_value n = parameter(kernel, "n", long_type);
+  struct cbe_value k = integer(int_type, (i64)kernel->index);
+
+  block(kernel, "entry");
+  usz i = name(kernel, "i");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                        .has_temporary = true,
+                                        .temporary = {i, kernel->long_ptr_type},
+                                        .alloc = {long_type}});
+  store(kernel, integer(long_type, 0), variable(kernel->long_ptr_type, i));
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                        .jmp = {name(kernel, "loop")}});
+
+  block(kernel, "loop");
+  struct cbe_value counter = load(kernel, "counter", long_type,
+                                  variable(kernel->long_ptr_type, i));
+  usz more = name(kernel, "more");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_CMP,
+                                        .has_temporary = true,
+                                        .temporary = {more, int_type},
+                                        .cmp = {CBE_PRED_LT, counter, n}});
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_BR,
+                   .br = {variable(int_type, more), name(kernel, "body"),
+                          name(kernel, "done")}});
+
+  block(kernel, "body");
+  struct cbe_value x = element(kernel, "x", a, counter);
+  struct cbe_value y = element(kernel, "y", b, counter);
+  struct cbe_value sum = binary(
+      kernel, CBE_INST_ADD, "sum", binary(kernel, CBE_INST_MUL, "xs", x, s),
+      binary(kernel, CBE_INST_MUL, "yk", y, k));
+  struct cbe_value product = binary(
+      kernel, CBE_INST_MUL, "product",
+      binary(kernel, CBE_INST_SUB, "xy", x, y),
+      binary(kernel, CBE_INST_ADD, "sk", s, k));
+  struct cbe_value value =
+      binary(kernel, CBE_INST_XOR, "value", sum, product);
+  usz target = name(kernel, "target");
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_ELEMPTR,
+                   .has_temporary = true,
+                   .temporary = {target, kernel->int_ptr_type},
+                   .elemptr = {out, counter}});
+  store(kernel, value, variable(kernel->int_ptr_type, target));
+  store(kernel,
+        binary(kernel, CBE_INST_ADD, "step", counter, integer(long_type, 1)),
+        variable(kernel->long_ptr_type, i));
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                        .jmp = {name(kernel, "loop")}});
+
+  block(kernel, "done");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_RET});
+  slice_push(&kernel->ctx->functions, kernel->fn);
+}
+
+// Writes the module to MODULE_PATH and returns it, along with the request
+// header compiling it the way ./a.out would.
+static u8 *build(struct cbe_serve_request *request, usz *size) {
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  struct bench_kernel builder = {.ctx = &ctx};
+  builder.int_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_INT});
+  builder.long_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_LONG});
+  builder.int_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.int_type});
+  builder.long_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.long_type});
+  for (builder.index = 0; builder.index < FUNCTIONS; builder.index++)
+    kernel(&builder);
+
+  char *module;
+  FILE *fp = open_memstream(&module, size);
+  cbe_write_module(&ctx, fp);
+  fclose(fp);
+  fp = fopen(MODULE_PATH, "wb");
+  fwrite(module, 1, *size, fp);
+  fclose(fp);
+  *request = (struct cbe_serve_request){
+      .size = *size,
+      .options = ctx.options,
+      .target_features = ctx.target_features,
+      .target_cpu = ctx.target_cpu,
+  };
+  return (u8 *)module;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool transfer(int fd, void *data, usz size, bool out) {
+  u8 *bytes = data;
+  while (size > 0) {
+    ssize_t n = out ? write(fd, bytes, size) : read(fd, bytes, size);
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+static int connect_to_server(void) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  strcpy(address.sun_path, SOCKET_PATH);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sends `requests` requests keeping `depth` in flight, recording how long
+// each took in `latencies`. The first response is left in `first`.
+static bool serve_client(struct cbe_serve_request *request, u8 *module,
+                         usz requests, usz depth, double *latencies,
+                         char **first, usz *first_size) {
+  int fd = connect_to_server();
+  if (fd < 0)
+    return false;
+  double *sent = malloc(sizeof(*sent) * requests);
+  usz next = 0;
+  bool ok = true;
+  for (usz done = 0; ok && done < requests; done++) {
+    while (ok && next < requests && next < done + depth) {
+      sent[next++] = now();
+      ok = transfer(fd, request, sizeof(*request), true) &&
+           transfer(fd, module, request->size, true);
+    }
+    struct cbe_serve_response response;
+    ok = ok && transfer(fd, &response, sizeof(response), false) &&
+         response.status == CBE_SERVE_OK;
+    char *output = ok ? malloc(response.size + 1) : NULL;
+    ok = ok && transfer(fd, output, response.size, false);
+    latencies[done] = now() - sent[done];
+    if (ok && done == 0) {
+      *first = output;
+      *first_size = response.size;
+    } else {
+      free(output);
+    }
+  }
+  free(sent);
+  close(fd);
+  return ok;
+}
+
+// Compiles with a process of its own every time, as a build system without
+// the server would.
+static bool spawn_client(usz client, usz requests, bool object,
+                         double *latencies) {
+  char output[64], command[160];
+  snprintf(output, sizeof(output), "load_%zu.s", client);
+  snprintf(command, sizeof(command), "as --64 -o load_%zu.o load_%zu.s",
+           client, client);
+  for (usz i = 0; i < requests; i++) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, 1);
+      dup2(null, 2);
+      execl("./a.out", "./a.out", "--module", MODULE_PATH, "--output", output,
+            (char *)NULL);
+      _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+      return false;
+    if (object && system(command) != 0)
+      return false;
+    latencies[i] = now() - start;
+  }
+  return true;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(cstr mode, double *latencies, usz count, double elapsed) {
+  qsort(latencies, count, sizeof(*latencies), compare_latencies);
+  printf("%-10s %12.1f %10.3f %10.3f\n", mode, count / elapsed,
+         latencies[count / 2] * 1e3, latencies[count * 99 / 100] * 1e3);
+}
+
+// Runs `clients` processes, client k filling latencies[k * requests...].
+static double run(bool serve, struct cbe_serve_request *request, u8 *module,
+                  usz clients, usz requests, usz depth, double *latencies) {
+  double start = now();
+  pid_t *pids = malloc(sizeof(*pids) * clients);
+  for (usz k = 0; k < clients; k++) {
+    if ((pids[k] = fork()) != 0)
+      continue;
+    double *own = &latencies[k * requests];
+    char *first = NULL;
+    usz size = 0;
+    bool ok = serve ? serve_client(request, module, requests, depth, own,
+                                   &first, &size)
+                    : spawn_client(k, requests,
+                                   request->flags & CBE_SERVE_OBJECT, own);
+    if (ok && serve && k == 0) {
+      FILE *fp = fopen("load_served", "wb");
+      fwrite(first, 1, size, fp);
+      fclose(fp);
+    }
+    _exit(ok ? 0 : 1);
+  }
+  bool ok = true;
+  for (usz k = 0; k < clients; k++) {
+    int status;
+    ok = waitpid(pids[k], &status, 0) == pids[k] && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0 && ok;
+  }
+  free(pids);
+  return ok ? now() - start : -1;
+}
+
+static bool same_file(cstr a, cstr b) {
+  FILE *x = fopen(a, "rb"), *y = fopen(b, "rb");
+  bool same = x != NULL && y != NULL;
+  for (int c = 0; same && c != EOF;) {
+    c = fgetc(x);
+    same = c == fgetc(y);
+  }
+  if (x != NULL)
+    fclose(x);
+  if (y != NULL)
+    fclose(y);
+  return same;
+}
+
+int main(int argc, char **argv) {
+  a_init(64 * 1024 * 1024);
+  usz workers = 4, clients = 4, requests = 200, depth = 1;
+  bool object = false;
+  for (int i = 1; i < argc; i++) {
+    usz *option = NULL;
+    if (strcmp(argv[i], "--workers") == 0)
+      option = &workers;
+    else if (strcmp(argv[i], "--clients") == 0)
+      option = &clients;
+    else if (strcmp(argv[i], "--requests") == 0)
+      option = &requests;
+    else if (strcmp(argv[i], "--depth") == 0)
+      option = &depth;
+    else if (strcmp(argv[i], "--object") == 0)
+      object = true;
+    if (option != NULL && i + 1 < argc)
+      *option = strtoul(argv[++i], NULL, 10);
+  }
+  if (workers == 0 || clients == 0 || requests == 0 || depth == 0)
+    return 1;
+
+  struct cbe_serve_request request;
+  usz size;
+  u8 *module = build(&request, &size);
+  if (object)
+    request.flags |= CBE_SERVE_OBJECT;
+
+  pid_t server = fork();
+  if (server == 0) {
+    freopen("/dev/null", "w", stderr);
+    _exit(cbe_serve(SOCKET_PATH, workers) ? 0 : 1);
+  }
+  int probe;
+  while ((probe = connect_to_server()) < 0)
+    nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+  close(probe);
+
+  printf("%zu %s of a %zu byte module, %zu clients, %zu workers\n",
+         clients * requests, object ? "objects" : "compiles", size, clients,
+         workers);
+  printf("%-10s %12s %10s %10s\n", "", "requests/s", "p50 ms", "p99 ms");
+  // Filled in by the client processes.
+  double *latencies =
+      mmap(NULL, sizeof(*latencies) * clients * requests,
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  double elapsed =
+      run(true, &request, module, clients, requests, depth, latencies);
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  if (elapsed < 0) {
+    printf("server: a request failed\n");
+    return 1;
+  }
+  report("server", latencies, clients * requests, elapsed);
+
+  elapsed = run(false, &request, module, clients, requests, depth, latencies);
+  if (elapsed < 0) {
+    printf("process: a compile failed, is ./a.out built?\n");
+    return 1;
+  }
+  report("process", latencies, clients * requests, elapsed);
+  if (!same_file("load_served", object ? "load_0.o" : "load_0.s")) {
+    printf("the server's output differs from ./a.out's\n");
+    return 1;
+  }
+  return 0;
+}
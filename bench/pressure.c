@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times the kernels of bench/spill.c compiled without and with splitting and
+// rematerialization, after checking that both agree. See that file for how
+// to build it.
+
+#define LENGTH 100003
+#define RUNS 2000
+
+void constants_off(int *, int *, long), constants_on(int *, int *, long);
+void mix_off(int *, int *, int *, int, int, long);
+void mix_on(int *, int *, int *, int, int, long);
+void chain_off(int *, int *, long), chain_on(int *, int *, long);
+
+static int a[LENGTH], b[LENGTH], off[LENGTH], on[LENGTH];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void constants_off_all(int *out) { constants_off(out, a, LENGTH); }
+static void constants_on_all(int *out) { constants_on(out, a, LENGTH); }
+static void mix_off_all(int *out) { mix_off(out, a, b, 17, -3, LENGTH); }
+static void mix_on_all(int *out) { mix_on(out, a, b, 17, -3, LENGTH); }
+static void chain_off_all(int *out) { chain_off(out, a, LENGTH); }
+static void chain_on_all(int *out) { chain_on(out, a, LENGTH); }
+
+static const struct {
+  const char *name;
+  void (*off)(int *), (*on)(int *);
+} kernels[] = {
+    {"constants", constants_off_all, constants_on_all},
+    {"mix", mix_off_all, mix_on_all},
+    {"chain", chain_off_all, chain_on_all},
+};
+
+static double measure(void (*kernel)(int *), int *out) {
+  double start = now();
+  for (int run = 0; run < RUNS; run++)
+    kernel(out);
+  return (now() - start) * 1e9 / RUNS / LENGTH;
+}
+
+int main(void) {
+  srand(1);
+  for (int i = 0; i < LENGTH; i++) {
+    a[i] = rand() % 2001 - 1000;
+    b[i] = rand() % 2001 - 1000;
+  }
+
+  printf("%-10s %10s %10s %8s\n", "ns/elem", "off", "on", "speedup");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    kernels[k].off(off);
+    kernels[k].on(on);
+    for (int i = 0; i < LENGTH; i++) {
+      if (off[i] != on[i]) {
+        printf("%s: out[%d] is %d, expected %d\n", kernels[k].name, i, on[i],
+               off[i]);
+        return 1;
+      }
+    }
+    double before = measure(kernels[k].off, off);
+    double after = measure(kernels[k].on, on);
+    printf("%-10s %10.3f %10.3f %7.2fx\n", kernels[k].name, before, after,
+           before / after);
+  }
+  return 0;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Checks the kernels of bench/execution.c against the C functions below and
+// times both, printing one line per kernel:
+//
+//   <kernel> <ns per element> <tsc ticks per element> <reference ns> ok|wrong
+//
+// bench/execution.c links it with the kernels of every configuration and
+// reads what it prints; see that file for how to build it.
+
+#define LENGTH 4096
+#define BATCHES 7
+#define RUNS 400
+
+void scale(int *, int *, int *, int, long);
+int sum(int *, long);
+long chase(long *, long, long);
+int calls(int *, int *, long);
+
+static int a[LENGTH], b[LENGTH], out[LENGTH], expected[LENGTH];
+static long next[LENGTH];
+static volatile long sink;
+
+static void reference_scale(int *out, int *a, int *b, int k, long n) {
+  for (long i = 0; i < n; i++)
+    out[i] = a[i] * k + b[i];
+}
+
+static int reference_sum(int *a, long n) {
+  int total = 0;
+  for (long i = 0; i < n; i++)
+    total += a[i];
+  return total;
+}
+
+static long reference_chase(long *next, long p, long steps) {
+  for (long i = 0; i < steps; i++)
+    p = next[p];
+  return p;
+}
+
+static int reference_mix(int x, int y) { return (x * 3 + y) ^ (x >> 2); }
+
+static int reference_calls(int *a, int *b, long n) {
+  int total = 0;
+  for (long i = 0; i < n; i++)
+    total += reference_mix(a[i], b[i]);
+  return total;
+}
+
+static long run_scale(void) {
+  scale(out, a, b, 7, LENGTH);
+  return out[LENGTH - 1];
+}
+
+static long run_sum(void) { return sum(a, LENGTH); }
+static long run_chase(void) { return chase(next, 0, LENGTH); }
+static long run_calls(void) { return calls(a, b, LENGTH); }
+
+static long run_reference_scale(void) {
+  reference_scale(expected, a, b, 7, LENGTH);
+  return expected[LENGTH - 1];
+}
+
+static long run_reference_sum(void) { return reference_sum(a, LENGTH); }
+static long run_reference_chase(void) {
+  return reference_chase(next, 0, LENGTH);
+}
+static long run_reference_calls(void) { return reference_calls(a, b, LENGTH); }
+
+static const struct {
+  const char *name;
+  long (*kernel)(void), (*reference)(void);
+} kernels[] = {
+    {"scale", run_scale, run_reference_scale},
+    {"sum", run_sum, run_reference_sum},
+    {"chase", run_chase, run_reference_chase},
+    {"calls", run_calls, run_reference_calls},
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Best of BATCHES batches of RUNS runs, in ns and tsc ticks per element.
+static void measure(long (*kernel)(void), double *ns, double *ticks) {
+  *ns = *ticks = 0;
+  for (int batch = 0; batch < BATCHES; batch++) {
+    double start = now();
+    unsigned long long tsc = __builtin_ia32_rdtsc();
+    for (int run = 0; run < RUNS; run++)
+      sink = kernel();
+    double elapsed = (now() - start) * 1e9 / RUNS / LENGTH;
+    double elapsed_ticks =
+        (double)(__builtin_ia32_rdtsc() - tsc) / RUNS / LENGTH;
+    if (batch == 0 || elapsed < *ns) {
+      *ns = elapsed;
+      *ticks = elapsed_ticks;
+    }
+  }
+}
+
+int main(void) {
+  srand(1);
+  for (int i = 0; i < LENGTH; i++) {
+    a[i] = rand() % 401 - 200;
+    b[i] = rand() % 401 - 200;
+    next[i] = i;
+  }
+  // One cycle through all elements, in random order.
+  for (int i = LENGTH - 1; i > 0; i--) {
+    int j = rand() % i;
+    long swap = next[i];
+    next[i] = next[j];
+    next[j] = swap;
+  }
+
+  int wrong = 0;
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    int ok = kernels[k].kernel() == kernels[k].reference() &&
+             memcmp(out, expected, sizeof(out)) == 0;
+    double ns, ticks, reference_ns, reference_ticks;
+    measure(kernels[k].kernel, &ns, &ticks);
+    measure(kernels[k].reference, &reference_ns, &reference_ticks);
+    printf("%s %.3f %.3f %.3f %s\n", kernels[k].name, ns, ticks, reference_ns,
+           ok ? "ok" : "wrong");
+    wrong += !ok;
+  }
+  return wrong > 0;
+}
@@ -0,0 +1,211 @@
+#define _DEFAULT_SOURCE
+#include "synthetic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Times the compilation of synthetic modules (see bench/synthetic.c) of
+// growing size, pressure and memory traffic, and writes for every shape the
+// best of a few runs as JSON: the time spent in cbe_check, cbe_optimize,
+// cbe_validate and cbe_generate, instructions compiled per second, the rate
+// of the checks, the diagnostics left (none, for a valid module), the bytes
+// of assembly, compiled into memory, the arena bytes one compile needs, the
+// peak resident size, and cbe_write_stats of that run for the breakdown by
+// phase. Each shape is measured in a process of its own, so neither the
+// resident size nor the arena carry over from the shapes before it. Options
+// set a single shape to run instead:
+//
+//   --seed n --functions n --blocks n --instructions n --pressure n
+//   --allocs fraction --runs n --output file
+//
+// Build and run from the repository root with
+//
+//   sources="bench/synthetic.c $(ls *.c | grep -v test.c)"
+//   gcc -O2 -o scaling bench/scaling.c $sources
+//   ./scaling > scaling.json
+
+struct bench_shape {
+  cstr name;
+  struct synthetic_shape shape;
+};
+
+static const struct bench_shape suite[] = {
+    {"small", {1, 16, 4, 16, 4, 0.1}},
+    {"medium", {1, 64, 8, 32, 8, 0.1}},
+    {"large", {1, 256, 16, 64, 8, 0.1}},
+    {"huge", {1, 512, 16, 64, 8, 0.1}},
+    {"wide", {1, 4, 256, 32, 8, 0.1}},
+    {"pressure", {1, 64, 8, 32, 24, 0.1}},
+    {"memory", {1, 64, 8, 32, 8, 0.5}},
+};
+
+// VALIDATE only builds what CHECK has checked.
+enum bench_phase { CHECK, OPTIMIZE, VALIDATE, GENERATE, PHASES };
+
+struct bench_result {
+  usz instructions;
+  u64 nanoseconds[PHASES];
+  usz diagnostics;
+  usz output_bytes; // of assembly.
+  usz arena_bytes;
+  char *stats; // JSON, by cbe_write_stats.
+};
+
+// Compiles into memory, so the output is timed without a disk and its size
+// is known.
+static void run(const struct synthetic_shape *shape,
+                struct bench_result *out) {
+  a_reset();
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  out->instructions = synthesize(&ctx, shape);
+
+  u64 start = cbe_stats_now();
+  cbe_check(&ctx);
+  u64 checked = cbe_stats_now();
+  cbe_optimize(&ctx);
+  u64 optimized = cbe_stats_now();
+  bool valid = cbe_validate(&ctx) == CBE_VALID_OK;
+  u64 validated = cbe_stats_now();
+  char *assembly = NULL;
+  size_t size = 0;
+  FILE *fp = open_memstream(&assembly, &size);
+  if (valid)
+    cbe_generate(&ctx, fp);
+  fclose(fp);
+  u64 generated = cbe_stats_now();
+  free(assembly);
+
+  out->nanoseconds[CHECK] = checked - start;
+  out->nanoseconds[OPTIMIZE] = optimized - checked;
+  out->nanoseconds[VALIDATE] = validated - optimized;
+  out->nanoseconds[GENERATE] = generated - validated;
+  out->diagnostics = ctx.diagnostics.size;
+  out->output_bytes = size;
+  out->arena_bytes = a_stats().in_use;
+  size = 0;
+  fp = open_memstream(&out->stats, &size);
+  cbe_write_stats(&ctx, fp);
+  fclose(fp);
+}
+
+static u64 total(struct bench_result *result) {
+  u64 total = 0;
+  for (usz i = 0; i < PHASES; i++)
+    total += result->nanoseconds[i];
+  return total;
+}
+
+static void measure(const struct bench_shape *bench, usz runs, bool first,
+                    FILE *out) {
+  const struct synthetic_shape *shape = &bench->shape;
+  struct bench_result best = {0}, result;
+  for (usz i = 0; i < runs; i++) {
+    run(shape, &result);
+    if (i > 0 && total(&result) >= total(&best)) {
+      free(result.stats);
+      continue;
+    }
+    free(best.stats);
+    best = result;
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(out, "%s {\"name\": \"%s\", \"seed\": %llu, \"functions\": %zu, ",
+          first ? "" : ",\n", bench->name, (unsigned long long)shape->seed,
+          shape->functions);
+  fprintf(out, "\"blocks\": %zu, \"instructions\": %zu, \"pressure\": %zu, "
+               "\"allocs\": %g,\n",
+          shape->blocks, shape->instructions, shape->pressure, shape->allocs);
+  fprintf(out, "  \"ir_instructions\": %zu, \"optimize_ns\": %llu, "
+               "\"validate_ns\": %llu, \"generate_ns\": %llu,\n",
+          best.instructions, (unsigned long long)best.nanoseconds[OPTIMIZE],
+          (unsigned long long)best.nanoseconds[VALIDATE],
+          (unsigned long long)best.nanoseconds[GENERATE]);
+  fprintf(out, "  \"check_ns\": %llu, \"checks_per_second\": %.0f, "
+               "\"diagnostics\": %zu,\n",
+          (unsigned long long)best.nanoseconds[CHECK],
+          best.instructions * 1e9 / best.nanoseconds[CHECK], best.diagnostics);
+  fprintf(out, "  \"instructions_per_second\": %.0f, \"output_bytes\": %zu, "
+               "\"arena_bytes\": %zu, \"max_rss_kb\": %ld,\n  \"stats\": ",
+          best.instructions * 1e9 / total(&best), best.output_bytes,
+          best.arena_bytes, usage.ru_maxrss);
+  // Without the newline cbe_write_stats ends with.
+  fprintf(out, "%.*s }", (int)strlen(best.stats) - 1, best.stats);
+  free(best.stats);
+}
+
+// Measures in a child, which writes to `out` and exits, so every shape
+// starts from the resident size and arena of a process that compiled
+// nothing. Returns false if the child failed.
+static bool measure_apart(const struct bench_shape *bench, usz runs,
+                          bool first, FILE *out) {
+  fflush(out);
+  pid_t pid = fork();
+  if (pid == 0) {
+    measure(bench, runs, first, out);
+    fflush(out);
+    _exit(0);
+  }
+  int status;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+  struct bench_shape custom = {"custom", suite[1].shape};
+  bool single = false;
+  usz runs = 5;
+  cstr output = NULL;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    cstr value = argv[i + 1];
+    if (strcmp(argv[i], "--runs") == 0) {
+      runs = strtoull(value, NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--output") == 0) {
+      output = value;
+      continue;
+    }
+    single = true;
+    if (strcmp(argv[i], "--seed") == 0)
+      custom.shape.seed = strtoull(value, NULL, 10);
+    else if (strcmp(argv[i], "--functions") == 0)
+      custom.shape.functions = strtoull(value, NULL, 10);
+    else if (strcmp(argv[i], "--blocks") == 0)
+      custom.shape.blocks = strtoull(value, NULL, 10);
+    else if (strcmp(argv[i], "--instructions") == 0)
+      custom.shape.instructions = strtoull(value, NULL, 10);
+    else if (strcmp(argv[i], "--pressure") == 0)
+      custom.shape.pressure = strtoull(value, NULL, 10);
+    else if (strcmp(argv[i], "--allocs") == 0)
+      custom.shape.allocs = strtod(value, NULL);
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (runs == 0 || custom.shape.blocks == 0 || custom.shape.pressure == 0) {
+    fprintf(stderr, "runs, blocks and pressure must be positive\n");
+    return 1;
+  }
+
+  a_init(256 * 1024 * 1024);
+  FILE *out = output != NULL ? fopen(output, "w") : stdout;
+  fprintf(out, "[\n");
+  bool ok = true;
+  if (single) {
+    ok = measure_apart(&custom, runs, true, out);
+  } else {
+    for (usz i = 0; ok && i < CBE_ARRAY_LEN(suite); i++)
+      ok = measure_apart(&suite[i], runs, i == 0, out);
+  }
+  fprintf(out, "\n]\n");
+  if (out != stdout)
+    fclose(out);
+  return !ok;
+}
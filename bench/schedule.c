@@ -0,0 +1,271 @@
+#include "../cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates the kernels of the scheduler benchmark twice, without and with
+// CBE_OPT_SCHEDULE, into schedule_off.s and schedule_on.s, and prints the
+// cycles the scheduler estimates for every function before and after. Over
+// int arrays of length n:
+//
+//   void blend_*(int *out, int *a, int *b, int *c, long n)
+//                                  out[i] = a[i] * 3 + b[i] * 5 + c[i] * 7
+//   void ratio_*(int *out, int *a, int *b, long n)
+//                                  out[i] = a[i] / 7 + b[i] / 3
+//   void stencil_*(int *out, int *a, long n)
+//                                  out[i] = a[i] * a[i + 1] + a[i + 2] * 4
+//
+// Every value is computed right before its use, so the loads and divisions
+// of one term wait on each other before the next term starts. Build and run
+// from the repository root with
+//
+//   gcc -o schedule bench/schedule.c $(ls *.c | grep -v test.c)
+//   ./schedule [--skylake | --zen2]
+//   gcc -O2 -o latency bench/latency.c schedule_*.s
+//   ./latency
+
+struct bench_kernel {
+  struct cbe_context *ctx;
+  cstr suffix;
+  cbe_type_id int_type, long_type, int_ptr_type, long_ptr_type;
+  struct cbe_function fn;
+  struct cbe_block *block;
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Blocks and functions are referred to by symbol, so equal names have to be
+// the same symbol.
+static usz name(struct bench_kernel *kernel, cstr text) {
+  usz size = strlen(text) + strlen(kernel->suffix) + 2;
+  char *symbol = CBE_ALLOC(size);
+  snprintf(symbol, size, "%s_%s", text, kernel->suffix);
+  return cbe_find_or_add_symbol(kernel->ctx, symbol);
+}
+
+static void push(struct bench_kernel *kernel, struct cbe_instruction inst) {
+  slice_push(&kernel->block->instructions, inst);
+}
+
+static void block(struct bench_kernel *kernel, cstr text) {
+  struct cbe_block block = {.name_index = name(kernel, text)};
+  slice_init(&block.instructions);
+  slice_push(&kernel->fn.blocks, block);
+  kernel->block = &kernel->fn.blocks.items[kernel->fn.blocks.size - 1];
+}
+
+static struct cbe_value parameter(struct bench_kernel *kernel, cstr text,
+                                  cbe_type_id type_id) {
+  usz name_index = name(kernel, text);
+  slice_push(&kernel->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+  return variable(type_id, name_index);
+}
+
+static struct cbe_value binary(struct bench_kernel *kernel,
+                               enum cbe_instruction_tag tag, cstr text,
+                               struct cbe_value lhs, struct cbe_value rhs) {
+  usz name_index = name(kernel, text);
+  push(kernel, (struct cbe_instruction){.tag = tag,
+                                        .has_temporary = true,
+                                        .temporary = {name_index, lhs.type_id},
+                                        .binary = {lhs, rhs}});
+  return variable(lhs.type_id, name_index);
+}
+
+static struct cbe_value load(struct bench_kernel *kernel, cstr text,
+                             cbe_type_id type_id, struct cbe_value pointer) {
+  usz name_index = name(kernel, text);
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                        .has_temporary = true,
+                                        .temporary = {name_index, type_id},
+                                        .load = {pointer}});
+  return variable(type_id, name_index);
+}
+
+static void store(struct bench_kernel *kernel, struct cbe_value value,
+                  struct cbe_value pointer) {
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_STORE,
+                                        .store = {value, pointer}});
+}
+
+// a[index], loaded.
+static struct cbe_value element(struct bench_kernel *kernel, cstr text,
+                                struct cbe_value array,
+                                struct cbe_value index) {
+  char address[64];
+  snprintf(address, sizeof(address), "%s.address", text);
+  usz name_index = name(kernel, address);
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_ELEMPTR,
+                   .has_temporary = true,
+                   .temporary = {name_index, kernel->int_ptr_type},
+                   .elemptr = {array, index}});
+  return load(kernel, text, kernel->int_type,
+              variable(kernel->int_ptr_type, name_index));
+}
+
+// void <text>(int *out, ..., long n): for (i = 0; i < n; i++) out[i] = body,
+// with the arrays after out in `arrays`.
+static void kernel(struct bench_kernel *kernel, cstr text, usz count,
+                   struct cbe_value (*body)(struct bench_kernel *,
+                                            struct cbe_value *,
+                                            struct cbe_value)) {
+  cbe_type_id long_type = kernel->long_type;
+  kernel->fn = (struct cbe_function){
+      .name_index = name(kernel, text),
+      .type_id = cbe_add_type(kernel->ctx, (struct cbe_type){CBE_TYPE_VOID})};
+  slice_init(&kernel->fn.parameters);
+  slice_init(&kernel->fn.blocks);
+  struct cbe_value out = parameter(kernel, "out", kernel->int_ptr_type);
+  struct cbe_value arrays[3];
+  cstr names[] = {"a", "b", "c"};
+  for (usz k = 0; k < count; k++)
+    arrays[k] = parameter(kernel, names[k], kernel->int_ptr_type);
+  struct cbe_value n = parameter(kernel, "n", long_type);
+
+  block(kernel, "entry");
+  usz i = name(kernel, "i");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                        .has_temporary = true,
+                                        .temporary = {i, kernel->long_ptr_type},
+                                        .alloc = {long_type}});
+  store(kernel, integer(long_type, 0), variable(kernel->long_ptr_type, i));
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                        .jmp = {name(kernel, "loop")}});
+
+  block(kernel, "loop");
+  struct cbe_value counter = load(kernel, "counter", long_type,
+                                  variable(kernel->long_ptr_type, i));
+  usz more = name(kernel, "more");
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_CMP,
+                   .has_temporary = true,
+                   .temporary = {more, kernel->int_type},
+                   .cmp = {CBE_PRED_LT, counter, n}});
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_BR,
+                   .br = {variable(kernel->int_type, more),
+                          name(kernel, "body"), name(kernel, "done")}});
+
+  block(kernel, "body");
+  struct cbe_value value = body(kernel, arrays, counter);
+  usz target = name(kernel, "target");
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_ELEMPTR,
+                   .has_temporary = true,
+                   .temporary = {target, kernel->int_ptr_type},
+                   .elemptr = {out, counter}});
+  store(kernel, value, variable(kernel->int_ptr_type, target));
+  store(kernel,
+        binary(kernel, CBE_INST_ADD, "step", counter, integer(long_type, 1)),
+        variable(kernel->long_ptr_type, i));
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                        .jmp = {name(kernel, "loop")}});
+
+  block(kernel, "done");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_RET});
+  slice_push(&kernel->ctx->functions, kernel->fn);
+}
+
+static struct cbe_value blend_body(struct bench_kernel *kernel,
+                                   struct cbe_value *arrays,
+                                   struct cbe_value i) {
+  cbe_type_id int_type = kernel->int_type;
+  struct cbe_value x =
+      binary(kernel, CBE_INST_MUL, "x3", element(kernel, "x", arrays[0], i),
+             integer(int_type, 3));
+  struct cbe_value y =
+      binary(kernel, CBE_INST_MUL, "y5", element(kernel, "y", arrays[1], i),
+             integer(int_type, 5));
+  struct cbe_value sum = binary(kernel, CBE_INST_ADD, "xy", x, y);
+  struct cbe_value z =
+      binary(kernel, CBE_INST_MUL, "z7", element(kernel, "z", arrays[2], i),
+             integer(int_type, 7));
+  return binary(kernel, CBE_INST_ADD, "xyz", sum, z);
+}
+
+static struct cbe_value ratio_body(struct bench_kernel *kernel,
+                                   struct cbe_value *arrays,
+                                   struct cbe_value i) {
+  cbe_type_id int_type = kernel->int_type;
+  struct cbe_value x =
+      binary(kernel, CBE_INST_DIV, "x7", element(kernel, "x", arrays[0], i),
+             integer(int_type, 7));
+  struct cbe_value y =
+      binary(kernel, CBE_INST_DIV, "y3", element(kernel, "y", arrays[1], i),
+             integer(int_type, 3));
+  return binary(kernel, CBE_INST_ADD, "xy", x, y);
+}
+
+static struct cbe_value stencil_body(struct bench_kernel *kernel,
+                                     struct cbe_value *arrays,
+                                     struct cbe_value i) {
+  cbe_type_id int_type = kernel->int_type, long_type = kernel->long_type;
+  struct cbe_value x = element(kernel, "x", arrays[0], i);
+  struct cbe_value y = element(
+      kernel, "y", arrays[0],
+      binary(kernel, CBE_INST_ADD, "i1", i, integer(long_type, 1)));
+  struct cbe_value product = binary(kernel, CBE_INST_MUL, "xy", x, y);
+  struct cbe_value z = element(
+      kernel, "z", arrays[0],
+      binary(kernel, CBE_INST_ADD, "i2", i, integer(long_type, 2)));
+  struct cbe_value scaled =
+      binary(kernel, CBE_INST_MUL, "z4", z, integer(int_type, 4));
+  return binary(kernel, CBE_INST_ADD, "sum", product, scaled);
+}
+
+static void generate(cstr suffix, u32 options, enum cbe_target_cpu cpu) {
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  ctx.options |= options;
+  ctx.target_cpu = cpu;
+
+  struct bench_kernel builder = {.ctx = &ctx, .suffix = suffix};
+  builder.int_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_INT});
+  builder.long_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_LONG});
+  builder.int_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.int_type});
+  builder.long_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.long_type});
+
+  kernel(&builder, "blend", 3, blend_body);
+  kernel(&builder, "ratio", 2, ratio_body);
+  kernel(&builder, "stencil", 1, stencil_body);
+
+  cbe_optimize(&ctx);
+  if (options & CBE_OPT_SCHEDULE) {
+    printf("%-16s %8s %8s\n", "cycles", "before", "after");
+    for (usz i = 0; i < ctx.functions.size; i++) {
+      struct cbe_function *fn = &ctx.functions.items[i];
+      printf("%-16s %8zu %8zu\n", ctx.symbol_table.items[fn->name_index],
+             fn->cycles[0], fn->cycles[1]);
+    }
+  }
+  cbe_validate(&ctx);
+  char path[64];
+  snprintf(path, sizeof(path), "schedule_%s.s", suffix);
+  FILE *fp = fopen(path, "w");
+  cbe_generate(&ctx, fp);
+  fclose(fp);
+}
+
+int main(int argc, char **argv) {
+  a_init(64 * 1024 * 1024);
+  enum cbe_target_cpu cpu = CBE_CPU_GENERIC;
+  if (argc > 1 && strcmp(argv[1], "--skylake") == 0)
+    cpu = CBE_CPU_SKYLAKE;
+  else if (argc > 1 && strcmp(argv[1], "--zen2") == 0)
+    cpu = CBE_CPU_ZEN2;
+  generate("off", 0, cpu);
+  generate("on", CBE_OPT_SCHEDULE, cpu);
+  return 0;
+}
@@ -0,0 +1,327 @@
+#include "../cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates kernels with more live values than registers twice, without and
+// with CBE_OPT_SPLIT, into spill_off.s and spill_on.s, and prints how many
+// instructions store spilled values and load them back in every function,
+// along with the instructions of every function. Over int arrays of length n:
+//
+//   void constants_*(int *out, int *a, long n)
+//       six constants computed ahead of the loop, the way inlining constant
+//       arguments leaves them, all of them used by every iteration
+//   void mix_*(int *out, int *a, int *b, int s, int t, long n)
+//       out[i] = a[i] * s + b[i] * t + (a[i] ^ t) * (b[i] - s) ^ s + t
+//   void chain_*(int *out, int *a, long n)
+//       out[i] = ((a[i] + 1) * 3 - 7 ^ 5) << 2, where every step can write
+//       its result over its operand
+//
+// Build and run from the repository root with
+//
+//   gcc -o spill bench/spill.c $(ls *.c | grep -v test.c)
+//   ./spill
+//   gcc -O2 -o pressure bench/pressure.c spill_*.s
+//   ./pressure
+
+#define MAX_VALUES 8
+
+struct bench_kernel {
+  struct cbe_context *ctx;
+  cstr suffix;
+  cbe_type_id int_type, long_type, int_ptr_type, long_ptr_type;
+  struct cbe_function fn;
+  struct cbe_block *block;
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Blocks and functions are referred to by symbol, so equal names have to be
+// the same symbol.
+static usz name(struct bench_kernel *kernel, cstr text) {
+  usz size = strlen(text) + strlen(kernel->suffix) + 2;
+  char *symbol = CBE_ALLOC(size);
+  snprintf(symbol, size, "%s_%s", text, kernel->suffix);
+  return cbe_find_or_add_symbol(kernel->ctx, symbol);
+}
+
+static void push(struct bench_kernel *kernel, struct cbe_instruction inst) {
+  slice_push(&kernel->block->instructions, inst);
+}
+
+static void block(struct bench_kernel *kernel, cstr text) {
+  struct cbe_block block = {.name_index = name(kernel, text)};
+  slice_init(&block.instructions);
+  slice_push(&kernel->fn.blocks, block);
+  kernel->block = &kernel->fn.blocks.items[kernel->fn.blocks.size - 1];
+}
+
+static struct cbe_value parameter(struct bench_kernel *kernel, cstr text,
+                                  cbe_type_id type_id) {
+  usz name_index = name(kernel, text);
+  slice_push(&kernel->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+  return variable(type_id, name_index);
+}
+
+static struct cbe_value binary(struct bench_kernel *kernel,
+                               enum cbe_instruction_tag tag, cstr text,
+                               struct cbe_value lhs, struct cbe_value rhs) {
+  usz name_index = name(kernel, text);
+  push(kernel, (struct cbe_instruction){.tag = tag,
+                                        .has_temporary = true,
+                                        .temporary = {name_index, lhs.type_id},
+                                        .binary = {lhs, rhs}});
+  return variable(lhs.type_id, name_index);
+}
+
+static struct cbe_value load(struct bench_kernel *kernel, cstr text,
+                             cbe_type_id type_id, struct cbe_value pointer) {
+  usz name_index = name(kernel, text);
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                        .has_temporary = true,
+                                        .temporary = {name_index, type_id},
+                                        .load = {pointer}});
+  return variable(type_id, name_index);
+}
+
+static void store(struct bench_kernel *kernel, struct cbe_value value,
+                  struct cbe_value pointer) {
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_STORE,
+                                        .store = {value, pointer}});
+}
+
+// a[index], loaded.
+static struct cbe_value element(struct bench_kernel *kernel, cstr text,
+                                struct cbe_value array,
+                                struct cbe_value index) {
+  char address[64];
+  snprintf(address, sizeof(address), "%s.address", text);
+  usz name_index = name(kernel, address);
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_ELEMPTR,
+                   .has_temporary = true,
+                   .temporary = {name_index, kernel->int_ptr_type},
+                   .elemptr = {array, index}});
+  return load(kernel, text, kernel->int_type,
+              variable(kernel->int_ptr_type, name_index));
+}
+
+// void <text>(int *out, <parameters>, long n): for (i = 0; i < n; i++)
+// out[i] = body. `body` gets the parameters between out and n followed by
+// whatever `setup` adds to them in the entry block.
+static void kernel(struct bench_kernel *kernel, cstr text,
+                   cstr *parameters, usz count,
+                   usz (*setup)(struct bench_kernel *, struct cbe_value *),
+                   struct cbe_value (*body)(struct bench_kernel *,
+                                            struct cbe_value *,
+                                            struct cbe_value)) {
+  cbe_type_id long_type = kernel->long_type;
+  kernel->fn = (struct cbe_function){
+      .name_index = name(kernel, text),
+      .type_id = cbe_add_type(kernel->ctx, (struct cbe_type){CBE_TYPE_VOID})};
+  slice_init(&kernel->fn.parameters);
+  slice_init(&kernel->fn.blocks);
+  struct cbe_value out = parameter(kernel, "out", kernel->int_ptr_type);
+  struct cbe_value values[MAX_VALUES];
+  // Arrays are named by one letter, ints by two.
+  for (usz k = 0; k < count; k++)
+    values[k] = parameter(kernel, parameters[k],
+                          strlen(parameters[k]) == 1 ? kernel->int_ptr_type
+                                                     : kernel->int_type);
+  struct cbe_value n = parameter(kernel, "n", long_type);
+
+  block(kernel, "entry");
+  if (setup != NULL)
+    count += setup(kernel, &values[count]);
+  usz i = name(kernel, "i");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                        .has_temporary = true,
+                                        .temporary = {i, kernel->long_ptr_type},
+                                        .alloc = {long_type}});
+  store(kernel, integer(long_type, 0), variable(kernel->long_ptr_type, i));
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                        .jmp = {name(kernel, "loop")}});
+
+  block(kernel, "loop");
+  struct cbe_value counter = load(kernel, "counter", long_type,
+                                  variable(kernel->long_ptr_type, i));
+  usz more = name(kernel, "more");
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_CMP,
+                   .has_temporary = true,
+                   .temporary = {more, kernel->int_type},
+                   .cmp = {CBE_PRED_LT, counter, n}});
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_BR,
+                   .br = {variable(kernel->int_type, more),
+                          name(kernel, "body"), name(kernel, "done")}});
+
+  block(kernel, "body");
+  struct cbe_value value = body(kernel, values, counter);
+  usz target = name(kernel, "target");
+  push(kernel, (struct cbe_instruction){
+                   .tag = CBE_INST_ELEMPTR,
+                   .has_temporary = true,
+                   .temporary = {target, kernel->int_ptr_type},
+                   .elemptr = {out, counter}});
+  store(kernel, value, variable(kernel->int_ptr_type, target));
+  store(kernel,
+        binary(kernel, CBE_INST_ADD, "step", counter, integer(long_type, 1)),
+        variable(kernel->long_ptr_type, i));
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                        .jmp = {name(kernel, "loop")}});
+
+  block(kernel, "done");
+  push(kernel, (struct cbe_instruction){.tag = CBE_INST_RET});
+  slice_push(&kernel->ctx->functions, kernel->fn);
+}
+
+static usz constants_setup(struct bench_kernel *kernel,
+                           struct cbe_value *values) {
+  cbe_type_id int_type = kernel->int_type;
+  values[0] = binary(kernel, CBE_INST_MUL, "k0", integer(int_type, 3),
+                     integer(int_type, 7));
+  values[1] = binary(kernel, CBE_INST_SHL, "k1", integer(int_type, 1),
+                     integer(int_type, 10));
+  values[2] = binary(kernel, CBE_INST_SUB, "k2", integer(int_type, 0),
+                     integer(int_type, 5));
+  values[3] = binary(kernel, CBE_INST_ADD, "k3", integer(int_type, 100),
+                     integer(int_type, 27));
+  values[4] = binary(kernel, CBE_INST_XOR, "k4", integer(int_type, 255),
+                     integer(int_type, 15));
+  values[5] = binary(kernel, CBE_INST_OR, "k5", integer(int_type, 64),
+                     integer(int_type, 3));
+  return 6;
+}
+
+// ((x * k0 + k1) ^ (x & k4) * k2) + k3 | k5
+static struct cbe_value constants_body(struct bench_kernel *kernel,
+                                       struct cbe_value *values,
+                                       struct cbe_value i) {
+  struct cbe_value x = element(kernel, "x", values[0], i);
+  struct cbe_value *k = &values[1];
+  struct cbe_value scaled =
+      binary(kernel, CBE_INST_ADD, "scaled",
+             binary(kernel, CBE_INST_MUL, "x0", x, k[0]), k[1]);
+  struct cbe_value masked =
+      binary(kernel, CBE_INST_MUL, "masked",
+             binary(kernel, CBE_INST_AND, "x4", x, k[4]), k[2]);
+  struct cbe_value mixed =
+      binary(kernel, CBE_INST_XOR, "mixed", scaled, masked);
+  return binary(kernel, CBE_INST_OR, "result",
+                binary(kernel, CBE_INST_ADD, "x3", mixed, k[3]), k[5]);
+}
+
+static struct cbe_value mix_body(struct bench_kernel *kernel,
+                                 struct cbe_value *values,
+                                 struct cbe_value i) {
+  struct cbe_value s = values[2], t = values[3];
+  struct cbe_value x = element(kernel, "x", values[0], i);
+  struct cbe_value y = element(kernel, "y", values[1], i);
+  struct cbe_value sum = binary(
+      kernel, CBE_INST_ADD, "sum", binary(kernel, CBE_INST_MUL, "xs", x, s),
+      binary(kernel, CBE_INST_MUL, "yt", y, t));
+  struct cbe_value product = binary(
+      kernel, CBE_INST_MUL, "product", binary(kernel, CBE_INST_XOR, "xt", x, t),
+      binary(kernel, CBE_INST_SUB, "ys", y, s));
+  struct cbe_value total =
+      binary(kernel, CBE_INST_ADD, "total", sum, product);
+  return binary(kernel, CBE_INST_ADD, "result",
+                binary(kernel, CBE_INST_XOR, "flipped", total, s), t);
+}
+
+static struct cbe_value chain_body(struct bench_kernel *kernel,
+                                   struct cbe_value *values,
+                                   struct cbe_value i) {
+  cbe_type_id int_type = kernel->int_type;
+  struct cbe_value x = element(kernel, "x", values[0], i);
+  x = binary(kernel, CBE_INST_ADD, "x1", x, integer(int_type, 1));
+  x = binary(kernel, CBE_INST_MUL, "x3", x, integer(int_type, 3));
+  x = binary(kernel, CBE_INST_SUB, "x7", x, integer(int_type, 7));
+  x = binary(kernel, CBE_INST_XOR, "x5", x, integer(int_type, 5));
+  return binary(kernel, CBE_INST_SHL, "x2", x, integer(int_type, 2));
+}
+
+static struct cbe_context *generate(cstr suffix, u32 options) {
+  struct cbe_context *ctx = CBE_ALLOC(sizeof(*ctx));
+  cbe_init(ctx);
+  ctx->options = (ctx->options & ~CBE_OPT_SPLIT) | options;
+
+  struct bench_kernel builder = {.ctx = ctx, .suffix = suffix};
+  builder.int_type = cbe_add_type(ctx, (struct cbe_type){CBE_TYPE_INT});
+  builder.long_type = cbe_add_type(ctx, (struct cbe_type){CBE_TYPE_LONG});
+  builder.int_ptr_type = cbe_add_type(
+      ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.int_type});
+  builder.long_ptr_type = cbe_add_type(
+      ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = builder.long_type});
+
+  cstr one[] = {"a"}, two[] = {"a", "b", "ss", "tt"};
+  kernel(&builder, "constants", one, 1, constants_setup, constants_body);
+  kernel(&builder, "mix", two, 4, NULL, mix_body);
+  kernel(&builder, "chain", one, 1, NULL, chain_body);
+
+  cbe_optimize(ctx);
+  cbe_validate(ctx);
+  char path[64];
+  snprintf(path, sizeof(path), "spill_%s.s", suffix);
+  FILE *fp = fopen(path, "w");
+  cbe_generate(ctx, fp);
+  fclose(fp);
+  return ctx;
+}
+
+// Counts the instructions of every function in `path`, in order.
+static void count_instructions(cstr path, usz *counts) {
+  FILE *fp = fopen(path, "r");
+  char line[256];
+  usz functions = 0;
+  bool inside = false;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    usz length = strcspn(line, "\n");
+    if (length > 1 && line[0] != '.' && line[0] != ' ' &&
+        line[length - 1] == ':') {
+      counts[functions++] = 0;
+      inside = true;
+    } else if (strncmp(line, ".size", 5) == 0) {
+      inside = false;
+    } else if (inside && line[0] == ' ' && line[2] != '.') {
+      counts[functions - 1]++;
+    }
+  }
+  fclose(fp);
+}
+
+int main(void) {
+  a_init(64 * 1024 * 1024);
+  struct cbe_context *ctx[] = {generate("off", 0),
+                               generate("on", CBE_OPT_SPLIT)};
+  usz counts[2][8];
+  count_instructions("spill_off.s", counts[0]);
+  count_instructions("spill_on.s", counts[1]);
+
+  printf("%-12s %15s %15s %15s\n", "", "spill stores", "spill loads",
+         "instructions");
+  printf("%-12s %7s %7s %7s %7s %7s %7s\n", "", "off", "on", "off", "on",
+         "off", "on");
+  for (usz i = 0; i < ctx[0]->functions.size; i++) {
+    struct cbe_function *off = &ctx[0]->functions.items[i];
+    struct cbe_function *on = &ctx[1]->functions.items[i];
+    char function[64];
+    snprintf(function, sizeof(function), "%s",
+             ctx[0]->symbol_table.items[off->name_index]);
+    *strrchr(function, '_') = '\0';
+    printf("%-12s %7zu %7zu %7zu %7zu %7zu %7zu\n", function,
+           off->spill_stores, on->spill_stores, off->spill_loads,
+           on->spill_loads, counts[0][i], counts[1][i]);
+  }
+  return 0;
+}
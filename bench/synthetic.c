@@ -0,0 +1,262 @@
+#include "synthetic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Synthetic modules.
+//
+// Every function takes up to six longs and returns one. Its entry block
+// computes `pressure` values from the parameters, and every other block
+// starts from those and keeps `pressure` values of its own: each instruction
+// combines values picked at random and takes the place of one of them, or
+// with probability `allocs` allocates, stores or loads a stack slot. A block
+// ends by folding its values with xor, which keeps them all live until then,
+// and branching on the result to the next block or any but the entry, which
+// makes loops, or by returning the result from the last block.
+
+static const enum cbe_instruction_tag synthetic_operations[] = {
+    CBE_INST_ADD, CBE_INST_SUB, CBE_INST_MUL, CBE_INST_AND,
+    CBE_INST_OR,  CBE_INST_XOR, CBE_INST_SHL, CBE_INST_SAR,
+};
+
+typedef slice(struct cbe_value) synthetic_values;
+
+struct synthetic {
+  struct cbe_context *ctx;
+  const struct synthetic_shape *shape;
+  u64 state;
+  cbe_type_id long_type, long_ptr_type;
+  // Symbols of v<n> and b<n>, shared by all functions.
+  slice(usz) value_names, block_names;
+  usz value_count; // values named in the current function.
+  struct cbe_block *block;
+  synthetic_values values, slots; // of the current block.
+  usz instructions;
+};
+
+// xorshift64*, so the same seed makes the same module everywhere.
+static u64 synthetic_next(struct synthetic *s) {
+  s->state ^= s->state >> 12;
+  s->state ^= s->state << 25;
+  s->state ^= s->state >> 27;
+  return s->state * 0x2545f4914f6cdd1dull;
+}
+
+static usz synthetic_pick(struct synthetic *s, usz n) {
+  return synthetic_next(s) % n;
+}
+
+static bool synthetic_chance(struct synthetic *s, double p) {
+  return (synthetic_next(s) >> 11) * 0x1p-53 < p;
+}
+
+static usz synthetic_name(struct synthetic *s, cstr prefix, usz n) {
+  char text[32];
+  usz size = snprintf(text, sizeof(text), "%s%zu", prefix, n) + 1;
+  char *symbol = CBE_ALLOC(size);
+  memcpy(symbol, text, size);
+  return cbe_find_or_add_symbol(s->ctx, symbol);
+}
+
+static usz synthetic_block_name(struct synthetic *s, usz n) {
+  while (s->block_names.size <= n) {
+    usz name_index = synthetic_name(s, "b", s->block_names.size);
+    slice_push(&s->block_names, name_index);
+  }
+  return s->block_names.items[n];
+}
+
+static usz synthetic_temporary(struct synthetic *s) {
+  if (s->value_count == s->value_names.size) {
+    usz name_index = synthetic_name(s, "v", s->value_count);
+    slice_push(&s->value_names, name_index);
+  }
+  return s->value_names.items[s->value_count++];
+}
+
+static void synthetic_push(struct synthetic *s, struct cbe_instruction inst) {
+  slice_push(&s->block->instructions, inst);
+  s->instructions++;
+}
+
+static struct cbe_value synthetic_integer(struct synthetic *s, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = s->long_type, .integer = integer};
+}
+
+static struct cbe_value synthetic_variable(cbe_type_id type_id,
+                                           usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+static struct cbe_value synthetic_operand(struct synthetic *s) {
+  return s->values.items[synthetic_pick(s, s->values.size)];
+}
+
+static struct cbe_value synthetic_binary(struct synthetic *s,
+                                         enum cbe_instruction_tag tag,
+                                         struct cbe_value lhs,
+                                         struct cbe_value rhs) {
+  usz name_index = synthetic_temporary(s);
+  synthetic_push(s, (struct cbe_instruction){
+                        .tag = tag,
+                        .has_temporary = true,
+                        .temporary = {name_index, s->long_type},
+                        .binary = {lhs, rhs}});
+  return synthetic_variable(s->long_type, name_index);
+}
+
+// Adds `value` to the values of the block, in place of a random one once
+// there are `pressure` of them.
+static void synthetic_keep(struct synthetic *s, synthetic_values *values,
+                           struct cbe_value value) {
+  if (values->size < s->shape->pressure)
+    slice_push(values, value);
+  else
+    values->items[synthetic_pick(s, values->size)] = value;
+}
+
+static void synthetic_compute(struct synthetic *s) {
+  enum cbe_instruction_tag tag = synthetic_operations[synthetic_pick(
+      s, CBE_ARRAY_LEN(synthetic_operations))];
+  struct cbe_value lhs = synthetic_operand(s), rhs;
+  if (tag == CBE_INST_SHL || tag == CBE_INST_SAR)
+    rhs = synthetic_integer(s, 1 + synthetic_pick(s, 63));
+  else if (synthetic_chance(s, 0.25))
+    rhs = synthetic_integer(s, synthetic_pick(s, 1000));
+  else
+    rhs = synthetic_operand(s);
+  synthetic_keep(s, &s->values, synthetic_binary(s, tag, lhs, rhs));
+}
+
+// Loads a slot, stores to one or allocates one and stores to it.
+static void synthetic_memory(struct synthetic *s) {
+  if (s->slots.size > 0 && synthetic_chance(s, 0.5)) {
+    usz name_index = synthetic_temporary(s);
+    synthetic_push(
+        s, (struct cbe_instruction){
+               .tag = CBE_INST_LOAD,
+               .has_temporary = true,
+               .temporary = {name_index, s->long_type},
+               .load = {s->slots.items[synthetic_pick(s, s->slots.size)]}});
+    synthetic_keep(s, &s->values,
+                   synthetic_variable(s->long_type, name_index));
+    return;
+  }
+
+  struct cbe_value slot;
+  if (s->slots.size > 0 && synthetic_chance(s, 0.5)) {
+    slot = s->slots.items[synthetic_pick(s, s->slots.size)];
+  } else {
+    usz name_index = synthetic_temporary(s);
+    synthetic_push(s, (struct cbe_instruction){
+                          .tag = CBE_INST_ALLOC,
+                          .has_temporary = true,
+                          .temporary = {name_index, s->long_ptr_type},
+                          .alloc = {s->long_type}});
+    slot = synthetic_variable(s->long_ptr_type, name_index);
+    synthetic_keep(s, &s->slots, slot);
+  }
+  synthetic_push(s, (struct cbe_instruction){
+                        .tag = CBE_INST_STORE,
+                        .store = {synthetic_operand(s), slot}});
+}
+
+static void synthetic_block(struct synthetic *s, struct cbe_function *fn,
+                            usz index) {
+  push_stack_frame(s->ctx);
+  const struct synthetic_shape *shape = s->shape;
+  struct cbe_block block = {.name_index = synthetic_block_name(s, index)};
+  slice_init_with_capacity(&block.instructions,
+                           2 * shape->instructions + shape->pressure + 2);
+  slice_push(&fn->blocks, block);
+  s->block = &fn->blocks.items[fn->blocks.size - 1];
+
+  for (usz i = 0; i < shape->instructions; i++) {
+    if (synthetic_chance(s, shape->allocs))
+      synthetic_memory(s);
+    else
+      synthetic_compute(s);
+  }
+  struct cbe_value folded = s->values.items[0];
+  for (usz i = 1; i < s->values.size; i++)
+    folded = synthetic_binary(s, CBE_INST_XOR, folded, s->values.items[i]);
+
+  if (index + 1 == shape->blocks) {
+    struct cbe_value *value = CBE_ALLOC(sizeof(*value));
+    *value = folded;
+    synthetic_push(s, (struct cbe_instruction){.tag = CBE_INST_RET,
+                                               .ret = {value}});
+    pop_stack_frame(s->ctx);
+    return;
+  }
+  usz more = synthetic_temporary(s);
+  synthetic_push(s, (struct cbe_instruction){
+                        .tag = CBE_INST_CMP,
+                        .has_temporary = true,
+                        .temporary = {more, s->long_type},
+                        .cmp = {CBE_PRED_NE, folded,
+                                synthetic_integer(s, 0)}});
+  usz target = 1 + synthetic_pick(s, shape->blocks - 1);
+  synthetic_push(s, (struct cbe_instruction){
+                        .tag = CBE_INST_BR,
+                        .br = {synthetic_variable(s->long_type, more),
+                               synthetic_block_name(s, index + 1),
+                               synthetic_block_name(s, target)}});
+  pop_stack_frame(s->ctx);
+}
+
+static void synthetic_function(struct synthetic *s, usz index) {
+  push_stack_frame(s->ctx);
+  const struct synthetic_shape *shape = s->shape;
+  struct cbe_function fn = {.name_index = synthetic_name(s, "f", index),
+                            .type_id = s->long_type};
+  slice_init_with_capacity(&fn.parameters, 6);
+  slice_init_with_capacity(&fn.blocks, shape->blocks);
+  s->value_count = 0;
+  s->values.size = 0;
+  s->slots.size = 0;
+  for (usz i = 0; i < shape->pressure && i < 6; i++) {
+    usz name_index = synthetic_temporary(s);
+    slice_push(&fn.parameters,
+               ((struct cbe_temporary){name_index, s->long_type}));
+    slice_push(&s->values, synthetic_variable(s->long_type, name_index));
+  }
+
+  // Every block starts from the values and slots of the entry block, which
+  // dominates them all.
+  synthetic_block(s, &fn, 0);
+  usz values = s->values.size, slots = s->slots.size;
+  struct cbe_value *entry = CBE_ALLOC(sizeof(*entry) * (values + slots));
+  memcpy(entry, s->values.items, sizeof(*entry) * values);
+  memcpy(entry + values, s->slots.items, sizeof(*entry) * slots);
+  for (usz i = 1; i < shape->blocks; i++) {
+    memcpy(s->values.items, entry, sizeof(*entry) * values);
+    memcpy(s->slots.items, entry + values, sizeof(*entry) * slots);
+    s->values.size = values;
+    s->slots.size = slots;
+    synthetic_block(s, &fn, i);
+  }
+  slice_push(&s->ctx->functions, fn);
+  pop_stack_frame(s->ctx);
+}
+
+usz synthesize(struct cbe_context *ctx, const struct synthetic_shape *shape) {
+  push_stack_frame(ctx);
+  CBE_ASSERT(*ctx, shape->blocks > 0 && shape->pressure > 0);
+  struct synthetic s = {.ctx = ctx, .shape = shape};
+  // xorshift is stuck at zero.
+  s.state = shape->seed != 0 ? shape->seed : 0x9e3779b97f4a7c15ull;
+  s.long_type = cbe_add_type(ctx, (struct cbe_type){CBE_TYPE_LONG});
+  s.long_ptr_type = cbe_add_type(
+      ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = s.long_type});
+  slice_init(&s.value_names);
+  slice_init(&s.block_names);
+  slice_init_with_capacity(&s.values, shape->pressure);
+  slice_init_with_capacity(&s.slots, shape->pressure);
+  for (usz i = 0; i < shape->functions; i++)
+    synthetic_function(&s, i);
+  pop_stack_frame(ctx);
+  return s.instructions;
+}
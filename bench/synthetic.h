@@ -0,0 +1,21 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "../cbe.h"
+
+// Shape of a module made up by synthesize. The same shape and seed always
+// make the same module.
+struct synthetic_shape {
+  u64 seed;
+  usz functions;
+  usz blocks;       // per function, the first of them the entry block.
+  usz instructions; // per block, besides the ones folding its values.
+  usz pressure;     // values every block keeps live until its end.
+  double allocs;    // share of instructions that are allocs, stores, loads.
+};
+
+// Adds the functions of `shape` to `ctx`, which has to be initialized, and
+// returns how many instructions they have.
+usz synthesize(struct cbe_context *ctx, const struct synthetic_shape *shape);
+
+#endif // SYNTHETIC_H
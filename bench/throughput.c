@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times the scalar and vectorized kernels from bench/vectorize.c against each
+// other, after checking that they agree. See that file for how to build it.
+
+#define LENGTH 100003 // not a multiple of any vector width, for the epilogue.
+#define RUNS 2000
+
+int sum_scalar(int *, long);
+int sum_vector(int *, long);
+void map_scalar(int *, int *, int *, int, long);
+void map_vector(int *, int *, int *, int, long);
+int filter_scalar(int *, int, long);
+int filter_vector(int *, int, long);
+
+static int a[LENGTH], b[LENGTH], out[LENGTH], expected[LENGTH];
+static volatile int sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Millions of elements per second.
+static double throughput(double start) {
+  return (double)LENGTH * RUNS / (now() - start) / 1e6;
+}
+
+static void report(const char *kernel, double scalar, double vector) {
+  printf("%-8s %10.1f %10.1f %8.2fx\n", kernel, scalar, vector,
+         vector / scalar);
+}
+
+int main(void) {
+  srand(1);
+  for (int i = 0; i < LENGTH; i++) {
+    a[i] = rand() % 2001 - 1000;
+    b[i] = rand() % 2001 - 1000;
+  }
+
+  map_scalar(expected, a, b, 3, LENGTH);
+  map_vector(out, a, b, 3, LENGTH);
+  for (int i = 0; i < LENGTH; i++) {
+    if (out[i] != expected[i]) {
+      printf("map: out[%d] is %d, expected %d\n", i, out[i], expected[i]);
+      return 1;
+    }
+  }
+  // In place, so the overlap check has to fall back to the scalar loop.
+  for (int i = 0; i < LENGTH; i++)
+    out[i] = a[i];
+  map_vector(out + 1, out, b, 3, LENGTH - 1);
+  for (int i = 1; i < LENGTH; i++) {
+    if (out[i] != out[i - 1] * 3 + b[i - 1]) {
+      printf("map: overlapping out[%d] is wrong\n", i);
+      return 1;
+    }
+  }
+  for (long n = 0; n < 40; n++) {
+    if (sum_scalar(a, n) != sum_vector(a, n) ||
+        filter_scalar(a, 100, n) != filter_vector(a, 100, n)) {
+      printf("sum or filter differ for n = %ld\n", n);
+      return 1;
+    }
+  }
+  if (sum_scalar(a, LENGTH) != sum_vector(a, LENGTH) ||
+      filter_scalar(a, 100, LENGTH) != filter_vector(a, 100, LENGTH)) {
+    printf("sum or filter differ\n");
+    return 1;
+  }
+
+  printf("%-8s %10s %10s %9s\n", "Melem/s", "scalar", "vector", "speedup");
+  double start, scalar;
+
+  start = now();
+  for (int run = 0; run < RUNS; run++)
+    sink = sum_scalar(a, LENGTH);
+  scalar = throughput(start);
+  start = now();
+  for (int run = 0; run < RUNS; run++)
+    sink = sum_vector(a, LENGTH);
+  report("sum", scalar, throughput(start));
+
+  start = now();
+  for (int run = 0; run < RUNS; run++)
+    map_scalar(out, a, b, run, LENGTH);
+  scalar = throughput(start);
+  start = now();
+  for (int run = 0; run < RUNS; run++)
+    map_vector(out, a, b, run, LENGTH);
+  report("map", scalar, throughput(start));
+
+  start = now();
+  for (int run = 0; run < RUNS; run++)
+    sink = filter_scalar(a, run % 1000, LENGTH);
+  scalar = throughput(start);
+  start = now();
+  for (int run = 0; run < RUNS; run++)
+    sink = filter_vector(a, run % 1000, LENGTH);
+  report("filter", scalar, throughput(start));
+  return 0;
+}
@@ -0,0 +1,292 @@
+#include "../cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates the kernels of the vectorizer benchmark twice, once as scalar
+// loops and once with CBE_OPT_VECTORIZE, into vectorize_scalar.s and
+// vectorize_vector.s. Over int arrays of length n:
+//
+//   int sum_*(int *a, long n)                        sum of the a[i]
+//   void map_*(int *out, int *a, int *b, int k, long n)
+//                                                    out[i] = a[i] * k + b[i]
+//   int filter_*(int *a, int t, long n)              sum of the a[i] > t
+//
+// Build and run from the repository root with
+//
+//   gcc -o vectorize bench/vectorize.c $(ls *.c | grep -v test.c)
+//   ./vectorize [--avx2]
+//   gcc -O2 -o throughput bench/throughput.c vectorize_*.s
+//   ./throughput
+
+struct bench_kernel {
+  struct cbe_context *ctx;
+  cstr suffix;
+  cbe_type_id int_type, long_type, int_ptr_type, long_ptr_type;
+  struct cbe_function fn;
+  struct cbe_block entry, loop, body, done;
+  usz i, acc, counter, n;
+};
+
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+// Symbols are per kernel, since every kernel's names end in its suffix.
+static usz name(struct bench_kernel *kernel, cstr text) {
+  usz size = strlen(text) + strlen(kernel->suffix) + 2;
+  char *symbol = CBE_ALLOC(size);
+  snprintf(symbol, size, "%s_%s", text, kernel->suffix);
+  return cbe_add_symbol(kernel->ctx, symbol);
+}
+
+static struct cbe_block block(usz name_index) {
+  struct cbe_block block = {.name_index = name_index};
+  slice_init(&block.instructions);
+  return block;
+}
+
+static void push(struct cbe_block *block, struct cbe_instruction inst) {
+  slice_push(&block->instructions, inst);
+}
+
+static void parameter(struct bench_kernel *kernel, usz name_index,
+                      cbe_type_id type_id) {
+  slice_push(&kernel->fn.parameters,
+             ((struct cbe_temporary){name_index, type_id}));
+}
+
+static struct cbe_instruction binary(enum cbe_instruction_tag tag,
+                                     usz name_index, cbe_type_id type_id,
+                                     struct cbe_value lhs,
+                                     struct cbe_value rhs) {
+  return (struct cbe_instruction){.tag = tag,
+                                  .has_temporary = true,
+                                  .temporary = {name_index, type_id},
+                                  .binary = {lhs, rhs}};
+}
+
+static struct cbe_instruction load(usz name_index, cbe_type_id type_id,
+                                   struct cbe_value pointer) {
+  return (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                  .has_temporary = true,
+                                  .temporary = {name_index, type_id},
+                                  .load = {pointer}};
+}
+
+static struct cbe_instruction store(struct cbe_value value,
+                                    struct cbe_value pointer) {
+  return (struct cbe_instruction){.tag = CBE_INST_STORE,
+                                  .store = {value, pointer}};
+}
+
+// &array[counter], for the element of the current iteration.
+static struct cbe_value element(struct bench_kernel *kernel, usz array) {
+  usz address = name(kernel, "address");
+  push(&kernel->body,
+       (struct cbe_instruction){
+           .tag = CBE_INST_ELEMPTR,
+           .has_temporary = true,
+           .temporary = {address, kernel->int_ptr_type},
+           .elemptr = {variable(kernel->int_ptr_type, array),
+                       variable(kernel->long_type, kernel->counter)}});
+  return variable(kernel->int_ptr_type, address);
+}
+
+// Starts `for (i = 0; i < n; i++)` with an int accumulator, leaving the body
+// open.
+static void begin(struct bench_kernel *kernel, struct cbe_context *ctx,
+                  cstr suffix, cstr function, cbe_type_id type_id) {
+  kernel->ctx = ctx;
+  kernel->suffix = suffix;
+  kernel->fn = (struct cbe_function){.name_index = name(kernel, function),
+                                     .type_id = type_id};
+  slice_init(&kernel->fn.parameters);
+  slice_init(&kernel->fn.blocks);
+  kernel->entry = block(name(kernel, "entry"));
+  kernel->loop = block(name(kernel, "loop"));
+  kernel->body = block(name(kernel, "body"));
+  kernel->done = block(name(kernel, "done"));
+  kernel->i = name(kernel, "i");
+  kernel->acc = name(kernel, "acc");
+  kernel->counter = name(kernel, "counter");
+  kernel->n = name(kernel, "n");
+
+  cbe_type_id int_ptr = kernel->int_ptr_type, long_ptr = kernel->long_ptr_type;
+  push(&kernel->entry,
+       (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                .has_temporary = true,
+                                .temporary = {kernel->i, long_ptr},
+                                .alloc = {kernel->long_type}});
+  push(&kernel->entry,
+       (struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                .has_temporary = true,
+                                .temporary = {kernel->acc, int_ptr},
+                                .alloc = {kernel->int_type}});
+  push(&kernel->entry, store(integer(kernel->long_type, 0),
+                             variable(long_ptr, kernel->i)));
+  push(&kernel->entry, store(integer(kernel->int_type, 0),
+                             variable(int_ptr, kernel->acc)));
+  push(&kernel->entry, (struct cbe_instruction){
+                           .tag = CBE_INST_JMP,
+                           .jmp = {kernel->loop.name_index}});
+
+  usz more = name(kernel, "more");
+  push(&kernel->loop, load(kernel->counter, kernel->long_type,
+                           variable(long_ptr, kernel->i)));
+  push(&kernel->loop,
+       (struct cbe_instruction){
+           .tag = CBE_INST_CMP,
+           .has_temporary = true,
+           .temporary = {more, kernel->int_type},
+           .cmp = {CBE_PRED_LT, variable(kernel->long_type, kernel->counter),
+                   variable(kernel->long_type, kernel->n)}});
+  push(&kernel->loop,
+       (struct cbe_instruction){
+           .tag = CBE_INST_BR,
+           .br = {variable(kernel->int_type, more), kernel->body.name_index,
+                  kernel->done.name_index}});
+}
+
+// acc += value
+static void accumulate(struct bench_kernel *kernel, struct cbe_value value) {
+  usz current = name(kernel, "current"), next = name(kernel, "next");
+  struct cbe_value acc = variable(kernel->int_ptr_type, kernel->acc);
+  push(&kernel->body, load(current, kernel->int_type, acc));
+  push(&kernel->body, binary(CBE_INST_ADD, next, kernel->int_type,
+                             variable(kernel->int_type, current), value));
+  push(&kernel->body, store(variable(kernel->int_type, next), acc));
+}
+
+// Closes the loop and returns the accumulator, if the kernel returns int.
+static void end(struct bench_kernel *kernel) {
+  usz step = name(kernel, "step");
+  push(&kernel->body,
+       binary(CBE_INST_ADD, step, kernel->long_type,
+              variable(kernel->long_type, kernel->counter),
+              integer(kernel->long_type, 1)));
+  push(&kernel->body, store(variable(kernel->long_type, step),
+                            variable(kernel->long_ptr_type, kernel->i)));
+  push(&kernel->body, (struct cbe_instruction){
+                          .tag = CBE_INST_JMP,
+                          .jmp = {kernel->loop.name_index}});
+
+  if (kernel->fn.type_id == kernel->int_type) {
+    usz total = name(kernel, "total");
+    struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+    *value = variable(kernel->int_type, total);
+    push(&kernel->done, load(total, kernel->int_type,
+                             variable(kernel->int_ptr_type, kernel->acc)));
+    push(&kernel->done,
+         (struct cbe_instruction){.tag = CBE_INST_RET, .ret = {value}});
+  } else {
+    push(&kernel->done, (struct cbe_instruction){.tag = CBE_INST_RET});
+  }
+
+  parameter(kernel, kernel->n, kernel->long_type);
+  slice_push(&kernel->fn.blocks, kernel->entry);
+  slice_push(&kernel->fn.blocks, kernel->loop);
+  slice_push(&kernel->fn.blocks, kernel->body);
+  slice_push(&kernel->fn.blocks, kernel->done);
+  slice_push(&kernel->ctx->functions, kernel->fn);
+}
+
+static void generate(cstr suffix, u32 options, u32 target_features) {
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  ctx.options |= options;
+  ctx.target_features |= target_features;
+
+  struct bench_kernel kernel = {0};
+  kernel.int_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_INT});
+  kernel.long_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_LONG});
+  kernel.int_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = kernel.int_type});
+  kernel.long_ptr_type = cbe_add_type(
+      &ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = kernel.long_type});
+  cbe_type_id void_type = cbe_add_type(&ctx, (struct cbe_type){CBE_TYPE_VOID});
+  cbe_type_id int_type = kernel.int_type, int_ptr = kernel.int_ptr_type;
+
+  {
+    begin(&kernel, &ctx, suffix, "sum", int_type);
+    usz a = name(&kernel, "a"), value = name(&kernel, "value");
+    parameter(&kernel, a, int_ptr);
+    push(&kernel.body, load(value, int_type, element(&kernel, a)));
+    accumulate(&kernel, variable(int_type, value));
+    end(&kernel);
+  }
+
+  {
+    begin(&kernel, &ctx, suffix, "map", void_type);
+    usz out = name(&kernel, "out"), a = name(&kernel, "a");
+    usz b = name(&kernel, "b"), k = name(&kernel, "k");
+    usz x = name(&kernel, "x"), y = name(&kernel, "y");
+    usz scaled = name(&kernel, "scaled"), result = name(&kernel, "result");
+    parameter(&kernel, out, int_ptr);
+    parameter(&kernel, a, int_ptr);
+    parameter(&kernel, b, int_ptr);
+    parameter(&kernel, k, int_type);
+    push(&kernel.body, load(x, int_type, element(&kernel, a)));
+    push(&kernel.body, load(y, int_type, element(&kernel, b)));
+    push(&kernel.body, binary(CBE_INST_MUL, scaled, int_type,
+                              variable(int_type, x), variable(int_type, k)));
+    push(&kernel.body,
+         binary(CBE_INST_ADD, result, int_type, variable(int_type, scaled),
+                variable(int_type, y)));
+    push(&kernel.body,
+         store(variable(int_type, result), element(&kernel, out)));
+    end(&kernel);
+  }
+
+  {
+    begin(&kernel, &ctx, suffix, "filter", int_type);
+    usz a = name(&kernel, "a"), t = name(&kernel, "t");
+    usz value = name(&kernel, "value"), above = name(&kernel, "above");
+    usz kept = name(&kernel, "kept");
+    parameter(&kernel, a, int_ptr);
+    parameter(&kernel, t, int_type);
+    push(&kernel.body, load(value, int_type, element(&kernel, a)));
+    push(&kernel.body,
+         (struct cbe_instruction){
+             .tag = CBE_INST_CMP,
+             .has_temporary = true,
+             .temporary = {above, int_type},
+             .cmp = {CBE_PRED_GT, variable(int_type, value),
+                     variable(int_type, t)}});
+    push(&kernel.body,
+         (struct cbe_instruction){
+             .tag = CBE_INST_SELECT,
+             .has_temporary = true,
+             .temporary = {kept, int_type},
+             .select = {variable(int_type, above), variable(int_type, value),
+                        integer(int_type, 0)}});
+    accumulate(&kernel, variable(int_type, kept));
+    end(&kernel);
+  }
+
+  cbe_optimize(&ctx);
+  cbe_validate(&ctx);
+  char path[64];
+  snprintf(path, sizeof(path), "vectorize_%s.s", suffix);
+  FILE *fp = fopen(path, "w");
+  cbe_generate(&ctx, fp);
+  fclose(fp);
+}
+
+int main(int argc, char **argv) {
+  a_init(64 * 1024 * 1024);
+  u32 target_features = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--avx2") == 0)
+      target_features |= CBE_TARGET_AVX2;
+  }
+  generate("scalar", 0, target_features);
+  generate("vector", CBE_OPT_VECTORIZE, target_features);
+  return 0;
+}
@@ -1,15 +1,43 @@
 #include "cbe.h"
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 void cbe_init(struct cbe_context *ctx) {
+  ctx->arena = a_stats();
   slice_init(&ctx->stacktrace);
   push_stack_frame(ctx);
+  ctx->options = CBE_OPT_BLOCK_LAYOUT | CBE_OPT_TAIL_CALLS | CBE_OPT_SPLIT |
+                 CBE_OPT_DEAD_CODE;
+  ctx->profile_path = "cbe.profile";
+  // Only callee-saved registers are handed out, so values survive calls
+  // without any caller-side saving.
   ctx->register_pool = (struct cbe_register_pool){
       .head = 0,
-      .registers = {CBE_REG_EAX, CBE_REG_EBX},
-      .registers_count = 2,
+      .registers = {CBE_REG_EBX, CBE_REG_R12D, CBE_REG_R13D, CBE_REG_R14D,
+                    CBE_REG_R15D},
+      .registers_count = 5,
+  };
+  ctx->scratch_pool = (struct cbe_register_pool){
+      .head = 0,
+      .registers = {CBE_REG_R10D, CBE_REG_R11D, CBE_REG_R9D},
+      .registers_count = 3,
+  };
+  // Every xmm register is caller-saved, so values living across a call are
+  // spilled instead. xmm0-xmm7 carry arguments and xmm15 is a fixed
+  // temporary of the isel templates.
+  ctx->target_features = CBE_TARGET_SSE2;
+  ctx->target_cpu = CBE_CPU_GENERIC;
+  ctx->vector_pool = (struct cbe_register_pool){
+      .head = 0,
+      .registers = {CBE_REG_XMM8, CBE_REG_XMM9, CBE_REG_XMM10, CBE_REG_XMM11},
+      .registers_count = 4,
+  };
+  ctx->vector_scratch_pool = (struct cbe_register_pool){
+      .head = 0,
+      .registers = {CBE_REG_XMM12, CBE_REG_XMM13, CBE_REG_XMM14},
+      .registers_count = 3,
   };
   ctx->current_stack_location = 0;
   slice_init(&ctx->functions);
@@ -19,71 +47,433 @@ void cbe_init(struct cbe_context *ctx) {
 
   slice_init(&ctx->live_intervals);
   slice_init(&ctx->active_intervals);
+  slice_init(&ctx->split_intervals);
   ctx->ip = 0;
+  slice_init(&ctx->definitions);
+  slice_init(&ctx->use_counts);
+  slice_init(&ctx->call_points);
 
   slice_init(&ctx->symbol_table);
   slice_init(&ctx->string_table);
+  slice_init(&ctx->constant_table);
+  ctx->string_index = (struct cbe_literal_index){0};
+  ctx->constant_index = (struct cbe_literal_index){0};
+  slice_init(&ctx->diagnostics);
+  slice_init(&ctx->checked_definitions);
+  slice_init(&ctx->pending_uses);
+  ctx->definition_walks = 0;
+  ctx->checked = false;
+  ctx->stats = (struct cbe_stats){0};
+  ctx->trace = (struct cbe_trace){0};
+
+  ctx->current_function = NULL;
+  ctx->current_block = SIZE_MAX;
+  ctx->next_block = SIZE_MAX;
+  pop_stack_frame(ctx);
+}
+
+static void cbe_optimize_dead_code(struct cbe_context *ctx) {
+  if (!(ctx->options & CBE_OPT_DEAD_CODE))
+    return;
+  CBE_TIMER_START(CBE_TIMER_DEAD_CODE);
+  cbe_eliminate_dead_code(ctx);
+  CBE_TIMER_STOP(ctx, CBE_TIMER_DEAD_CODE);
+}
+
+void cbe_optimize(struct cbe_context *ctx) {
+  // The passes take the IR to be well formed; a module that is not is left
+  // as it is, for cbe_validate to report.
+  if (cbe_check(ctx) != CBE_VALID_OK)
+    return;
+  push_stack_frame(ctx);
+  // Before inlining, so that nothing is inlined into dead code, and after it,
+  // which leaves local callees inlined everywhere without callers.
+  cbe_optimize_dead_code(ctx);
+  if (ctx->options & CBE_OPT_INLINE) {
+    CBE_TIMER_START(CBE_TIMER_INLINE);
+    cbe_inline_functions(ctx);
+    CBE_TIMER_STOP(ctx, CBE_TIMER_INLINE);
+    cbe_optimize_dead_code(ctx);
+  }
+  for (usz i = 0; i < ctx->functions.size; i++) {
+    struct cbe_function *fn = &ctx->functions.items[i];
+    if (ctx->options & CBE_OPT_VECTORIZE) {
+      CBE_TIMER_START(CBE_TIMER_VECTORIZE);
+      cbe_vectorize_loops(ctx, fn);
+      CBE_TIMER_STOP(ctx, CBE_TIMER_VECTORIZE);
+    }
+    if (ctx->options & CBE_OPT_SCHEDULE) {
+      CBE_TIMER_START(CBE_TIMER_SCHEDULE);
+      cbe_schedule_function(ctx, fn);
+      CBE_TIMER_STOP(ctx, CBE_TIMER_SCHEDULE);
+    }
+    if (ctx->options & CBE_OPT_BLOCK_LAYOUT) {
+      CBE_TIMER_START(CBE_TIMER_LAYOUT);
+      cbe_layout_blocks(ctx, fn);
+      CBE_TIMER_STOP(ctx, CBE_TIMER_LAYOUT);
+    }
+  }
   pop_stack_frame(ctx);
 }
 
+static struct cbe_register_pool *
+cbe_class_pool(struct cbe_context *ctx, enum cbe_register_class class) {
+  return class == CBE_REGISTER_CLASS_VECTOR ? &ctx->vector_pool
+                                            : &ctx->register_pool;
+}
+
 cbe_live_intervals
 cbe_expire_old_intervals(struct cbe_context *ctx,
                          cbe_live_intervals active_intervals,
                          struct cbe_live_interval *interval) {
-  qsort(active_intervals.items, sizeof(struct cbe_live_interval),
-        active_intervals.size, cbe_sort_by_end_point);
-  for (usz i = 0; i < active_intervals.size; i++) {
-    struct cbe_live_interval *active_interval = active_intervals.items[i];
+  qsort(active_intervals.items, active_intervals.size,
+        sizeof(*active_intervals.items), cbe_sort_by_end_point);
+  while (active_intervals.size > 0) {
+    struct cbe_live_interval *active_interval = active_intervals.items[0];
     if (active_interval->end_point >= interval->start_point)
       return active_intervals;
-    cbe_free_register(&ctx->register_pool, active_interval->symbol.reg);
-    cbe_delete_interval(&active_intervals, i);
-    return active_intervals;
+    cbe_free_register(cbe_class_pool(ctx, active_interval->register_class),
+                      active_interval->symbol.reg);
+    cbe_delete_interval(&active_intervals, 0);
   }
   return active_intervals;
 }
 
-void cbe_spill_at_interval(struct cbe_context *ctx,
-                           cbe_live_intervals active_intervals,
-                           struct cbe_live_interval *interval) {
-  qsort(active_intervals.items, sizeof(struct cbe_live_interval),
-        active_intervals.size, cbe_sort_by_end_point);
-  struct cbe_live_interval *spill =
-      active_intervals.items[active_intervals.size - 1];
-  if (spill->end_point > interval->end_point) {
-    CBE_DEBUG("ACTION: SPILL INTERVAL (%p)\n", (void *)spill);
-    CBE_DEBUG("ACTION: ALLOCATE REGISTER %s(%d) TO INTERVAL (%p)\n",
-              cbe_get_register_name(spill->symbol.reg), spill->symbol.reg,
-              (void *)interval);
+// What spilling `interval` costs, in profiled executions: a value that can
+// be recomputed at its uses costs next to nothing.
+static u64 cbe_spill_cost(struct cbe_live_interval *interval) {
+  return interval->remat != NULL ? 0 : interval->spill_weight + 1;
+}
+
+static struct cbe_block *cbe_block_at(struct cbe_function *fn, int ip) {
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    if (ip >= (int)block->first_ip && ip <= (int)block->last_ip)
+      return block;
+  }
+  return NULL;
+}
+
+// Splits the spilled `interval`, whose value stays in its slot from the
+// definition on, into pieces for the runs of at least two of its uses
+// (counting the definition) within one block. Every piece loads the slot
+// once and serves its uses from a register. Runs before `point`, where the
+// interval had `reg` to itself, keep that register; later ones are left in
+// ctx->split_intervals to compete for one.
+static void cbe_split_interval(struct cbe_context *ctx,
+                               struct cbe_live_interval *interval,
+                               enum cbe_register reg, int point) {
+  push_stack_frame(ctx);
+  usz count = 0;
+  int *points = CBE_ALLOC(sizeof(int) * (interval->uses.size + 1));
+  if (interval->definition >= 0)
+    points[count++] = interval->definition;
+  for (usz i = 0; i < interval->uses.size; i++)
+    points[count++] = interval->uses.items[i];
+
+  for (usz i = 0, j; i < count; i = j) {
+    struct cbe_block *block = cbe_block_at(ctx->current_function, points[i]);
+    CBE_ASSERT(*ctx, block != NULL);
+    bool before = points[i] < point;
+    for (j = i + 1; j < count && points[j] <= (int)block->last_ip &&
+                    (points[j] < point) == before;
+         j++)
+      ;
+    if (j - i < 2 || (before && reg == CBE_REG_NONE))
+      continue;
+
+    struct cbe_live_interval *piece = CBE_ALLOC(sizeof(*piece));
+    *piece = (struct cbe_live_interval){
+        .name_index = interval->name_index,
+        .symbol = {.name = interval->symbol.name,
+                   .reg = before ? reg : CBE_REG_NONE,
+                   .location = interval->symbol.location},
+        .location = -1,
+        .start_point = points[i],
+        .end_point = points[j - 1],
+        .spill_weight = (j - i) * block->weight,
+        .register_class = interval->register_class,
+        .size = interval->size,
+        .definition = -1,
+        .hint = SIZE_MAX,
+        .parent = interval,
+        .next = interval->pieces,
+        .reload = points[i] != interval->definition,
+    };
+    interval->pieces = piece;
+    if (piece->reload)
+      slice_push(&block->reloads, piece);
+    if (!before)
+      slice_push(&ctx->split_intervals, piece);
+  }
+  pop_stack_frame(ctx);
+}
+
+// Records `event` for `interval`, under the id of its parent if it is a piece.
+static void cbe_trace_interval(struct cbe_context *ctx,
+                               enum cbe_trace_event event,
+                               struct cbe_live_interval *interval,
+                               enum cbe_register reg, u16 flags, int ip,
+                               u32 operand) {
+  if (interval->parent != NULL) {
+    interval = interval->parent;
+    flags |= CBE_TRACE_PIECE;
+  }
+  CBE_TRACE(ctx, event, reg, flags, ip, interval - ctx->live_intervals.items,
+            operand);
+}
+
+// Takes the register of `interval` away from `point` on. A piece just goes
+// back to its slot and a value that is cheap to recompute is redone at its
+// uses; anything else gets a slot of its own and, with CBE_OPT_SPLIT, is
+// split around the point.
+static void cbe_spill_interval(struct cbe_context *ctx,
+                               struct cbe_live_interval *interval, int point) {
+  enum cbe_register reg = interval->symbol.reg;
+  interval->symbol.reg = CBE_REG_NONE;
+  if (interval->parent != NULL || interval->remat != NULL) {
+    cbe_trace_interval(ctx, CBE_EVENT_SPILL, interval, reg,
+                       interval->remat != NULL ? CBE_TRACE_REMAT : 0, point,
+                       0);
+    return;
+  }
+  cbe_trace_interval(ctx, CBE_EVENT_SPILL, interval, reg, CBE_TRACE_SLOT,
+                     point, 0);
+  interval->symbol.location = cbe_allocate_stack_slot(ctx, interval->size);
+  if (ctx->options & CBE_OPT_SPLIT)
+    cbe_split_interval(ctx, interval, reg, point);
+}
+
+cbe_live_intervals cbe_spill_at_interval(struct cbe_context *ctx,
+                                         cbe_live_intervals active_intervals,
+                                         struct cbe_live_interval *interval) {
+  qsort(active_intervals.items, active_intervals.size,
+        sizeof(*active_intervals.items), cbe_sort_by_end_point);
+  // Spill whatever ends last, unless it costs more to spill than something
+  // else: it is used more often according to a profile, or it is not as
+  // cheap to recompute.
+  struct cbe_live_interval *spill = NULL;
+  usz spill_index = 0;
+  for (usz i = active_intervals.size; i > 0; i--) {
+    struct cbe_live_interval *active = active_intervals.items[i - 1];
+    if (active->register_class != interval->register_class)
+      continue;
+    if (spill == NULL || cbe_spill_cost(active) < cbe_spill_cost(spill)) {
+      spill = active;
+      spill_index = i - 1;
+    }
+  }
+  CBE_ASSERT(*ctx, spill != NULL);
+  bool spill_active = cbe_spill_cost(spill) != cbe_spill_cost(interval)
+                          ? cbe_spill_cost(spill) < cbe_spill_cost(interval)
+                          : spill->end_point > interval->end_point;
+  // Pieces only take registers nobody else needs.
+  if (interval->parent != NULL)
+    spill_active = false;
+  if (spill_active) {
+    cbe_trace_interval(ctx, CBE_EVENT_ALLOCATE, interval, spill->symbol.reg,
+                       0, interval->start_point, 0);
     interval->symbol.reg = spill->symbol.reg;
-    spill->symbol.location = ctx->current_stack_location;
-    cbe_delete_interval(&active_intervals, active_intervals.size - 1);
+    cbe_spill_interval(ctx, spill, interval->start_point);
+    cbe_delete_interval(&active_intervals, spill_index);
+    slice_push(&active_intervals, interval);
   } else {
-    CBE_DEBUG("ACTION: SPILL INTERVAL (%p)\n", (void *)interval);
-    interval->symbol.location = ctx->current_stack_location;
+    cbe_spill_interval(ctx, interval, interval->start_point);
   }
-  ctx->current_stack_location += 4;
+  return active_intervals;
+}
+
+static int cbe_sort_by_start_point(const void *a, const void *b) {
+  const struct cbe_live_interval *x = *(struct cbe_live_interval *const *)a;
+  const struct cbe_live_interval *y = *(struct cbe_live_interval *const *)b;
+  if (x->start_point != y->start_point)
+    return (x->start_point > y->start_point) -
+           (x->start_point < y->start_point);
+  return (x > y) - (x < y);
+}
+
+// Whether a call clobbers the caller-saved register `interval` would get: it
+// is defined before the call and still used after it.
+static bool cbe_crosses_call(struct cbe_context *ctx,
+                             struct cbe_live_interval *interval) {
+  for (usz i = 0; i < ctx->call_points.size; i++) {
+    int ip = (int)ctx->call_points.items[i];
+    if (interval->start_point < ip && interval->end_point > ip)
+      return true;
+  }
+  return false;
+}
+
+// A two-address instruction whose first operand dies in it can write its
+// result over that operand: giving both the same register saves the copy.
+static bool cbe_coalesce(struct cbe_context *ctx,
+                         struct cbe_live_interval *interval) {
+  if (interval->hint == SIZE_MAX)
+    return false;
+  struct cbe_live_interval *source = &ctx->live_intervals.items[interval->hint];
+  if (source->end_point != interval->start_point)
+    return false;
+  for (usz i = 0; i < ctx->active_intervals.size; i++) {
+    if (ctx->active_intervals.items[i] != source)
+      continue;
+    interval->symbol.reg = source->symbol.reg;
+    ctx->active_intervals.items[i] = interval;
+    return true;
+  }
+  return false;
+}
+
+// Adds `piece` to the part of the by start point sorted `intervals` that
+// follows `from`.
+static void cbe_insert_interval(cbe_live_intervals *intervals, usz from,
+                                struct cbe_live_interval *piece) {
+  usz at = from;
+  while (at < intervals->size &&
+         intervals->items[at]->start_point <= piece->start_point)
+    at++;
+  slice_push(intervals, piece);
+  memmove(&intervals->items[at + 1], &intervals->items[at],
+          (intervals->size - 1 - at) * sizeof(*intervals->items));
+  intervals->items[at] = piece;
+}
+
+// Linear scan over the intervals created since `first`.
+void cbe_allocate_registers(struct cbe_context *ctx, usz first) {
+  push_stack_frame(ctx);
+  cbe_live_intervals intervals;
+  slice_init_with_capacity(&intervals, ctx->live_intervals.size - first + 1);
+  for (usz i = first; i < ctx->live_intervals.size; i++)
+    slice_push(&intervals, &ctx->live_intervals.items[i]);
+  qsort(intervals.items, intervals.size, sizeof(*intervals.items),
+        cbe_sort_by_start_point);
+
+  ctx->active_intervals.size = 0;
+  for (usz i = 0; i < intervals.size; i++) {
+    struct cbe_live_interval *interval = intervals.items[i];
+    cbe_trace_interval(ctx, CBE_EVENT_INTERVAL, interval, CBE_REG_NONE, 0,
+                       interval->start_point, interval->end_point);
+
+    ctx->active_intervals =
+        cbe_expire_old_intervals(ctx, ctx->active_intervals, interval);
+
+    struct cbe_register_pool *pool =
+        cbe_class_pool(ctx, interval->register_class);
+    if (interval->register_class == CBE_REGISTER_CLASS_VECTOR &&
+        cbe_crosses_call(ctx, interval)) {
+      cbe_spill_interval(ctx, interval, interval->start_point);
+    } else if (cbe_coalesce(ctx, interval)) {
+      cbe_trace_interval(ctx, CBE_EVENT_COALESCE, interval,
+                         interval->symbol.reg, 0, interval->start_point,
+                         interval->hint);
+    } else if (cbe_register_pool_is_empty(pool)) {
+      ctx->active_intervals =
+          cbe_spill_at_interval(ctx, ctx->active_intervals, interval);
+    } else {
+      enum cbe_register reg = cbe_get_register(pool);
+      cbe_trace_interval(ctx, CBE_EVENT_ALLOCATE, interval, reg, 0,
+                         interval->start_point, 0);
+      if (reg != CBE_REG_ERROR)
+        interval->symbol.reg = reg;
+      slice_push(&ctx->active_intervals, interval);
+    }
+
+    for (usz j = 0; j < ctx->split_intervals.size; j++)
+      cbe_insert_interval(&intervals, i + 1, ctx->split_intervals.items[j]);
+    ctx->split_intervals.size = 0;
+  }
+
+  for (usz i = 0; i < ctx->active_intervals.size; i++) {
+    struct cbe_live_interval *interval = ctx->active_intervals.items[i];
+    cbe_free_register(cbe_class_pool(ctx, interval->register_class),
+                      interval->symbol.reg);
+  }
+  ctx->active_intervals.size = 0;
+  pop_stack_frame(ctx);
 }
 
 static cstr registers[] = {
-    "None", "eax", "ebx", "ecx", "edx", "esi", "edi", "ebp", "esp",
+    "None", "eax", "ebx", "ecx",  "edx",  "esi",  "edi",  "ebp",  "esp",
+    "r8d",  "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+static cstr registers_64[] = {
+    "None", "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+    "r8",   "r9",  "r10", "r11", "r12", "r13", "r14", "r15",
 };
 
-cstr cbe_get_register_name(enum cbe_register reg) { return registers[reg]; }
+static cstr registers_16[] = {
+    "None", "ax",  "bx",   "cx",   "dx",   "si",   "di",   "bp",   "sp",
+    "r8w",  "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w",
+};
 
-static void *cbe_slice_array(void *arr, int elementSize, int start, int end) {
-  int size = (end - start + 1) * elementSize;
-  void *result = malloc(size);
+static cstr registers_8[] = {
+    "None", "al",  "bl",   "cl",   "dl",   "sil",  "dil",  "bpl",  "spl",
+    "r8b",  "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
 
-  if (result == NULL) {
-    printf("Memory allocation failed\n");
-    exit(1);
-  }
+static cstr vector_registers[] = {
+    "xmm0", "xmm1", "xmm2",  "xmm3",  "xmm4",  "xmm5",  "xmm6",  "xmm7",
+    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+};
 
-  char *src = (char *)arr + start * elementSize;
-  memcpy(result, src, size);
+static cstr vector_registers_256[] = {
+    "ymm0", "ymm1", "ymm2",  "ymm3",  "ymm4",  "ymm5",  "ymm6",  "ymm7",
+    "ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15",
+};
 
-  return result;
+cstr cbe_get_register_name(enum cbe_register reg) {
+  return cbe_get_register_name_sized(reg, 4);
+}
+
+enum cbe_register_class cbe_get_register_class(enum cbe_register reg) {
+  return reg >= CBE_REG_XMM0 && reg <= CBE_REG_XMM15
+             ? CBE_REGISTER_CLASS_VECTOR
+             : CBE_REGISTER_CLASS_GENERAL;
+}
+
+static enum cbe_register argument_registers[CBE_ARGUMENT_REGISTERS] = {
+    CBE_REG_EDI, CBE_REG_ESI, CBE_REG_EDX,
+    CBE_REG_ECX, CBE_REG_R8D, CBE_REG_R9D,
+};
+
+enum cbe_register cbe_get_argument_register(usz index) {
+  return argument_registers[index];
+}
+
+enum cbe_register cbe_get_vector_argument_register(usz index) {
+  return CBE_REG_XMM0 + index;
+}
+
+bool cbe_is_callee_saved(enum cbe_register reg) {
+  switch (reg) {
+  case CBE_REG_EBX:
+  case CBE_REG_EBP:
+  case CBE_REG_R12D:
+  case CBE_REG_R13D:
+  case CBE_REG_R14D:
+  case CBE_REG_R15D:
+    return true;
+  default:
+    return false;
+  }
+}
+
+cstr cbe_get_register_name_sized(enum cbe_register reg, usz size) {
+  if (reg == CBE_REG_ERROR)
+    return "None";
+  if (cbe_get_register_class(reg) == CBE_REGISTER_CLASS_VECTOR)
+    return size == 32 ? vector_registers_256[reg - CBE_REG_XMM0]
+                      : vector_registers[reg - CBE_REG_XMM0];
+  switch (size) {
+  case 1:
+    return registers_8[reg];
+  case 2:
+    return registers_16[reg];
+  case 4:
+    return registers[reg];
+  default:
+    return registers_64[reg];
+  }
 }
 
 enum cbe_register cbe_get_register(struct cbe_register_pool *pool) {
@@ -91,17 +481,17 @@ enum cbe_register cbe_get_register(struct cbe_register_pool *pool) {
     return CBE_REG_ERROR;
 
   enum cbe_register reg = pool->registers[0];
-  __auto_type regs = pool->registers;
-  int size = (CBE_ARRAY_LEN(regs) - 1 + 1) * sizeof(enum cbe_register);
-  char *src = (char *)regs + 1 * sizeof(enum cbe_register);
-  memcpy(pool->registers, src, size);
   pool->registers_count--;
+  memmove(pool->registers, pool->registers + 1,
+          pool->registers_count * sizeof(enum cbe_register));
 
   return reg;
 }
 
 void cbe_free_register(struct cbe_register_pool *pool, enum cbe_register reg) {
-  for (usz i = 0; i < CBE_ARRAY_LEN(pool->registers); i++) {
+  if (reg == CBE_REG_NONE || reg == CBE_REG_ERROR)
+    return;
+  for (usz i = 0; i < pool->registers_count; i++) {
     if (pool->registers[i] == reg)
       return;
   }
@@ -114,39 +504,49 @@ bool cbe_register_pool_is_empty(struct cbe_register_pool *pool) {
 }
 
 int cbe_sort_by_end_point(const void *a, const void *b) {
-  return (*(struct cbe_live_interval *)a).end_point <
-         (*(struct cbe_live_interval *)b).end_point;
+  const struct cbe_live_interval *x = *(struct cbe_live_interval *const *)a;
+  const struct cbe_live_interval *y = *(struct cbe_live_interval *const *)b;
+  return (x->end_point > y->end_point) - (x->end_point < y->end_point);
 }
 
 void cbe_delete_interval(cbe_live_intervals *intervals, usz index) {
-  cbe_live_intervals new_intervals;
-  slice_init_with_capacity(&new_intervals, intervals->size);
-
-  for (usz i = 0; i < intervals->size; i++) {
-    if (i == index)
-      continue;
-    slice_push(&new_intervals, intervals->items[i]);
-  }
-
-  intervals->items = new_intervals.items;
-  intervals->size = new_intervals.size;
+  memmove(&intervals->items[index], &intervals->items[index + 1],
+          (intervals->size - index - 1) * sizeof(*intervals->items));
+  intervals->size--;
 }
 
-usz cbe_allocate_stack_variable(struct cbe_context *ctx, usz name_index) {
+usz cbe_allocate_stack_variable(struct cbe_context *ctx, usz name_index,
+                                usz size) {
   push_stack_frame(ctx);
   usz index = ctx->stack_variables.size;
   struct cbe_value stored_value = {
       .tag = CBE_VALUE_NIL,
       .type_id = cbe_add_type(ctx, (struct cbe_type){.tag = CBE_TYPE_RAWPTR})};
-  slice_push(&ctx->stack_variables, (struct cbe_stack_variable){
-                                        .associated_name_index = name_index,
-                                        .slot = index,
-                                        .stored_value = stored_value,
-                                    });
+  slice_push(&ctx->stack_variables,
+             (struct cbe_stack_variable){
+                 .associated_name_index = name_index,
+                 .slot = index,
+                 .offset = cbe_allocate_stack_slot(ctx, size < 8 ? 8 : size),
+                 .stored_value = stored_value,
+             });
   pop_stack_frame(ctx);
   return index;
 }
 
+// Reserves `size` bytes in the current frame and returns their offset below
+// the frame base.
+usz cbe_allocate_stack_slot(struct cbe_context *ctx, usz size) {
+  ctx->current_stack_location += size;
+  return ctx->current_stack_location;
+}
+
+// Functions in the red zone keep their slots below rsp instead of rbp.
+int cbe_format_frame_address(struct cbe_context *ctx, char *buffer, usz size,
+                             usz offset) {
+  bool red_zone = ctx->current_function->red_zone;
+  return snprintf(buffer, size, "[%s - %zu]", red_zone ? "rsp" : "rbp", offset);
+}
+
 usz cbe_find_stack_variable(struct cbe_context *ctx, usz name_index) {
   push_stack_frame(ctx);
   for (usz i = 0; i < ctx->stack_variables.size; i++) {
@@ -169,6 +569,18 @@ usz cbe_new_global_variable(struct cbe_context *ctx,
   return index;
 }
 
+usz cbe_find_global_variable(struct cbe_context *ctx, usz name_index) {
+  push_stack_frame(ctx);
+  for (usz i = 0; i < ctx->global_variables.size; i++) {
+    if (ctx->global_variables.items[i].name_index == name_index) {
+      pop_stack_frame(ctx);
+      return i;
+    }
+  }
+  pop_stack_frame(ctx);
+  return SIZE_MAX;
+}
+
 cbe_type_id cbe_add_type(struct cbe_context *ctx, struct cbe_type type) {
   push_stack_frame(ctx);
   usz index = ctx->types.size;
@@ -211,45 +623,201 @@ usz cbe_add_symbol(struct cbe_context *ctx, cstr symbol) {
   return index;
 }
 
-usz cbe_find_interval(struct cbe_context *ctx, cstr interval_name) {
-  push_stack_frame(ctx);
-  for (usz i = 0; i < ctx->live_intervals.size; i++) {
-    struct cbe_live_interval interval = ctx->live_intervals.items[i];
-    if (interval.symbol.name == interval_name)
-      pop_stack_frame(ctx);
-    return i;
+usz cbe_type_size(struct cbe_context *ctx, cbe_type_id type_id) {
+  switch (ctx->types.items[type_id].tag) {
+  case CBE_TYPE_BYTE:
+    return 1;
+  case CBE_TYPE_SHORT:
+    return 2;
+  case CBE_TYPE_INT:
+    return 4;
+  case CBE_TYPE_LONG:
+  case CBE_TYPE_RAWPTR:
+  case CBE_TYPE_PTR:
+    return 8;
+  case CBE_TYPE_VOID:
+    return 0;
+  case CBE_TYPE_FLOAT:
+    return 4;
+  case CBE_TYPE_DOUBLE:
+    return 8;
+  case CBE_TYPE_VECTOR: {
+    struct cbe_type type = ctx->types.items[type_id];
+    return type.lanes * cbe_type_size(ctx, type.element);
+  }
+  }
+  return 0;
+}
+
+enum cbe_register_class cbe_type_register_class(struct cbe_context *ctx,
+                                                cbe_type_id type_id) {
+  switch (ctx->types.items[type_id].tag) {
+  case CBE_TYPE_FLOAT:
+  case CBE_TYPE_DOUBLE:
+  case CBE_TYPE_VECTOR:
+    return CBE_REGISTER_CLASS_VECTOR;
+  default:
+    return CBE_REGISTER_CLASS_GENERAL;
   }
-  pop_stack_frame(ctx);
-  return SIZE_MAX;
 }
 
-struct cbe_live_interval
-cbe_add_or_increment_live_interval(struct cbe_context *ctx,
-                                   cstr interval_name) {
+cbe_interval_id cbe_add_live_interval(struct cbe_context *ctx,
+                                      usz name_index, cbe_type_id type_id) {
   push_stack_frame(ctx);
-  usz interval_id = cbe_find_interval(ctx, interval_name);
-  if (interval_id == SIZE_MAX) {
-    slice_push(&ctx->live_intervals,
-               (struct cbe_live_interval){
-                   .symbol =
-                       (struct cbe_register_symbol){
-                           .name = interval_name,
-                           .reg = cbe_get_register(&ctx->register_pool),
-                           .location = -1},
-                   .start_point = ctx->ip,
-                   .end_point = ctx->ip,
-                   .location = -1,
-               });
-    interval_id = ctx->live_intervals.size - 1;
-  }
-  struct cbe_live_interval interval = ctx->live_intervals.items[interval_id];
-  interval.end_point += 1;
+  cbe_interval_id interval_id = ctx->live_intervals.size;
+  slice_push(&ctx->live_intervals,
+             (struct cbe_live_interval){
+                 .name_index = name_index,
+                 .symbol =
+                     (struct cbe_register_symbol){
+                         .name = ctx->symbol_table.items[name_index],
+                         .reg = CBE_REG_NONE,
+                         .location = -1},
+                 .start_point = ctx->ip,
+                 .end_point = ctx->ip,
+                 .location = -1,
+                 .register_class = cbe_type_register_class(ctx, type_id),
+                 .size = cbe_type_size(ctx, type_id) < 8
+                             ? 8
+                             : cbe_type_size(ctx, type_id),
+                 .definition = -1,
+                 .hint = SIZE_MAX,
+             });
+  slice_init_with_capacity(&ctx->live_intervals.items[interval_id].uses, 4);
   pop_stack_frame(ctx);
-  return interval;
+  return interval_id;
+}
+
+void cbe_extend_live_interval(struct cbe_context *ctx,
+                              cbe_interval_id interval_id, int point) {
+  struct cbe_live_interval *interval = &ctx->live_intervals.items[interval_id];
+  if (point > interval->end_point)
+    interval->end_point = point;
+  if (point < interval->start_point)
+    interval->start_point = point;
+}
+
+// The register holding interval `interval_id` at `ip`: its own, or once it
+// has been spilled that of the piece covering `ip`, if any.
+enum cbe_register cbe_interval_register(struct cbe_context *ctx,
+                                        cbe_interval_id interval_id, usz ip) {
+  struct cbe_live_interval *interval = &ctx->live_intervals.items[interval_id];
+  if (interval->symbol.reg != CBE_REG_NONE)
+    return interval->symbol.reg;
+  for (struct cbe_live_interval *piece = interval->pieces; piece != NULL;
+       piece = piece->next) {
+    if ((int)ip >= piece->start_point && (int)ip <= piece->end_point)
+      return piece->symbol.reg;
+  }
+  return CBE_REG_NONE;
+}
+
+bool cbe_is_terminator(enum cbe_instruction_tag tag) {
+  return tag == CBE_INST_RET || tag == CBE_INST_BR || tag == CBE_INST_JMP;
+}
+
+usz cbe_instruction_operand_count(struct cbe_instruction *inst) {
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+  case CBE_INST_JMP:
+    return 0;
+  case CBE_INST_LOAD:
+  case CBE_INST_BR:
+  case CBE_INST_BROADCAST:
+    return 1;
+  case CBE_INST_SELECT:
+    return 3;
+  case CBE_INST_RET:
+    return inst->ret.value != NULL;
+  case CBE_INST_CALL:
+    return inst->call.arguments.size;
+  default:
+    return 2;
+  }
+}
+
+struct cbe_value *cbe_instruction_operand(struct cbe_instruction *inst,
+                                          usz index) {
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+  case CBE_INST_JMP:
+    return NULL;
+  case CBE_INST_STORE:
+    return index == 0 ? &inst->store.value : &inst->store.pointer;
+  case CBE_INST_LOAD:
+    return &inst->load.pointer;
+  case CBE_INST_RET:
+    return inst->ret.value;
+  case CBE_INST_ELEMPTR:
+    return index == 0 ? &inst->elemptr.pointer : &inst->elemptr.index;
+  case CBE_INST_CMP:
+    return index == 0 ? &inst->cmp.lhs : &inst->cmp.rhs;
+  case CBE_INST_BR:
+    return &inst->br.condition;
+  case CBE_INST_SELECT:
+    return index == 0   ? &inst->select.condition
+           : index == 1 ? &inst->select.then_value
+                        : &inst->select.else_value;
+  case CBE_INST_BROADCAST:
+    return &inst->broadcast.value;
+  case CBE_INST_CALL:
+    return &inst->call.arguments.items[index];
+  default:
+    return index == 0 ? &inst->binary.lhs : &inst->binary.rhs;
+  }
+}
+
+struct cbe_instruction *cbe_block_terminator(struct cbe_block *block) {
+  if (block->instructions.size == 0)
+    return NULL;
+  struct cbe_instruction *last =
+      &block->instructions.items[block->instructions.size - 1];
+  return cbe_is_terminator(last->tag) ? last : NULL;
+}
+
+// Writes the name indices of the blocks `block` may branch to.
+usz cbe_block_successors(struct cbe_block *block, usz successors[2]) {
+  struct cbe_instruction *terminator = cbe_block_terminator(block);
+  if (terminator == NULL || terminator->tag == CBE_INST_RET)
+    return 0;
+  if (terminator->tag == CBE_INST_JMP) {
+    successors[0] = terminator->jmp.block;
+    return 1;
+  }
+  successors[0] = terminator->br.then_block;
+  successors[1] = terminator->br.else_block;
+  return 2;
+}
+
+usz cbe_find_block_index(struct cbe_function *fn, usz name_index) {
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    if (fn->blocks.items[i].name_index == name_index)
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+struct cbe_block *cbe_find_block(struct cbe_function *fn, usz name_index) {
+  usz index = cbe_find_block_index(fn, name_index);
+  return index == SIZE_MAX ? NULL : &fn->blocks.items[index];
+}
+
+int cbe_emit(struct cbe_context *ctx, FILE *fp, cstr format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vfprintf(fp, format, args);
+  va_end(args);
+  CBE_STATS_ADD(ctx, emitted_bytes, written > 0 ? written : 0);
+  return written;
 }
 
 void cbe_generate(struct cbe_context *ctx, FILE *fp) {
   push_stack_frame(ctx);
+  // Functions that failed cbe_validate have no code to emit.
+  CBE_ASSERT(*ctx, ctx->diagnostics.size == 0);
+  CBE_TIMER_START(CBE_TIMER_EMISSION);
+  cbe_emit(ctx, fp, ".intel_syntax noprefix\n");
+  cbe_emit(ctx, fp, ".text\n");
   for (usz i = 0; i < ctx->functions.size; i++) {
     struct cbe_function fn = ctx->functions.items[i];
     cbe_generate_function(ctx, fp, fn);
@@ -258,197 +826,582 @@ void cbe_generate(struct cbe_context *ctx, FILE *fp) {
     struct cbe_global_variable variable = ctx->global_variables.items[i];
     cbe_generate_global_variable(ctx, fp, variable);
   }
+  if (ctx->options & CBE_OPT_INSTRUMENT)
+    cbe_generate_profile(ctx, fp);
+  cbe_generate_literals(ctx, fp);
+  cbe_emit(ctx, fp, ".section .note.GNU-stack,\"\",@progbits\n");
+  CBE_TIMER_STOP(ctx, CBE_TIMER_EMISSION);
   pop_stack_frame(ctx);
 }
 
-void cbe_generate_global_variable(struct cbe_context *ctx, FILE *fp,
-                                  struct cbe_global_variable variable) {
-  push_stack_frame(ctx);
-  pop_stack_frame(ctx);
+// Callee-saved registers are kept in frame slots right below the ones
+// handed out by cbe_validate_function, in register order.
+static usz cbe_save_slot(struct cbe_function *fn, enum cbe_register reg) {
+  usz slot = 0;
+  for (usz r = 0; r <= reg; r++) {
+    if (fn->saved_registers & (1u << r))
+      slot++;
+  }
+  usz saved = __builtin_popcount(fn->saved_registers);
+  return fn->frame_size - 8 * (saved - slot);
 }
 
 void cbe_generate_function(struct cbe_context *ctx, FILE *fp,
                            struct cbe_function fn) {
   push_stack_frame(ctx);
-  fprintf(fp, "%s:\n", ctx->symbol_table.items[fn.name_index]);
+  cstr name = ctx->symbol_table.items[fn.name_index];
+  ctx->current_function = &fn;
+  if (!fn.local)
+    cbe_emit(ctx, fp, ".globl %s\n", name);
+  cbe_emit(ctx, fp, ".type %s, @function\n", name);
+  cbe_emit(ctx, fp, "%s:\n", name);
+  if (!fn.red_zone) {
+    cbe_emit(ctx, fp, "  push rbp\n");
+    cbe_emit(ctx, fp, "  mov rbp, rsp\n");
+    if (fn.frame_size > 0)
+      cbe_emit(ctx, fp, "  sub rsp, %zu\n", fn.frame_size);
+  }
+
+  char address[64];
+  for (usz r = 0; r <= CBE_REG_R15D; r++) {
+    if (!(fn.saved_registers & (1u << r)))
+      continue;
+    cbe_format_frame_address(ctx, address, sizeof(address),
+                             cbe_save_slot(&fn, r));
+    cbe_emit(ctx, fp, "  mov qword ptr %s, %s\n", address,
+             cbe_get_register_name_sized(r, 8));
+  }
+
+  usz general = 0, vector = 0;
+  for (usz i = 0; i < fn.parameters.size; i++) {
+    struct cbe_temporary parameter = fn.parameters.items[i];
+    struct cbe_live_interval interval =
+        ctx->live_intervals.items[parameter.interval_id];
+    usz size = cbe_type_size(ctx, parameter.type_id);
+    bool is_vector = interval.register_class == CBE_REGISTER_CLASS_VECTOR;
+    enum cbe_register reg = is_vector
+                                ? cbe_get_vector_argument_register(vector++)
+                                : cbe_get_argument_register(general++);
+    CBE_ASSERT(*ctx, general <= CBE_ARGUMENT_REGISTERS &&
+                         vector <= CBE_VECTOR_ARGUMENT_REGISTERS);
+    cstr source = cbe_get_register_name_sized(reg, size);
+    if (interval.symbol.reg != CBE_REG_NONE) {
+      cbe_emit(ctx, fp, "  %s %s, %s\n",
+               is_vector ? cbe_isel_move(ctx, parameter.type_id, false) : "mov",
+               cbe_get_register_name_sized(interval.symbol.reg, size), source);
+    } else {
+      cbe_format_frame_address(ctx, address, sizeof(address),
+                               interval.symbol.location);
+      cbe_emit(ctx, fp, "  %s %s ptr %s, %s\n",
+               is_vector ? cbe_isel_move(ctx, parameter.type_id, true) : "mov",
+               cbe_isel_size_name(size), address, source);
+    }
+  }
+
   for (usz i = 0; i < fn.blocks.size; i++) {
     struct cbe_block block = fn.blocks.items[i];
+    ctx->current_block = block.name_index;
+    ctx->next_block =
+        i + 1 < fn.blocks.size ? fn.blocks.items[i + 1].name_index : SIZE_MAX;
     cbe_generate_block(ctx, fp, block);
   }
+  cbe_emit(ctx, fp, ".size %s, .-%s\n", name, name);
+  ctx->current_function = NULL;
   pop_stack_frame(ctx);
 }
 
-void cbe_generate_block(struct cbe_context *ctx, FILE *fp,
-                        struct cbe_block block) {
+// Restores the saved registers and leaves the frame, then returns, or jumps
+// to `callee` if it is not SIZE_MAX: a tail call, which hands our return
+// address on to the callee.
+void cbe_generate_epilogue(struct cbe_context *ctx, FILE *fp, usz callee) {
   push_stack_frame(ctx);
-  fprintf(fp, ".%s:\n", ctx->symbol_table.items[block.name_index]);
-  for (usz i = 0; i < block.instructions.size; i++) {
-    struct cbe_instruction instruction = block.instructions.items[i];
-    cbe_generate_instruction(ctx, fp, instruction);
+  struct cbe_function *fn = ctx->current_function;
+  char address[64];
+  for (usz r = 0; r <= CBE_REG_R15D; r++) {
+    if (!(fn->saved_registers & (1u << r)))
+      continue;
+    cbe_format_frame_address(ctx, address, sizeof(address),
+                             cbe_save_slot(fn, r));
+    cbe_emit(ctx, fp, "  mov %s, qword ptr %s\n",
+             cbe_get_register_name_sized(r, 8), address);
   }
+  // Dirty upper ymm halves slow down SSE code in the caller. Tail calls
+  // have already cleared them along with the arguments.
+  if (callee == SIZE_MAX && (ctx->target_features & CBE_TARGET_AVX2) &&
+      cbe_type_size(ctx, fn->type_id) != 32)
+    cbe_emit(ctx, fp, "  vzeroupper\n");
+  if (!fn->red_zone)
+    cbe_emit(ctx, fp, "  leave\n");
+  if (callee != SIZE_MAX)
+    cbe_emit(ctx, fp, "  jmp %s\n", ctx->symbol_table.items[callee]);
+  else
+    cbe_emit(ctx, fp, "  ret\n");
   pop_stack_frame(ctx);
 }
 
-void cbe_generate_instruction(struct cbe_context *ctx, FILE *fp,
-                              struct cbe_instruction inst) {
+void cbe_generate_block(struct cbe_context *ctx, FILE *fp,
+                        struct cbe_block block) {
   push_stack_frame(ctx);
-  // printf("%u\n", inst.tag);
-  switch (inst.tag) {
-  case CBE_INST_ALLOC:
-    (void)cbe_allocate_stack_variable(ctx, inst.temporary.name_index);
-    break; /* %0 = alloc <type> */
-
-  case CBE_INST_STORE: {
-    __auto_type store = inst.store;
-    CBE_ASSERT(*ctx, store.pointer.tag == CBE_VALUE_VARIABLE);
-    usz index = cbe_find_stack_variable(ctx, store.pointer.variable);
-    CBE_ASSERT(*ctx, index != SIZE_MAX);
-    struct cbe_stack_variable stack_variable =
-        ctx->stack_variables.items[index];
-    fprintf(fp, "  mov ");
-    cbe_generate_value(
-        ctx, fp,
-        (struct cbe_value){.tag = CBE_VALUE_VARIABLE,
-                           .variable = stack_variable.associated_name_index});
-    fprintf(fp, ", ");
-    cbe_generate_value(ctx, fp, store.value);
-    fprintf(fp, "\n");
-  } break; /* store <typed value>, <typed temporary> */
-
-  case CBE_INST_LOAD: {
-    __auto_type load = inst.load;
-    CBE_ASSERT(*ctx, load.pointer.tag == CBE_VALUE_VARIABLE);
-    usz index = cbe_find_stack_variable(ctx, load.pointer.variable);
-    CBE_ASSERT(*ctx, index != SIZE_MAX);
-    struct cbe_stack_variable stack_variable =
-        ctx->stack_variables.items[index];
-
-    // enum cbe_register reg = cbe_get_register(&ctx->register_pool);
-    // fprintf(fp, "  mov %s, ");
-    // cbe_generate_value(
-    //     ctx, fp,
-    //     (struct cbe_value){.tag = CBE_VALUE_VARIABLE,
-    //                        .variable =
-    //                        stack_variable.associated_name_index});
-    // fprintf(fp, "\n");
-  } break; /* %0 = load <typed temporary> */
-
-  case CBE_INST_RET: {
-  } break; /* */
+  cbe_emit(ctx, fp, ".L%s.%s:\n",
+           ctx->symbol_table.items[ctx->current_function->name_index],
+           ctx->symbol_table.items[block.name_index]);
+  if (ctx->options & CBE_OPT_INSTRUMENT) {
+    char counter[128];
+    cbe_format_profile_counter(ctx, counter, sizeof(counter), block.name_index,
+                               0);
+    cbe_emit(ctx, fp, "  inc qword ptr %s\n", counter);
   }
+  cbe_isel_generate_block(ctx, fp, block);
   pop_stack_frame(ctx);
 }
 
 void cbe_generate_value(struct cbe_context *ctx, FILE *fp,
                         struct cbe_value value) {
   push_stack_frame(ctx);
+  char buffer[64];
+  cbe_format_value(ctx, buffer, sizeof(buffer), value);
+  cbe_emit(ctx, fp, "%s", buffer);
+  pop_stack_frame(ctx);
+}
+
+int cbe_format_value(struct cbe_context *ctx, char *buffer, usz size,
+                     struct cbe_value value) {
+  push_stack_frame(ctx);
+  int length = 0;
   switch (value.tag) {
   case CBE_VALUE_NIL:
-    fprintf(fp, "0");
+    length = snprintf(buffer, size, "0");
     break;
 
   case CBE_VALUE_INTEGER:
-    fprintf(fp, "%lld", value.integer);
+    length = snprintf(buffer, size, "%lld", value.integer);
     break;
 
-  case CBE_VALUE_STRING: {
-    usz string_index = ctx->string_table.size;
-    slice_push(&ctx->string_table, value.string);
-    fprintf(fp, "str__%zu", string_index);
-  } break;
+  case CBE_VALUE_STRING:
+    length = snprintf(buffer, size, ".Lstr.%zu",
+                      cbe_intern_string(ctx, value.string));
+    break;
+
+  case CBE_VALUE_FLOAT:
+    // As raw bits, to be moved through a general purpose register.
+    length = snprintf(buffer, size, "0x%llx",
+                      (unsigned long long)cbe_float_bits(ctx, value));
+    break;
 
   case CBE_VALUE_VARIABLE: {
-    CBE_ASSERT(*ctx, cbe_find_stack_variable(ctx, value.variable) != SIZE_MAX);
-    fprintf(fp, "[rsp - %zu]", 4 * (value.variable + 1));
+    usz index = cbe_find_stack_variable(ctx, value.variable);
+    CBE_ASSERT(*ctx, index != SIZE_MAX);
+    length = cbe_format_frame_address(
+        ctx, buffer, size, ctx->stack_variables.items[index].offset);
     break;
   }
   }
   pop_stack_frame(ctx);
+  return length;
 }
 
 void cbe_generate_type(struct cbe_context *ctx, FILE *fp,
                        struct cbe_type type) {}
 
-enum cbe_validation_result cbe_validate(struct cbe_context *ctx) {
+// Adds `delta` to the use count of every symbol read by `fn`.
+static void cbe_count_uses(struct cbe_context *ctx, struct cbe_function *fn,
+                           isz delta) {
+  while (ctx->use_counts.size < ctx->symbol_table.size)
+    slice_push(&ctx->use_counts, 0);
+  while (ctx->definitions.size < ctx->symbol_table.size)
+    slice_push(&ctx->definitions, NULL);
+
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    for (usz j = 0; j < block->instructions.size; j++) {
+      struct cbe_instruction *inst = &block->instructions.items[j];
+      for (usz k = 0; k < cbe_instruction_operand_count(inst); k++) {
+        struct cbe_value *value = cbe_instruction_operand(inst, k);
+        // Unknown symbols are left for cbe_validate_block to report.
+        if (value->tag == CBE_VALUE_VARIABLE &&
+            value->variable < ctx->use_counts.size)
+          ctx->use_counts.items[value->variable] += delta;
+      }
+    }
+  }
+}
+
+// Global variables need known names and values of known types.
+static void cbe_validate_globals(struct cbe_context *ctx) {
+  for (usz i = 0; i < ctx->global_variables.size; i++) {
+    struct cbe_global_variable *global = &ctx->global_variables.items[i];
+    enum cbe_validation_result result = cbe_validate_value(ctx, global->value);
+    cbe_type_id found = global->value.type_id;
+    if (result == CBE_VALID_UNKNOWN_TYPE || result == CBE_VALID_UNKNOWN_SYMBOL)
+      found = SIZE_MAX;
+    if (global->name_index >= ctx->symbol_table.size) {
+      result = CBE_VALID_UNKNOWN_SYMBOL;
+      found = SIZE_MAX;
+    }
+    if (result != CBE_VALID_OK)
+      slice_push(&ctx->diagnostics,
+                 ((struct cbe_diagnostic){result, global->name_index, SIZE_MAX,
+                                          SIZE_MAX, SIZE_MAX, SIZE_MAX,
+                                          found}));
+  }
+}
+
+static enum cbe_validation_result
+cbe_walk_block(struct cbe_context *, struct cbe_block *, bool, bool);
+
+static enum cbe_validation_result cbe_first_diagnostic(struct cbe_context *ctx,
+                                                       usz first) {
+  if (ctx->diagnostics.size > first)
+    return ctx->diagnostics.items[first].result;
+  return CBE_VALID_OK;
+}
+
+// Checks the module the way cbe_validate does, without building anything,
+// once: the passes of cbe_optimize take the IR to be well formed, and
+// cbe_validate builds a module checked here without checking it again.
+// Diagnostics and the result are those cbe_validate would give.
+enum cbe_validation_result cbe_check(struct cbe_context *ctx) {
+  if (ctx->checked)
+    return cbe_first_diagnostic(ctx, 0);
   push_stack_frame(ctx);
+  CBE_TIMER_START(CBE_TIMER_VALIDATE);
+  usz first = ctx->diagnostics.size;
+  cbe_validate_globals(ctx);
   for (usz i = 0; i < ctx->functions.size; i++) {
-    struct cbe_function fn = ctx->functions.items[i];
-    cbe_validate_function(ctx, fn);
+    struct cbe_function *fn = &ctx->functions.items[i];
+    cbe_validate_signature(ctx, fn);
+    ctx->current_function = fn;
+    cbe_validate_begin_definitions(ctx, fn);
+    for (usz j = 0; j < fn->blocks.size; j++)
+      cbe_walk_block(ctx, &fn->blocks.items[j], true, false);
+    cbe_validate_end_definitions(ctx);
+    ctx->current_function = NULL;
   }
+  ctx->checked = true;
+  CBE_TIMER_STOP(ctx, CBE_TIMER_VALIDATE);
+  pop_stack_frame(ctx);
+  return cbe_first_diagnostic(ctx, first);
+}
+
+// Checks the module and, for every function that passes, selects
+// instructions and allocates registers. What fails ends up in
+// ctx->diagnostics, see validate.c, and the first failure is returned. A
+// module cbe_check has seen is only built, if it passed.
+enum cbe_validation_result cbe_validate(struct cbe_context *ctx) {
+  if (ctx->checked && ctx->diagnostics.size > 0)
+    return cbe_first_diagnostic(ctx, 0);
+  push_stack_frame(ctx);
+  CBE_TIMER_START(CBE_TIMER_VALIDATE);
+  usz first = ctx->diagnostics.size;
+  if (!ctx->checked)
+    cbe_validate_globals(ctx);
+  for (usz i = 0; i < ctx->functions.size; i++)
+    cbe_validate_function(ctx, &ctx->functions.items[i]);
+  CBE_TIMER_STOP(ctx, CBE_TIMER_VALIDATE);
+  pop_stack_frame(ctx);
+  return cbe_first_diagnostic(ctx, first);
+}
 
-  for (usz i = 0; i < ctx->live_intervals.size; i++) {
-    struct cbe_live_interval interval = ctx->live_intervals.items[i];
-    CBE_DEBUG(
-        "(%p). SYMBOL: %s | LOCATION: %d | STARTPOINT: %d | ENDPOINT: %d\n",
-        &ctx->live_intervals.items[i], interval.symbol.name,
-        interval.symbol.location, interval.start_point, interval.end_point);
+// Values flowing between blocks: a backwards dataflow over the blocks gives
+// the intervals live on entry to and exit from each block, and every interval
+// is then stretched over the blocks it is live through.
+static void cbe_compute_liveness(struct cbe_context *ctx,
+                                 struct cbe_function *fn, usz first) {
+  push_stack_frame(ctx);
+  usz count = ctx->live_intervals.size - first;
+  usz words = (count + 63) / 64;
+  if (words == 0 || fn->blocks.size == 0) {
+    pop_stack_frame(ctx);
+    return;
+  }
 
-    cbe_expire_old_intervals(ctx, ctx->active_intervals,
-                             &ctx->live_intervals.items[i]);
+  usz blocks = fn->blocks.size;
+  u64 *live_in = CBE_ALLOC(sizeof(u64) * words * blocks);
+  u64 *live_out = CBE_ALLOC(sizeof(u64) * words * blocks);
+  u64 *defs = CBE_ALLOC(sizeof(u64) * words * blocks);
+  usz *successors = CBE_ALLOC(sizeof(usz) * 2 * blocks);
+  usz *successor_count = CBE_ALLOC(sizeof(usz) * blocks);
+  memset(live_in, 0, sizeof(u64) * words * blocks);
+  memset(live_out, 0, sizeof(u64) * words * blocks);
+  memset(defs, 0, sizeof(u64) * words * blocks);
 
-    if (cbe_register_pool_is_empty(&ctx->register_pool)) {
-      cbe_spill_at_interval(ctx, ctx->active_intervals,
-                            &ctx->live_intervals.items[i]);
-    } else {
-      enum cbe_register reg = cbe_get_register(&ctx->register_pool);
-      CBE_DEBUG("ACTION: ALLOCATE REGISTER %s(%d) TO INTERVAL (%p)\n",
-                cbe_get_register_name(reg), reg, &ctx->live_intervals.items[i]);
-      if (reg != CBE_REG_ERROR)
-        ctx->live_intervals.items[i].symbol.reg = reg;
-      slice_push(&ctx->active_intervals, &ctx->live_intervals.items[i]);
+  for (usz b = 0; b < blocks; b++) {
+    struct cbe_block *block = &fn->blocks.items[b];
+    usz names[2];
+    successor_count[b] = cbe_block_successors(block, names);
+    for (usz i = 0; i < successor_count[b]; i++) {
+      successors[2 * b + i] = cbe_find_block_index(fn, names[i]);
+      CBE_ASSERT(*ctx, successors[2 * b + i] != SIZE_MAX);
+    }
+    for (usz i = 0; i < block->upward_uses.size; i++) {
+      usz k = block->upward_uses.items[i].interval_id - first;
+      live_in[b * words + k / 64] |= 1ull << (k % 64);
+    }
+    for (usz k = 0; k < count; k++) {
+      int start = ctx->live_intervals.items[first + k].start_point;
+      if (start >= (int)block->first_ip && start <= (int)block->last_ip)
+        defs[b * words + k / 64] |= 1ull << (k % 64);
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (usz b = blocks; b > 0; b--) {
+      usz i = b - 1;
+      for (usz w = 0; w < words; w++) {
+        u64 out = 0;
+        for (usz j = 0; j < successor_count[i]; j++)
+          out |= live_in[successors[2 * i + j] * words + w];
+        u64 in = live_in[i * words + w] | (out & ~defs[i * words + w]);
+        if (out != live_out[i * words + w] || in != live_in[i * words + w])
+          changed = true;
+        live_out[i * words + w] = out;
+        live_in[i * words + w] = in;
+      }
     }
   }
 
+  for (usz b = 0; b < blocks; b++) {
+    struct cbe_block *block = &fn->blocks.items[b];
+    for (usz i = 0; i < block->upward_uses.size; i++) {
+      struct cbe_live_use use = block->upward_uses.items[i];
+      cbe_extend_live_interval(ctx, use.interval_id, use.ip);
+    }
+    for (usz k = 0; k < count; k++) {
+      u64 bit = 1ull << (k % 64);
+      if (live_in[b * words + k / 64] & bit)
+        cbe_extend_live_interval(ctx, first + k, block->first_ip);
+      if (live_out[b * words + k / 64] & bit)
+        cbe_extend_live_interval(ctx, first + k, block->last_ip);
+    }
+  }
   pop_stack_frame(ctx);
-  return CBE_VALID_OK;
 }
 
-enum cbe_validation_result cbe_validate_function(struct cbe_context *ctx,
-                                                 struct cbe_function fn) {
+// Whether the address of a stack slot is used as anything but the pointer of
+// a load or store, so that other pointers or callees could reach it. Tail
+// calls tear the frame down before the callee runs, and the scheduler takes
+// slots that do not escape to alias nothing else.
+bool cbe_slots_escape(struct cbe_context *ctx, struct cbe_function *fn) {
   push_stack_frame(ctx);
-  for (usz i = 0; i < fn.blocks.size; i++) {
-    ctx->ip = 0;
-    struct cbe_block block = fn.blocks.items[i];
-    cbe_validate_block(ctx, block);
+  bool *slots = CBE_ALLOC(ctx->symbol_table.size * sizeof(bool));
+  memset(slots, 0, ctx->symbol_table.size * sizeof(bool));
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    for (usz j = 0; j < block->instructions.size; j++) {
+      struct cbe_instruction *inst = &block->instructions.items[j];
+      if (inst->tag == CBE_INST_ALLOC &&
+          inst->temporary.name_index < ctx->symbol_table.size)
+        slots[inst->temporary.name_index] = true;
+    }
+  }
+
+  bool escape = false;
+  for (usz i = 0; !escape && i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    for (usz j = 0; !escape && j < block->instructions.size; j++) {
+      struct cbe_instruction *inst = &block->instructions.items[j];
+      for (usz k = 0; k < cbe_instruction_operand_count(inst); k++) {
+        struct cbe_value *value = cbe_instruction_operand(inst, k);
+        if (value->tag != CBE_VALUE_VARIABLE ||
+            value->variable >= ctx->symbol_table.size ||
+            !slots[value->variable])
+          continue;
+        if (!(inst->tag == CBE_INST_LOAD && value == &inst->load.pointer) &&
+            !(inst->tag == CBE_INST_STORE && value == &inst->store.pointer))
+          escape = true;
+      }
+    }
   }
   pop_stack_frame(ctx);
-  return CBE_VALID_OK;
+  return escape;
 }
 
-enum cbe_validation_result cbe_validate_block(struct cbe_context *ctx,
-                                              struct cbe_block block) {
+// Counts the instructions that move spilled values, the way
+// cbe_isel_generate_block emits them: a store at the definition, and a load
+// at every use outside of a piece and at the start of every piece.
+static void cbe_count_spills(struct cbe_context *ctx, struct cbe_function *fn,
+                             usz first) {
   push_stack_frame(ctx);
-  for (usz i = 0; i < block.instructions.size; i++) {
-    struct cbe_instruction instruction = block.instructions.items[i];
-    cbe_validate_instruction(ctx, instruction);
+  fn->spill_stores = fn->spill_loads = 0;
+  for (usz i = first; i < ctx->live_intervals.size; i++) {
+    struct cbe_live_interval *interval = &ctx->live_intervals.items[i];
+    if (interval->symbol.reg != CBE_REG_NONE || interval->remat != NULL)
+      continue;
+    fn->spill_stores++;
+    for (usz j = 0; j < interval->uses.size; j++) {
+      if (cbe_interval_register(ctx, i, interval->uses.items[j]) ==
+          CBE_REG_NONE)
+        fn->spill_loads++;
+    }
+    for (struct cbe_live_interval *piece = interval->pieces; piece != NULL;
+         piece = piece->next)
+      fn->spill_loads += piece->reload && piece->symbol.reg != CBE_REG_NONE;
   }
+  CBE_TRACE(ctx, CBE_EVENT_SPILLS, CBE_REG_NONE, 0, fn->spill_stores,
+            fn->name_index, fn->spill_loads);
   pop_stack_frame(ctx);
-  return CBE_VALID_OK;
 }
 
-enum cbe_validation_result
-cbe_validate_instruction(struct cbe_context *ctx, struct cbe_instruction inst) {
+enum cbe_validation_result cbe_validate_function(struct cbe_context *ctx,
+                                                 struct cbe_function *fn) {
   push_stack_frame(ctx);
+  // The blocks of a function with a bad signature are still checked, for
+  // their diagnostics, but its parameters have nothing to build.
+  bool check = !ctx->checked;
+  enum cbe_validation_result result = CBE_VALID_OK;
+  if (check)
+    result = cbe_validate_signature(ctx, fn);
+  ctx->current_stack_location = 0;
+  ctx->current_function = fn;
+  fn->red_zone = false;
+  cbe_count_uses(ctx, fn, 1);
+  fn->tail_calls =
+      (ctx->options & CBE_OPT_TAIL_CALLS) && !cbe_slots_escape(ctx, fn);
 
-  if (inst.has_temporary) {
-    struct cbe_live_interval live_interval = cbe_add_or_increment_live_interval(
-        ctx, ctx->symbol_table.items[inst.temporary.name_index]);
+  usz first_interval = ctx->live_intervals.size;
+  ctx->call_points.size = 0;
+  CBE_TIMER_START(CBE_TIMER_ISEL);
+  if (result == CBE_VALID_OK)
+    cbe_isel_build_arguments(ctx, fn);
+  if (check)
+    cbe_validate_begin_definitions(ctx, fn);
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    enum cbe_validation_result block_result =
+        cbe_walk_block(ctx, &fn->blocks.items[i], check, true);
+    if (block_result != CBE_VALID_OK && result == CBE_VALID_OK)
+      result = block_result;
   }
+  if (check) {
+    enum cbe_validation_result uses_result = cbe_validate_end_definitions(ctx);
+    if (result == CBE_VALID_OK)
+      result = uses_result;
+  }
+  // Trees of a function that failed are left half built; it gets no code,
+  // and nothing of it is allocated.
+  if (result != CBE_VALID_OK) {
+    CBE_TIMER_STOP(ctx, CBE_TIMER_ISEL);
+    ctx->live_intervals.size = first_interval;
+    cbe_count_uses(ctx, fn, -1);
+    ctx->current_function = NULL;
+    pop_stack_frame(ctx);
+    return result;
+  }
+  for (usz i = 0; i < fn->blocks.size; i++)
+    cbe_isel_resolve_block(ctx, &fn->blocks.items[i]);
+  cbe_isel_annotate_intervals(ctx, fn);
+  CBE_TIMER_STOP(ctx, CBE_TIMER_ISEL);
+  CBE_TIMER_START(CBE_TIMER_LIVENESS);
+  cbe_compute_liveness(ctx, fn, first_interval);
+  CBE_TIMER_STOP(ctx, CBE_TIMER_LIVENESS);
+  CBE_TIMER_START(CBE_TIMER_ALLOCATION);
+  cbe_allocate_registers(ctx, first_interval);
+  CBE_TIMER_STOP(ctx, CBE_TIMER_ALLOCATION);
+  cbe_count_spills(ctx, fn, first_interval);
+  CBE_STATS_ADD(ctx, functions, 1);
+  CBE_STATS_ADD(ctx, blocks, fn->blocks.size);
+  CBE_STATS_ADD(ctx, intervals, ctx->live_intervals.size - first_interval);
+  CBE_STATS_ADD(ctx, spill_stores, fn->spill_stores);
+  CBE_STATS_ADD(ctx, spill_loads, fn->spill_loads);
 
-  ctx->ip++;
+  fn->saved_registers = 0;
+  for (usz i = first_interval; i < ctx->live_intervals.size; i++) {
+    struct cbe_live_interval *interval = &ctx->live_intervals.items[i];
+    if (cbe_is_callee_saved(interval->symbol.reg))
+      fn->saved_registers |= 1u << interval->symbol.reg;
+    for (struct cbe_live_interval *piece = interval->pieces; piece != NULL;
+         piece = piece->next) {
+      if (cbe_is_callee_saved(piece->symbol.reg))
+        fn->saved_registers |= 1u << piece->symbol.reg;
+    }
+  }
+  for (usz r = 0; r <= CBE_REG_R15D; r++) {
+    if (fn->saved_registers & (1u << r))
+      (void)cbe_allocate_stack_slot(ctx, 8);
+  }
 
+  fn->frame_size = (ctx->current_stack_location + 15) & ~(usz)15;
+  // Leaves whose slots fit in the 128 bytes below rsp that signal handlers
+  // leave alone need no frame. Tail calls are jumps and leave rsp as is.
+  fn->red_zone = ctx->call_points.size == 0 && fn->frame_size <= 128;
+  cbe_count_uses(ctx, fn, -1);
+  ctx->current_function = NULL;
   pop_stack_frame(ctx);
-  return CBE_VALID_OK;
+  return result;
 }
 
-enum cbe_validation_result cbe_validate_value(struct cbe_context *ctx,
-                                              struct cbe_value value) {
-  return CBE_VALID_OK;
+// Checks every instruction of `block`, if `check`, and builds its isel tree,
+// if `build`, in the same walk, recording what fails into ctx->diagnostics.
+// Trees are only built while the block is clean, and numbered once all of
+// them are.
+static enum cbe_validation_result cbe_walk_block(struct cbe_context *ctx,
+                                                 struct cbe_block *block,
+                                                 bool check, bool build) {
+  push_stack_frame(ctx);
+  enum cbe_validation_result result = CBE_VALID_OK;
+  struct cbe_diagnostic diagnostic = {
+      .symbol = ctx->current_function->name_index,
+      .block = block->name_index,
+  };
+  if (check && block->name_index >= ctx->symbol_table.size) {
+    result = diagnostic.result = CBE_VALID_UNKNOWN_SYMBOL;
+    diagnostic.instruction = diagnostic.operand = SIZE_MAX;
+    diagnostic.expected = diagnostic.found = SIZE_MAX;
+    slice_push(&ctx->diagnostics, diagnostic);
+  }
+  usz size = block->instructions.size, next = 0;
+  usz index = block - ctx->current_function->blocks.items;
+  if (build)
+    cbe_isel_begin_block(ctx, block);
+  for (usz i = 0; i < size; i++) {
+    struct cbe_instruction *inst = &block->instructions.items[i];
+    if (!check) {
+      if (build && i == next)
+        next = cbe_isel_build_instruction(ctx, block, i);
+      continue;
+    }
+    diagnostic.instruction = i;
+    enum cbe_validation_result instruction_result =
+        cbe_validate_instruction(ctx, inst, &diagnostic);
+    if (instruction_result == CBE_VALID_OK &&
+        cbe_is_terminator(inst->tag) && i + 1 < size) {
+      instruction_result = diagnostic.result = CBE_VALID_MISPLACED_TERMINATOR;
+      diagnostic.operand = diagnostic.expected = diagnostic.found = SIZE_MAX;
+    }
+    if (instruction_result == CBE_VALID_OK)
+      instruction_result =
+          cbe_validate_definitions(ctx, inst, index, &diagnostic);
+    else
+      (void)cbe_validate_definitions(ctx, inst, index, NULL);
+    if (instruction_result != CBE_VALID_OK) {
+      slice_push(&ctx->diagnostics, diagnostic);
+      if (result == CBE_VALID_OK)
+        result = instruction_result;
+    } else if (build && result == CBE_VALID_OK && i == next) {
+      next = cbe_isel_build_instruction(ctx, block, i);
+    }
+  }
+  if (check && cbe_block_terminator(block) == NULL) {
+    diagnostic.result = CBE_VALID_MISSING_TERMINATOR;
+    diagnostic.instruction = diagnostic.operand = SIZE_MAX;
+    diagnostic.expected = diagnostic.found = SIZE_MAX;
+    slice_push(&ctx->diagnostics, diagnostic);
+    if (result == CBE_VALID_OK)
+      result = CBE_VALID_MISSING_TERMINATOR;
+  }
+  if (build) {
+    CBE_STATS_ADD(ctx, instructions, size);
+    if (result == CBE_VALID_OK)
+      cbe_isel_end_block(ctx, block);
+  }
+  pop_stack_frame(ctx);
+  return result;
 }
 
-enum cbe_validation_result cbe_validate_type(struct cbe_context *ctx,
-                                             struct cbe_type type) {
-  return CBE_VALID_OK;
+enum cbe_validation_result cbe_validate_block(struct cbe_context *ctx,
+                                              struct cbe_block *block) {
+  return cbe_walk_block(ctx, block, !ctx->checked, true);
 }
 
 void cbe_debug_stack_variables(struct cbe_context *ctx) {
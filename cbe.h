@@ -7,8 +7,6 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define CBE_LOG_DEBUG_MSG
-
 #ifndef CBE_ALLOC
 #define CBE_ALLOC a_alloc
 #endif // CBE_ALLOC
@@ -41,14 +39,6 @@
     }                                                                          \
   } while (0)
 
-#ifdef CBE_LOG_DEBUG_MSG
-#define CBE_DEBUG(s, ...)                                                      \
-  fprintf(stderr, "\033[0;1m%s:%d: \033[34;1mDEBUG: \033[0;0m" s, __FILE__,    \
-          __LINE__, __VA_ARGS__)
-#else
-#define CBE_DEBUG(...)
-#endif
-
 #define slice_init_capacity 256
 
 #define slice(T)                                                               \
@@ -77,10 +67,10 @@
 #define slice_push(s, ...)                                                     \
   do {                                                                         \
     if ((s)->size >= (s)->capacity) {                                          \
-      usz old_capacity = (s)->capacity;                                        \
+      usz old_size = sizeof(*(s)->items) * (s)->capacity;                      \
       (s)->capacity *= 2;                                                      \
       (s)->items = (__typeof__(*(s)->items) *)CBE_REALLOC(                     \
-          (s)->items, old_capacity, sizeof(*(s)->items) * (s)->capacity);      \
+          (s)->items, old_size, sizeof(*(s)->items) * (s)->capacity);          \
     }                                                                          \
     (s)->items[(s)->size++] = (__VA_ARGS__);                                   \
   } while (0)
@@ -137,21 +127,72 @@ enum cbe_register {
   CBE_REG_EBP,
   CBE_REG_ESP,
 
+  CBE_REG_R8D,
+  CBE_REG_R9D,
+  CBE_REG_R10D,
+  CBE_REG_R11D,
+  CBE_REG_R12D,
+  CBE_REG_R13D,
+  CBE_REG_R14D,
+  CBE_REG_R15D,
+
+  CBE_REG_XMM0,
+  CBE_REG_XMM1,
+  CBE_REG_XMM2,
+  CBE_REG_XMM3,
+  CBE_REG_XMM4,
+  CBE_REG_XMM5,
+  CBE_REG_XMM6,
+  CBE_REG_XMM7,
+  CBE_REG_XMM8,
+  CBE_REG_XMM9,
+  CBE_REG_XMM10,
+  CBE_REG_XMM11,
+  CBE_REG_XMM12,
+  CBE_REG_XMM13,
+  CBE_REG_XMM14,
+  CBE_REG_XMM15,
+
   CBE_REG_ERROR,
   CBE_REG_COUNT,
 };
 
+// Integers and pointers live in general purpose registers, floats and
+// vectors in xmm/ymm registers.
+enum cbe_register_class {
+  CBE_REGISTER_CLASS_GENERAL,
+  CBE_REGISTER_CLASS_VECTOR,
+};
+
+enum cbe_register_class cbe_get_register_class(enum cbe_register);
+
 struct cbe_register_symbol {
   cstr name;
   enum cbe_register reg;
   int location;
 };
 
+struct cbe_isel_node;
+
 typedef usz cbe_interval_id;
 struct cbe_live_interval {
+  usz name_index;
   struct cbe_register_symbol symbol;
   int location;
   int start_point, end_point;
+  u64 spill_weight; // profiled executions of its definition and uses.
+  enum cbe_register_class register_class;
+  usz size; // bytes of the value, and of its spill slot.
+  // Filled in by cbe_isel_annotate_intervals.
+  slice(int) uses;             // ips of the roots reading it, ascending.
+  int definition;              // ip of the root defining it, -1 if none.
+  struct cbe_isel_node *remat; // redone at every use instead of a spill.
+  cbe_interval_id hint; // dies where this one starts, SIZE_MAX if none.
+  // A spilled interval keeps the uses it has close together in one block in
+  // a register of their own, see cbe_split_interval.
+  struct cbe_live_interval *parent; // of a piece, NULL otherwise.
+  struct cbe_live_interval *pieces, *next;
+  bool reload; // a piece that starts by loading the spill slot.
 };
 typedef slice(struct cbe_live_interval *) cbe_live_intervals;
 
@@ -169,6 +210,13 @@ struct cbe_register_pool {
 };
 
 cstr cbe_get_register_name(enum cbe_register);
+cstr cbe_get_register_name_sized(enum cbe_register, usz);
+
+#define CBE_ARGUMENT_REGISTERS 6
+#define CBE_VECTOR_ARGUMENT_REGISTERS 8
+enum cbe_register cbe_get_argument_register(usz);
+enum cbe_register cbe_get_vector_argument_register(usz);
+bool cbe_is_callee_saved(enum cbe_register);
 enum cbe_register cbe_get_register(struct cbe_register_pool *);
 void cbe_free_register(struct cbe_register_pool *, enum cbe_register);
 bool cbe_register_pool_is_empty(struct cbe_register_pool *);
@@ -183,6 +231,10 @@ enum cbe_type_tag {
   CBE_TYPE_PTR,
 
   CBE_TYPE_VOID,
+
+  CBE_TYPE_FLOAT,
+  CBE_TYPE_DOUBLE,
+  CBE_TYPE_VECTOR, /* <lanes x element>, 16 or 32 bytes */
 };
 
 typedef usz cbe_type_id;
@@ -191,6 +243,8 @@ struct cbe_type {
   // union {
   cbe_type_id ptr;
   // };
+  cbe_type_id element; // vectors only.
+  usz lanes;           // vectors only.
 };
 
 enum cbe_value_tag {
@@ -198,6 +252,7 @@ enum cbe_value_tag {
   CBE_VALUE_INTEGER,
   CBE_VALUE_STRING,
   CBE_VALUE_VARIABLE,
+  CBE_VALUE_FLOAT,
 };
 struct cbe_value {
   enum cbe_value_tag tag;
@@ -206,13 +261,15 @@ struct cbe_value {
     i64 integer;
     cstr string;
     usz variable;
+    double floating;
   };
 };
 
 struct cbe_stack_variable {
   usz associated_name_index;
-  // [rsp - (8 * (slot + 1))]
   usz slot;
+  // [rsp - offset]
+  usz offset;
   struct cbe_value stored_value;
 };
 
@@ -225,9 +282,44 @@ struct cbe_temporary {
 enum cbe_instruction_tag {
   CBE_INST_ALLOC, /* %0 = alloc <type> */
   CBE_INST_STORE, /* store <typed value>, <typed value> */
-  CBE_INST_LOAD,  /* */
-  CBE_INST_RET,   /* */
+  CBE_INST_LOAD,  /* %0 = load <typed value> */
+  CBE_INST_RET,   /* ret [<typed value>] */
+
+  CBE_INST_ADD, /* %0 = add <typed value>, <typed value> */
+  CBE_INST_SUB, /* %0 = sub <typed value>, <typed value> */
+  CBE_INST_MUL, /* %0 = mul <typed value>, <typed value> */
+  CBE_INST_DIV, /* %0 = div <typed value>, <typed value> (signed) */
+  CBE_INST_REM, /* %0 = rem <typed value>, <typed value> (signed) */
+  CBE_INST_AND, /* %0 = and <typed value>, <typed value> */
+  CBE_INST_OR,  /* %0 = or <typed value>, <typed value> */
+  CBE_INST_XOR, /* %0 = xor <typed value>, <typed value> */
+  CBE_INST_SHL, /* %0 = shl <typed value>, <typed value> */
+  CBE_INST_SHR, /* %0 = shr <typed value>, <typed value> (logical) */
+  CBE_INST_SAR, /* %0 = sar <typed value>, <typed value> (arithmetic) */
+
+  CBE_INST_ELEMPTR,   /* %0 = elemptr <typed pointer>, <long index> */
+  CBE_INST_CMP,       /* %0 = cmp <predicate> <typed value>, <typed value> */
+  CBE_INST_SELECT,    /* %0 = select <typed value>, <typed value>, ... */
+  CBE_INST_BROADCAST, /* %0 = broadcast <typed value> */
+
+  CBE_INST_BR,   /* br <typed value>, <block>, <block> */
+  CBE_INST_JMP,  /* jmp <block> */
+  CBE_INST_CALL, /* [%0 =] call <function>(<typed value>, ...) */
+};
+
+enum cbe_predicate {
+  CBE_PRED_EQ,
+  CBE_PRED_NE,
+  CBE_PRED_LT,
+  CBE_PRED_LE,
+  CBE_PRED_GT,
+  CBE_PRED_GE,
+  CBE_PRED_ULT,
+  CBE_PRED_ULE,
+  CBE_PRED_UGT,
+  CBE_PRED_UGE,
 };
+
 struct cbe_instruction {
   enum cbe_instruction_tag tag;
   bool has_temporary;
@@ -245,29 +337,239 @@ struct cbe_instruction {
     struct {
       struct cbe_value *value;
     } ret;
+    struct {
+      struct cbe_value lhs, rhs;
+    } binary;
+    struct {
+      struct cbe_value pointer, index;
+    } elemptr;
+    struct {
+      enum cbe_predicate predicate;
+      struct cbe_value lhs, rhs;
+    } cmp;
+    struct {
+      // An integer picks one of the values, a vector of lane masks (as made
+      // by a vector cmp) picks lane by lane.
+      struct cbe_value condition, then_value, else_value;
+    } select;
+    struct {
+      struct cbe_value value; // copied into every lane.
+    } broadcast;
+    struct {
+      struct cbe_value condition;
+      usz then_block, else_block; // block name indices.
+      u64 weights[2]; // optional edge weights, all zero if unknown.
+    } br;
+    struct {
+      usz block;
+    } jmp;
+    struct {
+      usz function; // name index of the callee.
+      slice(struct cbe_value) arguments;
+    } call;
   };
 };
 
+bool cbe_is_terminator(enum cbe_instruction_tag);
+
+// Instruction selection trees, see isel.c.
+typedef slice(struct cbe_isel_node *) cbe_isel_nodes;
+
+struct cbe_live_use {
+  cbe_interval_id interval_id;
+  usz ip;
+};
+
 struct cbe_block {
   usz name_index;
   slice(struct cbe_instruction) instructions;
+  // Filled in by cbe_validate_block.
+  cbe_isel_nodes roots;
+  usz first_ip, last_ip;
+  slice(struct cbe_live_use) upward_uses; // of values from other blocks.
+  u64 weight; // execution count from cbe_load_profile, 0 if unknown.
+  slice(struct cbe_live_interval *) reloads; // pieces starting in it.
 };
 
+struct cbe_instruction *cbe_block_terminator(struct cbe_block *);
+usz cbe_block_successors(struct cbe_block *, usz[2]);
+
 struct cbe_function {
   usz name_index;
-  cbe_type_id type_id;
+  cbe_type_id type_id; // return type.
+  slice(struct cbe_temporary) parameters;
   slice(struct cbe_block) blocks;
+  bool local; // not exported, see deadcode.c.
+  // Filled in by cbe_validate.
+  usz frame_size;      // bytes of stack slots, including saves.
+  u32 saved_registers; // callee-saved registers used, by bit.
+  bool tail_calls;     // calls right before a ret become jumps.
+  bool red_zone;       // no frame, slots live below rsp.
+  u64 weight; // entry count from cbe_load_profile, 0 if unknown.
+  usz cycles[2]; // estimated by cbe_schedule_function, before and after.
+  usz spill_stores, spill_loads; // instructions moving spilled values.
 };
 
+struct cbe_block *cbe_find_block(struct cbe_function *, usz);
+usz cbe_find_block_index(struct cbe_function *, usz);
+
 struct cbe_global_variable {
   usz name_index;
   struct cbe_value value;
   bool constant; // Basically just specifies if the global is defined in the
                  // rodata or data section.
+  bool local;    // not exported, see deadcode.c.
+};
+
+// A float constant loaded from memory, see data.c.
+struct cbe_constant {
+  u64 bits;
+  usz size; // 4 or 8 bytes.
+};
+
+// Open-addressed hash index of interned literals. A bucket holds the hash of
+// its entry and the entry's index plus one, so zeroed buckets are empty.
+struct cbe_literal_bucket {
+  u64 hash;
+  usz entry;
+};
+struct cbe_literal_index {
+  struct cbe_literal_bucket *buckets;
+  usz capacity; // a power of two, kept at most half full.
+  usz count;
+};
+
+enum cbe_option {
+  CBE_OPT_BLOCK_LAYOUT = 1 << 0,
+  CBE_OPT_INSTRUMENT = 1 << 1, // count block and edge executions, see profile.c
+  CBE_OPT_VECTORIZE = 1 << 2,  // vectorize counted loops, see vectorize.c
+  CBE_OPT_INLINE = 1 << 3,     // inline small and hot calls, see inline.c
+  CBE_OPT_TAIL_CALLS = 1 << 4, // turn calls in tail position into jumps
+  CBE_OPT_SCHEDULE = 1 << 5,   // hide latencies in blocks, see schedule.c
+  CBE_OPT_SPLIT = 1 << 6, // split and rematerialize spills, coalesce moves
+  CBE_OPT_DEAD_CODE = 1 << 7, // drop unreachable locals, see deadcode.c
+  CBE_OPT_ALL = (1 << 8) - 1,
+};
+
+// Instruction set extensions the generated code may use. Vectors wider than
+// 16 bytes need AVX2; with it, all float and vector code is VEX encoded.
+enum cbe_target_feature {
+  CBE_TARGET_SSE2 = 1 << 0,
+  CBE_TARGET_AVX2 = 1 << 1,
+  CBE_TARGET_ALL = CBE_TARGET_SSE2 | CBE_TARGET_AVX2,
 };
 
+// Microarchitectures whose latencies the scheduler knows.
+enum cbe_target_cpu {
+  CBE_CPU_GENERIC,
+  CBE_CPU_SKYLAKE,
+  CBE_CPU_ZEN2,
+};
+
+// Compile-time statistics, written out by cbe_write_stats. Commenting out
+// CBE_COLLECT_STATS compiles the timers and counters out.
+#define CBE_COLLECT_STATS
+
+enum cbe_timer {
+  CBE_TIMER_DEAD_CODE, // passes of cbe_optimize.
+  CBE_TIMER_INLINE,
+  CBE_TIMER_VECTORIZE,
+  CBE_TIMER_SCHEDULE,
+  CBE_TIMER_LAYOUT,
+  CBE_TIMER_VALIDATE, // all of cbe_validate, the next three included.
+  CBE_TIMER_ISEL,
+  CBE_TIMER_LIVENESS,
+  CBE_TIMER_ALLOCATION,
+  CBE_TIMER_EMISSION, // cbe_generate.
+  CBE_TIMER_COUNT,
+};
+
+struct cbe_stats {
+  u64 nanoseconds[CBE_TIMER_COUNT];
+  usz functions, blocks, instructions; // validated.
+  usz intervals;                       // live intervals, without pieces.
+  usz spill_stores, spill_loads;
+  usz emitted_bytes;
+  usz removed_functions, removed_globals; // by cbe_eliminate_dead_code.
+};
+
+u64 cbe_stats_now(void);
+
+#ifdef CBE_COLLECT_STATS
+#define CBE_TIMER_START(timer) u64 cbe_timer_##timer = cbe_stats_now()
+#define CBE_TIMER_STOP(ctx, timer)                                             \
+  ((ctx)->stats.nanoseconds[timer] += cbe_stats_now() - cbe_timer_##timer)
+#define CBE_STATS_ADD(ctx, counter, n) ((ctx)->stats.counter += (n))
+#else
+#define CBE_TIMER_START(timer)
+#define CBE_TIMER_STOP(ctx, timer)
+#define CBE_STATS_ADD(ctx, counter, n)
+#endif // CBE_COLLECT_STATS
+
+// Allocator and pass decisions, recorded into a ring buffer when their
+// category is enabled and decoded offline, see trace.c.
+enum cbe_trace_category {
+  CBE_TRACE_ALLOCATION = 1 << 0, // intervals, registers and spills
+  CBE_TRACE_PASSES = 1 << 1,     // inlining, scheduling, vectorization
+};
+
+// What `id`, `ip` and `operand` of a record hold, if not what they say.
+enum cbe_trace_event {
+  CBE_EVENT_INTERVAL, // ip: start point, operand: end point.
+  CBE_EVENT_ALLOCATE, // reg: handed to the interval.
+  CBE_EVENT_SPILL,    // reg: taken away, flags: what became of the interval.
+  CBE_EVENT_COALESCE, // reg: shared, operand: interval id of the operand.
+  CBE_EVENT_SPILLS,   // id: function name, ip: stores, operand: loads.
+  CBE_EVENT_INLINE,   // id: callee name, operand: caller name.
+  CBE_EVENT_SCHEDULE, // id: function name, ip and operand: cycles before
+                      // and after.
+  CBE_EVENT_SCALAR,   // id: name of a loop header left without vector form.
+  CBE_EVENT_REMOVE,   // id: name of a dropped function or global, operand:
+                      // its instructions, flags: CBE_TRACE_GLOBAL if a global.
+  CBE_EVENT_COUNT,
+};
+
+#define CBE_TRACE_CATEGORY(event)                                              \
+  ((event) < CBE_EVENT_INLINE ? CBE_TRACE_ALLOCATION : CBE_TRACE_PASSES)
+
+enum cbe_trace_flag {
+  CBE_TRACE_PIECE = 1 << 0,  // the interval is a piece of interval `id`.
+  CBE_TRACE_REMAT = 1 << 1,  // it is recomputed at its uses.
+  CBE_TRACE_SLOT = 1 << 2,   // it got a spill slot.
+  CBE_TRACE_GLOBAL = 1 << 3, // a removed global rather than a function.
+};
+
+struct cbe_trace_record {
+  u8 event; // enum cbe_trace_event.
+  u8 reg;   // enum cbe_register.
+  u16 flags;
+  u32 ip;
+  u32 id; // live interval id, or a name index.
+  u32 operand;
+};
+
+struct cbe_trace {
+  u32 categories; // enum cbe_trace_category bits recorded, none by default.
+  struct cbe_trace_record *records; // `capacity` of them, a power of two.
+  usz capacity;
+  u64 head; // records ever written, only the last `capacity` are kept.
+};
+
+#define CBE_TRACE(ctx, event, ...)                                             \
+  do {                                                                         \
+    if ((ctx)->trace.categories & CBE_TRACE_CATEGORY(event))                   \
+      cbe_trace_record(ctx, (struct cbe_trace_record){event, __VA_ARGS__});    \
+  } while (0)
+
 struct cbe_context {
+  u32 options;         // enum cbe_option bits, used by cbe_optimize.
+  u32 target_features; // enum cbe_target_feature bits.
+  enum cbe_target_cpu target_cpu;
+  cstr profile_path;   // written at exit by instrumented code.
   struct cbe_register_pool register_pool;
+  struct cbe_register_pool scratch_pool; // registers used inside isel trees.
+  struct cbe_register_pool vector_pool;
+  struct cbe_register_pool vector_scratch_pool;
   int current_stack_location;
 
   slice(struct cbe_stack_frame) stacktrace;
@@ -278,10 +580,30 @@ struct cbe_context {
 
   slice(struct cbe_live_interval) live_intervals;
   cbe_live_intervals active_intervals;
+  cbe_live_intervals split_intervals; // pieces left by the last spill.
   usz ip; // instruction pointer used for register allocation.
+  cbe_isel_nodes definitions; // defining node of each symbol, by name index.
+  slice(usz) use_counts;      // operand uses of each symbol, by name index.
+  slice(usz) call_points;     // ips of the calls in the current function.
 
   slice(cstr) symbol_table;
-  slice(cstr) string_table;
+  slice(cstr) string_table; // distinct string literals, see data.c.
+  slice(struct cbe_constant) constant_table; // distinct float constants.
+  struct cbe_literal_index string_index, constant_index;
+
+  // Generation state.
+  struct cbe_function *current_function; // also set by cbe_validate_function.
+  usz current_block; // name index of the block being generated.
+  usz next_block;    // name index of the block laid out next, or SIZE_MAX.
+
+  slice(struct cbe_diagnostic) diagnostics; // found by cbe_validate.
+  bool checked; // by cbe_check, which cbe_validate then leaves out.
+  slice(struct cbe_definition) checked_definitions; // by name index.
+  slice(struct cbe_pending_use) pending_uses;
+  usz definition_walks; // functions checked so far.
+  struct cbe_stats stats; // summed over everything compiled in the context.
+  arena_stats_t arena;    // a_stats at cbe_init, see cbe_write_stats.
+  struct cbe_trace trace;
 };
 
 static void print_stacktrace(struct cbe_context ctx) {
@@ -294,51 +616,181 @@ static void print_stacktrace(struct cbe_context ctx) {
 enum cbe_validation_result {
   CBE_VALID_OK,
   CBE_VALID_TYPE_MISMATCH,
+  CBE_VALID_MISSING_TERMINATOR,
+  CBE_VALID_UNSUPPORTED_TYPE,     // no instructions for it on the target.
+  CBE_VALID_UNKNOWN_TYPE,         // a type id past the type table.
+  CBE_VALID_UNKNOWN_SYMBOL,       // a variable past the symbol table.
+  CBE_VALID_UNKNOWN_BLOCK,        // a branch out of the function.
+  CBE_VALID_NOT_A_POINTER,        // loaded, stored or indexed through.
+  CBE_VALID_MISSING_RESULT,       // a value without a temporary.
+  CBE_VALID_MISPLACED_TERMINATOR, // before the end of its block.
+  CBE_VALID_ARGUMENT_COUNT,       // not the callee's, or too many.
+  CBE_VALID_UNDEFINED_SYMBOL,     // not defined in the function, nor global.
+  CBE_VALID_USED_BEFORE_DEFINED,  // defined later in the same block.
+  CBE_VALID_RESULT_COUNT,
+};
+
+// Where and how validation failed, see validate.c. `operand` counts as
+// cbe_instruction_operand does.
+struct cbe_diagnostic {
+  enum cbe_validation_result result;
+  usz symbol;      // function, or global variable.
+  usz block;       // name index, SIZE_MAX for a global or a signature.
+  usz instruction; // in the block, SIZE_MAX for the block itself.
+  usz operand;     // or parameter, SIZE_MAX for the instruction or result.
+  cbe_type_id expected, found; // SIZE_MAX where no type is at fault.
+};
+
+// The first definition of a symbol in the function being checked, and a use
+// checked against it once the function is, see validate.c.
+struct cbe_definition {
+  usz walk;  // of the function, 0 for none.
+  usz block; // index, SIZE_MAX for a parameter.
+  cbe_type_id type_id;
+};
+struct cbe_pending_use {
+  usz variable, block;
+  cbe_type_id type_id;
+  struct cbe_diagnostic diagnostic;
 };
 
 void cbe_init(struct cbe_context *);
+void cbe_optimize(struct cbe_context *);
+void cbe_layout_blocks(struct cbe_context *, struct cbe_function *);
+void cbe_vectorize_loops(struct cbe_context *, struct cbe_function *);
+void cbe_inline_functions(struct cbe_context *);
+void cbe_eliminate_dead_code(struct cbe_context *);
+usz cbe_find_function_index(struct cbe_context *, usz);
+void cbe_schedule_function(struct cbe_context *, struct cbe_function *);
+bool cbe_slots_escape(struct cbe_context *, struct cbe_function *);
 
 cbe_live_intervals cbe_expire_old_intervals(struct cbe_context *,
                                             cbe_live_intervals,
                                             struct cbe_live_interval *);
-void cbe_spill_at_interval(struct cbe_context *, cbe_live_intervals,
-                           struct cbe_live_interval *);
-
-usz cbe_allocate_stack_variable(struct cbe_context *, usz);
+cbe_live_intervals cbe_spill_at_interval(struct cbe_context *,
+                                         cbe_live_intervals,
+                                         struct cbe_live_interval *);
+void cbe_allocate_registers(struct cbe_context *, usz);
+
+usz cbe_allocate_stack_variable(struct cbe_context *, usz, usz);
+usz cbe_allocate_stack_slot(struct cbe_context *, usz);
+int cbe_format_frame_address(struct cbe_context *, char *, usz, usz);
 usz cbe_find_stack_variable(struct cbe_context *, usz);
 
 usz cbe_new_global_variable(struct cbe_context *, struct cbe_global_variable);
+usz cbe_find_global_variable(struct cbe_context *, usz);
+
+// Global data and literal pools, see data.c.
+usz cbe_intern_string(struct cbe_context *, cstr);
+usz cbe_intern_constant(struct cbe_context *, u64, usz);
+u64 cbe_float_bits(struct cbe_context *, struct cbe_value);
+int cbe_format_constant(struct cbe_context *, char *, usz, struct cbe_value);
+void cbe_generate_literals(struct cbe_context *, FILE *);
 
 cbe_type_id cbe_add_type(struct cbe_context *, struct cbe_type);
+usz cbe_type_size(struct cbe_context *, cbe_type_id);
+enum cbe_register_class cbe_type_register_class(struct cbe_context *,
+                                                cbe_type_id);
 
 usz cbe_find_or_add_symbol(struct cbe_context *, cstr);
 usz cbe_find_symbol(struct cbe_context *, cstr);
 usz cbe_add_symbol(struct cbe_context *, cstr);
 
-struct cbe_live_interval
-cbe_add_or_increment_live_interval(struct cbe_context *, cstr);
+cbe_interval_id cbe_add_live_interval(struct cbe_context *, usz, cbe_type_id);
+void cbe_extend_live_interval(struct cbe_context *, cbe_interval_id, int);
+enum cbe_register cbe_interval_register(struct cbe_context *, cbe_interval_id,
+                                        usz);
+
+usz cbe_instruction_operand_count(struct cbe_instruction *);
+struct cbe_value *cbe_instruction_operand(struct cbe_instruction *, usz);
+
+void cbe_isel_build_arguments(struct cbe_context *, struct cbe_function *);
+void cbe_isel_begin_block(struct cbe_context *, struct cbe_block *);
+usz cbe_isel_build_instruction(struct cbe_context *, struct cbe_block *, usz);
+void cbe_isel_end_block(struct cbe_context *, struct cbe_block *);
+void cbe_isel_resolve_block(struct cbe_context *, struct cbe_block *);
+void cbe_isel_annotate_intervals(struct cbe_context *, struct cbe_function *);
+void cbe_isel_generate_block(struct cbe_context *, FILE *, struct cbe_block);
+cstr cbe_isel_move(struct cbe_context *, cbe_type_id, bool);
+cstr cbe_isel_size_name(usz);
+bool cbe_isel_is_supported(struct cbe_context *, struct cbe_instruction *);
 
 void cbe_generate(struct cbe_context *, FILE *);
+// fprintf for everything cbe_generate writes, counted in stats.emitted_bytes.
+int cbe_emit(struct cbe_context *, FILE *, cstr, ...)
+    __attribute__((format(printf, 3, 4)));
 void cbe_generate_global_variable(struct cbe_context *, FILE *,
                                   struct cbe_global_variable);
 void cbe_generate_function(struct cbe_context *, FILE *, struct cbe_function);
 void cbe_generate_block(struct cbe_context *, FILE *, struct cbe_block);
-void cbe_generate_instruction(struct cbe_context *, FILE *,
-                              struct cbe_instruction);
+void cbe_generate_epilogue(struct cbe_context *, FILE *, usz);
+void cbe_generate_profile(struct cbe_context *, FILE *);
+int cbe_format_profile_counter(struct cbe_context *, char *, usz, usz, usz);
+bool cbe_load_profile(struct cbe_context *, cstr);
 void cbe_generate_value(struct cbe_context *, FILE *, struct cbe_value);
+int cbe_format_value(struct cbe_context *, char *, usz, struct cbe_value);
 void cbe_generate_type(struct cbe_context *, FILE *, struct cbe_type);
 
+// Serialized modules, see module.c.
+void cbe_write_module(struct cbe_context *, FILE *);
+bool cbe_read_module(struct cbe_context *, const u8 *, usz);
+
+// Compile server, see server.c. Options, target features and cpu are those
+// of struct cbe_context.
+enum cbe_serve_flag {
+  CBE_SERVE_OBJECT = 1 << 0, // assemble the output into an object file
+};
+enum cbe_serve_status {
+  CBE_SERVE_OK,
+  CBE_SERVE_MALFORMED, // the request or module could not be read
+  CBE_SERVE_FAILED,    // the assembler failed
+  CBE_SERVE_INVALID,   // cbe_check or cbe_validate failed, see diagnostics
+};
+struct cbe_serve_request {
+  u32 size;  // bytes of the module that follows.
+  u32 flags; // enum cbe_serve_flag bits.
+  u32 options, target_features, target_cpu;
+  u32 reserved;
+};
+struct cbe_serve_response {
+  u32 status; // enum cbe_serve_status.
+  u32 size;   // bytes that follow.
+};
+bool cbe_serve(cstr, usz);
+
+void cbe_write_stats(struct cbe_context *, FILE *);
+
+void cbe_trace_enable(struct cbe_context *, u32, usz);
+void cbe_trace_record(struct cbe_context *, struct cbe_trace_record);
+u32 cbe_trace_parse_categories(cstr);
+void cbe_write_trace(struct cbe_context *, FILE *);
+bool cbe_decode_trace(FILE *, FILE *);
+
+enum cbe_validation_result cbe_check(struct cbe_context *);
 enum cbe_validation_result cbe_validate(struct cbe_context *);
 enum cbe_validation_result cbe_validate_function(struct cbe_context *,
-                                                 struct cbe_function);
+                                                 struct cbe_function *);
+enum cbe_validation_result cbe_validate_signature(struct cbe_context *,
+                                                  struct cbe_function *);
 enum cbe_validation_result cbe_validate_block(struct cbe_context *,
-                                              struct cbe_block);
+                                              struct cbe_block *);
 enum cbe_validation_result cbe_validate_instruction(struct cbe_context *,
-                                                    struct cbe_instruction);
+                                                    struct cbe_instruction *,
+                                                    struct cbe_diagnostic *);
+void cbe_validate_begin_definitions(struct cbe_context *,
+                                    struct cbe_function *);
+enum cbe_validation_result cbe_validate_definitions(struct cbe_context *,
+                                                    struct cbe_instruction *,
+                                                    usz,
+                                                    struct cbe_diagnostic *);
+enum cbe_validation_result cbe_validate_end_definitions(struct cbe_context *);
 enum cbe_validation_result cbe_validate_value(struct cbe_context *,
                                               struct cbe_value);
 enum cbe_validation_result cbe_validate_type(struct cbe_context *,
                                              struct cbe_type);
+bool cbe_same_type(struct cbe_context *, cbe_type_id, cbe_type_id);
+int cbe_format_type(struct cbe_context *, char *, usz, cbe_type_id);
+void cbe_write_diagnostics(struct cbe_context *, FILE *);
 
 const char *cbe_register_name(struct cbe_context *, usz);
 
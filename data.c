@@ -0,0 +1,265 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Global data.
+//
+// A global goes to .data, or to .bss when it starts out zero. A constant one
+// goes to .rodata, or to .data.rel.ro when it holds an address, which the
+// dynamic linker may have to relocate before it becomes read-only.
+//
+// String literals and the float constants instructions load from memory are
+// interned as they are emitted: each distinct one gets a single label,
+// .Lstr.<n> or .Lconst.<n>, and is written once by cbe_generate_literals
+// into the mergeable sections .rodata.str1.1, .rodata.cst4 and .rodata.cst8,
+// where the linker also folds the duplicates of other objects.
+
+#define CBE_LITERAL_MIN_CAPACITY 64
+
+// FNV-1a.
+static u64 cbe_hash_string(cstr string) {
+  u64 hash = 0xcbf29ce484222325ull;
+  for (const u8 *c = (const u8 *)string; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// The finalizer of splitmix64.
+static u64 cbe_hash_constant(u64 bits, usz size) {
+  u64 hash = bits ^ ((u64)size << 59);
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 31);
+}
+
+// Doubles the buckets of `index` once another entry would fill more than
+// half of them.
+static void cbe_literal_reserve(struct cbe_literal_index *index) {
+  if (2 * (index->count + 1) <= index->capacity)
+    return;
+  usz capacity = index->capacity == 0 ? CBE_LITERAL_MIN_CAPACITY
+                                      : 2 * index->capacity;
+  struct cbe_literal_bucket *buckets =
+      CBE_ALLOC(sizeof(*buckets) * capacity);
+  memset(buckets, 0, sizeof(*buckets) * capacity);
+  for (usz i = 0; i < index->capacity; i++) {
+    struct cbe_literal_bucket bucket = index->buckets[i];
+    if (bucket.entry == 0)
+      continue;
+    usz at = bucket.hash & (capacity - 1);
+    while (buckets[at].entry != 0)
+      at = (at + 1) & (capacity - 1);
+    buckets[at] = bucket;
+  }
+  index->buckets = buckets;
+  index->capacity = capacity;
+}
+
+usz cbe_intern_string(struct cbe_context *ctx, cstr string) {
+  push_stack_frame(ctx);
+  struct cbe_literal_index *index = &ctx->string_index;
+  cbe_literal_reserve(index);
+  u64 hash = cbe_hash_string(string);
+  usz mask = index->capacity - 1;
+  for (usz at = hash & mask;; at = (at + 1) & mask) {
+    struct cbe_literal_bucket *bucket = &index->buckets[at];
+    if (bucket->entry == 0) {
+      slice_push(&ctx->string_table, string);
+      *bucket = (struct cbe_literal_bucket){hash, ctx->string_table.size};
+      index->count++;
+      pop_stack_frame(ctx);
+      return ctx->string_table.size - 1;
+    }
+    if (bucket->hash == hash &&
+        strcmp(ctx->string_table.items[bucket->entry - 1], string) == 0) {
+      pop_stack_frame(ctx);
+      return bucket->entry - 1;
+    }
+  }
+}
+
+usz cbe_intern_constant(struct cbe_context *ctx, u64 bits, usz size) {
+  push_stack_frame(ctx);
+  CBE_ASSERT(*ctx, size == 4 || size == 8);
+  struct cbe_literal_index *index = &ctx->constant_index;
+  cbe_literal_reserve(index);
+  u64 hash = cbe_hash_constant(bits, size);
+  usz mask = index->capacity - 1;
+  for (usz at = hash & mask;; at = (at + 1) & mask) {
+    struct cbe_literal_bucket *bucket = &index->buckets[at];
+    if (bucket->entry == 0) {
+      slice_push(&ctx->constant_table, ((struct cbe_constant){bits, size}));
+      *bucket = (struct cbe_literal_bucket){hash, ctx->constant_table.size};
+      index->count++;
+      pop_stack_frame(ctx);
+      return ctx->constant_table.size - 1;
+    }
+    struct cbe_constant *constant =
+        &ctx->constant_table.items[bucket->entry - 1];
+    if (bucket->hash == hash && constant->bits == bits &&
+        constant->size == size) {
+      pop_stack_frame(ctx);
+      return bucket->entry - 1;
+    }
+  }
+}
+
+// The bits of `value` stored as its type: floats are converted to the width
+// of the type, integers are taken as they are.
+u64 cbe_float_bits(struct cbe_context *ctx, struct cbe_value value) {
+  if (value.tag == CBE_VALUE_NIL)
+    return 0;
+  if (value.tag != CBE_VALUE_FLOAT)
+    return value.integer;
+  if (cbe_type_size(ctx, value.type_id) == 4) {
+    float single = (float)value.floating;
+    u32 bits;
+    memcpy(&bits, &single, sizeof(bits));
+    return bits;
+  }
+  u64 bits;
+  memcpy(&bits, &value.floating, sizeof(bits));
+  return bits;
+}
+
+// The memory operand of scalar float `value` in the constant pool, without
+// its size keyword.
+int cbe_format_constant(struct cbe_context *ctx, char *buffer, usz size,
+                        struct cbe_value value) {
+  usz index = cbe_intern_constant(ctx, cbe_float_bits(ctx, value),
+                                  cbe_type_size(ctx, value.type_id));
+  return snprintf(buffer, size, "[rip + .Lconst.%zu]", index);
+}
+
+static cstr cbe_data_directive(usz size) {
+  switch (size) {
+  case 1:
+    return ".byte";
+  case 2:
+    return ".short";
+  case 4:
+    return ".long";
+  default:
+    return ".quad";
+  }
+}
+
+static bool cbe_is_zero(struct cbe_context *ctx, struct cbe_value value) {
+  switch (value.tag) {
+  case CBE_VALUE_NIL:
+    return true;
+  case CBE_VALUE_INTEGER:
+    return value.integer == 0;
+  case CBE_VALUE_FLOAT:
+    return cbe_float_bits(ctx, value) == 0;
+  default:
+    return false;
+  }
+}
+
+// One element of `type_id` holding `value`.
+static void cbe_generate_datum(struct cbe_context *ctx, FILE *fp,
+                               cbe_type_id type_id, struct cbe_value value) {
+  usz size = cbe_type_size(ctx, type_id);
+  value.type_id = type_id;
+  switch (value.tag) {
+  case CBE_VALUE_STRING:
+    cbe_emit(ctx, fp, "  .quad .Lstr.%zu\n",
+             cbe_intern_string(ctx, value.string));
+    break;
+  case CBE_VALUE_VARIABLE:
+    cbe_emit(ctx, fp, "  .quad %s\n", ctx->symbol_table.items[value.variable]);
+    break;
+  case CBE_VALUE_FLOAT:
+    cbe_emit(ctx, fp, "  %s 0x%llx\n", cbe_data_directive(size),
+             (unsigned long long)cbe_float_bits(ctx, value));
+    break;
+  default:
+    cbe_emit(ctx, fp, "  %s %lld\n", cbe_data_directive(size),
+             value.tag == CBE_VALUE_NIL ? 0 : value.integer);
+    break;
+  }
+}
+
+void cbe_generate_global_variable(struct cbe_context *ctx, FILE *fp,
+                                  struct cbe_global_variable variable) {
+  push_stack_frame(ctx);
+  cstr name = ctx->symbol_table.items[variable.name_index];
+  struct cbe_value value = variable.value;
+  struct cbe_type type = ctx->types.items[value.type_id];
+  usz size = cbe_type_size(ctx, value.type_id);
+  bool zero = cbe_is_zero(ctx, value);
+  bool address =
+      value.tag == CBE_VALUE_STRING || value.tag == CBE_VALUE_VARIABLE;
+  if (variable.constant && address)
+    cbe_emit(ctx, fp, ".section .data.rel.ro,\"aw\"\n");
+  else if (variable.constant)
+    cbe_emit(ctx, fp, ".section .rodata\n");
+  else if (zero)
+    cbe_emit(ctx, fp, ".bss\n");
+  else
+    cbe_emit(ctx, fp, ".data\n");
+
+  if (!variable.local)
+    cbe_emit(ctx, fp, ".globl %s\n", name);
+  cbe_emit(ctx, fp, ".type %s, @object\n", name);
+  cbe_emit(ctx, fp, ".balign %zu\n", size);
+  cbe_emit(ctx, fp, "%s:\n", name);
+  if (zero) {
+    cbe_emit(ctx, fp, "  .zero %zu\n", size);
+  } else if (type.tag == CBE_TYPE_VECTOR) {
+    // A scalar fills every lane.
+    for (usz i = 0; i < type.lanes; i++)
+      cbe_generate_datum(ctx, fp, type.element, value);
+  } else {
+    cbe_generate_datum(ctx, fp, value.type_id, value);
+  }
+  cbe_emit(ctx, fp, ".size %s, %zu\n", name, size);
+  pop_stack_frame(ctx);
+}
+
+static void cbe_generate_string(struct cbe_context *ctx, FILE *fp,
+                                cstr string) {
+  cbe_emit(ctx, fp, "  .asciz \"");
+  for (const u8 *c = (const u8 *)string; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\')
+      cbe_emit(ctx, fp, "\\%c", *c);
+    else if (*c < ' ' || *c > '~')
+      cbe_emit(ctx, fp, "\\%03o", *c);
+    else
+      cbe_emit(ctx, fp, "%c", *c);
+  }
+  cbe_emit(ctx, fp, "\"\n");
+}
+
+// Writes every literal interned so far, so it has to come after everything
+// that refers to them.
+void cbe_generate_literals(struct cbe_context *ctx, FILE *fp) {
+  push_stack_frame(ctx);
+  if (ctx->string_table.size > 0)
+    cbe_emit(ctx, fp, ".section .rodata.str1.1,\"aMS\",@progbits,1\n");
+  for (usz i = 0; i < ctx->string_table.size; i++) {
+    cbe_emit(ctx, fp, ".Lstr.%zu:\n", i);
+    cbe_generate_string(ctx, fp, ctx->string_table.items[i]);
+  }
+  for (usz size = 4; size <= 8; size *= 2) {
+    bool section = false;
+    for (usz i = 0; i < ctx->constant_table.size; i++) {
+      struct cbe_constant constant = ctx->constant_table.items[i];
+      if (constant.size != size)
+        continue;
+      if (!section)
+        cbe_emit(ctx, fp, ".section .rodata.cst%zu,\"aM\",@progbits,%zu\n",
+                 size, size);
+      section = true;
+      cbe_emit(ctx, fp, ".balign %zu\n", size);
+      cbe_emit(ctx, fp, ".Lconst.%zu:\n", i);
+      cbe_emit(ctx, fp, "  %s 0x%llx\n", cbe_data_directive(size),
+               (unsigned long long)constant.bits);
+    }
+  }
+  pop_stack_frame(ctx);
+}
@@ -0,0 +1,135 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Dead function and global elimination.
+//
+// Functions and globals that are not local are exported, and so are roots:
+// anything may refer to them from outside the module. From the roots, a
+// worklist follows the calls and symbol operands of every function it
+// reaches and the symbol a global holds; the local functions and globals it
+// never gets to are dropped, before any other pass or cbe_validate spends
+// time on them. Each of them is recorded as a CBE_EVENT_REMOVE and counted in
+// ctx.stats.
+
+struct cbe_reachability {
+  struct cbe_context *ctx;
+  // Function index, or the function count plus a global index, by symbol;
+  // SIZE_MAX for other symbols.
+  usz *owners;
+  bool *reached; // by owner.
+  usz *worklist, pending;
+};
+
+static void cbe_reach_owner(struct cbe_reachability *r, usz owner) {
+  if (owner == SIZE_MAX || r->reached[owner])
+    return;
+  r->reached[owner] = true;
+  r->worklist[r->pending++] = owner;
+}
+
+static void cbe_reach(struct cbe_reachability *r, usz name_index) {
+  if (name_index < r->ctx->symbol_table.size)
+    cbe_reach_owner(r, r->owners[name_index]);
+}
+
+static void cbe_reach_value(struct cbe_reachability *r,
+                            struct cbe_value value) {
+  if (value.tag == CBE_VALUE_VARIABLE)
+    cbe_reach(r, value.variable);
+}
+
+static void cbe_reach_function(struct cbe_reachability *r,
+                               struct cbe_function *fn) {
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    for (usz j = 0; j < block->instructions.size; j++) {
+      struct cbe_instruction *inst = &block->instructions.items[j];
+      if (inst->tag == CBE_INST_CALL)
+        cbe_reach(r, inst->call.function);
+      for (usz k = 0; k < cbe_instruction_operand_count(inst); k++)
+        cbe_reach_value(r, *cbe_instruction_operand(inst, k));
+    }
+  }
+}
+
+static usz cbe_instruction_count(struct cbe_function *fn) {
+  usz count = 0;
+  for (usz i = 0; i < fn->blocks.size; i++)
+    count += fn->blocks.items[i].instructions.size;
+  return count;
+}
+
+void cbe_eliminate_dead_code(struct cbe_context *ctx) {
+  push_stack_frame(ctx);
+  usz functions = ctx->functions.size;
+  usz owners = functions + ctx->global_variables.size;
+  struct cbe_reachability r = {.ctx = ctx};
+  r.owners = CBE_ALLOC(sizeof(*r.owners) * (ctx->symbol_table.size + 1));
+  r.reached = CBE_ALLOC(sizeof(*r.reached) * (owners + 1));
+  r.worklist = CBE_ALLOC(sizeof(*r.worklist) * (owners + 1));
+  memset(r.owners, 0xff, sizeof(*r.owners) * ctx->symbol_table.size);
+  memset(r.reached, 0, sizeof(*r.reached) * owners);
+  // Names past the symbol table own nothing, so nothing reaches them; they
+  // are kept as roots for cbe_validate to report.
+  usz symbols = ctx->symbol_table.size;
+  for (usz i = 0; i < functions; i++) {
+    usz name_index = ctx->functions.items[i].name_index;
+    if (name_index < symbols)
+      r.owners[name_index] = i;
+  }
+  for (usz i = 0; i < ctx->global_variables.size; i++) {
+    usz name_index = ctx->global_variables.items[i].name_index;
+    if (name_index < symbols)
+      r.owners[name_index] = functions + i;
+  }
+
+  for (usz i = 0; i < functions; i++) {
+    struct cbe_function *fn = &ctx->functions.items[i];
+    if (!fn->local || fn->name_index >= symbols)
+      cbe_reach_owner(&r, i);
+  }
+  for (usz i = 0; i < ctx->global_variables.size; i++) {
+    struct cbe_global_variable *global = &ctx->global_variables.items[i];
+    if (!global->local || global->name_index >= symbols)
+      cbe_reach_owner(&r, functions + i);
+  }
+  while (r.pending > 0) {
+    usz owner = r.worklist[--r.pending];
+    if (owner < functions) {
+      cbe_reach_function(&r, &ctx->functions.items[owner]);
+      continue;
+    }
+    struct cbe_global_variable *global =
+        &ctx->global_variables.items[owner - functions];
+    cbe_reach_value(&r, global->value);
+  }
+
+  // Compact both lists in place, keeping the order of what is left.
+  usz kept = 0;
+  for (usz i = 0; i < functions; i++) {
+    struct cbe_function *fn = &ctx->functions.items[i];
+    if (!r.reached[i]) {
+      CBE_TRACE(ctx, CBE_EVENT_REMOVE, CBE_REG_NONE, 0, 0, fn->name_index,
+                cbe_instruction_count(fn));
+      CBE_STATS_ADD(ctx, removed_functions, 1);
+      continue;
+    }
+    ctx->functions.items[kept++] = *fn;
+  }
+  ctx->functions.size = kept;
+  kept = 0;
+  for (usz i = 0; i < ctx->global_variables.size; i++) {
+    struct cbe_global_variable *global = &ctx->global_variables.items[i];
+    if (!r.reached[functions + i]) {
+      CBE_TRACE(ctx, CBE_EVENT_REMOVE, CBE_REG_NONE, CBE_TRACE_GLOBAL, 0,
+                global->name_index, 0);
+      CBE_STATS_ADD(ctx, removed_globals, 1);
+      continue;
+    }
+    ctx->global_variables.items[kept++] = *global;
+  }
+  ctx->global_variables.size = kept;
+  pop_stack_frame(ctx);
+}
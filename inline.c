@@ -0,0 +1,396 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function inlining.
+//
+// The call graph is split into strongly connected components, which Tarjan's
+// algorithm finds callees first; walking functions in that order inlines
+// bottom-up, so a function's calls are already expanded when it is inlined
+// somewhere. Calls within a component are recursive and never inlined.
+//
+// A call site is inlined when the callee is small, with a larger allowance
+// for sites that run more often than their function is entered (measured by
+// a profile, or guessed from the site being on a cycle), and as long as the
+// caller stays below a size limit. The block holding the call is split after
+// it, the callee's blocks are copied in between with fresh names, its
+// parameters are replaced by the arguments and its rets jump to the rest of
+// the block. A callee with several rets passes its result through a slot.
+
+#define CBE_INLINE_SIZE 12
+#define CBE_INLINE_HOT_SIZE 48
+#define CBE_INLINE_CALLER_LIMIT 1024
+
+struct cbe_inline_graph {
+  usz *callees;      // function indices, grouped by caller.
+  usz *callee_index; // first callee of each function.
+  usz *callee_count;
+  usz *component;    // strongly connected component of each function.
+  usz *order;        // functions, callees before callers.
+  usz ordered;
+
+  // Tarjan's algorithm state.
+  usz *index, *lowlink, *stack;
+  bool *on_stack;
+  usz next_index, depth, components;
+};
+
+usz cbe_find_function_index(struct cbe_context *ctx, usz name_index) {
+  cstr name = ctx->symbol_table.items[name_index];
+  for (usz i = 0; i < ctx->functions.size; i++) {
+    usz other = ctx->functions.items[i].name_index;
+    if (other == name_index ||
+        strcmp(ctx->symbol_table.items[other], name) == 0)
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+static usz cbe_inline_function_size(struct cbe_function *fn) {
+  usz size = 0;
+  for (usz i = 0; i < fn->blocks.size; i++)
+    size += fn->blocks.items[i].instructions.size;
+  return size;
+}
+
+static void cbe_inline_connect(struct cbe_inline_graph *graph, usz f) {
+  graph->index[f] = graph->lowlink[f] = graph->next_index++;
+  graph->stack[graph->depth++] = f;
+  graph->on_stack[f] = true;
+  for (usz i = 0; i < graph->callee_count[f]; i++) {
+    usz g = graph->callees[graph->callee_index[f] + i];
+    if (graph->index[g] == SIZE_MAX) {
+      cbe_inline_connect(graph, g);
+      if (graph->lowlink[g] < graph->lowlink[f])
+        graph->lowlink[f] = graph->lowlink[g];
+    } else if (graph->on_stack[g] && graph->index[g] < graph->lowlink[f]) {
+      graph->lowlink[f] = graph->index[g];
+    }
+  }
+  if (graph->lowlink[f] != graph->index[f])
+    return;
+  usz g;
+  do {
+    g = graph->stack[--graph->depth];
+    graph->on_stack[g] = false;
+    graph->component[g] = graph->components;
+    graph->order[graph->ordered++] = g;
+  } while (g != f);
+  graph->components++;
+}
+
+static void cbe_inline_build_graph(struct cbe_context *ctx,
+                                   struct cbe_inline_graph *graph) {
+  push_stack_frame(ctx);
+  usz functions = ctx->functions.size, total = 0;
+  for (usz f = 0; f < functions; f++) {
+    struct cbe_function *fn = &ctx->functions.items[f];
+    for (usz b = 0; b < fn->blocks.size; b++) {
+      struct cbe_block *block = &fn->blocks.items[b];
+      for (usz i = 0; i < block->instructions.size; i++)
+        total += block->instructions.items[i].tag == CBE_INST_CALL;
+    }
+  }
+
+  graph->callees = CBE_ALLOC(sizeof(usz) * (total + 1));
+  graph->callee_index = CBE_ALLOC(sizeof(usz) * functions);
+  graph->callee_count = CBE_ALLOC(sizeof(usz) * functions);
+  graph->component = CBE_ALLOC(sizeof(usz) * functions);
+  graph->order = CBE_ALLOC(sizeof(usz) * functions);
+  graph->index = CBE_ALLOC(sizeof(usz) * functions);
+  graph->lowlink = CBE_ALLOC(sizeof(usz) * functions);
+  graph->stack = CBE_ALLOC(sizeof(usz) * functions);
+  graph->on_stack = CBE_ALLOC(sizeof(bool) * functions);
+  total = 0;
+  for (usz f = 0; f < functions; f++) {
+    struct cbe_function *fn = &ctx->functions.items[f];
+    graph->callee_index[f] = total;
+    for (usz b = 0; b < fn->blocks.size; b++) {
+      struct cbe_block *block = &fn->blocks.items[b];
+      for (usz i = 0; i < block->instructions.size; i++) {
+        struct cbe_instruction *inst = &block->instructions.items[i];
+        if (inst->tag != CBE_INST_CALL)
+          continue;
+        // Calls to functions outside of the module are leaves.
+        usz callee = cbe_find_function_index(ctx, inst->call.function);
+        if (callee != SIZE_MAX)
+          graph->callees[total++] = callee;
+      }
+    }
+    graph->callee_count[f] = total - graph->callee_index[f];
+    graph->index[f] = SIZE_MAX;
+    graph->on_stack[f] = false;
+  }
+
+  for (usz f = 0; f < functions; f++) {
+    if (graph->index[f] == SIZE_MAX)
+      cbe_inline_connect(graph, f);
+  }
+  CBE_ASSERT(*ctx, graph->ordered == functions);
+  pop_stack_frame(ctx);
+}
+
+// Whether block `b` can reach itself.
+static bool cbe_inline_on_cycle(struct cbe_context *ctx,
+                                struct cbe_function *fn, usz b) {
+  push_stack_frame(ctx);
+  usz blocks = fn->blocks.size, count = 0;
+  bool *seen = CBE_ALLOC(sizeof(bool) * blocks);
+  usz *worklist = CBE_ALLOC(sizeof(usz) * blocks);
+  memset(seen, 0, sizeof(bool) * blocks);
+  worklist[count++] = b;
+  bool cycle = false;
+  while (!cycle && count > 0) {
+    usz names[2];
+    struct cbe_block *block = &fn->blocks.items[worklist[--count]];
+    usz successors = cbe_block_successors(block, names);
+    for (usz i = 0; i < successors; i++) {
+      usz to = cbe_find_block_index(fn, names[i]);
+      cycle |= to == b;
+      if (to != SIZE_MAX && !seen[to]) {
+        seen[to] = true;
+        worklist[count++] = to;
+      }
+    }
+  }
+  pop_stack_frame(ctx);
+  return cycle;
+}
+
+static bool cbe_inline_is_hot(struct cbe_context *ctx,
+                              struct cbe_function *fn, usz b) {
+  if (fn->weight > 0)
+    return fn->blocks.items[b].weight > fn->weight;
+  return cbe_inline_on_cycle(ctx, fn, b);
+}
+
+struct cbe_inline_site {
+  struct cbe_context *ctx;
+  struct cbe_function *caller, *callee;
+  usz instance;         // numbers the copies made in the caller.
+  usz *names;           // new name of every callee name, SIZE_MAX if kept.
+  usz name_count;
+  struct cbe_value *result; // replaces the call's temporary, NULL if loaded.
+};
+
+static usz cbe_inline_rename(struct cbe_inline_site *site, usz name,
+                             cstr suffix) {
+  struct cbe_context *ctx = site->ctx;
+  cstr base = ctx->symbol_table.items[name];
+  cstr callee = ctx->symbol_table.items[site->callee->name_index];
+  usz size = strlen(base) + strlen(callee) + strlen(suffix) + 32;
+  char *text = CBE_ALLOC(size);
+  snprintf(text, size, "%s.%s.%zu%s", base, callee, site->instance, suffix);
+  return cbe_add_symbol(ctx, text);
+}
+
+static struct cbe_value cbe_inline_value(struct cbe_inline_site *site,
+                                         struct cbe_value *arguments,
+                                         struct cbe_value value) {
+  if (value.tag != CBE_VALUE_VARIABLE)
+    return value;
+  for (usz i = 0; i < site->callee->parameters.size; i++) {
+    if (site->callee->parameters.items[i].name_index == value.variable)
+      return arguments[i];
+  }
+  if (value.variable < site->name_count &&
+      site->names[value.variable] != SIZE_MAX)
+    value.variable = site->names[value.variable];
+  return value;
+}
+
+static u64 cbe_inline_scale(u64 weight, u64 site, u64 entries) {
+  return entries > 0 ? (u64)((double)weight * site / entries) : 0;
+}
+
+// Inlines the call at instruction `k` of block `b` of the caller.
+static void cbe_inline_call(struct cbe_inline_site *site, usz b, usz k) {
+  struct cbe_context *ctx = site->ctx;
+  push_stack_frame(ctx);
+  struct cbe_function *caller = site->caller, *callee = site->callee;
+  struct cbe_block *block = &caller->blocks.items[b];
+  struct cbe_instruction call = block->instructions.items[k];
+  struct cbe_value *arguments = call.call.arguments.items;
+  u64 site_weight = block->weight;
+
+  // Fresh names for everything the callee defines.
+  usz names = ctx->symbol_table.size;
+  site->names = CBE_ALLOC(sizeof(usz) * names);
+  memset(site->names, 0xff, sizeof(usz) * names);
+  site->name_count = names;
+  usz returns = 0;
+  for (usz j = 0; j < callee->blocks.size; j++) {
+    struct cbe_block *from = &callee->blocks.items[j];
+    site->names[from->name_index] =
+        cbe_inline_rename(site, from->name_index, "");
+    for (usz i = 0; i < from->instructions.size; i++) {
+      struct cbe_instruction *inst = &from->instructions.items[i];
+      returns += inst->tag == CBE_INST_RET;
+      if (inst->has_temporary)
+        site->names[inst->temporary.name_index] =
+            cbe_inline_rename(site, inst->temporary.name_index, "");
+    }
+  }
+
+  struct cbe_block after = {
+      .name_index = cbe_inline_rename(site, block->name_index, ".return"),
+      .weight = site_weight};
+  slice_init(&after.instructions);
+  struct cbe_value slot = {0};
+  site->result = NULL;
+  if (call.has_temporary && returns > 1) {
+    slot = (struct cbe_value){
+        .tag = CBE_VALUE_VARIABLE,
+        .type_id = cbe_add_type(ctx, (struct cbe_type){
+                                         .tag = CBE_TYPE_PTR,
+                                         .ptr = call.temporary.type_id}),
+        .variable =
+            cbe_inline_rename(site, call.temporary.name_index, ".result")};
+    slice_push(&after.instructions,
+               ((struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                         .has_temporary = true,
+                                         .temporary = call.temporary,
+                                         .load = {slot}}));
+  }
+  for (usz i = k + 1; i < block->instructions.size; i++)
+    slice_push(&after.instructions, block->instructions.items[i]);
+
+  // The call site jumps into the copy of the callee's entry block.
+  block->instructions.size = k;
+  if (slot.tag == CBE_VALUE_VARIABLE)
+    slice_push(&block->instructions,
+               ((struct cbe_instruction){.tag = CBE_INST_ALLOC,
+                                         .has_temporary = true,
+                                         .temporary = {slot.variable,
+                                                       slot.type_id},
+                                         .alloc = {call.temporary.type_id}}));
+  slice_push(&block->instructions,
+             ((struct cbe_instruction){
+                 .tag = CBE_INST_JMP,
+                 .jmp = {site->names[callee->blocks.items[0].name_index]}}));
+
+  for (usz j = 0; j < callee->blocks.size; j++) {
+    struct cbe_block *from = &callee->blocks.items[j];
+    struct cbe_block copy = {
+        .name_index = site->names[from->name_index],
+        .weight = cbe_inline_scale(from->weight, site_weight, callee->weight)};
+    slice_init(&copy.instructions);
+    for (usz i = 0; i < from->instructions.size; i++) {
+      struct cbe_instruction inst = from->instructions.items[i];
+      if (inst.tag == CBE_INST_RET) {
+        struct cbe_value value = {0};
+        if (inst.ret.value != NULL)
+          value = cbe_inline_value(site, arguments, *inst.ret.value);
+        if (slot.tag == CBE_VALUE_VARIABLE) {
+          slice_push(&copy.instructions,
+                     ((struct cbe_instruction){.tag = CBE_INST_STORE,
+                                               .store = {value, slot}}));
+        } else if (call.has_temporary) {
+          site->result = CBE_ALLOC(sizeof(struct cbe_value));
+          *site->result = value;
+        }
+        slice_push(&copy.instructions,
+                   ((struct cbe_instruction){
+                       .tag = CBE_INST_JMP, .jmp = {after.name_index}}));
+        continue;
+      }
+
+      if (inst.has_temporary)
+        inst.temporary.name_index = site->names[inst.temporary.name_index];
+      if (inst.tag == CBE_INST_CALL) {
+        slice_init(&inst.call.arguments);
+        for (usz a = 0; a < from->instructions.items[i].call.arguments.size;
+             a++)
+          slice_push(&inst.call.arguments,
+                     from->instructions.items[i].call.arguments.items[a]);
+      }
+      for (usz o = 0; o < cbe_instruction_operand_count(&inst); o++) {
+        struct cbe_value *value = cbe_instruction_operand(&inst, o);
+        *value = cbe_inline_value(site, arguments, *value);
+      }
+      if (inst.tag == CBE_INST_JMP)
+        inst.jmp.block = site->names[inst.jmp.block];
+      if (inst.tag == CBE_INST_BR) {
+        inst.br.then_block = site->names[inst.br.then_block];
+        inst.br.else_block = site->names[inst.br.else_block];
+        inst.br.weights[0] = cbe_inline_scale(inst.br.weights[0], site_weight,
+                                              callee->weight);
+        inst.br.weights[1] = cbe_inline_scale(inst.br.weights[1], site_weight,
+                                              callee->weight);
+      }
+      slice_push(&copy.instructions, inst);
+    }
+    slice_push(&caller->blocks, copy);
+  }
+  slice_push(&caller->blocks, after);
+
+  // With a single ret the returned value is available wherever the call's
+  // result was, since every path there goes through that ret.
+  for (usz j = 0; site->result != NULL && j < caller->blocks.size; j++) {
+    struct cbe_block *other = &caller->blocks.items[j];
+    for (usz i = 0; i < other->instructions.size; i++) {
+      struct cbe_instruction *inst = &other->instructions.items[i];
+      for (usz o = 0; o < cbe_instruction_operand_count(inst); o++) {
+        struct cbe_value *value = cbe_instruction_operand(inst, o);
+        if (value->tag == CBE_VALUE_VARIABLE &&
+            value->variable == call.temporary.name_index)
+          *value = *site->result;
+      }
+    }
+  }
+  pop_stack_frame(ctx);
+}
+
+static void cbe_inline_into(struct cbe_context *ctx,
+                            struct cbe_inline_graph *graph, usz f) {
+  push_stack_frame(ctx);
+  struct cbe_function *caller = &ctx->functions.items[f];
+  usz size = cbe_inline_function_size(caller), instance = 0;
+  // Blocks copied from a callee hold calls that were already considered
+  // when that callee was processed, so only the caller's own blocks and the
+  // remainders of split blocks are visited.
+  slice(usz) worklist;
+  slice_init(&worklist);
+  for (usz b = 0; b < caller->blocks.size; b++)
+    slice_push(&worklist, b);
+  for (usz w = 0; w < worklist.size; w++) {
+    usz b = worklist.items[w];
+    struct cbe_block *block = &caller->blocks.items[b];
+    for (usz k = 0; k < block->instructions.size; k++) {
+      struct cbe_instruction *inst = &block->instructions.items[k];
+      if (inst->tag != CBE_INST_CALL)
+        continue;
+      usz g = cbe_find_function_index(ctx, inst->call.function);
+      if (g == SIZE_MAX || graph->component[g] == graph->component[f])
+        continue;
+      struct cbe_function *callee = &ctx->functions.items[g];
+      usz callee_size = cbe_inline_function_size(callee);
+      usz limit = cbe_inline_is_hot(ctx, caller, b) ? CBE_INLINE_HOT_SIZE
+                                                    : CBE_INLINE_SIZE;
+      if (callee->blocks.size == 0 || callee_size > limit ||
+          size + callee_size > CBE_INLINE_CALLER_LIMIT ||
+          inst->call.arguments.size != callee->parameters.size)
+        continue;
+
+      CBE_TRACE(ctx, CBE_EVENT_INLINE, CBE_REG_NONE, 0, 0, callee->name_index,
+                caller->name_index);
+      struct cbe_inline_site site = {ctx, caller, callee, instance++};
+      cbe_inline_call(&site, b, k);
+      size += callee_size;
+      // The rest of the block is now the last one.
+      slice_push(&worklist, caller->blocks.size - 1);
+      break;
+    }
+  }
+  pop_stack_frame(ctx);
+}
+
+void cbe_inline_functions(struct cbe_context *ctx) {
+  push_stack_frame(ctx);
+  struct cbe_inline_graph graph = {0};
+  cbe_inline_build_graph(ctx, &graph);
+  for (usz i = 0; i < graph.ordered; i++)
+    cbe_inline_into(ctx, &graph, graph.order[i]);
+  pop_stack_frame(ctx);
+}
@@ -0,0 +1,1593 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bottom-up rewrite instruction selection.
+//
+// Every block is turned into a list of trees: an instruction whose temporary
+// is used exactly once, by the next instruction that is still pending, is
+// folded into that user instead of getting a register of its own. At
+// generation time each tree is labelled bottom-up with the cheapest rule for
+// every nonterminal (dynamic programming over the rules in isel.def), and the
+// cover is then reduced top-down, emitting the templates of the chosen rules.
+
+enum cbe_isel_op {
+#define CBE_ISEL_OP(name, arity) CBE_ISEL_OP_##name,
+#include "isel.def"
+  CBE_ISEL_OP_COUNT,
+};
+
+static const u8 cbe_isel_arity[] = {
+#define CBE_ISEL_OP(name, arity) [CBE_ISEL_OP_##name] = arity,
+#include "isel.def"
+};
+
+enum cbe_isel_nt {
+#define CBE_ISEL_NT(name) CBE_ISEL_NT_##name,
+#include "isel.def"
+  CBE_ISEL_NT_COUNT,
+};
+
+enum cbe_isel_rule_id {
+#define CBE_ISEL_BEGIN(op)                                                     \
+  CBE_ISEL_FIRST_##op, CBE_ISEL_FIRST_##op##_ = CBE_ISEL_FIRST_##op - 1,
+#define CBE_ISEL_END(op)                                                       \
+  CBE_ISEL_LAST_##op, CBE_ISEL_LAST_##op##_ = CBE_ISEL_LAST_##op - 1,
+#define CBE_ISEL_RULE(name, ...) CBE_ISEL_RULE_##name,
+#include "isel.def"
+  CBE_ISEL_RULE_COUNT,
+};
+
+#define CBE_ISEL_NO_COST UINT16_MAX
+#define CBE_ISEL_MAX_PATTERN 12
+#define CBE_ISEL_MAX_LEAVES 8
+#define CBE_ISEL_MAX_OPERAND 128
+
+struct cbe_isel_node {
+  enum cbe_isel_op op;
+  struct cbe_isel_node *kids[3];
+  struct cbe_value value;             // leaves only.
+  struct cbe_instruction *inst;       // terminators and calls only.
+  struct cbe_isel_node **arguments;   // calls only.
+  enum cbe_predicate predicate;       // compares only.
+  usz scale;                          // elemptrs only.
+  cbe_type_id type_id;
+  usz name_index; // temporary defined by this node, SIZE_MAX if none.
+  cbe_interval_id interval_id;
+  usz ip;
+  u8 need; // registers needed to evaluate the tree (Sethi-Ullman number).
+  enum cbe_register dest;
+  bool scratch; // dest was taken from the scratch pool.
+  u16 cost[CBE_ISEL_NT_COUNT];
+  u16 rule[CBE_ISEL_NT_COUNT];
+};
+
+typedef bool (*cbe_isel_cond)(struct cbe_context *, struct cbe_isel_node *);
+
+struct cbe_isel_rule {
+  cstr name;
+  enum cbe_isel_nt lhs;
+  u16 cost;
+  cbe_isel_cond cond;
+  cstr template;
+  u8 pattern[CBE_ISEL_MAX_PATTERN];
+  u8 pattern_size;
+};
+
+static bool cbe_isel_general(struct cbe_context *ctx,
+                             struct cbe_isel_node *node) {
+  return cbe_type_register_class(ctx, node->type_id) ==
+         CBE_REGISTER_CLASS_GENERAL;
+}
+
+static bool cbe_isel_vector(struct cbe_context *ctx,
+                            struct cbe_isel_node *node) {
+  return cbe_type_register_class(ctx, node->type_id) ==
+         CBE_REGISTER_CLASS_VECTOR;
+}
+
+static bool cbe_isel_scalar_float(struct cbe_context *ctx,
+                                  struct cbe_isel_node *node) {
+  return cbe_isel_vector(ctx, node) && cbe_type_size(ctx, node->type_id) <= 8;
+}
+
+static bool cbe_isel_imm32(struct cbe_context *ctx,
+                           struct cbe_isel_node *node) {
+  return cbe_isel_general(ctx, node) && node->value.integer >= INT32_MIN &&
+         node->value.integer <= INT32_MAX;
+}
+
+static bool cbe_isel_size8(struct cbe_context *ctx,
+                           struct cbe_isel_node *node) {
+  return cbe_type_size(ctx, node->type_id) == 8;
+}
+
+static bool cbe_isel_scale(struct cbe_context *ctx,
+                           struct cbe_isel_node *node) {
+  return node->scale == 1 || node->scale == 2 || node->scale == 4 ||
+         node->scale == 8;
+}
+
+static bool cbe_isel_disp32(struct cbe_context *ctx,
+                            struct cbe_isel_node *node) {
+  i64 index = node->kids[1]->value.integer;
+  return index >= INT32_MIN / 8 && index <= INT32_MAX / 8;
+}
+
+static bool cbe_isel_same_tree(struct cbe_isel_node *a,
+                               struct cbe_isel_node *b) {
+  if (a->op != b->op)
+    return false;
+  switch (a->op) {
+  case CBE_ISEL_OP_CONST:
+    return a->value.integer == b->value.integer;
+  case CBE_ISEL_OP_SLOT:
+  case CBE_ISEL_OP_GLOBAL:
+    return a->value.variable == b->value.variable;
+  case CBE_ISEL_OP_TEMP:
+  case CBE_ISEL_OP_SPILL:
+    return a->interval_id == b->interval_id;
+  case CBE_ISEL_OP_ELEMPTR:
+    return cbe_isel_same_tree(a->kids[0], b->kids[0]) &&
+           cbe_isel_same_tree(a->kids[1], b->kids[1]);
+  default:
+    return false;
+  }
+}
+
+// store p, (op (load p), x)
+static bool cbe_isel_rmw(struct cbe_context *ctx, struct cbe_isel_node *node) {
+  return cbe_isel_same_tree(node->kids[0], node->kids[1]->kids[0]->kids[0]);
+}
+
+// store p, (op x, (load p))
+static bool cbe_isel_rmw_swapped(struct cbe_context *ctx,
+                                 struct cbe_isel_node *node) {
+  return cbe_isel_same_tree(node->kids[0], node->kids[1]->kids[1]->kids[0]);
+}
+
+static bool cbe_isel_avx(struct cbe_context *ctx, struct cbe_isel_node *node) {
+  return ctx->target_features & CBE_TARGET_AVX2;
+}
+
+static bool cbe_isel_sse(struct cbe_context *ctx, struct cbe_isel_node *node) {
+  return !cbe_isel_avx(ctx, node);
+}
+
+// Float and vector operations, by the kind of value they work on.
+enum cbe_isel_kind {
+  CBE_ISEL_KIND_F32S,
+  CBE_ISEL_KIND_F64S,
+  CBE_ISEL_KIND_I32V,
+  CBE_ISEL_KIND_I64V,
+  CBE_ISEL_KIND_F32V,
+  CBE_ISEL_KIND_F64V,
+  CBE_ISEL_KIND_COUNT,
+};
+
+static enum cbe_isel_kind cbe_isel_kind(struct cbe_context *ctx,
+                                        cbe_type_id type_id) {
+  struct cbe_type type = ctx->types.items[type_id];
+  switch (type.tag) {
+  case CBE_TYPE_FLOAT:
+    return CBE_ISEL_KIND_F32S;
+  case CBE_TYPE_DOUBLE:
+    return CBE_ISEL_KIND_F64S;
+  default:
+    break;
+  }
+  switch (ctx->types.items[type.element].tag) {
+  case CBE_TYPE_INT:
+    return CBE_ISEL_KIND_I32V;
+  case CBE_TYPE_LONG:
+    return CBE_ISEL_KIND_I64V;
+  case CBE_TYPE_FLOAT:
+    return CBE_ISEL_KIND_F32V;
+  default:
+    return CBE_ISEL_KIND_F64V;
+  }
+}
+
+// Legacy SSE forms; VEX encoding adds a "v" prefix. Missing entries have no
+// single instruction (and are rejected by cbe_isel_is_supported), except
+// pmulld which SSE2 lacks and cbe_isel_legacy_mul_i32 emulates.
+static const cstr cbe_isel_mnemonics[][CBE_ISEL_KIND_COUNT] = {
+    [CBE_INST_ADD] = {"addss", "addsd", "paddd", "paddq", "addps", "addpd"},
+    [CBE_INST_SUB] = {"subss", "subsd", "psubd", "psubq", "subps", "subpd"},
+    [CBE_INST_MUL] = {"mulss", "mulsd", "pmulld", NULL, "mulps", "mulpd"},
+    [CBE_INST_DIV] = {"divss", "divsd", NULL, NULL, "divps", "divpd"},
+    [CBE_INST_AND] = {NULL, NULL, "pand", "pand", "andps", "andpd"},
+    [CBE_INST_OR] = {NULL, NULL, "por", "por", "orps", "orpd"},
+    [CBE_INST_XOR] = {NULL, NULL, "pxor", "pxor", "xorps", "xorpd"},
+};
+
+static cstr cbe_isel_mnemonic(struct cbe_context *ctx,
+                              enum cbe_instruction_tag tag,
+                              cbe_type_id type_id) {
+  if (tag >= CBE_ARRAY_LEN(cbe_isel_mnemonics))
+    return NULL;
+  return cbe_isel_mnemonics[tag][cbe_isel_kind(ctx, type_id)];
+}
+
+static bool cbe_isel_is_mul_i32(struct cbe_context *ctx,
+                                struct cbe_isel_node *node) {
+  return node->inst->tag == CBE_INST_MUL &&
+         cbe_isel_kind(ctx, node->type_id) == CBE_ISEL_KIND_I32V;
+}
+
+static bool cbe_isel_vex(struct cbe_context *ctx, struct cbe_isel_node *node) {
+  return cbe_isel_avx(ctx, node) &&
+         cbe_isel_mnemonic(ctx, node->inst->tag, node->type_id) != NULL;
+}
+
+static bool cbe_isel_legacy(struct cbe_context *ctx,
+                            struct cbe_isel_node *node) {
+  return cbe_isel_sse(ctx, node) && !cbe_isel_is_mul_i32(ctx, node) &&
+         cbe_isel_mnemonic(ctx, node->inst->tag, node->type_id) != NULL;
+}
+
+static bool cbe_isel_legacy_scalar(struct cbe_context *ctx,
+                                   struct cbe_isel_node *node) {
+  return cbe_isel_legacy(ctx, node) &&
+         ctx->types.items[node->type_id].tag != CBE_TYPE_VECTOR;
+}
+
+static bool cbe_isel_legacy_mul_i32(struct cbe_context *ctx,
+                                    struct cbe_isel_node *node) {
+  return cbe_isel_sse(ctx, node) && cbe_isel_is_mul_i32(ctx, node);
+}
+
+static bool cbe_isel_fcmp(struct cbe_context *ctx,
+                          struct cbe_isel_node *node) {
+  return node->predicate != CBE_PRED_LT && node->predicate != CBE_PRED_LE;
+}
+
+static bool cbe_isel_fcmp_swapped(struct cbe_context *ctx,
+                                  struct cbe_isel_node *node) {
+  return !cbe_isel_fcmp(ctx, node);
+}
+
+static bool cbe_isel_br_fcmp(struct cbe_context *ctx,
+                             struct cbe_isel_node *node) {
+  return cbe_isel_fcmp(ctx, node->kids[0]);
+}
+
+static bool cbe_isel_br_fcmp_swapped(struct cbe_context *ctx,
+                                     struct cbe_isel_node *node) {
+  return cbe_isel_fcmp_swapped(ctx, node->kids[0]);
+}
+
+// There is no 8-bit cmov.
+static bool cbe_isel_cmov(struct cbe_context *ctx,
+                          struct cbe_isel_node *node) {
+  return cbe_isel_general(ctx, node) && cbe_type_size(ctx, node->type_id) > 1;
+}
+
+#define OP(name) CBE_ISEL_OP_##name
+#define NT(name) (CBE_ISEL_OP_COUNT + CBE_ISEL_NT_##name)
+
+static const struct cbe_isel_rule cbe_isel_rules[] = {
+#define CBE_ISEL_RULE(name, lhs, cost, cond, template, ...)                    \
+  [CBE_ISEL_RULE_##name] = {#name,                                             \
+                            CBE_ISEL_NT_##lhs,                                 \
+                            cost,                                              \
+                            cond,                                              \
+                            template,                                          \
+                            {__VA_ARGS__},                                     \
+                            sizeof((u8[]){__VA_ARGS__})},
+#include "isel.def"
+};
+
+static const struct {
+  u16 first, last;
+} cbe_isel_groups[CBE_ISEL_OP_COUNT] = {
+#define CBE_ISEL_BEGIN(op)                                                     \
+  [CBE_ISEL_OP_##op] = {CBE_ISEL_FIRST_##op, CBE_ISEL_LAST_##op},
+#include "isel.def"
+};
+
+#undef OP
+#undef NT
+
+static struct cbe_isel_node *cbe_isel_new_node(enum cbe_isel_op op,
+                                               cbe_type_id type_id) {
+  struct cbe_isel_node *node = CBE_ALLOC(sizeof(struct cbe_isel_node));
+  *node = (struct cbe_isel_node){
+      .op = op,
+      .type_id = type_id,
+      .name_index = SIZE_MAX,
+      .interval_id = SIZE_MAX,
+      .dest = CBE_REG_NONE,
+  };
+  return node;
+}
+
+static struct cbe_isel_node *cbe_isel_leaf(struct cbe_value value) {
+  enum cbe_isel_op op = CBE_ISEL_OP_CONST;
+  switch (value.tag) {
+  case CBE_VALUE_NIL:
+    value.integer = 0;
+    break;
+  case CBE_VALUE_INTEGER:
+  case CBE_VALUE_FLOAT:
+    break;
+  case CBE_VALUE_STRING:
+    op = CBE_ISEL_OP_STR;
+    break;
+  case CBE_VALUE_VARIABLE:
+    op = CBE_ISEL_OP_VAR;
+    break;
+  }
+  struct cbe_isel_node *node = cbe_isel_new_node(op, value.type_id);
+  node->value = value;
+  node->need = 1;
+  return node;
+}
+
+static bool cbe_isel_is_pure(struct cbe_isel_node *node) {
+  switch (node->op) {
+  case CBE_ISEL_OP_LOAD:
+  case CBE_ISEL_OP_ADD:
+  case CBE_ISEL_OP_SUB:
+  case CBE_ISEL_OP_MUL:
+  case CBE_ISEL_OP_DIV:
+  case CBE_ISEL_OP_REM:
+  case CBE_ISEL_OP_AND:
+  case CBE_ISEL_OP_OR:
+  case CBE_ISEL_OP_XOR:
+  case CBE_ISEL_OP_SHL:
+  case CBE_ISEL_OP_SHR:
+  case CBE_ISEL_OP_SAR:
+  case CBE_ISEL_OP_ELEMPTR:
+  case CBE_ISEL_OP_CMP:
+  case CBE_ISEL_OP_VBIN:
+  case CBE_ISEL_OP_FCMP:
+  case CBE_ISEL_OP_VCMP:
+  case CBE_ISEL_OP_SELECT:
+  case CBE_ISEL_OP_BROADCAST:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static const enum cbe_isel_op cbe_isel_binary_ops[] = {
+    [CBE_INST_ADD] = CBE_ISEL_OP_ADD, [CBE_INST_SUB] = CBE_ISEL_OP_SUB,
+    [CBE_INST_MUL] = CBE_ISEL_OP_MUL, [CBE_INST_DIV] = CBE_ISEL_OP_DIV,
+    [CBE_INST_REM] = CBE_ISEL_OP_REM, [CBE_INST_AND] = CBE_ISEL_OP_AND,
+    [CBE_INST_OR] = CBE_ISEL_OP_OR,   [CBE_INST_XOR] = CBE_ISEL_OP_XOR,
+    [CBE_INST_SHL] = CBE_ISEL_OP_SHL, [CBE_INST_SHR] = CBE_ISEL_OP_SHR,
+    [CBE_INST_SAR] = CBE_ISEL_OP_SAR,
+};
+
+// Returns the tree for an operand. `can_fold` is cleared as soon as one
+// operand could not be folded: operands are visited last to first, and
+// folding an earlier one past it would reorder the block.
+static struct cbe_isel_node *cbe_isel_operand(struct cbe_context *ctx,
+                                              struct cbe_block *block,
+                                              struct cbe_value value,
+                                              bool *can_fold) {
+  cbe_isel_nodes *pending = &block->roots;
+  if (*can_fold && value.tag == CBE_VALUE_VARIABLE && pending->size > 0) {
+    struct cbe_isel_node *top = pending->items[pending->size - 1];
+    if (top->name_index == value.variable && cbe_isel_is_pure(top) &&
+        ctx->use_counts.items[value.variable] == 1 &&
+        top->need < ctx->scratch_pool.registers_count) {
+      pending->size--;
+      return top;
+    }
+  }
+  *can_fold = false;
+  return cbe_isel_leaf(value);
+}
+
+static u8 cbe_isel_need(struct cbe_isel_node *node) {
+  u8 need = 1;
+  if (node->kids[0] != NULL && node->kids[0]->need > need)
+    need = node->kids[0]->need;
+  for (usz i = 1; i < CBE_ARRAY_LEN(node->kids) && node->kids[i] != NULL;
+       i++) {
+    if (node->kids[i]->need == need)
+      need++;
+    else if (node->kids[i]->need > need)
+      need = node->kids[i]->need;
+  }
+  return need;
+}
+
+void cbe_isel_build_arguments(struct cbe_context *ctx,
+                              struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  for (usz i = 0; i < fn->parameters.size; i++) {
+    struct cbe_temporary *parameter = &fn->parameters.items[i];
+    struct cbe_isel_node *node =
+        cbe_isel_new_node(CBE_ISEL_OP_PARAM, parameter->type_id);
+    node->name_index = parameter->name_index;
+    node->interval_id = cbe_add_live_interval(ctx, parameter->name_index,
+                                              parameter->type_id);
+    ctx->live_intervals.items[node->interval_id].spill_weight = fn->weight;
+    parameter->interval_id = node->interval_id;
+    ctx->definitions.items[node->name_index] = node;
+  }
+  ctx->ip++;
+  pop_stack_frame(ctx);
+}
+
+// Trees are built one instruction at a time, as cbe_validate_block checks
+// them: cbe_isel_begin_block, cbe_isel_build_instruction for every
+// instruction it gets back the index of, then cbe_isel_end_block.
+void cbe_isel_begin_block(struct cbe_context *ctx, struct cbe_block *block) {
+  slice_init_with_capacity(&block->roots, block->instructions.size + 1);
+  slice_init(&block->upward_uses);
+  slice_init(&block->reloads);
+}
+
+// Builds the tree of instruction `i` of `block` and returns the index of the
+// next one to build, past the ret a tail call takes along.
+usz cbe_isel_build_instruction(struct cbe_context *ctx,
+                               struct cbe_block *block, usz i) {
+  push_stack_frame(ctx);
+  struct cbe_instruction *inst = &block->instructions.items[i];
+  struct cbe_isel_node *node = NULL;
+  bool can_fold = true;
+
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+    node = cbe_isel_new_node(CBE_ISEL_OP_ALLOC, inst->temporary.type_id);
+    (void)cbe_allocate_stack_variable(ctx, inst->temporary.name_index,
+                                      cbe_type_size(ctx, inst->alloc.type));
+    break;
+
+  case CBE_INST_STORE:
+    node = cbe_isel_new_node(CBE_ISEL_OP_STORE, inst->store.value.type_id);
+    node->kids[1] =
+        cbe_isel_operand(ctx, block, inst->store.value, &can_fold);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->store.pointer, &can_fold);
+    break;
+
+  case CBE_INST_LOAD:
+    node = cbe_isel_new_node(CBE_ISEL_OP_LOAD, inst->temporary.type_id);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->load.pointer, &can_fold);
+    break;
+
+  case CBE_INST_RET:
+    if (inst->ret.value == NULL) {
+      node = cbe_isel_new_node(CBE_ISEL_OP_RET, 0);
+      break;
+    }
+    node = cbe_isel_new_node(CBE_ISEL_OP_RETV, inst->ret.value->type_id);
+    node->kids[0] = cbe_isel_operand(ctx, block, *inst->ret.value, &can_fold);
+    break;
+
+  case CBE_INST_ADD:
+  case CBE_INST_SUB:
+  case CBE_INST_MUL:
+  case CBE_INST_DIV:
+  case CBE_INST_REM:
+  case CBE_INST_AND:
+  case CBE_INST_OR:
+  case CBE_INST_XOR:
+  case CBE_INST_SHL:
+  case CBE_INST_SHR:
+  case CBE_INST_SAR:
+    node = cbe_isel_new_node(
+        cbe_type_register_class(ctx, inst->temporary.type_id) ==
+                CBE_REGISTER_CLASS_VECTOR
+            ? CBE_ISEL_OP_VBIN
+            : cbe_isel_binary_ops[inst->tag],
+        inst->temporary.type_id);
+    node->kids[1] =
+        cbe_isel_operand(ctx, block, inst->binary.rhs, &can_fold);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->binary.lhs, &can_fold);
+    break;
+
+  case CBE_INST_ELEMPTR: {
+    node = cbe_isel_new_node(CBE_ISEL_OP_ELEMPTR, inst->temporary.type_id);
+    struct cbe_type type = ctx->types.items[inst->temporary.type_id];
+    node->scale = type.tag == CBE_TYPE_PTR ? cbe_type_size(ctx, type.ptr) : 1;
+    node->kids[1] =
+        cbe_isel_operand(ctx, block, inst->elemptr.index, &can_fold);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->elemptr.pointer, &can_fold);
+  } break;
+
+  case CBE_INST_CMP: {
+    struct cbe_type type = ctx->types.items[inst->cmp.lhs.type_id];
+    enum cbe_isel_op op = type.tag == CBE_TYPE_VECTOR ? CBE_ISEL_OP_VCMP
+                          : type.tag == CBE_TYPE_FLOAT ||
+                                  type.tag == CBE_TYPE_DOUBLE
+                              ? CBE_ISEL_OP_FCMP
+                              : CBE_ISEL_OP_CMP;
+    node = cbe_isel_new_node(op, inst->temporary.type_id);
+    node->predicate = inst->cmp.predicate;
+    node->kids[1] = cbe_isel_operand(ctx, block, inst->cmp.rhs, &can_fold);
+    node->kids[0] = cbe_isel_operand(ctx, block, inst->cmp.lhs, &can_fold);
+  } break;
+
+  case CBE_INST_SELECT:
+    node = cbe_isel_new_node(CBE_ISEL_OP_SELECT, inst->temporary.type_id);
+    node->kids[2] =
+        cbe_isel_operand(ctx, block, inst->select.else_value, &can_fold);
+    node->kids[1] =
+        cbe_isel_operand(ctx, block, inst->select.then_value, &can_fold);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->select.condition, &can_fold);
+    break;
+
+  case CBE_INST_BROADCAST:
+    node =
+        cbe_isel_new_node(CBE_ISEL_OP_BROADCAST, inst->temporary.type_id);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->broadcast.value, &can_fold);
+    break;
+
+  case CBE_INST_BR:
+    node = cbe_isel_new_node(CBE_ISEL_OP_BR, inst->br.condition.type_id);
+    node->kids[0] =
+        cbe_isel_operand(ctx, block, inst->br.condition, &can_fold);
+    break;
+
+  case CBE_INST_JMP:
+    node = cbe_isel_new_node(CBE_ISEL_OP_JMP, 0);
+    break;
+
+  case CBE_INST_CALL: {
+    node = cbe_isel_new_node(CBE_ISEL_OP_CALL, inst->has_temporary
+                                                   ? inst->temporary.type_id
+                                                   : 0);
+    usz count = inst->call.arguments.size, vectors = 0;
+    node->arguments = CBE_ALLOC(sizeof(struct cbe_isel_node *) * (count + 1));
+    for (usz j = 0; j < count; j++) {
+      node->arguments[j] = cbe_isel_leaf(inst->call.arguments.items[j]);
+      vectors += cbe_isel_vector(ctx, node->arguments[j]);
+    }
+    CBE_ASSERT(*ctx, count - vectors <= CBE_ARGUMENT_REGISTERS &&
+                         vectors <= CBE_VECTOR_ARGUMENT_REGISTERS);
+    // A call whose value, if any, is returned right away becomes a jump,
+    // and the ret goes with it.
+    struct cbe_instruction *next =
+        i + 1 < block->instructions.size ? inst + 1 : NULL;
+    if (ctx->current_function->tail_calls && next != NULL &&
+        next->tag == CBE_INST_RET &&
+        (next->ret.value == NULL ||
+         (inst->has_temporary && next->ret.value->tag == CBE_VALUE_VARIABLE &&
+          next->ret.value->variable == inst->temporary.name_index))) {
+      node->op = CBE_ISEL_OP_TAILCALL;
+      node->type_id = 0;
+      i++;
+    }
+  } break;
+  }
+
+  node->inst = inst;
+  node->need = cbe_isel_need(node);
+  if (inst->has_temporary && node->op != CBE_ISEL_OP_TAILCALL) {
+    node->name_index = inst->temporary.name_index;
+    ctx->definitions.items[node->name_index] = node;
+  }
+  slice_push(&block->roots, node);
+  pop_stack_frame(ctx);
+  return i + 1;
+}
+
+// Whatever was not folded is a root; number them and open an interval for
+// every value they define.
+void cbe_isel_end_block(struct cbe_context *ctx, struct cbe_block *block) {
+  push_stack_frame(ctx);
+  block->first_ip = ctx->ip;
+  for (usz i = 0; i < block->roots.size; i++) {
+    struct cbe_isel_node *root = block->roots.items[i];
+    root->ip = ctx->ip;
+    if (root->op == CBE_ISEL_OP_CALL)
+      slice_push(&ctx->call_points, root->ip);
+    if (root->name_index != SIZE_MAX && root->op != CBE_ISEL_OP_ALLOC) {
+      root->interval_id =
+          cbe_add_live_interval(ctx, root->name_index, root->type_id);
+      ctx->live_intervals.items[root->interval_id].spill_weight =
+          block->weight;
+    }
+    ctx->ip++;
+  }
+  block->last_ip = ctx->ip - 1;
+  pop_stack_frame(ctx);
+}
+
+static usz cbe_isel_kid_count(struct cbe_isel_node *node) {
+  return cbe_isel_arity[node->op];
+}
+
+// Folded nodes are evaluated where their root is, so every temporary read
+// anywhere in the tree has to stay live until the root's ip. Reads of values
+// defined in other blocks are left to cbe_validate_function's liveness.
+static void cbe_isel_resolve(struct cbe_context *ctx, struct cbe_block *block,
+                             struct cbe_isel_node *node, usz ip) {
+  node->ip = ip;
+  for (usz i = 0; i < cbe_isel_kid_count(node); i++)
+    cbe_isel_resolve(ctx, block, node->kids[i], ip);
+  if (node->op == CBE_ISEL_OP_CALL || node->op == CBE_ISEL_OP_TAILCALL) {
+    for (usz i = 0; i < node->inst->call.arguments.size; i++)
+      cbe_isel_resolve(ctx, block, node->arguments[i], ip);
+  }
+
+  if (node->op != CBE_ISEL_OP_VAR)
+    return;
+  struct cbe_isel_node *definition =
+      ctx->definitions.items[node->value.variable];
+  if (definition == NULL) {
+    CBE_ASSERT(*ctx, cbe_find_global_variable(ctx, node->value.variable) !=
+                         SIZE_MAX);
+    node->op = CBE_ISEL_OP_GLOBAL;
+    return;
+  }
+  if (definition->op == CBE_ISEL_OP_ALLOC) {
+    node->op = CBE_ISEL_OP_SLOT;
+    return;
+  }
+  node->op = CBE_ISEL_OP_TEMP;
+  node->interval_id = definition->interval_id;
+  CBE_ASSERT(*ctx, node->interval_id != SIZE_MAX);
+  ctx->live_intervals.items[node->interval_id].spill_weight += block->weight;
+  if (definition->ip >= block->first_ip && definition->ip <= block->last_ip &&
+      definition->op != CBE_ISEL_OP_PARAM)
+    cbe_extend_live_interval(ctx, node->interval_id, ip);
+  else
+    slice_push(&block->upward_uses,
+               (struct cbe_live_use){node->interval_id, ip});
+}
+
+void cbe_isel_resolve_block(struct cbe_context *ctx, struct cbe_block *block) {
+  push_stack_frame(ctx);
+  for (usz i = 0; i < block->roots.size; i++) {
+    struct cbe_isel_node *root = block->roots.items[i];
+    cbe_isel_resolve(ctx, block, root, root->ip);
+  }
+  pop_stack_frame(ctx);
+}
+
+// Integer arithmetic on constants, which can be folded into one.
+static bool cbe_isel_is_constant(struct cbe_context *ctx,
+                                 struct cbe_isel_node *node) {
+  switch (node->op) {
+  case CBE_ISEL_OP_CONST:
+    return node->value.tag != CBE_VALUE_FLOAT && cbe_isel_general(ctx, node);
+  case CBE_ISEL_OP_ADD:
+  case CBE_ISEL_OP_SUB:
+  case CBE_ISEL_OP_MUL:
+  case CBE_ISEL_OP_AND:
+  case CBE_ISEL_OP_OR:
+  case CBE_ISEL_OP_XOR:
+  case CBE_ISEL_OP_SHL:
+  case CBE_ISEL_OP_SHR:
+  case CBE_ISEL_OP_SAR:
+    return cbe_isel_is_constant(ctx, node->kids[0]) &&
+           cbe_isel_is_constant(ctx, node->kids[1]);
+  default:
+    return false;
+  }
+}
+
+// `value` cut down to `size` bytes and sign extended again.
+static i64 cbe_isel_truncate(i64 value, usz size) {
+  if (size >= 8)
+    return value;
+  u32 shift = 64 - 8 * size;
+  return (i64)((u64)value << shift) >> shift;
+}
+
+// The value of a constant tree, computed the way the instructions would.
+static i64 cbe_isel_fold(struct cbe_context *ctx, struct cbe_isel_node *node) {
+  if (node->op == CBE_ISEL_OP_CONST)
+    return node->value.integer;
+  usz size = cbe_type_size(ctx, node->type_id);
+  u64 lhs = cbe_isel_fold(ctx, node->kids[0]);
+  u64 rhs = cbe_isel_fold(ctx, node->kids[1]);
+  u32 count = rhs & (size == 8 ? 63 : 31);
+  u64 mask = size >= 8 ? UINT64_MAX : (1ull << (8 * size)) - 1;
+  u64 value = 0;
+  switch (node->op) {
+  case CBE_ISEL_OP_ADD:
+    value = lhs + rhs;
+    break;
+  case CBE_ISEL_OP_SUB:
+    value = lhs - rhs;
+    break;
+  case CBE_ISEL_OP_MUL:
+    value = lhs * rhs;
+    break;
+  case CBE_ISEL_OP_AND:
+    value = lhs & rhs;
+    break;
+  case CBE_ISEL_OP_OR:
+    value = lhs | rhs;
+    break;
+  case CBE_ISEL_OP_XOR:
+    value = lhs ^ rhs;
+    break;
+  case CBE_ISEL_OP_SHL:
+    value = lhs << count;
+    break;
+  case CBE_ISEL_OP_SHR:
+    value = (lhs & mask) >> count;
+    break;
+  default:
+    value = (u64)(cbe_isel_truncate(lhs, size) >> count);
+    break;
+  }
+  return cbe_isel_truncate(value, size);
+}
+
+// Whether `root` gives the same value wherever it is evaluated, at about the
+// cost of loading it from a slot: a constant expression, the address of a
+// stack slot element or a constant broadcast into every lane. Constant
+// expressions are mostly left behind by inlining constant arguments.
+static bool cbe_isel_is_rematerializable(struct cbe_context *ctx,
+                                         struct cbe_isel_node *root) {
+  switch (root->op) {
+  case CBE_ISEL_OP_ELEMPTR:
+    return root->kids[0]->op == CBE_ISEL_OP_SLOT &&
+           root->kids[1]->op == CBE_ISEL_OP_CONST;
+  case CBE_ISEL_OP_BROADCAST:
+    return root->kids[0]->op == CBE_ISEL_OP_CONST;
+  default:
+    return cbe_isel_is_constant(ctx, root);
+  }
+}
+
+// Instructions that copy their first operand into the destination before
+// anything else writes it, so that the two can share a register.
+static bool cbe_isel_is_two_address(struct cbe_isel_node *root) {
+  switch (root->op) {
+  case CBE_ISEL_OP_ADD:
+  case CBE_ISEL_OP_SUB:
+  case CBE_ISEL_OP_MUL:
+  case CBE_ISEL_OP_AND:
+  case CBE_ISEL_OP_OR:
+  case CBE_ISEL_OP_XOR:
+  case CBE_ISEL_OP_SHL:
+  case CBE_ISEL_OP_SHR:
+  case CBE_ISEL_OP_SAR:
+    return root->kids[0]->op == CBE_ISEL_OP_TEMP;
+  default:
+    return false;
+  }
+}
+
+// Records `root` as a use of every temporary read in the tree under `node`.
+// With `check` set, rematerializations that would need more scratch
+// registers than the tree can spare are called off instead.
+static void cbe_isel_annotate_uses(struct cbe_context *ctx,
+                                   struct cbe_isel_node *root,
+                                   struct cbe_isel_node *node, bool check) {
+  for (usz i = 0; i < cbe_isel_arity[node->op]; i++)
+    cbe_isel_annotate_uses(ctx, root, node->kids[i], check);
+  if (node->op == CBE_ISEL_OP_CALL || node->op == CBE_ISEL_OP_TAILCALL) {
+    for (usz i = 0; i < node->inst->call.arguments.size; i++)
+      cbe_isel_annotate_uses(ctx, root, node->arguments[i], check);
+  }
+  if (node->op != CBE_ISEL_OP_TEMP)
+    return;
+  struct cbe_live_interval *interval =
+      &ctx->live_intervals.items[node->interval_id];
+  if (!check) {
+    slice_push(&interval->uses, (int)root->ip);
+  } else if (interval->remat != NULL &&
+             !cbe_isel_is_constant(ctx, interval->remat) &&
+             root->need + interval->remat->need >
+                 ctx->scratch_pool.registers_count) {
+    interval->remat = NULL;
+  }
+}
+
+// Tells the allocator where every interval is used and, with CBE_OPT_SPLIT,
+// whether it can be recomputed instead of spilled and which operand's
+// register it can take over.
+void cbe_isel_annotate_intervals(struct cbe_context *ctx,
+                                 struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  bool split = ctx->options & CBE_OPT_SPLIT;
+  for (usz i = 0; i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    for (usz j = 0; j < block->roots.size; j++) {
+      struct cbe_isel_node *root = block->roots.items[j];
+      cbe_isel_annotate_uses(ctx, root, root, false);
+      if (root->interval_id == SIZE_MAX)
+        continue;
+      struct cbe_live_interval *interval =
+          &ctx->live_intervals.items[root->interval_id];
+      interval->definition = (int)root->ip;
+      if (split && cbe_isel_is_rematerializable(ctx, root))
+        interval->remat = root;
+      if (split && cbe_isel_general(ctx, root) &&
+          cbe_isel_is_two_address(root))
+        interval->hint = root->kids[0]->interval_id;
+    }
+  }
+  for (usz i = 0; split && i < fn->blocks.size; i++) {
+    struct cbe_block *block = &fn->blocks.items[i];
+    for (usz j = 0; j < block->roots.size; j++)
+      cbe_isel_annotate_uses(ctx, block->roots.items[j],
+                             block->roots.items[j], true);
+  }
+  pop_stack_frame(ctx);
+}
+
+struct cbe_isel_leaf {
+  struct cbe_isel_node *node;
+  enum cbe_isel_nt nt;
+};
+
+static bool cbe_isel_match(struct cbe_isel_node *node,
+                           const struct cbe_isel_rule *rule, usz *pos,
+                           u32 *cost, struct cbe_isel_leaf *leaves,
+                           usz *leaf_count) {
+  u8 token = rule->pattern[(*pos)++];
+  if (token >= CBE_ISEL_OP_COUNT) {
+    enum cbe_isel_nt nt = token - CBE_ISEL_OP_COUNT;
+    if (node->cost[nt] == CBE_ISEL_NO_COST)
+      return false;
+    *cost += node->cost[nt];
+    leaves[(*leaf_count)++] = (struct cbe_isel_leaf){node, nt};
+    return true;
+  }
+
+  if (node->op != token)
+    return false;
+  for (usz i = 0; i < cbe_isel_arity[token]; i++) {
+    if (!cbe_isel_match(node->kids[i], rule, pos, cost, leaves, leaf_count))
+      return false;
+  }
+  return true;
+}
+
+static void cbe_isel_label(struct cbe_context *ctx,
+                           struct cbe_isel_node *node) {
+  for (usz i = 0; i < cbe_isel_arity[node->op]; i++)
+    cbe_isel_label(ctx, node->kids[i]);
+  if (node->op == CBE_ISEL_OP_CALL || node->op == CBE_ISEL_OP_TAILCALL) {
+    for (usz i = 0; i < node->inst->call.arguments.size; i++)
+      cbe_isel_label(ctx, node->arguments[i]);
+  }
+
+  for (usz nt = 0; nt < CBE_ISEL_NT_COUNT; nt++)
+    node->cost[nt] = CBE_ISEL_NO_COST;
+
+  struct cbe_isel_leaf leaves[CBE_ISEL_MAX_LEAVES];
+  for (usz r = cbe_isel_groups[node->op].first;
+       r < cbe_isel_groups[node->op].last; r++) {
+    const struct cbe_isel_rule *rule = &cbe_isel_rules[r];
+    usz pos = 0, leaf_count = 0;
+    u32 cost = rule->cost;
+    if (!cbe_isel_match(node, rule, &pos, &cost, leaves, &leaf_count))
+      continue;
+    if (rule->cond != NULL && !rule->cond(ctx, node))
+      continue;
+    if (cost < node->cost[rule->lhs]) {
+      node->cost[rule->lhs] = cost;
+      node->rule[rule->lhs] = r;
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (usz r = cbe_isel_groups[CBE_ISEL_OP_CHAIN].first;
+         r < cbe_isel_groups[CBE_ISEL_OP_CHAIN].last; r++) {
+      const struct cbe_isel_rule *rule = &cbe_isel_rules[r];
+      enum cbe_isel_nt from = rule->pattern[0] - CBE_ISEL_OP_COUNT;
+      if (node->cost[from] == CBE_ISEL_NO_COST)
+        continue;
+      u32 cost = (u32)node->cost[from] + rule->cost;
+      if (cost < node->cost[rule->lhs]) {
+        node->cost[rule->lhs] = cost;
+        node->rule[rule->lhs] = r;
+        changed = true;
+      }
+    }
+  }
+}
+
+struct cbe_isel_state {
+  struct cbe_context *ctx;
+  FILE *fp;
+  struct cbe_register_pool scratch;
+  struct cbe_register_pool vector_scratch;
+};
+
+static struct cbe_register_pool *
+cbe_isel_scratch_pool(struct cbe_isel_state *state, enum cbe_register reg) {
+  return cbe_get_register_class(reg) == CBE_REGISTER_CLASS_VECTOR
+             ? &state->vector_scratch
+             : &state->scratch;
+}
+
+cstr cbe_isel_size_name(usz size) {
+  switch (size) {
+  case 1:
+    return "byte";
+  case 2:
+    return "word";
+  case 4:
+    return "dword";
+  case 16:
+    return "xmmword";
+  case 32:
+    return "ymmword";
+  default:
+    return "qword";
+  }
+}
+
+// Moves of a float or vector between registers (`memory` false) or to and from
+// memory, which is not assumed to be aligned.
+cstr cbe_isel_move(struct cbe_context *ctx, cbe_type_id type_id, bool memory) {
+  static const cstr moves[][2][CBE_ISEL_KIND_COUNT] = {
+      {{"movaps", "movaps", "movaps", "movaps", "movaps", "movaps"},
+       {"movss", "movsd", "movdqu", "movdqu", "movups", "movupd"}},
+      {{"vmovaps", "vmovaps", "vmovaps", "vmovaps", "vmovaps", "vmovaps"},
+       {"vmovss", "vmovsd", "vmovdqu", "vmovdqu", "vmovups", "vmovupd"}},
+  };
+  bool avx = ctx->target_features & CBE_TARGET_AVX2;
+  return moves[avx][memory][cbe_isel_kind(ctx, type_id)];
+}
+
+// Whether instruction selection can cover `inst`: the float and vector
+// operations without an instruction of their own are turned away here.
+bool cbe_isel_is_supported(struct cbe_context *ctx,
+                           struct cbe_instruction *inst) {
+  bool avx = ctx->target_features & CBE_TARGET_AVX2;
+  switch (inst->tag) {
+  case CBE_INST_ADD:
+  case CBE_INST_SUB:
+  case CBE_INST_MUL:
+  case CBE_INST_DIV:
+  case CBE_INST_REM:
+  case CBE_INST_AND:
+  case CBE_INST_OR:
+  case CBE_INST_XOR:
+  case CBE_INST_SHL:
+  case CBE_INST_SHR:
+  case CBE_INST_SAR:
+    return cbe_type_register_class(ctx, inst->temporary.type_id) ==
+               CBE_REGISTER_CLASS_GENERAL ||
+           cbe_isel_mnemonic(ctx, inst->tag, inst->temporary.type_id) != NULL;
+
+  case CBE_INST_CMP: {
+    cbe_type_id type_id = inst->cmp.lhs.type_id;
+    if (cbe_type_register_class(ctx, type_id) == CBE_REGISTER_CLASS_GENERAL)
+      return true;
+    // Floats are ordered, and integer lanes are compared as signed; 64-bit
+    // lanes need pcmpeqq and pcmpgtq.
+    if (inst->cmp.predicate >= CBE_PRED_ULT)
+      return false;
+    return cbe_isel_kind(ctx, type_id) != CBE_ISEL_KIND_I64V || avx;
+  }
+
+  case CBE_INST_SELECT: {
+    enum cbe_register_class condition =
+        cbe_type_register_class(ctx, inst->select.condition.type_id);
+    if (condition != cbe_type_register_class(ctx, inst->temporary.type_id))
+      return false;
+    return condition == CBE_REGISTER_CLASS_VECTOR
+               ? ctx->types.items[inst->temporary.type_id].tag ==
+                     CBE_TYPE_VECTOR
+               : cbe_type_size(ctx, inst->temporary.type_id) > 1;
+  }
+
+  case CBE_INST_BROADCAST: {
+    struct cbe_type type = ctx->types.items[inst->temporary.type_id];
+    return type.tag == CBE_TYPE_VECTOR &&
+           ctx->types.items[type.element].tag ==
+               ctx->types.items[inst->broadcast.value.type_id].tag;
+  }
+
+  default:
+    return true;
+  }
+}
+
+static const cstr cbe_isel_condition_codes[] = {
+    [CBE_PRED_EQ] = "e",   [CBE_PRED_NE] = "ne",  [CBE_PRED_LT] = "l",
+    [CBE_PRED_LE] = "le",  [CBE_PRED_GT] = "g",   [CBE_PRED_GE] = "ge",
+    [CBE_PRED_ULT] = "b",  [CBE_PRED_ULE] = "be", [CBE_PRED_UGT] = "a",
+    [CBE_PRED_UGE] = "ae",
+};
+
+// After ucomis, with less-than compares written with swapped operands.
+static const cstr cbe_isel_float_condition_codes[] = {
+    [CBE_PRED_EQ] = "e",  [CBE_PRED_NE] = "ne", [CBE_PRED_LT] = "a",
+    [CBE_PRED_LE] = "ae", [CBE_PRED_GT] = "a",  [CBE_PRED_GE] = "ae",
+};
+
+static const cstr cbe_isel_inverse_condition_codes[][2] = {
+    {"e", "ne"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"},
+};
+
+static cstr cbe_isel_condition_code(struct cbe_isel_node *compare) {
+  if (compare->op == CBE_ISEL_OP_FCMP)
+    return cbe_isel_float_condition_codes[compare->predicate];
+  return cbe_isel_condition_codes[compare->predicate];
+}
+
+static cstr cbe_isel_inverse_condition_code(cstr code) {
+  for (usz i = 0; i < CBE_ARRAY_LEN(cbe_isel_inverse_condition_codes); i++) {
+    for (usz j = 0; j < 2; j++) {
+      if (strcmp(code, cbe_isel_inverse_condition_codes[i][j]) == 0)
+        return cbe_isel_inverse_condition_codes[i][!j];
+    }
+  }
+  return code;
+}
+
+static enum cbe_register cbe_isel_dest(struct cbe_isel_state *state,
+                                       struct cbe_isel_node *node) {
+  if (node->dest == CBE_REG_NONE) {
+    node->dest = cbe_get_register(
+        cbe_isel_vector(state->ctx, node) ? &state->vector_scratch
+                                          : &state->scratch);
+    node->scratch = true;
+    CBE_ASSERT(*state->ctx, node->dest != CBE_REG_ERROR);
+  }
+  return node->dest;
+}
+
+// The scratch register the result of `rule` can take over from one of its
+// `held` operands, or CBE_REG_NONE. Sethi-Ullman numbers count on that, but
+// operands spilled after the tree was built hold registers of their own. The
+// template has to write the result with its first instruction without
+// reading it there, and read the operand nowhere after.
+static enum cbe_register cbe_isel_reuse(const struct cbe_isel_rule *rule,
+                                        const u64 *held, usz leaf_count) {
+  cstr end = strchr(rule->template, '\n');
+  cstr operands = strchr(rule->template, ' ');
+  if (end == NULL || operands == NULL || operands > end ||
+      strncmp(operands, " %c, ", 5) != 0)
+    return CBE_REG_NONE;
+  operands += 5;
+  for (cstr c = operands; c < end; c++) {
+    if (c[0] == '%' && c[1] == 'c')
+      return CBE_REG_NONE;
+  }
+  for (cstr c = operands; c < end; c++) {
+    if (c[0] != '%' || c[1] < '0' || c[1] > '9')
+      continue;
+    usz i = c[1] - '0';
+    char operand[3] = {'%', c[1], '\0'};
+    if (i < leaf_count && held[i] != 0 && (held[i] & (held[i] - 1)) == 0 &&
+        strstr(end, operand) == NULL)
+      return (enum cbe_register)__builtin_ctzll(held[i]);
+  }
+  return CBE_REG_NONE;
+}
+
+// Writes the expanded lines of `text` to the output, dropping moves of a
+// register to itself. Labels are not indented.
+static void cbe_isel_emit(struct cbe_isel_state *state, char *text) {
+  for (char *line = text; *line != '\0';) {
+    char *end = strchr(line, '\n');
+    if (end == NULL)
+      end = line + strlen(line);
+    int length = (int)(end - line);
+    char *comma = memchr(line, ',', length);
+    char *space = memchr(line, ' ', length);
+    int mnemonic = space != NULL ? (int)(space - line) : length;
+    bool move = (mnemonic == 3 && strncmp(line, "mov", 3) == 0) ||
+                (mnemonic == 6 && strncmp(line, "movaps", 6) == 0) ||
+                (mnemonic == 7 && strncmp(line, "vmovaps", 7) == 0);
+    int first = mnemonic + 1;
+    bool redundant =
+        move && comma != NULL && comma - line - first == end - comma - 2 &&
+        strncmp(line + first, comma + 2, comma - line - first) == 0;
+    if (length > 0 && line[length - 1] == ':')
+      cbe_emit(state->ctx, state->fp, "%.*s\n", length, line);
+    else if (length > 0 && !redundant)
+      cbe_emit(state->ctx, state->fp, "  %.*s\n", length, line);
+    line = *end == '\0' ? end : end + 1;
+  }
+}
+
+static int cbe_isel_label_name(struct cbe_context *ctx, char *buffer,
+                               usz size, usz block) {
+  return snprintf(buffer, size, ".L%s.%s",
+                  ctx->symbol_table.items[ctx->current_function->name_index],
+                  ctx->symbol_table.items[block]);
+}
+
+// Expands a br that also counts which way it went. The taken side goes
+// through a counting stub placed right after the not-taken side:
+//
+//   j<cc> .L<fn>.<block>.taken
+//   inc <else counter>
+//   jmp <else>
+//   .L<fn>.<block>.taken:
+//   inc <then counter>
+//   jmp <then>
+static int cbe_isel_instrumented_jumps(struct cbe_isel_state *state,
+                                       struct cbe_isel_node *node, cstr code,
+                                       char *buffer, usz size) {
+  struct cbe_context *ctx = state->ctx;
+  usz block = ctx->current_block;
+  char taken[CBE_ISEL_MAX_OPERAND], label[CBE_ISEL_MAX_OPERAND];
+  char counter[CBE_ISEL_MAX_OPERAND];
+  cbe_isel_label_name(ctx, taken, sizeof(taken), block);
+  int length = snprintf(buffer, size, "j%s %s.taken\n", code, taken);
+
+  cbe_format_profile_counter(ctx, counter, sizeof(counter), block, 2);
+  cbe_isel_label_name(ctx, label, sizeof(label), node->inst->br.else_block);
+  length += snprintf(&buffer[length], size - length,
+                     "inc qword ptr %s\njmp %s\n", counter, label);
+
+  cbe_format_profile_counter(ctx, counter, sizeof(counter), block, 1);
+  length += snprintf(&buffer[length], size - length,
+                     "%s.taken:\ninc qword ptr %s\n", taken, counter);
+  if (node->inst->br.then_block != ctx->next_block) {
+    cbe_isel_label_name(ctx, label, sizeof(label), node->inst->br.then_block);
+    length += snprintf(&buffer[length], size - length, "jmp %s\n", label);
+  }
+  return length;
+}
+
+// Expands the jumps of a br or jmp, leaving out a jump to the block that is
+// laid out right after this one.
+static int cbe_isel_jumps(struct cbe_isel_state *state,
+                          struct cbe_isel_node *node,
+                          const struct cbe_isel_rule *rule, char *buffer,
+                          usz size) {
+  struct cbe_context *ctx = state->ctx;
+  char label[CBE_ISEL_MAX_OPERAND];
+  if (node->op == CBE_ISEL_OP_JMP) {
+    if (node->inst->jmp.block == ctx->next_block)
+      return 0;
+    cbe_isel_label_name(ctx, label, sizeof(label), node->inst->jmp.block);
+    return snprintf(buffer, size, "jmp %s\n", label);
+  }
+
+  cstr code = "ne"; // test x, x
+  if (rule->pattern[1] == CBE_ISEL_OP_CMP ||
+      rule->pattern[1] == CBE_ISEL_OP_FCMP)
+    code = cbe_isel_condition_code(node->kids[0]);
+  usz then_block = node->inst->br.then_block;
+  usz else_block = node->inst->br.else_block;
+  if (ctx->options & CBE_OPT_INSTRUMENT)
+    return cbe_isel_instrumented_jumps(state, node, code, buffer, size);
+  if (then_block == ctx->next_block) {
+    then_block = else_block;
+    else_block = ctx->next_block;
+    code = cbe_isel_inverse_condition_code(code);
+  }
+
+  int length = 0;
+  cbe_isel_label_name(ctx, label, sizeof(label), then_block);
+  length += snprintf(buffer, size, "j%s %s\n", code, label);
+  if (else_block != ctx->next_block) {
+    cbe_isel_label_name(ctx, label, sizeof(label), else_block);
+    length += snprintf(&buffer[length], size - length, "jmp %s\n", label);
+  }
+  return length;
+}
+
+static u64 cbe_isel_reduce(struct cbe_isel_state *, struct cbe_isel_node *,
+                           enum cbe_isel_nt, char *);
+
+// Expands the argument moves and the call itself. Registers and spill slots
+// are moved into the argument registers, everything else is evaluated
+// straight into them. Floats and vectors go in xmm0-xmm7.
+static int cbe_isel_call(struct cbe_isel_state *state,
+                         struct cbe_isel_node *node, char *buffer, usz size) {
+  struct cbe_context *ctx = state->ctx;
+  int length = 0;
+  usz general = 0, vector = 0;
+  bool wide = false;
+  for (usz i = 0; i < node->inst->call.arguments.size; i++) {
+    struct cbe_isel_node *argument = node->arguments[i];
+    bool is_vector = cbe_isel_vector(ctx, argument);
+    usz argument_size = cbe_type_size(ctx, argument->type_id);
+    enum cbe_register reg = is_vector
+                                ? cbe_get_vector_argument_register(vector++)
+                                : cbe_get_argument_register(general++);
+    char operand[CBE_ISEL_MAX_OPERAND];
+    wide |= argument_size == 32;
+    if (argument->op == CBE_ISEL_OP_TEMP || argument->op == CBE_ISEL_OP_SPILL) {
+      (void)cbe_isel_reduce(state, argument,
+                            is_vector ? CBE_ISEL_NT_xrm : CBE_ISEL_NT_rmi,
+                            operand);
+      cstr move = !is_vector ? "mov"
+                  : cbe_isel_move(ctx, argument->type_id,
+                                  argument->op == CBE_ISEL_OP_SPILL);
+      length += snprintf(&buffer[length], size - length, "%s %s, %s\n", move,
+                         cbe_get_register_name_sized(reg, argument_size),
+                         operand);
+    } else {
+      argument->dest = reg;
+      (void)cbe_isel_reduce(state, argument,
+                            is_vector ? CBE_ISEL_NT_xmm : CBE_ISEL_NT_reg,
+                            operand);
+    }
+  }
+  if ((ctx->target_features & CBE_TARGET_AVX2) && !wide)
+    length += snprintf(&buffer[length], size - length, "vzeroupper\n");
+  // Tail calls jump once %R has left the frame.
+  if (node->op == CBE_ISEL_OP_CALL)
+    length += snprintf(&buffer[length], size - length, "call %s\n",
+                       ctx->symbol_table.items[node->inst->call.function]);
+  return length;
+}
+
+// A lanewise compare of operands `lhs` and `rhs` into `dest`. Integers only
+// have equal and greater-than compares and floats no greater-than, so the
+// other predicates swap the operands or negate the result.
+static int cbe_isel_vector_compare(struct cbe_isel_state *state,
+                                   struct cbe_isel_node *node, cstr lhs,
+                                   cstr rhs, char *buffer, usz size) {
+  struct cbe_context *ctx = state->ctx;
+  enum cbe_isel_kind kind = cbe_isel_kind(ctx, node->kids[0]->type_id);
+  usz width = cbe_type_size(ctx, node->type_id);
+  cstr dest = cbe_get_register_name_sized(cbe_isel_dest(state, node), width);
+  cstr temporary = cbe_get_register_name_sized(CBE_REG_XMM15, width);
+  bool avx = ctx->target_features & CBE_TARGET_AVX2;
+  enum cbe_predicate predicate = node->predicate;
+  if (predicate == CBE_PRED_GT || predicate == CBE_PRED_GE) {
+    cstr swap = lhs;
+    lhs = rhs;
+    rhs = swap;
+    predicate = predicate == CBE_PRED_GT ? CBE_PRED_LT : CBE_PRED_LE;
+  }
+
+  if (kind == CBE_ISEL_KIND_F32V || kind == CBE_ISEL_KIND_F64V) {
+    static const int immediates[] = {
+        [CBE_PRED_EQ] = 0, [CBE_PRED_LT] = 1, [CBE_PRED_LE] = 2,
+        [CBE_PRED_NE] = 4};
+    cstr suffix = kind == CBE_ISEL_KIND_F32V ? "s" : "d";
+    if (avx)
+      return snprintf(buffer, size, "vcmpp%s %s, %s, %s, %d\n", suffix, dest,
+                      lhs, rhs, immediates[predicate]);
+    return snprintf(buffer, size, "movaps %s, %s\ncmpp%s %s, %s, %d\n", dest,
+                    lhs, suffix, dest, rhs, immediates[predicate]);
+  }
+
+  // a < b is b > a, a <= b is !(a > b) and a != b is !(a == b).
+  cstr lanes = kind == CBE_ISEL_KIND_I32V ? "d" : "q";
+  cstr compare = predicate == CBE_PRED_EQ || predicate == CBE_PRED_NE ? "eq"
+                                                                        : "gt";
+  bool negate = predicate == CBE_PRED_NE || predicate == CBE_PRED_LE;
+  if (predicate == CBE_PRED_LT) {
+    cstr swap = lhs;
+    lhs = rhs;
+    rhs = swap;
+  }
+  int length;
+  if (avx)
+    length = snprintf(buffer, size, "vpcmp%s%s %s, %s, %s\n", compare, lanes,
+                      dest, lhs, rhs);
+  else
+    length = snprintf(buffer, size, "movdqa %s, %s\npcmp%s%s %s, %s\n", dest,
+                      lhs, compare, lanes, dest, rhs);
+  if (!negate)
+    return length;
+  if (avx)
+    return length + snprintf(&buffer[length], size - length,
+                              "vpcmpeqd %s, %s, %s\nvpxor %s, %s, %s\n",
+                              temporary, temporary, temporary, dest, dest,
+                              temporary);
+  return length + snprintf(&buffer[length], size - length,
+                           "pcmpeqd %s, %s\npxor %s, %s\n", temporary,
+                           temporary, dest, temporary);
+}
+
+// Copies the scalar `value` into every lane of `dest`, from a general purpose
+// register for integers and from an xmm register for floats.
+static int cbe_isel_broadcast(struct cbe_isel_state *state,
+                              struct cbe_isel_node *node, cstr value,
+                              char *buffer, usz size) {
+  struct cbe_context *ctx = state->ctx;
+  enum cbe_register reg = cbe_isel_dest(state, node);
+  cstr dest =
+      cbe_get_register_name_sized(reg, cbe_type_size(ctx, node->type_id));
+  cstr low = cbe_get_register_name_sized(reg, 16);
+  bool avx = ctx->target_features & CBE_TARGET_AVX2;
+  switch (cbe_isel_kind(ctx, node->type_id)) {
+  case CBE_ISEL_KIND_I32V:
+    return avx ? snprintf(buffer, size, "vmovd %s, %s\nvpbroadcastd %s, %s\n",
+                          low, value, dest, low)
+               : snprintf(buffer, size, "movd %s, %s\npshufd %s, %s, 0\n",
+                          low, value, dest, dest);
+  case CBE_ISEL_KIND_I64V:
+    return avx ? snprintf(buffer, size, "vmovq %s, %s\nvpbroadcastq %s, %s\n",
+                          low, value, dest, low)
+               : snprintf(buffer, size, "movq %s, %s\npunpcklqdq %s, %s\n",
+                          low, value, dest, dest);
+  case CBE_ISEL_KIND_F32V:
+    return avx ? snprintf(buffer, size, "vbroadcastss %s, %s\n", dest, value)
+               : snprintf(buffer, size, "movaps %s, %s\nshufps %s, %s, 0\n",
+                          dest, value, dest, dest);
+  default:
+    return avx ? snprintf(buffer, size, "vpbroadcastq %s, %s\n", dest, value)
+               : snprintf(buffer, size, "movaps %s, %s\nunpcklpd %s, %s\n",
+                          dest, value, dest, dest);
+  }
+}
+
+// Reduces `node` as nonterminal `nt` and writes the resulting operand to
+// `out`. Returns the set of scratch registers the operand refers to.
+static u64 cbe_isel_reduce(struct cbe_isel_state *state,
+                           struct cbe_isel_node *node, enum cbe_isel_nt nt,
+                           char *out) {
+  struct cbe_context *ctx = state->ctx;
+  CBE_ASSERT(*ctx, node->cost[nt] != CBE_ISEL_NO_COST);
+  const struct cbe_isel_rule *rule = &cbe_isel_rules[node->rule[nt]];
+
+  struct cbe_isel_leaf leaves[CBE_ISEL_MAX_LEAVES];
+  usz pos = 0, leaf_count = 0;
+  u32 cost = 0;
+  if (rule->pattern[0] >= CBE_ISEL_OP_COUNT)
+    leaves[leaf_count++] = (struct cbe_isel_leaf){
+        node, (enum cbe_isel_nt)(rule->pattern[0] - CBE_ISEL_OP_COUNT)};
+  else
+    (void)cbe_isel_match(node, rule, &pos, &cost, leaves, &leaf_count);
+
+  char operands[CBE_ISEL_MAX_LEAVES][CBE_ISEL_MAX_OPERAND];
+  u64 held = 0, holds[CBE_ISEL_MAX_LEAVES];
+  for (usz i = 0; i < leaf_count; i++) {
+    holds[i] = cbe_isel_reduce(state, leaves[i].node, leaves[i].nt,
+                               operands[i]);
+    held |= holds[i];
+  }
+  if (node->dest == CBE_REG_NONE && rule->lhs != CBE_ISEL_NT_stmt) {
+    struct cbe_register_pool *pool = cbe_isel_vector(ctx, node)
+                                         ? &state->vector_scratch
+                                         : &state->scratch;
+    enum cbe_register reg = cbe_isel_reuse(rule, holds, leaf_count);
+    if (cbe_register_pool_is_empty(pool) && reg != CBE_REG_NONE &&
+        cbe_isel_scratch_pool(state, reg) == pool) {
+      node->dest = reg;
+      node->scratch = true;
+    }
+  }
+
+  usz size = cbe_type_size(ctx, node->type_id);
+  bool avx = ctx->target_features & CBE_TARGET_AVX2;
+  char text[8 * CBE_ISEL_MAX_OPERAND];
+  usz length = 0;
+  for (cstr c = rule->template; *c != '\0'; c++) {
+    usz left = sizeof(text) - length;
+    if (*c != '%') {
+      text[length++] = *c;
+      continue;
+    }
+    c++;
+    if (*c >= '0' && *c <= '9') {
+      length += snprintf(&text[length], left, "%s", operands[*c - '0']);
+    } else if (*c == 'c') {
+      enum cbe_register reg = cbe_isel_dest(state, node);
+      length += snprintf(&text[length], left, "%s",
+                         cbe_get_register_name_sized(reg, size));
+    } else if (*c == 'b' || *c == 'l') {
+      enum cbe_register reg = cbe_isel_dest(state, node);
+      length += snprintf(&text[length], left, "%s",
+                         cbe_get_register_name_sized(reg, *c == 'b' ? 1 : 4));
+    } else if (*c == 'A' || *c == 'D' || *c == 'K') {
+      enum cbe_register reg = *c == 'A'   ? CBE_REG_EAX
+                              : *c == 'D' ? CBE_REG_EDX
+                                          : CBE_REG_ECX;
+      length += snprintf(&text[length], left, "%s",
+                         cbe_get_register_name_sized(reg, size));
+    } else if (*c == 'X') {
+      length += snprintf(&text[length], left, "%s", size == 8 ? "cqo" : "cdq");
+    } else if (*c == 'p') {
+      length +=
+          snprintf(&text[length], left, "%s", cbe_isel_condition_code(node));
+    } else if (*c == 's') {
+      length += snprintf(&text[length], left, "%zu", node->scale);
+    } else if (*c == 'o') {
+      length += snprintf(&text[length], left, "%lld",
+                         node->kids[1]->value.integer * (i64)node->scale);
+    } else if (*c == 'v') {
+      length += cbe_format_value(ctx, &text[length], left, node->value);
+    } else if (*c == 'g') {
+      length += snprintf(&text[length], left, "%s",
+                         ctx->symbol_table.items[node->value.variable]);
+    } else if (*c == 'k') {
+      length += cbe_format_constant(ctx, &text[length], left, node->value);
+    } else if (*c == 'a') {
+      length += cbe_format_frame_address(
+          ctx, &text[length], left,
+          ctx->live_intervals.items[node->interval_id].symbol.location);
+    } else if (*c == 'S') {
+      length += snprintf(&text[length], left, "%s", cbe_isel_size_name(size));
+    } else if (*c == 'J') {
+      length += cbe_isel_jumps(state, node, rule, &text[length], left);
+    } else if (*c == 'C') {
+      length += cbe_isel_call(state, node, &text[length], left);
+    } else if (*c == 'M' || *c == 'L') {
+      length += snprintf(&text[length], left, "%s",
+                         cbe_isel_move(ctx, node->type_id, *c == 'L'));
+    } else if (*c == 'm') {
+      length += snprintf(
+          &text[length], left, "%s%s", avx ? "v" : "",
+          cbe_isel_mnemonic(ctx, node->inst->tag, node->type_id));
+    } else if (*c == 'e') {
+      struct cbe_isel_node *compare =
+          node->op == CBE_ISEL_OP_BR ? node->kids[0] : node;
+      bool single =
+          ctx->types.items[compare->kids[0]->type_id].tag == CBE_TYPE_FLOAT;
+      length += snprintf(&text[length], left, "%s", single ? "s" : "d");
+    } else if (*c == 'V') {
+      length += snprintf(&text[length], left, "%s", avx ? "v" : "");
+    } else if (*c == 'T' || *c == 'Z') {
+      enum cbe_register reg = *c == 'T' ? CBE_REG_XMM15 : CBE_REG_XMM0;
+      length += snprintf(&text[length], left, "%s",
+                         cbe_get_register_name_sized(reg, size));
+    } else if (*c == 'x') {
+      enum cbe_register reg = cbe_isel_dest(state, node);
+      length += snprintf(&text[length], left, "%s",
+                         cbe_get_register_name_sized(reg, 16));
+    } else if (*c == 'P') {
+      length += cbe_isel_vector_compare(state, node, operands[0], operands[1],
+                                        &text[length], left);
+    } else if (*c == 'B') {
+      length += cbe_isel_broadcast(state, node, operands[0], &text[length],
+                                   left);
+    } else if (*c == 'R') {
+      text[length] = '\0';
+      cbe_isel_emit(state, text);
+      cbe_generate_epilogue(ctx, state->fp,
+                            node->op == CBE_ISEL_OP_TAILCALL
+                                ? node->inst->call.function
+                                : SIZE_MAX);
+      length = 0;
+    } else {
+      text[length++] = *c;
+    }
+  }
+  text[length] = '\0';
+
+  if (rule->lhs != CBE_ISEL_NT_stmt &&
+      (length == 0 || text[length - 1] != '\n')) {
+    snprintf(out, CBE_ISEL_MAX_OPERAND, "%.*s", CBE_ISEL_MAX_OPERAND - 1,
+             text);
+    return held;
+  }
+  cbe_isel_emit(state, text);
+
+  // The leaves have been consumed, give their scratch registers back.
+  for (usz reg = 0; reg < CBE_REG_COUNT; reg++) {
+    if ((held & (1ull << reg)) && reg != node->dest)
+      cbe_free_register(cbe_isel_scratch_pool(state, reg), reg);
+  }
+  if (rule->lhs == CBE_ISEL_NT_stmt) {
+    out[0] = '\0';
+    return 0;
+  }
+
+  enum cbe_register reg = cbe_isel_dest(state, node);
+  snprintf(out, CBE_ISEL_MAX_OPERAND, "%s",
+           cbe_get_register_name_sized(reg, size));
+  return node->scratch ? 1ull << reg : 0;
+}
+
+// A copy of `node` evaluated at `ip`.
+static struct cbe_isel_node *cbe_isel_copy(struct cbe_isel_node *node,
+                                           usz ip) {
+  struct cbe_isel_node *copy = CBE_ALLOC(sizeof(*copy));
+  *copy = *node;
+  copy->name_index = SIZE_MAX;
+  copy->interval_id = SIZE_MAX;
+  copy->ip = ip;
+  for (usz i = 0; i < cbe_isel_arity[node->op]; i++)
+    copy->kids[i] = cbe_isel_copy(node->kids[i], ip);
+  return copy;
+}
+
+// Replaces a read of a spilled value that is cheap to recompute by the tree
+// that defines it, or by the constant that tree folds into.
+static struct cbe_isel_node *
+cbe_isel_rematerialize(struct cbe_context *ctx, struct cbe_isel_node *node) {
+  if (node->op != CBE_ISEL_OP_TEMP && node->op != CBE_ISEL_OP_SPILL)
+    return node;
+  struct cbe_live_interval interval =
+      ctx->live_intervals.items[node->interval_id];
+  if (interval.remat == NULL || interval.symbol.reg != CBE_REG_NONE)
+    return node;
+  if (!cbe_isel_is_constant(ctx, interval.remat))
+    return cbe_isel_copy(interval.remat, node->ip);
+  struct cbe_isel_node *constant = cbe_isel_leaf(
+      (struct cbe_value){.tag = CBE_VALUE_INTEGER,
+                         .type_id = interval.remat->type_id,
+                         .integer = cbe_isel_fold(ctx, interval.remat)});
+  constant->ip = node->ip;
+  return constant;
+}
+
+static void cbe_isel_assign(struct cbe_context *ctx,
+                            struct cbe_isel_node *node) {
+  for (usz i = 0; i < cbe_isel_arity[node->op]; i++) {
+    node->kids[i] = cbe_isel_rematerialize(ctx, node->kids[i]);
+    cbe_isel_assign(ctx, node->kids[i]);
+  }
+  if (node->op == CBE_ISEL_OP_CALL || node->op == CBE_ISEL_OP_TAILCALL) {
+    for (usz i = 0; i < node->inst->call.arguments.size; i++) {
+      node->arguments[i] = cbe_isel_rematerialize(ctx, node->arguments[i]);
+      cbe_isel_assign(ctx, node->arguments[i]);
+    }
+  }
+  node->dest = CBE_REG_NONE;
+  node->scratch = false;
+  if (node->interval_id == SIZE_MAX)
+    return;
+  enum cbe_register reg =
+      cbe_interval_register(ctx, node->interval_id, node->ip);
+  if (node->op == CBE_ISEL_OP_TEMP && reg == CBE_REG_NONE)
+    node->op = CBE_ISEL_OP_SPILL;
+  else if (node->op == CBE_ISEL_OP_SPILL && reg != CBE_REG_NONE)
+    node->op = CBE_ISEL_OP_TEMP;
+  node->dest = reg;
+}
+
+// Loads the pieces of spilled values that start at `ip` into their
+// registers, see cbe_split_interval.
+static void cbe_isel_reload(struct cbe_context *ctx, FILE *fp,
+                            struct cbe_block block, usz ip) {
+  bool avx = ctx->target_features & CBE_TARGET_AVX2;
+  for (usz i = 0; i < block.reloads.size; i++) {
+    struct cbe_live_interval *piece = block.reloads.items[i];
+    if (piece->start_point != (int)ip || piece->symbol.reg == CBE_REG_NONE)
+      continue;
+    char address[CBE_ISEL_MAX_OPERAND];
+    cbe_format_frame_address(ctx, address, sizeof(address),
+                             piece->symbol.location);
+    cstr move = piece->register_class == CBE_REGISTER_CLASS_GENERAL ? "mov"
+                : piece->size == 8 ? "movsd"
+                                   : "movdqu";
+    cbe_emit(ctx, fp, "  %s%s %s, %s ptr %s\n",
+             avx && piece->register_class == CBE_REGISTER_CLASS_VECTOR ? "v"
+                                                                        : "",
+             move, cbe_get_register_name_sized(piece->symbol.reg, piece->size),
+             cbe_isel_size_name(piece->size), address);
+  }
+}
+
+void cbe_isel_generate_block(struct cbe_context *ctx, FILE *fp,
+                             struct cbe_block block) {
+  push_stack_frame(ctx);
+  for (usz i = 0; i < block.roots.size; i++) {
+    struct cbe_isel_node *root = block.roots.items[i];
+    struct cbe_isel_state state = {ctx, fp, ctx->scratch_pool,
+                                   ctx->vector_scratch_pool};
+    // Spilled values that are cheap to recompute are, where they are used.
+    if (root->interval_id != SIZE_MAX &&
+        ctx->live_intervals.items[root->interval_id].remat != NULL &&
+        ctx->live_intervals.items[root->interval_id].symbol.reg ==
+            CBE_REG_NONE)
+      continue;
+
+    cbe_isel_reload(ctx, fp, block, root->ip);
+    cbe_isel_assign(ctx, root);
+    cbe_isel_label(ctx, root);
+
+    char operand[CBE_ISEL_MAX_OPERAND];
+    if (root->interval_id == SIZE_MAX) {
+      (void)cbe_isel_reduce(&state, root, CBE_ISEL_NT_stmt, operand);
+      continue;
+    }
+
+    bool is_vector = cbe_isel_vector(ctx, root);
+    (void)cbe_isel_reduce(&state, root,
+                          is_vector ? CBE_ISEL_NT_xmm : CBE_ISEL_NT_reg,
+                          operand);
+    struct cbe_live_interval interval =
+        ctx->live_intervals.items[root->interval_id];
+    if (interval.symbol.reg == CBE_REG_NONE) {
+      char address[CBE_ISEL_MAX_OPERAND];
+      cbe_format_frame_address(ctx, address, sizeof(address),
+                               interval.symbol.location);
+      cbe_emit(ctx, fp, "  %s %s ptr %s, %s\n",
+               is_vector ? cbe_isel_move(ctx, root->type_id, true) : "mov",
+               cbe_isel_size_name(cbe_type_size(ctx, root->type_id)), address,
+               operand);
+    }
+  }
+  pop_stack_frame(ctx);
+}
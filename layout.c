@@ -0,0 +1,256 @@
+#include "cbe.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Profile-guided block placement (Pettis & Hansen, "Profile guided code
+// positioning").
+//
+// Every edge gets a weight: its probability, taken from the br's weights when
+// they are known and guessed otherwise, times the frequency of its source
+// block, measured by a profile or estimated from the probabilities. Edges are
+// then visited heaviest first and the chain ending in the edge's source is
+// glued in front of the chain starting at its target, so that hot edges become
+// fall-throughs. Chains are finally laid out with the
+// entry chain first and the others by decreasing frequency.
+
+#define CBE_LAYOUT_BACK_EDGE_PROBABILITY 0.88
+#define CBE_LAYOUT_ITERATIONS 64
+
+struct cbe_layout_edge {
+  usz from, to;
+  double probability;
+  double weight;
+};
+
+// Marks the edges that close a cycle in a depth-first walk from the entry.
+static void cbe_layout_find_back_edges(struct cbe_context *ctx,
+                                       struct cbe_function *fn,
+                                       struct cbe_layout_edge *edges,
+                                       usz *edge_index, usz *edge_count,
+                                       bool *back_edges) {
+  push_stack_frame(ctx);
+  usz blocks = fn->blocks.size;
+  u8 *state = CBE_ALLOC(blocks); // 0 unvisited, 1 on the stack, 2 done.
+  usz *stack = CBE_ALLOC(sizeof(usz) * blocks);
+  usz *next = CBE_ALLOC(sizeof(usz) * blocks);
+  memset(state, 0, blocks);
+
+  usz depth = 0;
+  stack[depth++] = 0;
+  state[0] = 1;
+  next[0] = 0;
+  while (depth > 0) {
+    usz b = stack[depth - 1];
+    if (next[b] == edge_count[b]) {
+      state[b] = 2;
+      depth--;
+      continue;
+    }
+    usz e = edge_index[b] + next[b]++;
+    usz to = edges[e].to;
+    if (state[to] == 1) {
+      back_edges[e] = true;
+    } else if (state[to] == 0) {
+      state[to] = 1;
+      next[to] = 0;
+      stack[depth++] = to;
+    }
+  }
+  pop_stack_frame(ctx);
+}
+
+// Marks the edges that leave a loop: for every back edge t -> h the loop is h
+// plus every block that reaches t without passing through h.
+static void cbe_layout_find_exit_edges(struct cbe_context *ctx,
+                                       struct cbe_function *fn,
+                                       struct cbe_layout_edge *edges,
+                                       usz total, bool *back_edges,
+                                       bool *exit_edges) {
+  push_stack_frame(ctx);
+  usz blocks = fn->blocks.size;
+  bool *in_loop = CBE_ALLOC(sizeof(bool) * blocks);
+  usz *worklist = CBE_ALLOC(sizeof(usz) * blocks);
+  for (usz back = 0; back < total; back++) {
+    if (!back_edges[back])
+      continue;
+    memset(in_loop, 0, sizeof(bool) * blocks);
+    usz header = edges[back].to, count = 0;
+    in_loop[header] = true;
+    if (!in_loop[edges[back].from]) {
+      in_loop[edges[back].from] = true;
+      worklist[count++] = edges[back].from;
+    }
+    while (count > 0) {
+      usz b = worklist[--count];
+      for (usz e = 0; e < total; e++) {
+        if (edges[e].to == b && !in_loop[edges[e].from]) {
+          in_loop[edges[e].from] = true;
+          worklist[count++] = edges[e].from;
+        }
+      }
+    }
+    for (usz e = 0; e < total; e++) {
+      if (in_loop[edges[e].from] && !in_loop[edges[e].to])
+        exit_edges[e] = true;
+    }
+  }
+  pop_stack_frame(ctx);
+}
+
+static int cbe_layout_compare_edges(const void *a, const void *b) {
+  const struct cbe_layout_edge *x = *(const struct cbe_layout_edge **)a;
+  const struct cbe_layout_edge *y = *(const struct cbe_layout_edge **)b;
+  if (x->weight != y->weight)
+    return x->weight < y->weight ? 1 : -1;
+  if (x->from != y->from)
+    return x->from < y->from ? -1 : 1;
+  return x->to < y->to ? -1 : x->to > y->to;
+}
+
+struct cbe_layout_chain {
+  usz head;
+  double frequency; // of the hottest block in the chain.
+};
+
+static int cbe_layout_compare_chains(const void *a, const void *b) {
+  const struct cbe_layout_chain *x = a, *y = b;
+  if (x->frequency != y->frequency)
+    return x->frequency < y->frequency ? 1 : -1;
+  return x->head < y->head ? -1 : x->head > y->head;
+}
+
+void cbe_layout_blocks(struct cbe_context *ctx, struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  usz blocks = fn->blocks.size;
+  if (blocks < 3) {
+    pop_stack_frame(ctx);
+    return;
+  }
+
+  // Collect the edges, grouped by source block.
+  struct cbe_layout_edge *edges =
+      CBE_ALLOC(sizeof(struct cbe_layout_edge) * 2 * blocks);
+  usz *edge_index = CBE_ALLOC(sizeof(usz) * blocks);
+  usz *edge_count = CBE_ALLOC(sizeof(usz) * blocks);
+  usz total = 0;
+  for (usz b = 0; b < blocks; b++) {
+    struct cbe_block *block = &fn->blocks.items[b];
+    usz names[2];
+    edge_index[b] = total;
+    edge_count[b] = cbe_block_successors(block, names);
+    for (usz i = 0; i < edge_count[b]; i++) {
+      usz to = cbe_find_block_index(fn, names[i]);
+      CBE_ASSERT(*ctx, to != SIZE_MAX);
+      edges[total++] = (struct cbe_layout_edge){b, to, 0, 0};
+    }
+  }
+
+  bool *back_edges = CBE_ALLOC(sizeof(bool) * (total + 1));
+  memset(back_edges, 0, sizeof(bool) * (total + 1));
+  bool *exit_edges = CBE_ALLOC(sizeof(bool) * (total + 1));
+  memset(exit_edges, 0, sizeof(bool) * (total + 1));
+  cbe_layout_find_back_edges(ctx, fn, edges, edge_index, edge_count,
+                             back_edges);
+  cbe_layout_find_exit_edges(ctx, fn, edges, total, back_edges, exit_edges);
+
+  // Branch probabilities: measured weights if there are any, otherwise loops
+  // are assumed to iterate rather than exit, and other branches to be
+  // unbiased.
+  for (usz b = 0; b < blocks; b++) {
+    struct cbe_layout_edge *out = &edges[edge_index[b]];
+    if (edge_count[b] == 1) {
+      out[0].probability = 1;
+      continue;
+    }
+    if (edge_count[b] != 2)
+      continue;
+    struct cbe_instruction *br = cbe_block_terminator(&fn->blocks.items[b]);
+    u64 sum = br->br.weights[0] + br->br.weights[1];
+    usz e = edge_index[b];
+    bool back0 = back_edges[e] || (exit_edges[e + 1] && !exit_edges[e]);
+    bool back1 = back_edges[e + 1] || (exit_edges[e] && !exit_edges[e + 1]);
+    if (sum > 0) {
+      out[0].probability = (double)br->br.weights[0] / (double)sum;
+    } else if (back0 != back1) {
+      out[0].probability = back0 ? CBE_LAYOUT_BACK_EDGE_PROBABILITY
+                                 : 1 - CBE_LAYOUT_BACK_EDGE_PROBABILITY;
+    } else {
+      out[0].probability = 0.5;
+    }
+    out[1].probability = 1 - out[0].probability;
+  }
+
+  // Block frequencies, relative to one entry into the function. The
+  // iteration converges because every cycle has a probability below one.
+  double *frequency = CBE_ALLOC(sizeof(double) * blocks);
+  double *incoming = CBE_ALLOC(sizeof(double) * blocks);
+  for (usz b = 0; b < blocks; b++)
+    frequency[b] = b == 0;
+  for (usz iteration = 0; iteration < CBE_LAYOUT_ITERATIONS; iteration++) {
+    for (usz b = 0; b < blocks; b++)
+      incoming[b] = b == 0;
+    for (usz e = 0; e < total; e++)
+      incoming[edges[e].to] += frequency[edges[e].from] * edges[e].probability;
+    memcpy(frequency, incoming, sizeof(double) * blocks);
+  }
+  // A profile measured them, no need to guess.
+  if (fn->weight > 0) {
+    for (usz b = 0; b < blocks; b++)
+      frequency[b] = (double)fn->blocks.items[b].weight / (double)fn->weight;
+  }
+  for (usz e = 0; e < total; e++)
+    edges[e].weight = frequency[edges[e].from] * edges[e].probability;
+
+  struct cbe_layout_edge **sorted =
+      CBE_ALLOC(sizeof(struct cbe_layout_edge *) * (total + 1));
+  for (usz e = 0; e < total; e++)
+    sorted[e] = &edges[e];
+  qsort(sorted, total, sizeof(*sorted), cbe_layout_compare_edges);
+
+  // Every block starts as a chain of its own; `next` links a chain's blocks
+  // and `head`/`tail` are only meaningful for the ends of a chain.
+  usz *next = CBE_ALLOC(sizeof(usz) * blocks);
+  usz *head = CBE_ALLOC(sizeof(usz) * blocks);
+  usz *tail = CBE_ALLOC(sizeof(usz) * blocks);
+  for (usz b = 0; b < blocks; b++) {
+    next[b] = SIZE_MAX;
+    head[b] = b;
+    tail[b] = b;
+  }
+  for (usz e = 0; e < total; e++) {
+    usz from = sorted[e]->from, to = sorted[e]->to;
+    if (to == 0 || tail[head[from]] != from || head[to] != to ||
+        head[from] == to)
+      continue;
+    usz first = head[from], last = tail[to];
+    next[from] = to;
+    for (usz b = to; b != SIZE_MAX; b = next[b])
+      head[b] = first;
+    tail[first] = last;
+  }
+
+  struct cbe_layout_chain *chains =
+      CBE_ALLOC(sizeof(struct cbe_layout_chain) * blocks);
+  usz chain_count = 0;
+  for (usz b = 1; b < blocks; b++) {
+    if (head[b] != b)
+      continue;
+    double hottest = 0;
+    for (usz c = b; c != SIZE_MAX; c = next[c])
+      hottest = frequency[c] > hottest ? frequency[c] : hottest;
+    chains[chain_count++] = (struct cbe_layout_chain){b, hottest};
+  }
+  qsort(chains, chain_count, sizeof(*chains), cbe_layout_compare_chains);
+
+  struct cbe_block *order = CBE_ALLOC(sizeof(struct cbe_block) * blocks);
+  usz placed = 0;
+  for (usz b = 0; b != SIZE_MAX; b = next[b])
+    order[placed++] = fn->blocks.items[b];
+  for (usz i = 0; i < chain_count; i++) {
+    for (usz b = chains[i].head; b != SIZE_MAX; b = next[b])
+      order[placed++] = fn->blocks.items[b];
+  }
+  CBE_ASSERT(*ctx, placed == blocks);
+  memcpy(fn->blocks.items, order, sizeof(struct cbe_block) * blocks);
+  pop_stack_frame(ctx);
+}
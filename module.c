@@ -0,0 +1,431 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Serialized modules.
+//
+// Everything the generator needs to compile a module, without any of the
+// state cbe_validate fills in, as little-endian fields in this order:
+//
+//   header       "CBEM", u32 version, u32 type, symbol, global variable and
+//                function counts
+//   type         u32 tag, u32 lanes, u64 pointee, u64 element
+//   symbol       u32 length, the bytes of the name
+//   global       u64 name, u32 flags (1 constant, 2 local), value
+//   function     u64 name, u64 return type, u32 local, u32 parameter and
+//                block counts, u64 name and type of every parameter
+//   block        u64 name, u32 instruction count
+//   instruction  u32 tag, u32 has temporary, u64 temporary name and type,
+//                the operands of the tag in the order cbe.h declares them
+//   value        u32 tag, u32 reserved, u64 type, then an i64 integer, a u64
+//                variable, the bits of a double, or u32 length and the bytes
+//                of a string
+//
+// Types, symbols and globals are written as they are in the context, so their
+// ids in the module are the ids cbe_read_module recreates.
+
+#define CBE_MODULE_MAGIC "CBEM"
+#define CBE_MODULE_VERSION 2
+#define CBE_MODULE_CONSTANT 1
+#define CBE_MODULE_LOCAL 2
+
+static void cbe_module_write(FILE *fp, const void *data, usz size) {
+  fwrite(data, 1, size, fp);
+}
+
+static void cbe_module_write_u32(FILE *fp, u32 value) {
+  cbe_module_write(fp, &value, sizeof(value));
+}
+
+static void cbe_module_write_u64(FILE *fp, u64 value) {
+  cbe_module_write(fp, &value, sizeof(value));
+}
+
+static void cbe_module_write_string(FILE *fp, cstr string) {
+  u32 length = strlen(string);
+  cbe_module_write_u32(fp, length);
+  cbe_module_write(fp, string, length);
+}
+
+static void cbe_module_write_value(FILE *fp, struct cbe_value value) {
+  cbe_module_write_u32(fp, value.tag);
+  cbe_module_write_u32(fp, 0);
+  cbe_module_write_u64(fp, value.type_id);
+  switch (value.tag) {
+  case CBE_VALUE_NIL:
+    break;
+  case CBE_VALUE_INTEGER:
+    cbe_module_write_u64(fp, value.integer);
+    break;
+  case CBE_VALUE_STRING:
+    cbe_module_write_string(fp, value.string);
+    break;
+  case CBE_VALUE_VARIABLE:
+    cbe_module_write_u64(fp, value.variable);
+    break;
+  case CBE_VALUE_FLOAT:
+    cbe_module_write(fp, &value.floating, sizeof(value.floating));
+    break;
+  }
+}
+
+static void cbe_module_write_instruction(FILE *fp,
+                                         struct cbe_instruction *inst) {
+  cbe_module_write_u32(fp, inst->tag);
+  cbe_module_write_u32(fp, inst->has_temporary);
+  cbe_module_write_u64(fp, inst->temporary.name_index);
+  cbe_module_write_u64(fp, inst->temporary.type_id);
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+    cbe_module_write_u64(fp, inst->alloc.type);
+    break;
+  case CBE_INST_STORE:
+    cbe_module_write_value(fp, inst->store.value);
+    cbe_module_write_value(fp, inst->store.pointer);
+    break;
+  case CBE_INST_LOAD:
+    cbe_module_write_value(fp, inst->load.pointer);
+    break;
+  case CBE_INST_RET:
+    cbe_module_write_u32(fp, inst->ret.value != NULL);
+    if (inst->ret.value != NULL)
+      cbe_module_write_value(fp, *inst->ret.value);
+    break;
+  case CBE_INST_ADD:
+  case CBE_INST_SUB:
+  case CBE_INST_MUL:
+  case CBE_INST_DIV:
+  case CBE_INST_REM:
+  case CBE_INST_AND:
+  case CBE_INST_OR:
+  case CBE_INST_XOR:
+  case CBE_INST_SHL:
+  case CBE_INST_SHR:
+  case CBE_INST_SAR:
+    cbe_module_write_value(fp, inst->binary.lhs);
+    cbe_module_write_value(fp, inst->binary.rhs);
+    break;
+  case CBE_INST_ELEMPTR:
+    cbe_module_write_value(fp, inst->elemptr.pointer);
+    cbe_module_write_value(fp, inst->elemptr.index);
+    break;
+  case CBE_INST_CMP:
+    cbe_module_write_u32(fp, inst->cmp.predicate);
+    cbe_module_write_value(fp, inst->cmp.lhs);
+    cbe_module_write_value(fp, inst->cmp.rhs);
+    break;
+  case CBE_INST_SELECT:
+    cbe_module_write_value(fp, inst->select.condition);
+    cbe_module_write_value(fp, inst->select.then_value);
+    cbe_module_write_value(fp, inst->select.else_value);
+    break;
+  case CBE_INST_BROADCAST:
+    cbe_module_write_value(fp, inst->broadcast.value);
+    break;
+  case CBE_INST_BR:
+    cbe_module_write_value(fp, inst->br.condition);
+    cbe_module_write_u64(fp, inst->br.then_block);
+    cbe_module_write_u64(fp, inst->br.else_block);
+    cbe_module_write_u64(fp, inst->br.weights[0]);
+    cbe_module_write_u64(fp, inst->br.weights[1]);
+    break;
+  case CBE_INST_JMP:
+    cbe_module_write_u64(fp, inst->jmp.block);
+    break;
+  case CBE_INST_CALL:
+    cbe_module_write_u64(fp, inst->call.function);
+    cbe_module_write_u32(fp, inst->call.arguments.size);
+    for (usz i = 0; i < inst->call.arguments.size; i++)
+      cbe_module_write_value(fp, inst->call.arguments.items[i]);
+    break;
+  }
+}
+
+// Writes the module built in `ctx`, before it is optimized or validated.
+void cbe_write_module(struct cbe_context *ctx, FILE *fp) {
+  push_stack_frame(ctx);
+  cbe_module_write(fp, CBE_MODULE_MAGIC, 4);
+  cbe_module_write_u32(fp, CBE_MODULE_VERSION);
+  cbe_module_write_u32(fp, ctx->types.size);
+  cbe_module_write_u32(fp, ctx->symbol_table.size);
+  cbe_module_write_u32(fp, ctx->global_variables.size);
+  cbe_module_write_u32(fp, ctx->functions.size);
+
+  for (usz i = 0; i < ctx->types.size; i++) {
+    struct cbe_type *type = &ctx->types.items[i];
+    cbe_module_write_u32(fp, type->tag);
+    cbe_module_write_u32(fp, type->lanes);
+    cbe_module_write_u64(fp, type->ptr);
+    cbe_module_write_u64(fp, type->element);
+  }
+  for (usz i = 0; i < ctx->symbol_table.size; i++)
+    cbe_module_write_string(fp, ctx->symbol_table.items[i]);
+  for (usz i = 0; i < ctx->global_variables.size; i++) {
+    struct cbe_global_variable *global = &ctx->global_variables.items[i];
+    cbe_module_write_u64(fp, global->name_index);
+    cbe_module_write_u32(fp, (global->constant ? CBE_MODULE_CONSTANT : 0) |
+                                 (global->local ? CBE_MODULE_LOCAL : 0));
+    cbe_module_write_value(fp, global->value);
+  }
+
+  for (usz i = 0; i < ctx->functions.size; i++) {
+    struct cbe_function *fn = &ctx->functions.items[i];
+    cbe_module_write_u64(fp, fn->name_index);
+    cbe_module_write_u64(fp, fn->type_id);
+    cbe_module_write_u32(fp, fn->local);
+    cbe_module_write_u32(fp, fn->parameters.size);
+    cbe_module_write_u32(fp, fn->blocks.size);
+    for (usz j = 0; j < fn->parameters.size; j++) {
+      cbe_module_write_u64(fp, fn->parameters.items[j].name_index);
+      cbe_module_write_u64(fp, fn->parameters.items[j].type_id);
+    }
+    for (usz j = 0; j < fn->blocks.size; j++) {
+      struct cbe_block *block = &fn->blocks.items[j];
+      cbe_module_write_u64(fp, block->name_index);
+      cbe_module_write_u32(fp, block->instructions.size);
+      for (usz k = 0; k < block->instructions.size; k++)
+        cbe_module_write_instruction(fp, &block->instructions.items[k]);
+    }
+  }
+  pop_stack_frame(ctx);
+}
+
+struct cbe_module_reader {
+  struct cbe_context *ctx;
+  const u8 *data;
+  usz size, offset;
+  bool ok; // cleared by the first read past the end or out of range.
+};
+
+static void cbe_module_read(struct cbe_module_reader *reader, void *out,
+                            usz size) {
+  if (!reader->ok || reader->size - reader->offset < size) {
+    reader->ok = false;
+    memset(out, 0, size);
+    return;
+  }
+  memcpy(out, &reader->data[reader->offset], size);
+  reader->offset += size;
+}
+
+static u32 cbe_module_read_u32(struct cbe_module_reader *reader) {
+  u32 value;
+  cbe_module_read(reader, &value, sizeof(value));
+  return value;
+}
+
+static u64 cbe_module_read_u64(struct cbe_module_reader *reader) {
+  u64 value;
+  cbe_module_read(reader, &value, sizeof(value));
+  return value;
+}
+
+// A u32 or u64 that has to be below `limit`.
+static usz cbe_module_read_index(struct cbe_module_reader *reader, bool wide,
+                                 usz limit) {
+  u64 index = wide ? cbe_module_read_u64(reader) : cbe_module_read_u32(reader);
+  if (index >= limit)
+    reader->ok = false;
+  return reader->ok ? index : 0;
+}
+
+// A count of items taking at least `size` bytes each, so that a corrupt
+// count fails here rather than in an allocation.
+static usz cbe_module_read_count(struct cbe_module_reader *reader, usz size) {
+  u32 count = cbe_module_read_u32(reader);
+  if (count > (reader->size - reader->offset) / size)
+    reader->ok = false;
+  return reader->ok ? count : 0;
+}
+
+static cstr cbe_module_read_string(struct cbe_module_reader *reader) {
+  usz length = cbe_module_read_count(reader, 1);
+  char *string = CBE_ALLOC(length + 1);
+  cbe_module_read(reader, string, length);
+  string[length] = '\0';
+  return string;
+}
+
+static usz cbe_module_read_type(struct cbe_module_reader *reader) {
+  return cbe_module_read_index(reader, true, reader->ctx->types.size);
+}
+
+static usz cbe_module_read_symbol(struct cbe_module_reader *reader) {
+  return cbe_module_read_index(reader, true, reader->ctx->symbol_table.size);
+}
+
+static struct cbe_value cbe_module_read_value(
+    struct cbe_module_reader *reader) {
+  struct cbe_value value = {
+      .tag = cbe_module_read_index(reader, false, CBE_VALUE_FLOAT + 1)};
+  cbe_module_read_u32(reader);
+  value.type_id = cbe_module_read_type(reader);
+  switch (value.tag) {
+  case CBE_VALUE_NIL:
+    break;
+  case CBE_VALUE_INTEGER:
+    value.integer = cbe_module_read_u64(reader);
+    break;
+  case CBE_VALUE_STRING:
+    value.string = cbe_module_read_string(reader);
+    break;
+  case CBE_VALUE_VARIABLE:
+    value.variable = cbe_module_read_symbol(reader);
+    break;
+  case CBE_VALUE_FLOAT:
+    cbe_module_read(reader, &value.floating, sizeof(value.floating));
+    break;
+  }
+  return value;
+}
+
+static struct cbe_instruction cbe_module_read_instruction(
+    struct cbe_module_reader *reader) {
+  struct cbe_instruction inst = {
+      .tag = cbe_module_read_index(reader, false, CBE_INST_CALL + 1)};
+  inst.has_temporary = cbe_module_read_u32(reader) != 0;
+  inst.temporary.name_index = cbe_module_read_symbol(reader);
+  inst.temporary.type_id = cbe_module_read_type(reader);
+  switch (inst.tag) {
+  case CBE_INST_ALLOC:
+    inst.alloc.type = cbe_module_read_type(reader);
+    break;
+  case CBE_INST_STORE:
+    inst.store.value = cbe_module_read_value(reader);
+    inst.store.pointer = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_LOAD:
+    inst.load.pointer = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_RET:
+    if (cbe_module_read_u32(reader) != 0) {
+      inst.ret.value = CBE_ALLOC(sizeof(*inst.ret.value));
+      *inst.ret.value = cbe_module_read_value(reader);
+    }
+    break;
+  case CBE_INST_ADD:
+  case CBE_INST_SUB:
+  case CBE_INST_MUL:
+  case CBE_INST_DIV:
+  case CBE_INST_REM:
+  case CBE_INST_AND:
+  case CBE_INST_OR:
+  case CBE_INST_XOR:
+  case CBE_INST_SHL:
+  case CBE_INST_SHR:
+  case CBE_INST_SAR:
+    inst.binary.lhs = cbe_module_read_value(reader);
+    inst.binary.rhs = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_ELEMPTR:
+    inst.elemptr.pointer = cbe_module_read_value(reader);
+    inst.elemptr.index = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_CMP:
+    inst.cmp.predicate = cbe_module_read_index(reader, false, CBE_PRED_UGE + 1);
+    inst.cmp.lhs = cbe_module_read_value(reader);
+    inst.cmp.rhs = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_SELECT:
+    inst.select.condition = cbe_module_read_value(reader);
+    inst.select.then_value = cbe_module_read_value(reader);
+    inst.select.else_value = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_BROADCAST:
+    inst.broadcast.value = cbe_module_read_value(reader);
+    break;
+  case CBE_INST_BR:
+    inst.br.condition = cbe_module_read_value(reader);
+    inst.br.then_block = cbe_module_read_symbol(reader);
+    inst.br.else_block = cbe_module_read_symbol(reader);
+    inst.br.weights[0] = cbe_module_read_u64(reader);
+    inst.br.weights[1] = cbe_module_read_u64(reader);
+    break;
+  case CBE_INST_JMP:
+    inst.jmp.block = cbe_module_read_symbol(reader);
+    break;
+  case CBE_INST_CALL: {
+    inst.call.function = cbe_module_read_symbol(reader);
+    usz count = cbe_module_read_count(reader, 16);
+    slice_init_with_capacity(&inst.call.arguments, count + 1);
+    for (usz i = 0; i < count; i++)
+      slice_push(&inst.call.arguments, cbe_module_read_value(reader));
+  } break;
+  }
+  return inst;
+}
+
+// Adds the module in `data` to `ctx`, which should be freshly initialized so
+// that ids in the module mean the same in the context. Returns false if the
+// module is truncated or refers to types or symbols it does not have; the
+// instructions themselves are left for cbe_validate to check.
+bool cbe_read_module(struct cbe_context *ctx, const u8 *data, usz size) {
+  push_stack_frame(ctx);
+  struct cbe_module_reader reader = {ctx, data, size, 0, true};
+  char magic[4];
+  cbe_module_read(&reader, magic, sizeof(magic));
+  if (memcmp(magic, CBE_MODULE_MAGIC, sizeof(magic)) != 0 ||
+      cbe_module_read_u32(&reader) != CBE_MODULE_VERSION) {
+    pop_stack_frame(ctx);
+    return false;
+  }
+  usz types = cbe_module_read_count(&reader, 24);
+  usz symbols = cbe_module_read_count(&reader, 4);
+  usz globals = cbe_module_read_count(&reader, 28);
+  usz functions = cbe_module_read_count(&reader, 28);
+
+  // Types and symbols come first so that everything after can be checked
+  // against them.
+  for (usz i = 0; i < types; i++) {
+    struct cbe_type type = {
+        .tag = cbe_module_read_index(&reader, false, CBE_TYPE_VECTOR + 1)};
+    type.lanes = cbe_module_read_u32(&reader);
+    type.ptr = cbe_module_read_u64(&reader);
+    type.element = cbe_module_read_u64(&reader);
+    cbe_add_type(ctx, type);
+  }
+  for (usz i = 0; i < types; i++) {
+    struct cbe_type *type = &ctx->types.items[i];
+    if ((type->tag == CBE_TYPE_PTR && type->ptr >= types) ||
+        (type->tag == CBE_TYPE_VECTOR && type->element >= types))
+      reader.ok = false;
+  }
+  for (usz i = 0; i < symbols; i++)
+    cbe_add_symbol(ctx, cbe_module_read_string(&reader));
+  for (usz i = 0; i < globals; i++) {
+    struct cbe_global_variable global = {
+        .name_index = cbe_module_read_symbol(&reader)};
+    u32 flags = cbe_module_read_u32(&reader);
+    global.constant = flags & CBE_MODULE_CONSTANT;
+    global.local = flags & CBE_MODULE_LOCAL;
+    global.value = cbe_module_read_value(&reader);
+    cbe_new_global_variable(ctx, global);
+  }
+
+  for (usz i = 0; reader.ok && i < functions; i++) {
+    struct cbe_function fn = {.name_index = cbe_module_read_symbol(&reader)};
+    fn.type_id = cbe_module_read_type(&reader);
+    fn.local = cbe_module_read_u32(&reader) != 0;
+    usz parameters = cbe_module_read_count(&reader, 16);
+    usz blocks = cbe_module_read_count(&reader, 12);
+    slice_init_with_capacity(&fn.parameters, parameters + 1);
+    slice_init_with_capacity(&fn.blocks, blocks + 1);
+    for (usz j = 0; j < parameters; j++) {
+      struct cbe_temporary parameter = {cbe_module_read_symbol(&reader)};
+      parameter.type_id = cbe_module_read_type(&reader);
+      slice_push(&fn.parameters, parameter);
+    }
+    for (usz j = 0; reader.ok && j < blocks; j++) {
+      struct cbe_block block = {.name_index = cbe_module_read_symbol(&reader)};
+      usz instructions = cbe_module_read_count(&reader, 24);
+      slice_init_with_capacity(&block.instructions, instructions + 1);
+      for (usz k = 0; k < instructions; k++)
+        slice_push(&block.instructions, cbe_module_read_instruction(&reader));
+      slice_push(&fn.blocks, block);
+    }
+    slice_push(&ctx->functions, fn);
+  }
+  pop_stack_frame(ctx);
+  return reader.ok && reader.offset == reader.size;
+}
@@ -0,0 +1,215 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Execution profiles.
+//
+// With CBE_OPT_INSTRUMENT set, every block starts by incrementing its own
+// counter and every br counts which way it went. The counters live in .data
+// inside a self-describing image that a .fini_array hook appends to
+// ctx->profile_path when the program exits:
+//
+//   header    "CBEP", u32 version, u32 function count, u32 reserved
+//   function  u32 name length, u32 block count, name padded to 8 bytes
+//   block     u32 name length, u32 edge count, name padded to 8 bytes,
+//             u64 executions, u64 taken and not-taken counts of a br
+//
+// Since runs are appended, a profile file holds one image per run (and per
+// instrumented module); cbe_load_profile sums all of them.
+
+#define CBE_PROFILE_MAGIC "CBEP"
+#define CBE_PROFILE_VERSION 1
+
+// Linux x86-64 system calls and open(2) flags used by the exit hook.
+#define CBE_PROFILE_SYS_WRITE 1
+#define CBE_PROFILE_SYS_OPEN 2
+#define CBE_PROFILE_SYS_CLOSE 3
+#define CBE_PROFILE_OPEN_FLAGS 02101 // O_WRONLY | O_CREAT | O_APPEND
+#define CBE_PROFILE_OPEN_MODE 0644
+
+static usz cbe_profile_edge_count(struct cbe_block *block) {
+  struct cbe_instruction *terminator = cbe_block_terminator(block);
+  return terminator != NULL && terminator->tag == CBE_INST_BR ? 2 : 0;
+}
+
+// Counter `index` of `block` in the current function: 0 counts executions of
+// the block, 1 and 2 the taken and not-taken sides of its br.
+int cbe_format_profile_counter(struct cbe_context *ctx, char *buffer,
+                               usz size, usz block, usz index) {
+  cstr fn = ctx->symbol_table.items[ctx->current_function->name_index];
+  if (index == 0)
+    return snprintf(buffer, size, "[rip + .Lprofile.%s.%s]", fn,
+                    ctx->symbol_table.items[block]);
+  return snprintf(buffer, size, "[rip + .Lprofile.%s.%s + %zu]", fn,
+                  ctx->symbol_table.items[block], index * 8);
+}
+
+static void cbe_generate_profile_name(struct cbe_context *ctx, FILE *fp,
+                                      cstr name, usz count) {
+  cbe_emit(ctx, fp, "  .long %zu, %zu\n", strlen(name), count);
+  cbe_emit(ctx, fp, "  .ascii \"%s\"\n", name);
+  cbe_emit(ctx, fp, "  .balign 8\n");
+}
+
+void cbe_generate_profile(struct cbe_context *ctx, FILE *fp) {
+  push_stack_frame(ctx);
+  cbe_emit(ctx, fp, ".data\n");
+  cbe_emit(ctx, fp, ".balign 8\n");
+  cbe_emit(ctx, fp, ".Lprofile.begin:\n");
+  cbe_emit(ctx, fp, "  .ascii \"%s\"\n", CBE_PROFILE_MAGIC);
+  cbe_emit(ctx, fp, "  .long %d, %zu, 0\n", CBE_PROFILE_VERSION,
+           ctx->functions.size);
+  for (usz i = 0; i < ctx->functions.size; i++) {
+    struct cbe_function *fn = &ctx->functions.items[i];
+    cstr name = ctx->symbol_table.items[fn->name_index];
+    cbe_generate_profile_name(ctx, fp, name, fn->blocks.size);
+    for (usz j = 0; j < fn->blocks.size; j++) {
+      struct cbe_block *block = &fn->blocks.items[j];
+      usz edges = cbe_profile_edge_count(block);
+      cbe_generate_profile_name(
+          ctx, fp, ctx->symbol_table.items[block->name_index], edges);
+      cbe_emit(ctx, fp, ".Lprofile.%s.%s:\n", name,
+               ctx->symbol_table.items[block->name_index]);
+      cbe_emit(ctx, fp, "  .zero %zu\n", 8 * (1 + edges));
+    }
+  }
+  cbe_emit(ctx, fp, ".Lprofile.end:\n");
+
+  cbe_emit(ctx, fp, ".section .rodata\n");
+  cbe_emit(ctx, fp, ".Lprofile.path:\n");
+  cbe_emit(ctx, fp, "  .asciz \"%s\"\n", ctx->profile_path);
+
+  // The hook talks to the kernel directly so that it works whatever the
+  // program is linked against.
+  cbe_emit(ctx, fp, ".text\n");
+  cbe_emit(ctx, fp, ".Lprofile.dump:\n");
+  cbe_emit(ctx, fp, "  mov eax, %d\n", CBE_PROFILE_SYS_OPEN);
+  cbe_emit(ctx, fp, "  lea rdi, [rip + .Lprofile.path]\n");
+  cbe_emit(ctx, fp, "  mov esi, %d\n", CBE_PROFILE_OPEN_FLAGS);
+  cbe_emit(ctx, fp, "  mov edx, %d\n", CBE_PROFILE_OPEN_MODE);
+  cbe_emit(ctx, fp, "  syscall\n");
+  cbe_emit(ctx, fp, "  test eax, eax\n");
+  cbe_emit(ctx, fp, "  js .Lprofile.done\n");
+  cbe_emit(ctx, fp, "  mov edi, eax\n");
+  cbe_emit(ctx, fp, "  mov eax, %d\n", CBE_PROFILE_SYS_WRITE);
+  cbe_emit(ctx, fp, "  lea rsi, [rip + .Lprofile.begin]\n");
+  cbe_emit(ctx, fp, "  lea rdx, [rip + .Lprofile.end]\n");
+  cbe_emit(ctx, fp, "  sub rdx, rsi\n");
+  cbe_emit(ctx, fp, "  syscall\n");
+  cbe_emit(ctx, fp, "  mov eax, %d\n", CBE_PROFILE_SYS_CLOSE);
+  cbe_emit(ctx, fp, "  syscall\n");
+  cbe_emit(ctx, fp, ".Lprofile.done:\n");
+  cbe_emit(ctx, fp, "  ret\n");
+  cbe_emit(ctx, fp, ".section .fini_array, \"aw\"\n");
+  cbe_emit(ctx, fp, ".balign 8\n");
+  cbe_emit(ctx, fp, "  .quad .Lprofile.dump\n");
+  pop_stack_frame(ctx);
+}
+
+struct cbe_profile_reader {
+  u8 *data;
+  usz size, offset;
+};
+
+static bool cbe_profile_read(struct cbe_profile_reader *reader, void *out,
+                             usz size) {
+  if (reader->size - reader->offset < size)
+    return false;
+  memcpy(out, &reader->data[reader->offset], size);
+  reader->offset += size;
+  return true;
+}
+
+// Reads a name and its count, returning the name in `name` (not terminated).
+static bool cbe_profile_read_name(struct cbe_profile_reader *reader,
+                                  cstr *name, u32 *length, u32 *count) {
+  if (!cbe_profile_read(reader, length, sizeof(u32)) ||
+      !cbe_profile_read(reader, count, sizeof(u32)))
+    return false;
+  usz padded = (*length + 7) & ~(usz)7;
+  if (reader->size - reader->offset < padded)
+    return false;
+  *name = (cstr)&reader->data[reader->offset];
+  reader->offset += padded;
+  return true;
+}
+
+static bool cbe_profile_name_is(struct cbe_context *ctx, usz name_index,
+                                cstr name, u32 length) {
+  cstr symbol = ctx->symbol_table.items[name_index];
+  return strlen(symbol) == length && memcmp(symbol, name, length) == 0;
+}
+
+// Adds the counts in the profile at `path` to the weights of the matching
+// functions, blocks and branches. Functions and blocks are matched by name
+// and whatever is not in the profile keeps its weights. Returns false if the
+// file can't be read or is malformed.
+bool cbe_load_profile(struct cbe_context *ctx, cstr path) {
+  push_stack_frame(ctx);
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    pop_stack_frame(ctx);
+    return false;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  struct cbe_profile_reader reader = {CBE_ALLOC(size + 1), 0, 0};
+  reader.size = size > 0 ? fread(reader.data, 1, size, fp) : 0;
+  fclose(fp);
+
+  bool ok = true;
+  while (ok && reader.offset < reader.size) {
+    char magic[4];
+    u32 version, functions, reserved;
+    ok = cbe_profile_read(&reader, magic, sizeof(magic)) &&
+         memcmp(magic, CBE_PROFILE_MAGIC, sizeof(magic)) == 0 &&
+         cbe_profile_read(&reader, &version, sizeof(u32)) &&
+         version == CBE_PROFILE_VERSION &&
+         cbe_profile_read(&reader, &functions, sizeof(u32)) &&
+         cbe_profile_read(&reader, &reserved, sizeof(u32));
+
+    for (u32 i = 0; ok && i < functions; i++) {
+      cstr name;
+      u32 length, blocks;
+      ok = cbe_profile_read_name(&reader, &name, &length, &blocks);
+      struct cbe_function *fn = NULL;
+      for (usz j = 0; ok && fn == NULL && j < ctx->functions.size; j++) {
+        if (cbe_profile_name_is(ctx, ctx->functions.items[j].name_index, name,
+                                length))
+          fn = &ctx->functions.items[j];
+      }
+
+      for (u32 j = 0; ok && j < blocks; j++) {
+        u32 edges;
+        u64 counts[3] = {0};
+        ok = cbe_profile_read_name(&reader, &name, &length, &edges) &&
+             edges <= 2 &&
+             cbe_profile_read(&reader, counts, sizeof(u64) * (1 + edges));
+        if (!ok || fn == NULL)
+          continue;
+
+        struct cbe_block *block = NULL;
+        for (usz k = 0; block == NULL && k < fn->blocks.size; k++) {
+          if (cbe_profile_name_is(ctx, fn->blocks.items[k].name_index, name,
+                                  length))
+            block = &fn->blocks.items[k];
+        }
+        if (block == NULL)
+          continue;
+        block->weight += counts[0];
+        if (block == &fn->blocks.items[0])
+          fn->weight += counts[0];
+        struct cbe_instruction *terminator = cbe_block_terminator(block);
+        if (edges == 2 && terminator != NULL &&
+            terminator->tag == CBE_INST_BR) {
+          terminator->br.weights[0] += counts[1];
+          terminator->br.weights[1] += counts[2];
+        }
+      }
+    }
+  }
+  pop_stack_frame(ctx);
+  return ok;
+}
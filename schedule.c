@@ -0,0 +1,594 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// List scheduling within basic blocks, before register allocation.
+//
+// Blocks are cut into regions at calls, which stay where they are, as do the
+// terminator and the instructions isel folds into it. Every region gets a
+// dependency DAG: register edges from a definition to its uses, and memory
+// edges from stores to the loads and stores after them, and from loads to
+// the stores after them, within a location class. Each stack slot whose
+// address does not escape is a class of its own; all other memory is one
+// class. Edges carry latencies from the table of the target's
+// microarchitecture.
+//
+// Ready instructions are then picked by the longest latency path from them
+// to the end of the region. Once the values live in a register class reach
+// what the allocator has to hand out, instructions that do not add to them
+// come first. The new order is kept only if an in-order issue model
+// estimates fewer cycles for it and it does not need more registers than
+// both the old order and the allocator.
+
+// Latencies in cycles, roughly as measured by instruction tables, and how
+// many instructions issue per cycle.
+struct cbe_schedule_latencies {
+  u8 load, forward, alu, mul, div, fadd, fmul, fdiv, vmul, shuffle;
+  u8 width;
+};
+
+static const struct cbe_schedule_latencies cbe_schedule_latencies[] = {
+    [CBE_CPU_GENERIC] = {4, 5, 1, 3, 20, 4, 4, 12, 6, 3, 4},
+    [CBE_CPU_SKYLAKE] = {5, 4, 1, 3, 26, 4, 4, 11, 10, 3, 4},
+    [CBE_CPU_ZEN2] = {4, 6, 1, 3, 20, 3, 3, 10, 4, 3, 5},
+};
+
+// A region in CSR form: the successors of node i are succs[succ_index[i]]
+// up to succ_index[i + 1], likewise for predecessors.
+struct cbe_schedule_region {
+  struct cbe_instruction *insts;
+  usz size;
+  u8 *latency;
+  usz *height;           // longest latency path to the end of the region.
+  usz *uses;             // operand uses of each node's value in the region.
+  usz (*reads)[3];       // node defining each operand, or SIZE_MAX.
+  usz *glued;            // address feeding each load, or SIZE_MAX.
+  bool *folded;          // addresses issued along with their load.
+  bool *live_out;        // whether its value is used after the region.
+  enum cbe_register_class *class;
+  usz *succ_index, *succs, *pred_index, *preds;
+  u8 *succ_latency, *pred_latency;
+  usz limit[2]; // registers of each class the allocator can hand out.
+};
+
+struct cbe_schedule_state {
+  struct cbe_context *ctx;
+  usz *uses;      // operand uses of every symbol in the function.
+  usz *defined;   // region node defining each symbol, or SIZE_MAX.
+  usz *seen;      // region that last read each symbol, for live-ins.
+  usz *slot;      // location class of each slot's address, 0 for none.
+  usz classes;    // one more than the slots that do not escape.
+  usz *last_store; // last store of each class in the region.
+  usz *loads;      // first load of each class since that store.
+  usz regions;
+};
+
+static u8 cbe_schedule_latency(struct cbe_context *ctx,
+                               struct cbe_instruction *inst) {
+  const struct cbe_schedule_latencies *table =
+      &cbe_schedule_latencies[ctx->target_cpu];
+  bool is_vector = false, is_float = false;
+  if (inst->has_temporary) {
+    struct cbe_type type = ctx->types.items[inst->temporary.type_id];
+    is_vector = type.tag == CBE_TYPE_VECTOR;
+    if (is_vector)
+      type = ctx->types.items[type.element];
+    is_float = type.tag == CBE_TYPE_FLOAT || type.tag == CBE_TYPE_DOUBLE;
+  }
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+    return 0;
+  case CBE_INST_LOAD:
+    return table->load;
+  case CBE_INST_STORE:
+    return 1;
+  case CBE_INST_ADD:
+  case CBE_INST_SUB:
+    return is_float ? table->fadd : table->alu;
+  case CBE_INST_MUL:
+    return is_float ? table->fmul : is_vector ? table->vmul : table->mul;
+  case CBE_INST_DIV:
+  case CBE_INST_REM:
+    return is_float ? table->fdiv : table->div;
+  case CBE_INST_BROADCAST:
+    return table->shuffle;
+  default:
+    return table->alu;
+  }
+}
+
+// Whether isel may fold the instruction into its user, see isel.c.
+static bool cbe_schedule_is_pure(struct cbe_instruction *inst) {
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+  case CBE_INST_STORE:
+  case CBE_INST_RET:
+  case CBE_INST_BR:
+  case CBE_INST_JMP:
+  case CBE_INST_CALL:
+    return false;
+  default:
+    return true;
+  }
+}
+
+// The operand isel reads `k`-th, which folds from the top of its pending
+// roots: stores take their value first, everything else goes right to left.
+static struct cbe_value *cbe_schedule_operand(struct cbe_instruction *inst,
+                                              usz k) {
+  usz count = cbe_instruction_operand_count(inst);
+  return cbe_instruction_operand(
+      inst, inst->tag == CBE_INST_STORE ? k : count - 1 - k);
+}
+
+// Memory location class of an access through `pointer`.
+static usz cbe_schedule_class(struct cbe_schedule_state *state,
+                              struct cbe_value pointer) {
+  return pointer.tag == CBE_VALUE_VARIABLE ? state->slot[pointer.variable] : 0;
+}
+
+static void cbe_schedule_edge(usz *edges, usz *count, usz from, usz to,
+                              u8 latency) {
+  edges[3 * *count] = from;
+  edges[3 * *count + 1] = to;
+  edges[3 * (*count)++ + 2] = latency;
+}
+
+// Sorts the (from, to, latency) triples in `edges` into CSR arrays, by
+// `from` if `forward`, else by `to`.
+static void cbe_schedule_csr(usz size, usz *edges, usz count, bool forward,
+                             usz **index, usz **nodes, u8 **latency) {
+  *index = CBE_ALLOC((size + 1) * sizeof(usz));
+  *nodes = CBE_ALLOC((count + 1) * sizeof(usz));
+  *latency = CBE_ALLOC(count + 1);
+  memset(*index, 0, (size + 1) * sizeof(usz));
+  for (usz e = 0; e < count; e++)
+    (*index)[edges[3 * e + !forward] + 1]++;
+  for (usz i = 0; i < size; i++)
+    (*index)[i + 1] += (*index)[i];
+  usz *next = CBE_ALLOC((size + 1) * sizeof(usz));
+  memcpy(next, *index, (size + 1) * sizeof(usz));
+  for (usz e = 0; e < count; e++) {
+    usz key = edges[3 * e + !forward], other = edges[3 * e + forward];
+    (*nodes)[next[key]] = other;
+    (*latency)[next[key]++] = (u8)edges[3 * e + 2];
+  }
+}
+
+static void cbe_schedule_build(struct cbe_schedule_state *state,
+                               struct cbe_schedule_region *region) {
+  struct cbe_context *ctx = state->ctx;
+  push_stack_frame(ctx);
+  usz size = region->size;
+  region->latency = CBE_ALLOC(size + 1);
+  region->height = CBE_ALLOC((size + 1) * sizeof(usz));
+  region->uses = CBE_ALLOC((size + 1) * sizeof(usz));
+  region->reads = CBE_ALLOC((size + 1) * sizeof(usz[3]));
+  region->live_out = CBE_ALLOC(size + 1);
+  region->glued = CBE_ALLOC((size + 1) * sizeof(usz));
+  region->folded = CBE_ALLOC(size + 1);
+  region->class = CBE_ALLOC((size + 1) * sizeof(enum cbe_register_class));
+  region->limit[CBE_REGISTER_CLASS_GENERAL] =
+      ctx->register_pool.registers_count;
+  region->limit[CBE_REGISTER_CLASS_VECTOR] = ctx->vector_pool.registers_count;
+  for (usz c = 0; c < state->classes; c++) {
+    state->last_store[c] = SIZE_MAX;
+    state->loads[c] = SIZE_MAX;
+  }
+  state->regions++;
+
+  // Every node has at most three register edges in, one from the last
+  // store and one to the next store.
+  usz *edges = CBE_ALLOC(3 * 5 * (size + 1) * sizeof(usz)), count = 0;
+  usz *next_load = CBE_ALLOC((size + 1) * sizeof(usz));
+  for (usz i = 0; i < size; i++) {
+    struct cbe_instruction *inst = &region->insts[i];
+    region->latency[i] = cbe_schedule_latency(ctx, inst);
+    region->uses[i] = 0;
+    region->class[i] = CBE_REGISTER_CLASS_GENERAL;
+    if (inst->has_temporary) {
+      state->defined[inst->temporary.name_index] = i;
+      region->class[i] =
+          cbe_type_register_class(ctx, inst->temporary.type_id);
+    }
+
+    CBE_ASSERT(*ctx, cbe_instruction_operand_count(inst) <= 3);
+    for (usz k = 0; k < 3; k++)
+      region->reads[i][k] = SIZE_MAX;
+    for (usz k = 0; k < cbe_instruction_operand_count(inst); k++) {
+      struct cbe_value *value = cbe_instruction_operand(inst, k);
+      if (value->tag != CBE_VALUE_VARIABLE)
+        continue;
+      usz definition = state->defined[value->variable];
+      if (definition != SIZE_MAX) {
+        region->uses[definition]++;
+        region->reads[i][k] = definition;
+        cbe_schedule_edge(edges, &count, definition, i,
+                          region->latency[definition]);
+      } else if (state->seen[value->variable] != state->regions) {
+        // Values from before the region hold registers throughout it.
+        state->seen[value->variable] = state->regions;
+        usz *limit = &region->limit[cbe_type_register_class(
+            ctx, value->type_id)];
+        if (*limit > 1)
+          (*limit)--;
+      }
+    }
+
+    usz class;
+    if (inst->tag == CBE_INST_LOAD) {
+      class = cbe_schedule_class(state, inst->load.pointer);
+      if (state->last_store[class] != SIZE_MAX)
+        cbe_schedule_edge(edges, &count, state->last_store[class], i,
+                          cbe_schedule_latencies[ctx->target_cpu].forward);
+      next_load[i] = state->loads[class];
+      state->loads[class] = i;
+    } else if (inst->tag == CBE_INST_STORE) {
+      class = cbe_schedule_class(state, inst->store.pointer);
+      if (state->last_store[class] != SIZE_MAX)
+        cbe_schedule_edge(edges, &count, state->last_store[class], i, 1);
+      for (usz load = state->loads[class]; load != SIZE_MAX;
+           load = next_load[load])
+        cbe_schedule_edge(edges, &count, load, i, 0);
+      state->last_store[class] = i;
+      state->loads[class] = SIZE_MAX;
+    }
+  }
+
+  for (usz i = 0; i < size; i++) {
+    struct cbe_instruction *inst = &region->insts[i];
+    region->live_out[i] = false;
+    region->glued[i] = SIZE_MAX;
+    region->folded[i] = false;
+    if (inst->has_temporary) {
+      usz name = inst->temporary.name_index;
+      region->live_out[i] = state->uses[name] > region->uses[i];
+      state->defined[name] = SIZE_MAX;
+    }
+  }
+
+  // An elemptr used only as the address of a load becomes its addressing
+  // mode, so it moves with the load and takes no time of its own: edges
+  // into it go to the load instead. Stores fold their address only from
+  // below the value's tree, which is left to the order found.
+  usz *access = CBE_ALLOC((size + 1) * sizeof(usz));
+  for (usz i = 0; i < size; i++) {
+    usz address = region->reads[i][0];
+    if (region->insts[i].tag != CBE_INST_LOAD || address == SIZE_MAX ||
+        region->insts[address].tag != CBE_INST_ELEMPTR ||
+        region->uses[address] != 1 || region->live_out[address])
+      continue;
+    region->glued[i] = address;
+    region->folded[address] = true;
+    access[address] = i;
+    region->latency[address] = 0;
+  }
+  usz kept = 0;
+  for (usz e = 0; e < count; e++) {
+    usz from = edges[3 * e], to = edges[3 * e + 1];
+    if (region->folded[from])
+      continue;
+    edges[3 * kept] = from;
+    edges[3 * kept + 1] = region->folded[to] ? access[to] : to;
+    edges[3 * kept++ + 2] = edges[3 * e + 2];
+  }
+  count = kept;
+  cbe_schedule_csr(size, edges, count, true, &region->succ_index,
+                   &region->succs, &region->succ_latency);
+  cbe_schedule_csr(size, edges, count, false, &region->pred_index,
+                   &region->preds, &region->pred_latency);
+
+  // Edges only run forwards, so heights come out in one backward pass.
+  for (usz i = size; i > 0; i--) {
+    usz node = i - 1;
+    region->height[node] = region->latency[node];
+    for (usz e = region->succ_index[node]; e < region->succ_index[node + 1];
+         e++) {
+      usz height = region->succ_latency[e] + region->height[region->succs[e]];
+      if (height > region->height[node])
+        region->height[node] = height;
+    }
+  }
+  pop_stack_frame(ctx);
+}
+
+// Cycles until the last result of the region is ready, when it is issued in
+// `order` by an in-order machine of the target's width.
+static usz cbe_schedule_cycles(struct cbe_context *ctx,
+                               struct cbe_schedule_region *region,
+                               usz *order) {
+  usz width = cbe_schedule_latencies[ctx->target_cpu].width;
+  usz *issue = CBE_ALLOC((region->size + 1) * sizeof(usz));
+  usz cycle = 0, issued = 0, end = 0;
+  for (usz k = 0; k < region->size; k++) {
+    usz node = order[k], ready = cycle;
+    for (usz e = region->pred_index[node]; e < region->pred_index[node + 1];
+         e++) {
+      usz at = issue[region->preds[e]] + region->pred_latency[e];
+      if (at > ready)
+        ready = at;
+    }
+    if (ready > cycle) {
+      cycle = ready;
+      issued = 0;
+    }
+    if (issued == width) {
+      cycle++;
+      issued = 0;
+    }
+    issue[node] = cycle;
+    issued++;
+    if (cycle + region->latency[node] > end)
+      end = cycle + region->latency[node];
+  }
+  return end;
+}
+
+// The most values of each register class live at once in `order`, leaving
+// out those isel folds into their only user.
+static void cbe_schedule_pressure(struct cbe_schedule_state *state,
+                                  struct cbe_schedule_region *region,
+                                  usz *order, usz pressure[2]) {
+  usz size = region->size;
+  bool *folded = CBE_ALLOC(size + 1);
+  usz *pending = CBE_ALLOC((size + 1) * sizeof(usz));
+  usz *left = CBE_ALLOC((size + 1) * sizeof(usz));
+  usz depth = 0;
+  for (usz k = 0; k < size; k++) {
+    struct cbe_instruction *inst = &region->insts[order[k]];
+    for (usz j = 0; j < cbe_instruction_operand_count(inst); j++) {
+      struct cbe_value *value = cbe_schedule_operand(inst, j);
+      if (value->tag != CBE_VALUE_VARIABLE || depth == 0)
+        break;
+      struct cbe_instruction *top = &region->insts[pending[depth - 1]];
+      if (!top->has_temporary || top->temporary.name_index != value->variable ||
+          !cbe_schedule_is_pure(top) || state->uses[value->variable] != 1)
+        break;
+      folded[pending[--depth]] = true;
+    }
+    folded[order[k]] = false;
+    pending[depth++] = order[k];
+  }
+
+  usz live[2] = {0, 0};
+  pressure[0] = pressure[1] = 0;
+  for (usz k = 0; k < size; k++) {
+    usz node = order[k];
+    struct cbe_instruction *inst = &region->insts[node];
+    left[node] = region->uses[node];
+    for (usz j = 0; j < 3; j++) {
+      usz definition = region->reads[node][j];
+      if (definition != SIZE_MAX && --left[definition] == 0 &&
+          !region->live_out[definition] && !folded[definition])
+        live[region->class[definition]]--;
+    }
+    if (inst->has_temporary && !folded[node] &&
+        (region->uses[node] > 0 || region->live_out[node])) {
+      usz class = region->class[node];
+      if (++live[class] > pressure[class])
+        pressure[class] = live[class];
+    }
+  }
+}
+
+// Top-down list scheduling by height, with the register pressure check
+// described at the top of the file.
+static void cbe_schedule_list(struct cbe_context *ctx,
+                              struct cbe_schedule_region *region,
+                              usz *order) {
+  usz size = region->size;
+  usz width = cbe_schedule_latencies[ctx->target_cpu].width;
+  usz *waiting = CBE_ALLOC((size + 1) * sizeof(usz));
+  usz *earliest = CBE_ALLOC((size + 1) * sizeof(usz));
+  usz *left = CBE_ALLOC((size + 1) * sizeof(usz));
+  isz *growth = CBE_ALLOC((size + 1) * sizeof(isz));
+  bool *done = CBE_ALLOC(size + 1);
+  for (usz i = 0; i < size; i++) {
+    waiting[i] = region->pred_index[i + 1] - region->pred_index[i];
+    earliest[i] = 0;
+    left[i] = region->uses[i];
+    done[i] = false;
+  }
+
+  usz live[2] = {0, 0}, cycle = 0, issued = 0;
+  for (usz k = 0; k < size;) {
+    bool high = live[0] >= region->limit[0] || live[1] >= region->limit[1];
+    usz best = SIZE_MAX;
+    for (usz i = 0; i < size; i++) {
+      if (done[i] || waiting[i] > 0 || region->folded[i])
+        continue;
+      struct cbe_instruction *inst = &region->insts[i];
+      growth[i] = inst->has_temporary &&
+                  (region->uses[i] > 0 || region->live_out[i]);
+      usz nodes[] = {i, region->glued[i]};
+      for (usz n = 0; n < 2 && nodes[n] != SIZE_MAX; n++) {
+        for (usz j = 0; j < 3; j++) {
+          usz definition = region->reads[nodes[n]][j];
+          if (definition != SIZE_MAX && !region->folded[definition] &&
+              left[definition] == 1 && !region->live_out[definition])
+            growth[i]--;
+        }
+      }
+      if (best == SIZE_MAX) {
+        best = i;
+        continue;
+      }
+      bool now = earliest[i] <= cycle, best_now = earliest[best] <= cycle;
+      if (high && growth[i] != growth[best]) {
+        if (growth[i] < growth[best])
+          best = i;
+      } else if (now != best_now) {
+        if (now)
+          best = i;
+      } else if (region->height[i] > region->height[best]) {
+        best = i;
+      }
+    }
+
+    if (earliest[best] > cycle) {
+      cycle = earliest[best];
+      issued = 0;
+    }
+    if (issued == width) {
+      cycle++;
+      issued = 0;
+    }
+    issued++;
+    done[best] = true;
+    usz nodes[] = {region->glued[best], best};
+    for (usz n = 0; n < 2; n++) {
+      if (nodes[n] == SIZE_MAX)
+        continue;
+      order[k++] = nodes[n];
+      for (usz j = 0; j < 3; j++) {
+        usz definition = region->reads[nodes[n]][j];
+        if (definition != SIZE_MAX && !region->folded[definition] &&
+            --left[definition] == 0 && !region->live_out[definition])
+          live[region->class[definition]]--;
+      }
+    }
+    struct cbe_instruction *inst = &region->insts[best];
+    if (inst->has_temporary && (region->uses[best] > 0 ||
+                                region->live_out[best]))
+      live[region->class[best]]++;
+    for (usz e = region->succ_index[best]; e < region->succ_index[best + 1];
+         e++) {
+      usz successor = region->succs[e];
+      waiting[successor]--;
+      if (cycle + region->succ_latency[e] > earliest[successor])
+        earliest[successor] = cycle + region->succ_latency[e];
+    }
+  }
+}
+
+// Schedules one region and returns its estimated cycles, before and after.
+static void cbe_schedule_region(struct cbe_schedule_state *state,
+                                struct cbe_instruction *insts, usz size,
+                                usz cycles[2]) {
+  struct cbe_context *ctx = state->ctx;
+  push_stack_frame(ctx);
+  struct cbe_schedule_region region = {.insts = insts, .size = size};
+  cbe_schedule_build(state, &region);
+
+  usz *before = CBE_ALLOC((size + 1) * sizeof(usz));
+  usz *after = CBE_ALLOC((size + 1) * sizeof(usz));
+  for (usz i = 0; i < size; i++)
+    before[i] = i;
+  // Pressure the old order already has is no reason to hold back.
+  usz old_pressure[2], new_pressure[2];
+  cbe_schedule_pressure(state, &region, before, old_pressure);
+  for (usz c = 0; c < 2; c++) {
+    if (old_pressure[c] > region.limit[c])
+      region.limit[c] = old_pressure[c];
+  }
+  cbe_schedule_list(ctx, &region, after);
+  cbe_schedule_pressure(state, &region, after, new_pressure);
+
+  usz old_cycles = cbe_schedule_cycles(ctx, &region, before);
+  usz new_cycles = cbe_schedule_cycles(ctx, &region, after);
+  bool better = new_cycles < old_cycles &&
+                new_pressure[0] <= region.limit[0] &&
+                new_pressure[1] <= region.limit[1];
+
+  cycles[0] += old_cycles;
+  if (!better) {
+    cycles[1] += old_cycles;
+    pop_stack_frame(ctx);
+    return;
+  }
+  cycles[1] += new_cycles;
+  struct cbe_instruction *copy =
+      CBE_ALLOC((size + 1) * sizeof(struct cbe_instruction));
+  memcpy(copy, insts, size * sizeof(struct cbe_instruction));
+  for (usz k = 0; k < size; k++)
+    insts[k] = copy[after[k]];
+  pop_stack_frame(ctx);
+}
+
+static void cbe_schedule_block(struct cbe_schedule_state *state,
+                               struct cbe_block *block, usz cycles[2]) {
+  push_stack_frame(state->ctx);
+  usz end = block->instructions.size;
+  if (end == 0) {
+    pop_stack_frame(state->ctx);
+    return;
+  }
+  struct cbe_instruction *insts = block->instructions.items;
+  CBE_ASSERT(*state->ctx, cbe_is_terminator(insts[end - 1].tag));
+
+  // Keep what folds into the terminator in front of it: a tree used only
+  // by the terminator, or by instructions already kept.
+  bool *kept = CBE_ALLOC(state->ctx->symbol_table.size + 1);
+  memset(kept, 0, state->ctx->symbol_table.size + 1);
+  end--;
+  for (usz k = 0; k < cbe_instruction_operand_count(&insts[end]); k++) {
+    struct cbe_value *value = cbe_instruction_operand(&insts[end], k);
+    if (value->tag == CBE_VALUE_VARIABLE)
+      kept[value->variable] = true;
+  }
+  while (end > 0 && insts[end - 1].has_temporary &&
+         cbe_schedule_is_pure(&insts[end - 1]) &&
+         kept[insts[end - 1].temporary.name_index] &&
+         state->uses[insts[end - 1].temporary.name_index] == 1) {
+    end--;
+    for (usz k = 0; k < cbe_instruction_operand_count(&insts[end]); k++) {
+      struct cbe_value *value = cbe_instruction_operand(&insts[end], k);
+      if (value->tag == CBE_VALUE_VARIABLE)
+        kept[value->variable] = true;
+    }
+  }
+
+  usz start = 0;
+  for (usz i = 0; i <= end; i++) {
+    if (i < end && insts[i].tag != CBE_INST_CALL)
+      continue;
+    if (i - start > 1)
+      cbe_schedule_region(state, &insts[start], i - start, cycles);
+    start = i + 1;
+  }
+  pop_stack_frame(state->ctx);
+}
+
+// `fn` has passed cbe_check, see cbe_optimize.
+void cbe_schedule_function(struct cbe_context *ctx, struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  usz symbols = ctx->symbol_table.size;
+  struct cbe_schedule_state state = {
+      .ctx = ctx,
+      .uses = CBE_ALLOC((symbols + 1) * sizeof(usz)),
+      .defined = CBE_ALLOC((symbols + 1) * sizeof(usz)),
+      .seen = CBE_ALLOC((symbols + 1) * sizeof(usz)),
+      .slot = CBE_ALLOC((symbols + 1) * sizeof(usz)),
+      .classes = 1,
+  };
+  bool escape = cbe_slots_escape(ctx, fn);
+  for (usz i = 0; i < symbols; i++) {
+    state.uses[i] = 0;
+    state.defined[i] = SIZE_MAX;
+    state.seen[i] = 0;
+    state.slot[i] = 0;
+  }
+  for (usz b = 0; b < fn->blocks.size; b++) {
+    struct cbe_block *block = &fn->blocks.items[b];
+    for (usz i = 0; i < block->instructions.size; i++) {
+      struct cbe_instruction *inst = &block->instructions.items[i];
+      if (inst->tag == CBE_INST_ALLOC && !escape)
+        state.slot[inst->temporary.name_index] = state.classes++;
+      for (usz k = 0; k < cbe_instruction_operand_count(inst); k++) {
+        struct cbe_value *value = cbe_instruction_operand(inst, k);
+        if (value->tag == CBE_VALUE_VARIABLE)
+          state.uses[value->variable]++;
+      }
+    }
+  }
+  state.last_store = CBE_ALLOC(state.classes * sizeof(usz));
+  state.loads = CBE_ALLOC(state.classes * sizeof(usz));
+
+  fn->cycles[0] = fn->cycles[1] = 0;
+  for (usz b = 0; b < fn->blocks.size; b++)
+    cbe_schedule_block(&state, &fn->blocks.items[b], fn->cycles);
+  CBE_TRACE(ctx, CBE_EVENT_SCHEDULE, CBE_REG_NONE, 0, fn->cycles[0],
+            fn->name_index, fn->cycles[1]);
+  pop_stack_frame(ctx);
+}
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cbe.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Compile server.
+//
+// cbe_serve listens on a Unix domain socket for modules written by
+// cbe_write_module and sends back what cbe_generate makes of them, saving
+// clients the process startup and cold arena of one compiler run per module.
+// Every connection carries any number of requests, each answered in order,
+// so a client may write several before reading the first response:
+//
+//   request   struct cbe_serve_request, then the module
+//   response  struct cbe_serve_response, then the assembly, the object file
+//             or an error message, the diagnostics of cbe_validate for an
+//             invalid module
+//
+// The arena is global to the process, so the pool of workers is a fixed
+// number of processes forked up front, each accepting connections on the
+// shared socket, compiling into a fresh context in its arena reset between
+// requests. Connections beyond the pool wait in the listen backlog. Requests
+// and modules are checked before anything is compiled, see cbe_check, and
+// answered as malformed or invalid.
+
+#define CBE_SERVE_BACKLOG 128
+#define CBE_SERVE_MAX_MODULE (256u << 20)
+
+static volatile sig_atomic_t cbe_serve_stopping;
+
+static void cbe_serve_stop(int signal) {
+  (void)signal;
+  cbe_serve_stopping = 1;
+}
+
+static bool cbe_serve_read(int fd, void *data, usz size) {
+  u8 *bytes = data;
+  while (size > 0) {
+    ssize_t n = read(fd, bytes, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool cbe_serve_write(int fd, const void *data, usz size) {
+  const u8 *bytes = data;
+  while (size > 0) {
+    ssize_t n = write(fd, bytes, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool cbe_serve_respond(int fd, enum cbe_serve_status status,
+                              const void *data, usz size) {
+  struct cbe_serve_response response = {status, size};
+  return cbe_serve_write(fd, &response, sizeof(response)) &&
+         cbe_serve_write(fd, data, size);
+}
+
+// Runs `assembly` through as, leaving the object file in `output`.
+static bool cbe_serve_assemble(char *assembly, usz size, char **output,
+                               usz *output_size) {
+  char path[] = "/tmp/cbe-serve-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return false;
+  char command[64];
+  snprintf(command, sizeof(command), "as --64 -o %s -", path);
+  FILE *as = popen(command, "w");
+  bool ok = as != NULL && fwrite(assembly, 1, size, as) == size;
+  ok = as != NULL && pclose(as) == 0 && ok;
+
+  off_t length = ok ? lseek(fd, 0, SEEK_END) : -1;
+  ok = length >= 0 && lseek(fd, 0, SEEK_SET) == 0;
+  *output = ok ? malloc(length + 1) : NULL;
+  *output_size = ok ? length : 0;
+  ok = ok && *output != NULL && cbe_serve_read(fd, *output, length);
+  close(fd);
+  unlink(path);
+  return ok;
+}
+
+// Compiles the module of `request` into `output`, which the caller frees.
+static enum cbe_serve_status cbe_serve_compile(
+    struct cbe_serve_request *request, u8 *module, char **output,
+    usz *size) {
+  cstr malformed = NULL;
+  if (request->options & ~(u32)CBE_OPT_ALL)
+    malformed = "unknown options";
+  else if (request->target_features & ~(u32)CBE_TARGET_ALL)
+    malformed = "unknown target features";
+  else if (request->target_cpu > CBE_CPU_ZEN2)
+    malformed = "unknown target cpu";
+  a_reset();
+  struct cbe_context ctx;
+  cbe_init(&ctx);
+  ctx.options = request->options;
+  ctx.target_features = request->target_features;
+  ctx.target_cpu = request->target_cpu;
+  if (malformed == NULL && !cbe_read_module(&ctx, module, request->size))
+    malformed = "malformed module";
+  if (malformed != NULL) {
+    *output = strdup(malformed);
+    *size = strlen(*output);
+    return CBE_SERVE_MALFORMED;
+  }
+  // cbe_optimize leaves a module that fails cbe_check alone.
+  cbe_optimize(&ctx);
+  FILE *fp = open_memstream(output, size);
+  if (cbe_validate(&ctx) != CBE_VALID_OK) {
+    cbe_write_diagnostics(&ctx, fp);
+    fclose(fp);
+    return CBE_SERVE_INVALID;
+  }
+  cbe_generate(&ctx, fp);
+  fclose(fp);
+  if (!(request->flags & CBE_SERVE_OBJECT))
+    return CBE_SERVE_OK;
+  char *assembly = *output;
+  usz assembly_size = *size;
+  bool ok = cbe_serve_assemble(assembly, assembly_size, output, size);
+  free(assembly);
+  if (ok)
+    return CBE_SERVE_OK;
+  free(*output);
+  *output = strdup("as failed");
+  *size = strlen(*output);
+  return CBE_SERVE_FAILED;
+}
+
+// Answers the requests on `fd` until the client hangs up. The module buffer
+// is kept across requests and connections.
+static void cbe_serve_connection(int fd, u8 **module, usz *capacity) {
+  struct cbe_serve_request request;
+  while (cbe_serve_read(fd, &request, sizeof(request))) {
+    if (request.size > CBE_SERVE_MAX_MODULE) {
+      cstr message = "module too large";
+      cbe_serve_respond(fd, CBE_SERVE_MALFORMED, message, strlen(message));
+      return;
+    }
+    if (request.size > *capacity) {
+      free(*module);
+      *capacity = request.size;
+      *module = malloc(*capacity);
+      if (*module == NULL) {
+        *capacity = 0;
+        return;
+      }
+    }
+    if (!cbe_serve_read(fd, *module, request.size))
+      return;
+
+    char *output = NULL;
+    usz size = 0;
+    enum cbe_serve_status status =
+        cbe_serve_compile(&request, *module, &output, &size);
+    bool ok = cbe_serve_respond(fd, status, output, size);
+    free(output);
+    if (!ok)
+      return;
+  }
+}
+
+static void cbe_serve_worker(int listener) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+  u8 *module = NULL;
+  usz capacity = 0;
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0 && errno == EINTR)
+      continue;
+    if (fd < 0)
+      exit(1);
+    cbe_serve_connection(fd, &module, &capacity);
+    close(fd);
+  }
+}
+
+static pid_t cbe_serve_fork(int listener) {
+  pid_t pid = fork();
+  if (pid == 0)
+    cbe_serve_worker(listener);
+  return pid;
+}
+
+// Serves compile requests on the socket at `path` with `workers` processes
+// until interrupted or terminated. The arena has to be initialized; what a
+// module needs beyond it, up to CBE_SERVE_MAX_MODULE, a_alloc chains more
+// blocks for. Returns false if the socket can't be set up.
+bool cbe_serve(cstr path, usz workers) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (workers == 0 || strlen(path) >= sizeof(address.sun_path))
+    return false;
+  strcpy(address.sun_path, path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    return false;
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, CBE_SERVE_BACKLOG) < 0) {
+    close(listener);
+    return false;
+  }
+
+  struct sigaction action = {.sa_handler = cbe_serve_stop};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  pid_t *pids = malloc(sizeof(*pids) * workers);
+  for (usz i = 0; i < workers; i++)
+    pids[i] = cbe_serve_fork(listener);
+
+  while (!cbe_serve_stopping) {
+    pid_t pid = wait(NULL);
+    if (pid < 0 && errno != EINTR)
+      break;
+    for (usz i = 0; pid > 0 && !cbe_serve_stopping && i < workers; i++) {
+      if (pids[i] == pid)
+        pids[i] = cbe_serve_fork(listener);
+    }
+  }
+
+  for (usz i = 0; i < workers; i++) {
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  }
+  while (wait(NULL) > 0)
+    ;
+  free(pids);
+  close(listener);
+  unlink(path);
+  return true;
+}
@@ -0,0 +1,66 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cbe.h"
+#include <stdio.h>
+#include <time.h>
+
+// Compile-time statistics.
+//
+// The timers and counters of struct cbe_stats add up everything compiled in
+// a context. Timers nest: validate includes isel, liveness and allocation.
+// cbe_write_stats prints them as one JSON object, along with what arena.c
+// counts: the bytes allocated and the blocks reserved since cbe_init, and
+// the bytes in use and their high-water mark since the last a_reset, which
+// comes before each context the drivers compile:
+//
+//   {"enabled": true,
+//    "timers_ns": {"dead_code": 0, ..., "emission": 81234},
+//    "counters": {"functions": 4, ..., "removed_globals": 0},
+//    "arena": {"allocated": ..., "in_use": ..., "high_water": ...,
+//              "reserved": ...}}
+
+static const cstr cbe_timer_names[CBE_TIMER_COUNT] = {
+    [CBE_TIMER_DEAD_CODE] = "dead_code",
+    [CBE_TIMER_INLINE] = "inline",
+    [CBE_TIMER_VECTORIZE] = "vectorize",
+    [CBE_TIMER_SCHEDULE] = "schedule",
+    [CBE_TIMER_LAYOUT] = "layout",
+    [CBE_TIMER_VALIDATE] = "validate",
+    [CBE_TIMER_ISEL] = "isel",
+    [CBE_TIMER_LIVENESS] = "liveness",
+    [CBE_TIMER_ALLOCATION] = "allocation",
+    [CBE_TIMER_EMISSION] = "emission",
+};
+
+u64 cbe_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void cbe_write_stats(struct cbe_context *ctx, FILE *fp) {
+  push_stack_frame(ctx);
+  struct cbe_stats *stats = &ctx->stats;
+#ifdef CBE_COLLECT_STATS
+  fprintf(fp, "{\"enabled\": true,\n \"timers_ns\": {");
+#else
+  fprintf(fp, "{\"enabled\": false,\n \"timers_ns\": {");
+#endif // CBE_COLLECT_STATS
+  for (usz i = 0; i < CBE_TIMER_COUNT; i++)
+    fprintf(fp, "%s\"%s\": %llu", i > 0 ? ", " : "", cbe_timer_names[i],
+            (unsigned long long)stats->nanoseconds[i]);
+  fprintf(fp, "},\n \"counters\": {\"functions\": %zu, \"blocks\": %zu, "
+              "\"instructions\": %zu, \"intervals\": %zu, ",
+          stats->functions, stats->blocks, stats->instructions,
+          stats->intervals);
+  fprintf(fp, "\"spill_stores\": %zu, \"spill_loads\": %zu, "
+              "\"emitted_bytes\": %zu, ",
+          stats->spill_stores, stats->spill_loads, stats->emitted_bytes);
+  fprintf(fp, "\"removed_functions\": %zu, \"removed_globals\": %zu},\n",
+          stats->removed_functions, stats->removed_globals);
+  arena_stats_t arena = a_stats();
+  fprintf(fp, " \"arena\": {\"allocated\": %zu, \"in_use\": %zu, "
+              "\"high_water\": %zu, \"reserved\": %zu}}\n",
+          arena.allocated - ctx->arena.allocated, arena.in_use,
+          arena.high_water, arena.reserved - ctx->arena.reserved);
+  pop_stack_frame(ctx);
+}
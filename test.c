@@ -1,13 +1,164 @@
 #include "cbe.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int main(void) {
-  a_init(64 * 1024);
+static struct cbe_value integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static struct cbe_value variable(cbe_type_id type_id, usz name_index) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name_index};
+}
+
+static struct cbe_instruction binary(enum cbe_instruction_tag tag,
+                                     usz name_index, cbe_type_id type_id,
+                                     struct cbe_value lhs,
+                                     struct cbe_value rhs) {
+  return (struct cbe_instruction){
+      .tag = tag,
+      .has_temporary = true,
+      .temporary = {.name_index = name_index, .type_id = type_id},
+      .binary = {lhs, rhs}};
+}
+
+static struct cbe_instruction jmp(usz block) {
+  return (struct cbe_instruction){.tag = CBE_INST_JMP, .jmp = {block}};
+}
+
+static struct cbe_block block(usz name_index) {
+  struct cbe_block block = {.name_index = name_index};
+  slice_init(&block.instructions);
+  return block;
+}
+
+// Files named on the command line, NULL if not.
+struct files {
+  cstr profile, output, stats, trace;
+};
+
+static bool compile(struct cbe_context *ctx, struct files *files) {
+  // The profile takes the IR to be well formed, as the passes do, so the
+  // module is checked first; cbe_optimize and cbe_validate don't again.
+  if (cbe_check(ctx) != CBE_VALID_OK) {
+    cbe_write_diagnostics(ctx, stderr);
+    return false;
+  }
+  if (files->profile != NULL && !cbe_load_profile(ctx, files->profile)) {
+    fprintf(stderr, "could not load profile %s\n", files->profile);
+    return false;
+  }
+  cbe_optimize(ctx);
+  if (cbe_validate(ctx) != CBE_VALID_OK) {
+    cbe_write_diagnostics(ctx, stderr);
+    return false;
+  }
+
+  FILE *fp = fopen(files->output, "w");
+  cbe_generate(ctx, fp);
+  fclose(fp);
+  if (files->stats != NULL) {
+    fp = fopen(files->stats, "w");
+    cbe_write_stats(ctx, fp);
+    fclose(fp);
+  }
+  if (files->trace != NULL) {
+    fp = fopen(files->trace, "wb");
+    cbe_write_trace(ctx, fp);
+    fclose(fp);
+  }
+  return true;
+}
+
+// Compiles the module written by cbe_write_module to `path` instead of the
+// demo below.
+static int compile_module(struct cbe_context *ctx, cstr path,
+                          struct files *files) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open module %s\n", path);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  u8 *data = CBE_ALLOC(size + 1);
+  size = size > 0 ? (long)fread(data, 1, size, fp) : 0;
+  fclose(fp);
+  if (!cbe_read_module(ctx, data, size)) {
+    fprintf(stderr, "malformed module %s\n", path);
+    return 1;
+  }
+  return compile(ctx, files) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  a_init(64 * 1024 * 1024);
 
   struct cbe_context ctx;
   cbe_init(&ctx);
 
+  // --instrument makes out.s count block executions into cbe.profile, and
+  // --profile <file> feeds such a profile back into the compilation.
+  // --inline inlines square() into sum() and drain() into main(), and
+  // --schedule reorders instructions within blocks. --module <file> compiles
+  // a serialized module instead, and --output <file> writes somewhere other
+  // than out.s. --stats <file> writes timers and counters of the compilation
+  // as JSON, and --trace <file> [--trace-categories <list>] the decisions of
+  // the allocator and passes, which --decode <file> renders as text.
+  // --serve <socket> [--workers <n>] runs a compile server.
+  struct files files = {.output = "out.s"};
+  cstr module = NULL, serve = NULL, decode = NULL;
+  u32 categories = CBE_TRACE_ALLOCATION | CBE_TRACE_PASSES;
+  usz workers = 4;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--instrument") == 0)
+      ctx.options |= CBE_OPT_INSTRUMENT;
+    else if (strcmp(argv[i], "--inline") == 0)
+      ctx.options |= CBE_OPT_INLINE;
+    else if (strcmp(argv[i], "--schedule") == 0)
+      ctx.options |= CBE_OPT_SCHEDULE;
+    else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+      files.profile = argv[++i];
+    else if (strcmp(argv[i], "--module") == 0 && i + 1 < argc)
+      module = argv[++i];
+    else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+      files.output = argv[++i];
+    else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+      files.stats = argv[++i];
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      files.trace = argv[++i];
+    else if (strcmp(argv[i], "--trace-categories") == 0 && i + 1 < argc)
+      categories = cbe_trace_parse_categories(argv[++i]);
+    else if (strcmp(argv[i], "--decode") == 0 && i + 1 < argc)
+      decode = argv[++i];
+    else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      serve = argv[++i];
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+      workers = strtoul(argv[++i], NULL, 10);
+  }
+  if (serve != NULL) {
+    if (cbe_serve(serve, workers))
+      return 0;
+    fprintf(stderr, "could not serve on %s\n", serve);
+    return 1;
+  }
+  if (decode != NULL) {
+    FILE *fp = fopen(decode, "rb");
+    bool ok = fp != NULL && cbe_decode_trace(fp, stdout);
+    if (fp != NULL)
+      fclose(fp);
+    if (!ok)
+      fprintf(stderr, "could not decode trace %s\n", decode);
+    return ok ? 0 : 1;
+  }
+  if (files.trace != NULL)
+    cbe_trace_enable(&ctx, categories, 1 << 16);
+  if (module != NULL)
+    return compile_module(&ctx, module, &files);
+
   // {
   //   struct cbe_live_interval live_intervals[] = {
   //       (struct cbe_live_interval){
@@ -71,10 +222,229 @@ int main(void) {
           .tag = CBE_TYPE_PTR,
           .ptr = cbe_add_type(&ctx, (struct cbe_type){.tag = CBE_TYPE_INT})});
 
+  // square(x) = x * x
+  struct cbe_function square = {
+      .name_index = cbe_add_symbol(&ctx, "square"),
+      .type_id = int_type,
+      .local = true,
+  };
+  slice_init(&square.parameters);
+  slice_init(&square.blocks);
+  usz x = cbe_add_symbol(&ctx, "x");
+  slice_push(&square.parameters,
+             ((struct cbe_temporary){.name_index = x, .type_id = int_type}));
+  {
+    struct cbe_block entry = block(cbe_add_symbol(&ctx, "entry"));
+    usz result = cbe_add_symbol(&ctx, "result");
+    slice_push(&entry.instructions,
+               binary(CBE_INST_MUL, result, int_type, variable(int_type, x),
+                      variable(int_type, x)));
+    struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+    *value = variable(int_type, result);
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){.tag = CBE_INST_RET,
+                                         .ret = {value}}));
+    slice_push(&square.blocks, entry);
+  }
+  slice_push(&ctx.functions, square);
+
+  // sum(n) = square(0) + square(1) + ... + square(n - 1), with the counter
+  // and the accumulator kept in stack slots.
+  struct cbe_function sum = {
+      .name_index = cbe_add_symbol(&ctx, "sum"),
+      .type_id = int_type,
+      .local = true,
+  };
+  slice_init(&sum.parameters);
+  slice_init(&sum.blocks);
+  usz n = cbe_add_symbol(&ctx, "n");
+  slice_push(&sum.parameters,
+             ((struct cbe_temporary){.name_index = n, .type_id = int_type}));
+  {
+    usz loop_name = cbe_add_symbol(&ctx, "loop");
+    usz body_name = cbe_add_symbol(&ctx, "body");
+    usz done_name = cbe_add_symbol(&ctx, "done");
+    usz acc = cbe_add_symbol(&ctx, "acc");
+    usz i = cbe_add_symbol(&ctx, "i");
+
+    struct cbe_block entry = block(cbe_add_symbol(&ctx, "entry"));
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_ALLOC,
+                   .has_temporary = true,
+                   .temporary = {.name_index = acc, .type_id = int_ptr_type},
+                   .alloc = {int_type}}));
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_ALLOC,
+                   .has_temporary = true,
+                   .temporary = {.name_index = i, .type_id = int_ptr_type},
+                   .alloc = {int_type}}));
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_STORE,
+                   .store = {integer(int_type, 0),
+                             variable(int_ptr_type, acc)}}));
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_STORE,
+                   .store = {integer(int_type, 0),
+                             variable(int_ptr_type, i)}}));
+    slice_push(&entry.instructions, jmp(loop_name));
+
+    struct cbe_block loop = block(loop_name);
+    usz counter = cbe_add_symbol(&ctx, "counter");
+    usz more = cbe_add_symbol(&ctx, "more");
+    slice_push(&loop.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_LOAD,
+                   .has_temporary = true,
+                   .temporary = {.name_index = counter, .type_id = int_type},
+                   .load = {variable(int_ptr_type, i)}}));
+    slice_push(&loop.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_CMP,
+                   .has_temporary = true,
+                   .temporary = {.name_index = more, .type_id = int_type},
+                   .cmp = {CBE_PRED_LT, variable(int_type, counter),
+                           variable(int_type, n)}}));
+    slice_push(&loop.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_BR,
+                   .br = {.condition = variable(int_type, more),
+                          .then_block = body_name,
+                          .else_block = done_name}}));
+
+    struct cbe_block body = block(body_name);
+    usz current = cbe_add_symbol(&ctx, "current");
+    usz squared = cbe_add_symbol(&ctx, "squared");
+    usz next = cbe_add_symbol(&ctx, "next");
+    struct cbe_instruction call = {
+        .tag = CBE_INST_CALL,
+        .has_temporary = true,
+        .temporary = {.name_index = squared, .type_id = int_type},
+        .call = {.function = square.name_index}};
+    slice_init(&call.call.arguments);
+    slice_push(&call.call.arguments, variable(int_type, counter));
+    slice_push(&body.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_LOAD,
+                   .has_temporary = true,
+                   .temporary = {.name_index = current, .type_id = int_type},
+                   .load = {variable(int_ptr_type, acc)}}));
+    slice_push(&body.instructions, call);
+    slice_push(&body.instructions,
+               binary(CBE_INST_ADD, next, int_type,
+                      variable(int_type, current),
+                      variable(int_type, squared)));
+    slice_push(&body.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_STORE,
+                   .store = {variable(int_type, next),
+                             variable(int_ptr_type, acc)}}));
+    usz step = cbe_add_symbol(&ctx, "step");
+    slice_push(&body.instructions,
+               binary(CBE_INST_ADD, step, int_type,
+                      variable(int_type, counter), integer(int_type, 1)));
+    slice_push(&body.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_STORE,
+                   .store = {variable(int_type, step),
+                             variable(int_ptr_type, i)}}));
+    slice_push(&body.instructions, jmp(loop_name));
+
+    struct cbe_block done = block(done_name);
+    usz total = cbe_add_symbol(&ctx, "total");
+    slice_push(&done.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_LOAD,
+                   .has_temporary = true,
+                   .temporary = {.name_index = total, .type_id = int_type},
+                   .load = {variable(int_ptr_type, acc)}}));
+    struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+    *value = variable(int_type, total);
+    slice_push(&done.instructions,
+               ((struct cbe_instruction){.tag = CBE_INST_RET,
+                                         .ret = {value}}));
+
+    slice_push(&sum.blocks, entry);
+    slice_push(&sum.blocks, done);
+    slice_push(&sum.blocks, loop);
+    slice_push(&sum.blocks, body);
+  }
+  slice_push(&ctx.functions, sum);
+
+  // drain(n) = n == 0 ? 0 : drain(n - 1), which only runs in constant stack
+  // as a tail call.
+  struct cbe_function drain = {
+      .name_index = cbe_add_symbol(&ctx, "drain"),
+      .type_id = int_type,
+      .local = true,
+  };
+  slice_init(&drain.parameters);
+  slice_init(&drain.blocks);
+  usz m = cbe_add_symbol(&ctx, "m");
+  slice_push(&drain.parameters,
+             ((struct cbe_temporary){.name_index = m, .type_id = int_type}));
+  {
+    usz done_name = cbe_add_symbol(&ctx, "done");
+    usz again_name = cbe_add_symbol(&ctx, "again");
+    struct cbe_block entry = block(cbe_add_symbol(&ctx, "entry"));
+    usz zero = cbe_add_symbol(&ctx, "zero");
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_CMP,
+                   .has_temporary = true,
+                   .temporary = {.name_index = zero, .type_id = int_type},
+                   .cmp = {CBE_PRED_EQ, variable(int_type, m),
+                           integer(int_type, 0)}}));
+    slice_push(&entry.instructions,
+               ((struct cbe_instruction){
+                   .tag = CBE_INST_BR,
+                   .br = {.condition = variable(int_type, zero),
+                          .then_block = done_name,
+                          .else_block = again_name}}));
+
+    struct cbe_block done = block(done_name);
+    struct cbe_value *nothing = CBE_ALLOC(sizeof(struct cbe_value));
+    *nothing = integer(int_type, 0);
+    slice_push(&done.instructions,
+               ((struct cbe_instruction){.tag = CBE_INST_RET,
+                                         .ret = {nothing}}));
+
+    struct cbe_block again = block(again_name);
+    usz less = cbe_add_symbol(&ctx, "less");
+    usz drained = cbe_add_symbol(&ctx, "drained");
+    slice_push(&again.instructions,
+               binary(CBE_INST_SUB, less, int_type, variable(int_type, m),
+                      integer(int_type, 1)));
+    struct cbe_instruction call = {
+        .tag = CBE_INST_CALL,
+        .has_temporary = true,
+        .temporary = {.name_index = drained, .type_id = int_type},
+        .call = {.function = drain.name_index}};
+    slice_init(&call.call.arguments);
+    slice_push(&call.call.arguments, variable(int_type, less));
+    slice_push(&again.instructions, call);
+    struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+    *value = variable(int_type, drained);
+    slice_push(&again.instructions,
+               ((struct cbe_instruction){.tag = CBE_INST_RET,
+                                         .ret = {value}}));
+
+    slice_push(&drain.blocks, entry);
+    slice_push(&drain.blocks, done);
+    slice_push(&drain.blocks, again);
+  }
+  slice_push(&ctx.functions, drain);
+
+  // main() = 123 + sum(10) % 100 + drain(1 << 24), so the program exits with
+  // 208 rather than overflowing the stack.
   struct cbe_function main = {
       .name_index = cbe_add_symbol(&ctx, "main"),
       .type_id = int_type,
   };
+  slice_init(&main.parameters);
   slice_init(&main.blocks);
 
   struct cbe_block entry = {
@@ -110,20 +480,67 @@ int main(void) {
                    .type_id = int_ptr_type,
                    .variable = cbe_find_symbol(&ctx, "ptr")}}};
 
+  usz sum_result = cbe_add_symbol(&ctx, "sum_result");
+  struct cbe_instruction call = {
+      .tag = CBE_INST_CALL,
+      .has_temporary = true,
+      .temporary = {.name_index = sum_result, .type_id = int_type},
+      .call = {.function = sum.name_index}};
+  slice_init(&call.call.arguments);
+  slice_push(&call.call.arguments, integer(int_type, 10));
+
+  usz drained = cbe_add_symbol(&ctx, "drained");
+  struct cbe_instruction drain_call = {
+      .tag = CBE_INST_CALL,
+      .has_temporary = true,
+      .temporary = {.name_index = drained, .type_id = int_type},
+      .call = {.function = drain.name_index}};
+  slice_init(&drain_call.call.arguments);
+  slice_push(&drain_call.call.arguments, integer(int_type, 1 << 24));
+
+  usz remainder = cbe_add_symbol(&ctx, "remainder");
+  usz partial = cbe_add_symbol(&ctx, "partial");
+  usz result = cbe_add_symbol(&ctx, "result");
+  struct cbe_value *value = CBE_ALLOC(sizeof(struct cbe_value));
+  *value = variable(int_type, result);
+
   slice_push(&entry.instructions, alloc);
   slice_push(&entry.instructions, store);
   slice_push(&entry.instructions, load);
+  slice_push(&entry.instructions, call);
+  slice_push(&entry.instructions, drain_call);
+  slice_push(&entry.instructions,
+             binary(CBE_INST_REM, remainder, int_type,
+                    variable(int_type, sum_result), integer(int_type, 100)));
+  slice_push(&entry.instructions,
+             binary(CBE_INST_ADD, partial, int_type,
+                    variable(int_type, cbe_find_symbol(&ctx, "value")),
+                    variable(int_type, remainder)));
+  slice_push(&entry.instructions,
+             binary(CBE_INST_ADD, result, int_type,
+                    variable(int_type, partial),
+                    variable(int_type, drained)));
+  slice_push(&entry.instructions,
+             ((struct cbe_instruction){.tag = CBE_INST_RET, .ret = {value}}));
 
   slice_push(&main.blocks, entry);
 
   slice_push(&ctx.functions, main);
 
-  cbe_validate(&ctx);
-
-  FILE *fp = fopen("out.s", "w");
-  cbe_generate(&ctx, fp);
-  fclose(fp);
+  if (!compile(&ctx, &files))
+    return 1;
 
   cbe_debug_symbol_table(&ctx);
   cbe_debug_stack_variables(&ctx);
+
+  for (usz i = 0; files.profile != NULL && i < ctx.functions.size; i++) {
+    struct cbe_function *fn = &ctx.functions.items[i];
+    printf("%s: entered %llu times\n", ctx.symbol_table.items[fn->name_index],
+           (unsigned long long)fn->weight);
+    for (usz j = 0; j < fn->blocks.size; j++) {
+      struct cbe_block *block = &fn->blocks.items[j];
+      printf("  %s: %llu\n", ctx.symbol_table.items[block->name_index],
+             (unsigned long long)block->weight);
+    }
+  }
 }
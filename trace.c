@@ -0,0 +1,250 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Decision traces.
+//
+// CBE_TRACE writes a fixed-size record into the ring buffer of the context
+// when the category of its event is enabled, and does nothing but test a bit
+// otherwise. There is one writer, the compiling thread, which publishes every
+// record by bumping `head` with a release store, so another thread may copy
+// out the last `capacity` records without locking. When the ring is full the
+// oldest records are overwritten.
+//
+// cbe_write_trace saves the ring along with the names its records refer to,
+// as little-endian fields in this order:
+//
+//   header    "CBET", u32 version, u32 categories, u32 record count,
+//             u64 records dropped, u32 symbol and interval counts
+//   symbol    u32 length, the bytes of the name
+//   interval  u32 name index of the value of every live interval id
+//   record    struct cbe_trace_record, oldest first
+//
+// and cbe_decode_trace renders such a file as text, one record a line.
+
+#define CBE_TRACE_MAGIC "CBET"
+#define CBE_TRACE_VERSION 1
+
+static const struct {
+  cstr name;
+  u32 category;
+} cbe_trace_categories[] = {
+    {"allocation", CBE_TRACE_ALLOCATION},
+    {"passes", CBE_TRACE_PASSES},
+};
+
+static const cstr cbe_trace_events[CBE_EVENT_COUNT] = {
+    [CBE_EVENT_INTERVAL] = "interval", [CBE_EVENT_ALLOCATE] = "allocate",
+    [CBE_EVENT_SPILL] = "spill",       [CBE_EVENT_COALESCE] = "coalesce",
+    [CBE_EVENT_SPILLS] = "spills",     [CBE_EVENT_INLINE] = "inline",
+    [CBE_EVENT_SCHEDULE] = "schedule", [CBE_EVENT_SCALAR] = "scalar",
+    [CBE_EVENT_REMOVE] = "remove",
+};
+
+// Records `categories` from now on into a ring of at least `capacity`
+// records, keeping whatever the ring already holds if it is large enough.
+void cbe_trace_enable(struct cbe_context *ctx, u32 categories,
+                      usz capacity) {
+  push_stack_frame(ctx);
+  usz size = 1;
+  while (size < capacity)
+    size *= 2;
+  if (size > ctx->trace.capacity) {
+    ctx->trace.records = CBE_ALLOC(sizeof(*ctx->trace.records) * size);
+    ctx->trace.capacity = size;
+    ctx->trace.head = 0;
+  }
+  ctx->trace.categories = categories;
+  pop_stack_frame(ctx);
+}
+
+void cbe_trace_record(struct cbe_context *ctx,
+                      struct cbe_trace_record record) {
+  u64 head = ctx->trace.head;
+  ctx->trace.records[head & (ctx->trace.capacity - 1)] = record;
+  __atomic_store_n(&ctx->trace.head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Categories named in the comma-separated `list`, or all of them for "all".
+// Unknown names are ignored.
+u32 cbe_trace_parse_categories(cstr list) {
+  u32 categories = 0;
+  while (*list != '\0') {
+    usz length = strcspn(list, ",");
+    for (usz i = 0; i < CBE_ARRAY_LEN(cbe_trace_categories); i++) {
+      if (strlen(cbe_trace_categories[i].name) == length &&
+          strncmp(list, cbe_trace_categories[i].name, length) == 0)
+        categories |= cbe_trace_categories[i].category;
+    }
+    if (length == 3 && strncmp(list, "all", 3) == 0)
+      categories = CBE_TRACE_ALLOCATION | CBE_TRACE_PASSES;
+    list += length + (list[length] == ',');
+  }
+  return categories;
+}
+
+static void cbe_trace_write_u32(FILE *fp, u32 value) {
+  fwrite(&value, sizeof(value), 1, fp);
+}
+
+void cbe_write_trace(struct cbe_context *ctx, FILE *fp) {
+  push_stack_frame(ctx);
+  u64 head = __atomic_load_n(&ctx->trace.head, __ATOMIC_ACQUIRE);
+  u64 count = head < ctx->trace.capacity ? head : ctx->trace.capacity;
+  u64 dropped = head - count;
+  fwrite(CBE_TRACE_MAGIC, 1, 4, fp);
+  cbe_trace_write_u32(fp, CBE_TRACE_VERSION);
+  cbe_trace_write_u32(fp, ctx->trace.categories);
+  cbe_trace_write_u32(fp, count);
+  fwrite(&dropped, sizeof(dropped), 1, fp);
+  cbe_trace_write_u32(fp, ctx->symbol_table.size);
+  cbe_trace_write_u32(fp, ctx->live_intervals.size);
+  for (usz i = 0; i < ctx->symbol_table.size; i++) {
+    u32 length = strlen(ctx->symbol_table.items[i]);
+    cbe_trace_write_u32(fp, length);
+    fwrite(ctx->symbol_table.items[i], 1, length, fp);
+  }
+  for (usz i = 0; i < ctx->live_intervals.size; i++)
+    cbe_trace_write_u32(fp, ctx->live_intervals.items[i].name_index);
+  for (u64 i = dropped; i < head; i++)
+    fwrite(&ctx->trace.records[i & (ctx->trace.capacity - 1)],
+           sizeof(struct cbe_trace_record), 1, fp);
+  pop_stack_frame(ctx);
+}
+
+struct cbe_trace_file {
+  char **symbols;
+  u32 *intervals;
+  u32 symbol_count, interval_count;
+};
+
+static bool cbe_trace_read(FILE *fp, void *out, usz size) {
+  return fread(out, 1, size, fp) == size;
+}
+
+static cstr cbe_trace_symbol(struct cbe_trace_file *file, u32 index) {
+  return index < file->symbol_count ? file->symbols[index] : "?";
+}
+
+static cstr cbe_trace_interval(struct cbe_trace_file *file, u32 id) {
+  return id < file->interval_count
+             ? cbe_trace_symbol(file, file->intervals[id])
+             : "?";
+}
+
+static void cbe_trace_render(struct cbe_trace_file *file, FILE *out,
+                             struct cbe_trace_record *record) {
+  cstr reg = record->reg < CBE_REG_COUNT
+                 ? cbe_get_register_name(record->reg)
+                 : "?";
+  fprintf(out, "%-9s ",
+          record->event < CBE_EVENT_COUNT ? cbe_trace_events[record->event]
+                                          : "?");
+  switch (record->event) {
+  case CBE_EVENT_INTERVAL:
+    fprintf(out, "%s#%u [%u, %u]", cbe_trace_interval(file, record->id),
+            record->id, record->ip, record->operand);
+    break;
+  case CBE_EVENT_ALLOCATE:
+  case CBE_EVENT_SPILL:
+    fprintf(out, "%s#%u%s", cbe_trace_interval(file, record->id), record->id,
+            record->flags & CBE_TRACE_PIECE ? " piece" : "");
+    if (record->reg == CBE_REG_NONE)
+      fprintf(out, " spilled at %u", record->ip);
+    else if (record->event == CBE_EVENT_SPILL)
+      fprintf(out, " loses %s at %u", reg, record->ip);
+    else
+      fprintf(out, " gets %s at %u", reg, record->ip);
+    if (record->flags & CBE_TRACE_REMAT)
+      fprintf(out, ", recomputed at its uses");
+    if (record->flags & CBE_TRACE_SLOT)
+      fprintf(out, ", to a slot");
+    break;
+  case CBE_EVENT_COALESCE:
+    fprintf(out, "%s#%u takes %s from %s#%u at %u",
+            cbe_trace_interval(file, record->id), record->id, reg,
+            cbe_trace_interval(file, record->operand), record->operand,
+            record->ip);
+    break;
+  case CBE_EVENT_SPILLS:
+    fprintf(out, "%s: %u stores, %u loads",
+            cbe_trace_symbol(file, record->id), record->ip, record->operand);
+    break;
+  case CBE_EVENT_INLINE:
+    fprintf(out, "%s into %s", cbe_trace_symbol(file, record->id),
+            cbe_trace_symbol(file, record->operand));
+    break;
+  case CBE_EVENT_SCHEDULE:
+    fprintf(out, "%s: %u -> %u cycles", cbe_trace_symbol(file, record->id),
+            record->ip, record->operand);
+    break;
+  case CBE_EVENT_SCALAR:
+    fprintf(out, "loop %s has no vector form on this target",
+            cbe_trace_symbol(file, record->id));
+    break;
+  case CBE_EVENT_REMOVE:
+    if (record->flags & CBE_TRACE_GLOBAL)
+      fprintf(out, "global %s is unreachable",
+              cbe_trace_symbol(file, record->id));
+    else
+      fprintf(out, "function %s is unreachable, %u instructions",
+              cbe_trace_symbol(file, record->id), record->operand);
+    break;
+  }
+  fprintf(out, "\n");
+}
+
+// Renders the trace in `in` to `out`. Returns false if it is malformed.
+bool cbe_decode_trace(FILE *in, FILE *out) {
+  char magic[4];
+  u32 version, categories, count;
+  u64 dropped;
+  struct cbe_trace_file file = {0};
+  if (!cbe_trace_read(in, magic, sizeof(magic)) ||
+      memcmp(magic, CBE_TRACE_MAGIC, sizeof(magic)) != 0 ||
+      !cbe_trace_read(in, &version, sizeof(version)) ||
+      version != CBE_TRACE_VERSION ||
+      !cbe_trace_read(in, &categories, sizeof(categories)) ||
+      !cbe_trace_read(in, &count, sizeof(count)) ||
+      !cbe_trace_read(in, &dropped, sizeof(dropped)) ||
+      !cbe_trace_read(in, &file.symbol_count, sizeof(u32)) ||
+      !cbe_trace_read(in, &file.interval_count, sizeof(u32)))
+    return false;
+
+  bool ok = true;
+  file.symbols = calloc(file.symbol_count + 1, sizeof(*file.symbols));
+  for (u32 i = 0; ok && i < file.symbol_count; i++) {
+    u32 length;
+    ok = cbe_trace_read(in, &length, sizeof(length)) &&
+         (file.symbols[i] = malloc(length + 1)) != NULL &&
+         cbe_trace_read(in, file.symbols[i], length);
+    if (ok)
+      file.symbols[i][length] = '\0';
+  }
+  file.intervals = malloc(sizeof(u32) * (file.interval_count + 1));
+  ok = ok && cbe_trace_read(in, file.intervals,
+                            sizeof(u32) * file.interval_count);
+
+  fprintf(out, "%u records", count);
+  if (dropped > 0)
+    fprintf(out, ", %llu older ones dropped", (unsigned long long)dropped);
+  fprintf(out, ", categories:");
+  for (usz i = 0; i < CBE_ARRAY_LEN(cbe_trace_categories); i++) {
+    if (categories & cbe_trace_categories[i].category)
+      fprintf(out, " %s", cbe_trace_categories[i].name);
+  }
+  fprintf(out, "\n");
+  for (u32 i = 0; ok && i < count; i++) {
+    struct cbe_trace_record record;
+    ok = cbe_trace_read(in, &record, sizeof(record));
+    if (ok)
+      cbe_trace_render(&file, out, &record);
+  }
+
+  for (u32 i = 0; i < file.symbol_count; i++)
+    free(file.symbols[i]);
+  free(file.symbols);
+  free(file.intervals);
+  return ok;
+}
@@ -0,0 +1,730 @@
+#include "cbe.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Validation.
+//
+// cbe_validate_block checks each instruction right before building its isel
+// tree, in the same walk that numbers the trees for liveness, so the IR of a
+// function is only traversed once. An instruction that fails is described by
+// a struct cbe_diagnostic in ctx->diagnostics instead of stopping the
+// compilation; a function with any of them is left without code, and
+// cbe_validate returns the first result that was not CBE_VALID_OK.
+// cbe_check makes the same walk without building, before cbe_optimize.
+//
+// Types are not interned, so two type ids stand for the same type when their
+// structure is the same, see cbe_same_type. Operands are checked by the type
+// they carry: a pointer has to be loaded, stored or indexed through with the
+// type it points to, and a rawptr points to anything.
+//
+// The type an operand carries also has to be that of its definition. As the
+// blocks of a function are walked, the first definition of every symbol is
+// recorded with its type and block, see cbe_validate_definitions. A use of a
+// symbol defined by then is checked right away; any other waits for the end
+// of the function. A symbol first defined further down the same block is
+// used before its definition, one defined in a later block may reach the
+// use over a back edge, and one defined nowhere in the function has to be a
+// global variable, whose address it stands for.
+
+// Chains of pointers longer than this are taken to be cycles.
+#define CBE_TYPE_MAX_DEPTH 16
+
+static const cstr cbe_validation_results[CBE_VALID_RESULT_COUNT] = {
+    [CBE_VALID_OK] = "ok",
+    [CBE_VALID_TYPE_MISMATCH] = "type mismatch",
+    [CBE_VALID_MISSING_TERMINATOR] = "missing terminator",
+    [CBE_VALID_UNSUPPORTED_TYPE] = "unsupported type",
+    [CBE_VALID_UNKNOWN_TYPE] = "unknown type",
+    [CBE_VALID_UNKNOWN_SYMBOL] = "unknown symbol",
+    [CBE_VALID_UNKNOWN_BLOCK] = "unknown block",
+    [CBE_VALID_NOT_A_POINTER] = "not a pointer",
+    [CBE_VALID_MISSING_RESULT] = "missing result",
+    [CBE_VALID_MISPLACED_TERMINATOR] = "terminator before the end of a block",
+    [CBE_VALID_ARGUMENT_COUNT] = "wrong argument count",
+    [CBE_VALID_UNDEFINED_SYMBOL] = "undefined symbol",
+    [CBE_VALID_USED_BEFORE_DEFINED] = "used before its definition",
+};
+
+static const cstr cbe_instruction_names[] = {
+    [CBE_INST_ALLOC] = "alloc",         [CBE_INST_STORE] = "store",
+    [CBE_INST_LOAD] = "load",           [CBE_INST_RET] = "ret",
+    [CBE_INST_ADD] = "add",             [CBE_INST_SUB] = "sub",
+    [CBE_INST_MUL] = "mul",             [CBE_INST_DIV] = "div",
+    [CBE_INST_REM] = "rem",             [CBE_INST_AND] = "and",
+    [CBE_INST_OR] = "or",               [CBE_INST_XOR] = "xor",
+    [CBE_INST_SHL] = "shl",             [CBE_INST_SHR] = "shr",
+    [CBE_INST_SAR] = "sar",             [CBE_INST_ELEMPTR] = "elemptr",
+    [CBE_INST_CMP] = "cmp",             [CBE_INST_SELECT] = "select",
+    [CBE_INST_BROADCAST] = "broadcast", [CBE_INST_BR] = "br",
+    [CBE_INST_JMP] = "jmp",             [CBE_INST_CALL] = "call",
+};
+
+static const cstr cbe_type_names[] = {
+    [CBE_TYPE_BYTE] = "byte",     [CBE_TYPE_SHORT] = "short",
+    [CBE_TYPE_INT] = "int",       [CBE_TYPE_LONG] = "long",
+    [CBE_TYPE_RAWPTR] = "rawptr", [CBE_TYPE_PTR] = "ptr",
+    [CBE_TYPE_VOID] = "void",     [CBE_TYPE_FLOAT] = "float",
+    [CBE_TYPE_DOUBLE] = "double", [CBE_TYPE_VECTOR] = "vector",
+};
+
+static enum cbe_type_tag cbe_tag(struct cbe_context *ctx, cbe_type_id id) {
+  return ctx->types.items[id].tag;
+}
+
+static bool cbe_is_integer(struct cbe_context *ctx, cbe_type_id id) {
+  return cbe_tag(ctx, id) <= CBE_TYPE_LONG;
+}
+
+static bool cbe_is_pointer(struct cbe_context *ctx, cbe_type_id id) {
+  enum cbe_type_tag tag = cbe_tag(ctx, id);
+  return tag == CBE_TYPE_PTR || tag == CBE_TYPE_RAWPTR;
+}
+
+// Pointers are offset and subtracted as longs.
+static bool cbe_is_address(struct cbe_context *ctx, cbe_type_id id) {
+  return cbe_is_pointer(ctx, id) || cbe_tag(ctx, id) == CBE_TYPE_LONG;
+}
+
+static bool cbe_is_float(struct cbe_context *ctx, cbe_type_id id) {
+  return cbe_tag(ctx, id) == CBE_TYPE_FLOAT ||
+         cbe_tag(ctx, id) == CBE_TYPE_DOUBLE;
+}
+
+static usz cbe_lanes(struct cbe_context *ctx, cbe_type_id id) {
+  struct cbe_type type = ctx->types.items[id];
+  return type.tag == CBE_TYPE_VECTOR ? type.lanes : 1;
+}
+
+// Whether `id` and the types it is made of are all in the type table.
+static bool cbe_known_type(struct cbe_context *ctx, cbe_type_id id) {
+  for (usz depth = 0; depth < CBE_TYPE_MAX_DEPTH; depth++) {
+    if (id >= ctx->types.size)
+      return false;
+    struct cbe_type type = ctx->types.items[id];
+    if (type.tag == CBE_TYPE_PTR)
+      id = type.ptr;
+    else if (type.tag == CBE_TYPE_VECTOR)
+      id = type.element;
+    else
+      return true;
+  }
+  return true;
+}
+
+bool cbe_same_type(struct cbe_context *ctx, cbe_type_id a, cbe_type_id b) {
+  for (usz depth = 0; depth < CBE_TYPE_MAX_DEPTH; depth++) {
+    if (a == b)
+      return true;
+    if (a >= ctx->types.size || b >= ctx->types.size)
+      return false;
+    struct cbe_type x = ctx->types.items[a], y = ctx->types.items[b];
+    if (cbe_is_pointer(ctx, a) && cbe_is_pointer(ctx, b)) {
+      if (x.tag == CBE_TYPE_RAWPTR || y.tag == CBE_TYPE_RAWPTR)
+        return true;
+      a = x.ptr;
+      b = y.ptr;
+      continue;
+    }
+    if (x.tag != y.tag)
+      return false;
+    if (x.tag != CBE_TYPE_VECTOR)
+      return true;
+    if (x.lanes != y.lanes)
+      return false;
+    a = x.element;
+    b = y.element;
+  }
+  return true;
+}
+
+// Whether the pointer type `pointer` may be used to reach a `pointee`: what
+// it points to, or a vector of as many of them side by side.
+static bool cbe_points_to(struct cbe_context *ctx, cbe_type_id pointer,
+                          cbe_type_id pointee) {
+  struct cbe_type type = ctx->types.items[pointer];
+  if (type.tag == CBE_TYPE_RAWPTR || cbe_same_type(ctx, type.ptr, pointee))
+    return true;
+  struct cbe_type vector = ctx->types.items[pointee];
+  return vector.tag == CBE_TYPE_VECTOR &&
+         cbe_same_type(ctx, type.ptr, vector.element);
+}
+
+static int cbe_append(char *buffer, usz size, int length, cstr format, ...) {
+  va_list args;
+  va_start(args, format);
+  usz at = (usz)length;
+  int written = at < size ? vsnprintf(buffer + at, size - at, format, args)
+                          : vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  return length + written;
+}
+
+// "int", "ptr ptr long" or "<4 x float>", "?" for what is not in the table.
+int cbe_format_type(struct cbe_context *ctx, char *buffer, usz size,
+                    cbe_type_id id) {
+  int length = 0;
+  if (size > 0)
+    buffer[0] = '\0';
+  for (usz depth = 0; depth < CBE_TYPE_MAX_DEPTH; depth++) {
+    if (id >= ctx->types.size)
+      break;
+    struct cbe_type type = ctx->types.items[id];
+    if (type.tag == CBE_TYPE_PTR) {
+      length = cbe_append(buffer, size, length, "ptr ");
+      id = type.ptr;
+      continue;
+    }
+    if (type.tag != CBE_TYPE_VECTOR)
+      return cbe_append(buffer, size, length, "%s", cbe_type_names[type.tag]);
+    if (type.element >= ctx->types.size)
+      break;
+    return cbe_append(buffer, size, length, "<%zu x %s>", type.lanes,
+                      cbe_type_names[cbe_tag(ctx, type.element)]);
+  }
+  return cbe_append(buffer, size, length, "?");
+}
+
+// Fills in `diagnostic`, if there is one, and returns `result`.
+static enum cbe_validation_result
+cbe_fail(struct cbe_diagnostic *diagnostic, enum cbe_validation_result result,
+         usz operand, cbe_type_id expected, cbe_type_id found) {
+  if (diagnostic != NULL) {
+    diagnostic->result = result;
+    diagnostic->operand = operand;
+    diagnostic->expected = expected;
+    diagnostic->found = found;
+  }
+  return result;
+}
+
+// Operand `k` of `inst` has to be of type `expected`.
+static enum cbe_validation_result
+cbe_expect(struct cbe_context *ctx, struct cbe_instruction *inst, usz k,
+           cbe_type_id expected, struct cbe_diagnostic *diagnostic) {
+  cbe_type_id found = cbe_instruction_operand(inst, k)->type_id;
+  if (cbe_same_type(ctx, expected, found))
+    return CBE_VALID_OK;
+  return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, k, expected, found);
+}
+
+// Operand `k` of `inst` has to be an integer, or a vector of `lanes` of them
+// when `lanes` is more than one.
+static enum cbe_validation_result
+cbe_expect_integer(struct cbe_context *ctx, struct cbe_instruction *inst,
+                   usz k, usz lanes, struct cbe_diagnostic *diagnostic) {
+  cbe_type_id found = cbe_instruction_operand(inst, k)->type_id;
+  cbe_type_id scalar = found;
+  if (cbe_tag(ctx, found) == CBE_TYPE_VECTOR)
+    scalar = ctx->types.items[found].element;
+  if (cbe_is_integer(ctx, scalar) && cbe_lanes(ctx, found) == lanes)
+    return CBE_VALID_OK;
+  return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, k, SIZE_MAX, found);
+}
+
+// Operand `k` of `inst` has to be a pointer to `pointee`.
+static enum cbe_validation_result
+cbe_expect_pointer(struct cbe_context *ctx, struct cbe_instruction *inst,
+                   usz k, cbe_type_id pointee,
+                   struct cbe_diagnostic *diagnostic) {
+  cbe_type_id found = cbe_instruction_operand(inst, k)->type_id;
+  if (!cbe_is_pointer(ctx, found))
+    return cbe_fail(diagnostic, CBE_VALID_NOT_A_POINTER, k, SIZE_MAX, found);
+  if (!cbe_points_to(ctx, found, pointee))
+    return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, k, SIZE_MAX, found);
+  return CBE_VALID_OK;
+}
+
+static usz cbe_function_by_name(struct cbe_context *ctx, usz name_index) {
+  for (usz i = 0; i < ctx->functions.size; i++) {
+    if (ctx->functions.items[i].name_index == name_index)
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+// Calls pass their arguments in registers only, and to a function of the
+// module as many of them as it has parameters, of the same types.
+static enum cbe_validation_result
+cbe_validate_call(struct cbe_context *ctx, struct cbe_instruction *inst,
+                  struct cbe_diagnostic *diagnostic) {
+  if (inst->call.function >= ctx->symbol_table.size)
+    return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_SYMBOL, SIZE_MAX, SIZE_MAX,
+                    SIZE_MAX);
+  usz count = inst->call.arguments.size, vectors = 0;
+  for (usz k = 0; k < count; k++) {
+    cbe_type_id id = inst->call.arguments.items[k].type_id;
+    vectors += cbe_type_register_class(ctx, id) == CBE_REGISTER_CLASS_VECTOR;
+  }
+  if (count - vectors > CBE_ARGUMENT_REGISTERS ||
+      vectors > CBE_VECTOR_ARGUMENT_REGISTERS)
+    return cbe_fail(diagnostic, CBE_VALID_ARGUMENT_COUNT, SIZE_MAX, SIZE_MAX,
+                    SIZE_MAX);
+
+  usz callee = cbe_function_by_name(ctx, inst->call.function);
+  if (callee == SIZE_MAX)
+    return CBE_VALID_OK;
+  struct cbe_function *fn = &ctx->functions.items[callee];
+  if (count != fn->parameters.size)
+    return cbe_fail(diagnostic, CBE_VALID_ARGUMENT_COUNT, SIZE_MAX, SIZE_MAX,
+                    SIZE_MAX);
+  for (usz k = 0; k < count; k++) {
+    enum cbe_validation_result result =
+        cbe_expect(ctx, inst, k, fn->parameters.items[k].type_id, diagnostic);
+    if (result != CBE_VALID_OK)
+      return result;
+  }
+  if (inst->has_temporary &&
+      !cbe_same_type(ctx, fn->type_id, inst->temporary.type_id))
+    return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, SIZE_MAX,
+                    fn->type_id, inst->temporary.type_id);
+  return CBE_VALID_OK;
+}
+
+// What `inst` does with the types of its operands and result, once they are
+// known to be in the type table.
+static enum cbe_validation_result
+cbe_validate_operands(struct cbe_context *ctx, struct cbe_instruction *inst,
+                      struct cbe_diagnostic *diagnostic) {
+  cbe_type_id result_type = inst->temporary.type_id;
+  struct cbe_function *fn = ctx->current_function;
+  enum cbe_validation_result result = CBE_VALID_OK;
+  switch (inst->tag) {
+  case CBE_INST_ALLOC:
+    if (!cbe_is_pointer(ctx, result_type))
+      return cbe_fail(diagnostic, CBE_VALID_NOT_A_POINTER, SIZE_MAX, SIZE_MAX,
+                      result_type);
+    if (!cbe_points_to(ctx, result_type, inst->alloc.type))
+      return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, SIZE_MAX, SIZE_MAX,
+                      result_type);
+    return CBE_VALID_OK;
+  case CBE_INST_STORE:
+    return cbe_expect_pointer(ctx, inst, 1, inst->store.value.type_id,
+                              diagnostic);
+  case CBE_INST_LOAD:
+    return cbe_expect_pointer(ctx, inst, 0, result_type, diagnostic);
+  case CBE_INST_RET:
+    if (fn == NULL)
+      return CBE_VALID_OK;
+    if (!cbe_known_type(ctx, fn->type_id))
+      return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_TYPE, SIZE_MAX, SIZE_MAX,
+                      SIZE_MAX);
+    if (inst->ret.value != NULL)
+      return cbe_expect(ctx, inst, 0, fn->type_id, diagnostic);
+    if (cbe_tag(ctx, fn->type_id) != CBE_TYPE_VOID)
+      return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, SIZE_MAX,
+                      fn->type_id, SIZE_MAX);
+    return CBE_VALID_OK;
+  case CBE_INST_SHL:
+  case CBE_INST_SHR:
+  case CBE_INST_SAR:
+    // The count is any integer, or a vector of counts.
+    result = cbe_expect(ctx, inst, 0, result_type, diagnostic);
+    if (result != CBE_VALID_OK || cbe_same_type(ctx, result_type,
+                                                inst->binary.rhs.type_id))
+      return result;
+    return cbe_expect_integer(ctx, inst, 1, 1, diagnostic);
+  case CBE_INST_ELEMPTR:
+    if (!cbe_is_pointer(ctx, inst->elemptr.pointer.type_id))
+      return cbe_fail(diagnostic, CBE_VALID_NOT_A_POINTER, 0, SIZE_MAX,
+                      inst->elemptr.pointer.type_id);
+    result = cbe_expect(ctx, inst, 0, result_type, diagnostic);
+    if (result != CBE_VALID_OK)
+      return result;
+    return cbe_expect_integer(ctx, inst, 1, 1, diagnostic);
+  case CBE_INST_CMP:
+    result = cbe_expect(ctx, inst, 1, inst->cmp.lhs.type_id, diagnostic);
+    if (result != CBE_VALID_OK)
+      return result;
+    // An integer flag, or a mask per lane.
+    if (cbe_lanes(ctx, result_type) != cbe_lanes(ctx, inst->cmp.lhs.type_id) ||
+        (cbe_lanes(ctx, result_type) == 1 && !cbe_is_integer(ctx, result_type)))
+      return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, SIZE_MAX,
+                      inst->cmp.lhs.type_id, result_type);
+    return CBE_VALID_OK;
+  case CBE_INST_SELECT:
+    result = cbe_expect(ctx, inst, 1, result_type, diagnostic);
+    if (result == CBE_VALID_OK)
+      result = cbe_expect(ctx, inst, 2, result_type, diagnostic);
+    if (result != CBE_VALID_OK)
+      return result;
+    if (cbe_lanes(ctx, inst->select.condition.type_id) == 1)
+      return cbe_expect_integer(ctx, inst, 0, 1, diagnostic);
+    return cbe_expect_integer(ctx, inst, 0, cbe_lanes(ctx, result_type),
+                              diagnostic);
+  case CBE_INST_BROADCAST:
+    if (cbe_tag(ctx, result_type) != CBE_TYPE_VECTOR)
+      return cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, SIZE_MAX, SIZE_MAX,
+                      result_type);
+    return cbe_expect(ctx, inst, 0, ctx->types.items[result_type].element,
+                      diagnostic);
+  case CBE_INST_BR:
+    result = cbe_expect_integer(ctx, inst, 0, 1, diagnostic);
+    if (result != CBE_VALID_OK || fn == NULL)
+      return result;
+    if (cbe_find_block_index(fn, inst->br.then_block) == SIZE_MAX ||
+        cbe_find_block_index(fn, inst->br.else_block) == SIZE_MAX)
+      return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_BLOCK, SIZE_MAX, SIZE_MAX,
+                      SIZE_MAX);
+    return CBE_VALID_OK;
+  case CBE_INST_JMP:
+    if (fn != NULL && cbe_find_block_index(fn, inst->jmp.block) == SIZE_MAX)
+      return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_BLOCK, SIZE_MAX, SIZE_MAX,
+                      SIZE_MAX);
+    return CBE_VALID_OK;
+  case CBE_INST_CALL:
+    return cbe_validate_call(ctx, inst, diagnostic);
+  default:
+    if ((inst->tag == CBE_INST_ADD || inst->tag == CBE_INST_SUB) &&
+        cbe_is_address(ctx, result_type) &&
+        cbe_is_address(ctx, inst->binary.lhs.type_id) &&
+        cbe_is_address(ctx, inst->binary.rhs.type_id))
+      return CBE_VALID_OK;
+    result = cbe_expect(ctx, inst, 0, result_type, diagnostic);
+    if (result != CBE_VALID_OK)
+      return result;
+    return cbe_expect(ctx, inst, 1, result_type, diagnostic);
+  }
+}
+
+static bool cbe_needs_result(enum cbe_instruction_tag tag) {
+  return tag != CBE_INST_STORE && tag != CBE_INST_CALL &&
+         !cbe_is_terminator(tag);
+}
+
+// Checks `inst` against the function being validated, if any, and fills in
+// the result, operand and types of `diagnostic`, if there is one, when it
+// fails.
+enum cbe_validation_result
+cbe_validate_instruction(struct cbe_context *ctx, struct cbe_instruction *inst,
+                         struct cbe_diagnostic *diagnostic) {
+  enum cbe_validation_result result;
+  if (inst->has_temporary) {
+    cbe_type_id id = inst->temporary.type_id;
+    if (inst->temporary.name_index >= ctx->symbol_table.size)
+      return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_SYMBOL, SIZE_MAX,
+                      SIZE_MAX, SIZE_MAX);
+    if (!cbe_known_type(ctx, id))
+      return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_TYPE, SIZE_MAX, SIZE_MAX,
+                      SIZE_MAX);
+    result = cbe_validate_type(ctx, ctx->types.items[id]);
+    if (result != CBE_VALID_OK)
+      return cbe_fail(diagnostic, result, SIZE_MAX, SIZE_MAX, id);
+  } else if (cbe_needs_result(inst->tag)) {
+    return cbe_fail(diagnostic, CBE_VALID_MISSING_RESULT, SIZE_MAX, SIZE_MAX,
+                    SIZE_MAX);
+  }
+  if (inst->tag == CBE_INST_ALLOC && !cbe_known_type(ctx, inst->alloc.type))
+    return cbe_fail(diagnostic, CBE_VALID_UNKNOWN_TYPE, SIZE_MAX, SIZE_MAX,
+                    SIZE_MAX);
+  for (usz k = 0; k < cbe_instruction_operand_count(inst); k++) {
+    struct cbe_value *value = cbe_instruction_operand(inst, k);
+    result = cbe_validate_value(ctx, *value);
+    if (result == CBE_VALID_UNKNOWN_TYPE || result == CBE_VALID_UNKNOWN_SYMBOL)
+      return cbe_fail(diagnostic, result, k, SIZE_MAX, SIZE_MAX);
+    if (result != CBE_VALID_OK)
+      return cbe_fail(diagnostic, result, k, SIZE_MAX, value->type_id);
+  }
+
+  result = cbe_validate_operands(ctx, inst, diagnostic);
+  if (result != CBE_VALID_OK)
+    return result;
+  if (!cbe_isel_is_supported(ctx, inst))
+    return cbe_fail(diagnostic, CBE_VALID_UNSUPPORTED_TYPE, SIZE_MAX, SIZE_MAX,
+                    SIZE_MAX);
+  return CBE_VALID_OK;
+}
+
+// A value has a known type that fits it: strings are pointers and float
+// constants floats or vectors of them.
+enum cbe_validation_result cbe_validate_value(struct cbe_context *ctx,
+                                              struct cbe_value value) {
+  if (!cbe_known_type(ctx, value.type_id))
+    return CBE_VALID_UNKNOWN_TYPE;
+  struct cbe_type type = ctx->types.items[value.type_id];
+  cbe_type_id scalar = value.type_id;
+  if (type.tag == CBE_TYPE_VECTOR)
+    scalar = type.element;
+  switch (value.tag) {
+  case CBE_VALUE_VARIABLE:
+    if (value.variable >= ctx->symbol_table.size)
+      return CBE_VALID_UNKNOWN_SYMBOL;
+    break;
+  case CBE_VALUE_STRING:
+    if (!cbe_is_pointer(ctx, value.type_id))
+      return CBE_VALID_TYPE_MISMATCH;
+    break;
+  case CBE_VALUE_FLOAT:
+    if (!cbe_is_float(ctx, scalar))
+      return CBE_VALID_TYPE_MISMATCH;
+    break;
+  default:
+    if (type.tag == CBE_TYPE_VOID)
+      return CBE_VALID_TYPE_MISMATCH;
+    break;
+  }
+  return cbe_validate_type(ctx, type);
+}
+
+// Vectors hold ints, longs, floats or doubles and fill an xmm register, or a
+// ymm register when the target has AVX2.
+enum cbe_validation_result cbe_validate_type(struct cbe_context *ctx,
+                                             struct cbe_type type) {
+  if (type.tag != CBE_TYPE_VECTOR)
+    return CBE_VALID_OK;
+  switch (ctx->types.items[type.element].tag) {
+  case CBE_TYPE_INT:
+  case CBE_TYPE_LONG:
+  case CBE_TYPE_FLOAT:
+  case CBE_TYPE_DOUBLE:
+    break;
+  default:
+    return CBE_VALID_UNSUPPORTED_TYPE;
+  }
+  usz size = type.lanes * cbe_type_size(ctx, type.element);
+  if (size == 16 || (size == 32 && (ctx->target_features & CBE_TARGET_AVX2)))
+    return CBE_VALID_OK;
+  return CBE_VALID_UNSUPPORTED_TYPE;
+}
+
+static struct cbe_definition *cbe_definition(struct cbe_context *ctx,
+                                             usz name_index) {
+  if (name_index >= ctx->checked_definitions.size)
+    return NULL;
+  struct cbe_definition *definition =
+      &ctx->checked_definitions.items[name_index];
+  return definition->walk == ctx->definition_walks ? definition : NULL;
+}
+
+// Records the first definition of `name_index` in the function, or checks a
+// later one against it.
+static enum cbe_validation_result cbe_define(struct cbe_context *ctx,
+                                             usz name_index, usz block,
+                                             cbe_type_id type_id) {
+  struct cbe_definition *definition = cbe_definition(ctx, name_index);
+  if (definition != NULL)
+    return cbe_same_type(ctx, definition->type_id, type_id)
+               ? CBE_VALID_OK
+               : CBE_VALID_TYPE_MISMATCH;
+  if (name_index < ctx->checked_definitions.size)
+    ctx->checked_definitions.items[name_index] =
+        (struct cbe_definition){ctx->definition_walks, block, type_id};
+  return CBE_VALID_OK;
+}
+
+// Starts the definitions of `fn` over from its parameters, once its
+// signature has been checked.
+void cbe_validate_begin_definitions(struct cbe_context *ctx,
+                                    struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  while (ctx->checked_definitions.size < ctx->symbol_table.size)
+    slice_push(&ctx->checked_definitions, (struct cbe_definition){0});
+  ctx->definition_walks++;
+  ctx->pending_uses.size = 0;
+  for (usz k = 0; k < fn->parameters.size; k++) {
+    struct cbe_temporary *parameter = &fn->parameters.items[k];
+    if (cbe_known_type(ctx, parameter->type_id))
+      (void)cbe_define(ctx, parameter->name_index, SIZE_MAX,
+                       parameter->type_id);
+  }
+  pop_stack_frame(ctx);
+}
+
+// Checks the variables `inst`, of the block at `block`, reads against their
+// definitions so far, leaving the others for cbe_validate_end_definitions,
+// and then records its result. `diagnostic` has its instruction filled in;
+// without one, for an instruction that already failed, only the result is
+// recorded.
+enum cbe_validation_result
+cbe_validate_definitions(struct cbe_context *ctx, struct cbe_instruction *inst,
+                         usz block, struct cbe_diagnostic *diagnostic) {
+  enum cbe_validation_result result = CBE_VALID_OK;
+  usz count = diagnostic != NULL ? cbe_instruction_operand_count(inst) : 0;
+  for (usz k = 0; k < count; k++) {
+    struct cbe_value *value = cbe_instruction_operand(inst, k);
+    if (value->tag != CBE_VALUE_VARIABLE)
+      continue;
+    struct cbe_definition *definition = cbe_definition(ctx, value->variable);
+    if (definition == NULL) {
+      struct cbe_pending_use use = {value->variable, block, value->type_id,
+                                    *diagnostic};
+      use.diagnostic.operand = k;
+      slice_push(&ctx->pending_uses, use);
+    } else if (!cbe_same_type(ctx, definition->type_id, value->type_id)) {
+      result = cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, k,
+                        definition->type_id, value->type_id);
+      break;
+    }
+  }
+  if (inst->has_temporary) {
+    cbe_type_id type_id = inst->temporary.type_id;
+    struct cbe_definition *definition =
+        cbe_definition(ctx, inst->temporary.name_index);
+    if (cbe_define(ctx, inst->temporary.name_index, block, type_id) !=
+            CBE_VALID_OK &&
+        result == CBE_VALID_OK)
+      result = cbe_fail(diagnostic, CBE_VALID_TYPE_MISMATCH, SIZE_MAX,
+                        definition->type_id, type_id);
+  }
+  return result;
+}
+
+// Checks the uses that came before any definition once the whole function
+// has been walked, recording what fails into ctx->diagnostics, and returns
+// the first failure.
+enum cbe_validation_result
+cbe_validate_end_definitions(struct cbe_context *ctx) {
+  push_stack_frame(ctx);
+  enum cbe_validation_result first = CBE_VALID_OK;
+  for (usz i = 0; i < ctx->pending_uses.size; i++) {
+    struct cbe_pending_use *use = &ctx->pending_uses.items[i];
+    struct cbe_definition *definition = cbe_definition(ctx, use->variable);
+    enum cbe_validation_result result = CBE_VALID_OK;
+    cbe_type_id expected = SIZE_MAX;
+    if (definition != NULL && definition->block == use->block) {
+      result = CBE_VALID_USED_BEFORE_DEFINED;
+    } else if (definition != NULL) {
+      expected = definition->type_id;
+      if (!cbe_same_type(ctx, expected, use->type_id))
+        result = CBE_VALID_TYPE_MISMATCH;
+    } else if (cbe_find_global_variable(ctx, use->variable) == SIZE_MAX) {
+      result = CBE_VALID_UNDEFINED_SYMBOL;
+    } else if (!cbe_is_pointer(ctx, use->type_id)) {
+      result = CBE_VALID_NOT_A_POINTER;
+    }
+    if (result == CBE_VALID_OK)
+      continue;
+    cbe_type_id found = result == CBE_VALID_UNDEFINED_SYMBOL ||
+                                result == CBE_VALID_USED_BEFORE_DEFINED
+                            ? SIZE_MAX
+                            : use->type_id;
+    cbe_fail(&use->diagnostic, result, use->diagnostic.operand, expected,
+             found);
+    slice_push(&ctx->diagnostics, use->diagnostic);
+    if (first == CBE_VALID_OK)
+      first = result;
+  }
+  ctx->pending_uses.size = 0;
+  pop_stack_frame(ctx);
+  return first;
+}
+
+// Records a failure of the signature of the function in `diagnostic`.
+static enum cbe_validation_result
+cbe_report(struct cbe_context *ctx, struct cbe_diagnostic diagnostic,
+           enum cbe_validation_result result, usz parameter,
+           cbe_type_id found) {
+  cbe_fail(&diagnostic, result, parameter, SIZE_MAX, found);
+  slice_push(&ctx->diagnostics, diagnostic);
+  return result;
+}
+
+static enum cbe_validation_result
+cbe_validate_signature_type(struct cbe_context *ctx, cbe_type_id id) {
+  if (!cbe_known_type(ctx, id))
+    return CBE_VALID_UNKNOWN_TYPE;
+  return cbe_validate_type(ctx, ctx->types.items[id]);
+}
+
+// The name and return type of `fn`, and its parameters, which all have to
+// arrive in registers. Every failure is recorded into ctx->diagnostics, with
+// the parameter as its operand, and the first one is returned.
+enum cbe_validation_result cbe_validate_signature(struct cbe_context *ctx,
+                                                  struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  enum cbe_validation_result first = CBE_VALID_OK, result;
+  struct cbe_diagnostic diagnostic = {.symbol = fn->name_index,
+                                      .block = SIZE_MAX,
+                                      .instruction = SIZE_MAX};
+  if (fn->name_index >= ctx->symbol_table.size)
+    first = cbe_report(ctx, diagnostic, CBE_VALID_UNKNOWN_SYMBOL, SIZE_MAX,
+                       SIZE_MAX);
+  result = cbe_validate_signature_type(ctx, fn->type_id);
+  if (result != CBE_VALID_OK) {
+    cbe_type_id found = result == CBE_VALID_UNKNOWN_TYPE ? SIZE_MAX
+                                                         : fn->type_id;
+    result = cbe_report(ctx, diagnostic, result, SIZE_MAX, found);
+    if (first == CBE_VALID_OK)
+      first = result;
+  }
+
+  usz general = 0, vectors = 0;
+  for (usz k = 0; k < fn->parameters.size; k++) {
+    struct cbe_temporary *parameter = &fn->parameters.items[k];
+    cbe_type_id found = parameter->type_id;
+    result = cbe_validate_signature_type(ctx, found);
+    if (parameter->name_index >= ctx->symbol_table.size) {
+      result = CBE_VALID_UNKNOWN_SYMBOL;
+      found = SIZE_MAX;
+    } else if (result == CBE_VALID_UNKNOWN_TYPE) {
+      found = SIZE_MAX;
+    } else if (result == CBE_VALID_OK &&
+               cbe_tag(ctx, found) == CBE_TYPE_VOID) {
+      result = CBE_VALID_UNSUPPORTED_TYPE;
+    } else if (result == CBE_VALID_OK) {
+      // The first parameter past the registers of its class.
+      bool vector = cbe_type_register_class(ctx, found) ==
+                    CBE_REGISTER_CLASS_VECTOR;
+      usz count = vector ? ++vectors : ++general;
+      usz limit =
+          vector ? CBE_VECTOR_ARGUMENT_REGISTERS : CBE_ARGUMENT_REGISTERS;
+      if (count == limit + 1)
+        result = CBE_VALID_ARGUMENT_COUNT;
+    }
+    if (result == CBE_VALID_OK)
+      continue;
+    result = cbe_report(ctx, diagnostic, result, k, found);
+    if (first == CBE_VALID_OK)
+      first = result;
+  }
+  pop_stack_frame(ctx);
+  return first;
+}
+
+static cstr cbe_symbol_name(struct cbe_context *ctx, usz name_index) {
+  if (name_index >= ctx->symbol_table.size)
+    return "?";
+  return ctx->symbol_table.items[name_index];
+}
+
+// One line per diagnostic:
+//
+//   <function>.<block>:<instruction>: <opcode>: operand <n>: <result>,
+//   expected <type>, found <type>
+//
+// leaving out what the diagnostic does not name. A function's signature has
+// no block, and its parameters stand in for operands.
+void cbe_write_diagnostics(struct cbe_context *ctx, FILE *fp) {
+  push_stack_frame(ctx);
+  char expected[64], found[64];
+  for (usz i = 0; i < ctx->diagnostics.size; i++) {
+    struct cbe_diagnostic *d = &ctx->diagnostics.items[i];
+    fprintf(fp, "%s", cbe_symbol_name(ctx, d->symbol));
+    if (d->block != SIZE_MAX)
+      fprintf(fp, ".%s", cbe_symbol_name(ctx, d->block));
+    struct cbe_block *block = NULL;
+    usz index = cbe_function_by_name(ctx, d->symbol);
+    if (index != SIZE_MAX && d->block != SIZE_MAX)
+      block = cbe_find_block(&ctx->functions.items[index], d->block);
+    if (block != NULL && d->instruction < block->instructions.size) {
+      struct cbe_instruction *inst = &block->instructions.items[d->instruction];
+      fprintf(fp, ":%zu: %s", d->instruction,
+              cbe_instruction_names[inst->tag]);
+    }
+    if (d->operand != SIZE_MAX)
+      fprintf(fp, d->block == SIZE_MAX ? ": parameter %zu" : ": operand %zu",
+              d->operand);
+    fprintf(fp, ": %s", cbe_validation_results[d->result]);
+    if (d->expected != SIZE_MAX) {
+      cbe_format_type(ctx, expected, sizeof(expected), d->expected);
+      fprintf(fp, ", expected %s", expected);
+    }
+    if (d->found != SIZE_MAX) {
+      cbe_format_type(ctx, found, sizeof(found), d->found);
+      fprintf(fp, ", found %s", found);
+    }
+    fprintf(fp, "\n");
+  }
+  pop_stack_frame(ctx);
+}
@@ -0,0 +1,836 @@
+#include "cbe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Loop vectorization.
+//
+// Loops are recognized in the shape the front end gives them, with the
+// induction variable and any accumulators kept in alloc'd slots:
+//
+//   header:  %i = load %counter              body:  ...
+//            %c = cmp lt %i, <bound>                %n = add %i, 1
+//            br %c, body, exit                      store %n, %counter
+//                                                   jmp header
+//
+// The body may only index invariant pointers by %i, compute on the loaded
+// values and store the results back the same way, or fold them into an
+// accumulator slot with add, mul, and, or or xor. Such a loop gets a vector
+// copy that runs first and handles `lanes` iterations at a time, with
+// invariants broadcast once before it and the partial results of every
+// accumulator added up after it. The original loop is left in place as the
+// epilogue for the remaining iterations, and as the fallback when a runtime
+// check finds that the arrays overlap within a vector's width.
+
+#define CBE_VECTOR_MAX_VALUES 32
+
+enum cbe_vector_role {
+  CBE_VECTOR_INVARIANT, // defined outside of the loop
+  CBE_VECTOR_SLOT,      // address of an alloc'd slot
+  CBE_VECTOR_COUNTER,   // the header's load of the induction variable
+  CBE_VECTOR_STEP,      // the counter plus one
+  CBE_VECTOR_ADDRESS,   // an invariant pointer indexed by the counter
+  CBE_VECTOR_LANES,     // a value of each iteration, one lane each
+  CBE_VECTOR_MASK,      // a compare, as lane masks
+  CBE_VECTOR_CONDITION, // the header's compare
+};
+
+struct cbe_vector_reduction {
+  usz slot;       // name of the accumulator slot.
+  usz load, op;   // names of its load and of the update that is stored.
+  usz vector;     // name of the vector slot holding the partial results.
+  cbe_type_id type_id, slot_type, pointer_type;
+  enum cbe_instruction_tag tag;
+};
+
+struct cbe_vector_loop {
+  struct cbe_context *ctx;
+  struct cbe_function *fn;
+  usz header, body; // block indices.
+  usz counter, induction;
+  struct cbe_instruction *compare;
+  usz element_size, lanes;
+  u8 *roles;        // enum cbe_vector_role, by name index.
+  usz *vector_names; // name of the vector counterpart, by name index.
+
+  struct cbe_vector_reduction reductions[CBE_VECTOR_MAX_VALUES];
+  usz reduction_count;
+  struct cbe_value stored_bases[CBE_VECTOR_MAX_VALUES];
+  struct cbe_value loaded_bases[CBE_VECTOR_MAX_VALUES];
+  usz stored_count, loaded_count;
+  struct cbe_value broadcasts[CBE_VECTOR_MAX_VALUES];
+  usz broadcast_names[CBE_VECTOR_MAX_VALUES];
+  usz broadcast_count;
+
+  struct cbe_block entry, head, vector_body, exit;
+  bool supported;
+};
+
+static struct cbe_value cbe_vector_variable(cbe_type_id type_id, usz name) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_VARIABLE, .type_id = type_id, .variable = name};
+}
+
+static struct cbe_value cbe_vector_integer(cbe_type_id type_id, i64 integer) {
+  return (struct cbe_value){
+      .tag = CBE_VALUE_INTEGER, .type_id = type_id, .integer = integer};
+}
+
+static cbe_type_id cbe_vector_find_type(struct cbe_context *ctx,
+                                        struct cbe_type type) {
+  for (usz i = 0; i < ctx->types.size; i++) {
+    struct cbe_type other = ctx->types.items[i];
+    if (other.tag != type.tag)
+      continue;
+    if (type.tag == CBE_TYPE_PTR && other.ptr == type.ptr)
+      return i;
+    if (type.tag != CBE_TYPE_VECTOR && type.tag != CBE_TYPE_PTR)
+      return i;
+    if (type.tag == CBE_TYPE_VECTOR && other.lanes == type.lanes &&
+        ctx->types.items[other.element].tag ==
+            ctx->types.items[type.element].tag)
+      return i;
+  }
+  return cbe_add_type(ctx, type);
+}
+
+static cbe_type_id cbe_vector_type(struct cbe_vector_loop *loop,
+                                   cbe_type_id element) {
+  return cbe_vector_find_type(
+      loop->ctx, (struct cbe_type){.tag = CBE_TYPE_VECTOR,
+                                   .element = element,
+                                   .lanes = loop->lanes});
+}
+
+// Compares give lane masks as wide as the lanes they compare.
+static cbe_type_id cbe_vector_mask_type(struct cbe_vector_loop *loop) {
+  cbe_type_id element = cbe_vector_find_type(
+      loop->ctx,
+      (struct cbe_type){loop->element_size == 8 ? CBE_TYPE_LONG
+                                                : CBE_TYPE_INT});
+  return cbe_vector_type(loop, element);
+}
+
+static usz cbe_vector_name(struct cbe_vector_loop *loop, usz name,
+                           cstr suffix) {
+  struct cbe_context *ctx = loop->ctx;
+  cstr base = ctx->symbol_table.items[name];
+  usz size = strlen(base) + strlen(suffix) + 2;
+  char *text = CBE_ALLOC(size);
+  snprintf(text, size, "%s.%s", base, suffix);
+  return cbe_add_symbol(ctx, text);
+}
+
+static bool cbe_vector_is_lane_type(struct cbe_vector_loop *loop,
+                                    cbe_type_id type_id) {
+  switch (loop->ctx->types.items[type_id].tag) {
+  case CBE_TYPE_INT:
+  case CBE_TYPE_LONG:
+  case CBE_TYPE_FLOAT:
+  case CBE_TYPE_DOUBLE:
+    break;
+  default:
+    return false;
+  }
+  usz size = cbe_type_size(loop->ctx, type_id);
+  if (loop->element_size == 0)
+    loop->element_size = size;
+  return size == loop->element_size;
+}
+
+static enum cbe_vector_role cbe_vector_role(struct cbe_vector_loop *loop,
+                                            struct cbe_value value) {
+  if (value.tag != CBE_VALUE_VARIABLE)
+    return CBE_VECTOR_INVARIANT;
+  return loop->roles[value.variable];
+}
+
+// Whether `value` can be a lane operand: a value of the loop, or an
+// invariant scalar that can be broadcast.
+static bool cbe_vector_is_operand(struct cbe_vector_loop *loop,
+                                  struct cbe_value value) {
+  switch (cbe_vector_role(loop, value)) {
+  case CBE_VECTOR_LANES:
+    return true;
+  case CBE_VECTOR_INVARIANT:
+    return (value.tag == CBE_VALUE_VARIABLE ||
+            value.tag == CBE_VALUE_INTEGER || value.tag == CBE_VALUE_FLOAT) &&
+           cbe_vector_is_lane_type(loop, value.type_id);
+  default:
+    return false;
+  }
+}
+
+static void cbe_vector_add_base(struct cbe_value *bases, usz *count,
+                                struct cbe_value base) {
+  for (usz i = 0; i < *count; i++) {
+    if (bases[i].variable == base.variable)
+      return;
+  }
+  bases[(*count)++] = base;
+}
+
+static struct cbe_vector_reduction *
+cbe_vector_find_reduction(struct cbe_vector_loop *loop, usz slot) {
+  for (usz i = 0; i < loop->reduction_count; i++) {
+    if (loop->reductions[i].slot == slot)
+      return &loop->reductions[i];
+  }
+  if (loop->reduction_count == CBE_VECTOR_MAX_VALUES)
+    return NULL;
+  struct cbe_vector_reduction *reduction =
+      &loop->reductions[loop->reduction_count++];
+  *reduction = (struct cbe_vector_reduction){
+      .slot = slot, .load = SIZE_MAX, .op = SIZE_MAX};
+  return reduction;
+}
+
+// Gives a role to everything the body defines, or returns false if some
+// instruction has no vector counterpart.
+static bool cbe_vector_classify(struct cbe_vector_loop *loop) {
+  struct cbe_context *ctx = loop->ctx;
+  struct cbe_block *body = &loop->fn->blocks.items[loop->body];
+  bool stepped = false;
+  for (usz i = 0; i + 1 < body->instructions.size; i++) {
+    struct cbe_instruction *inst = &body->instructions.items[i];
+    enum cbe_vector_role role = CBE_VECTOR_LANES;
+    switch (inst->tag) {
+    case CBE_INST_ELEMPTR: {
+      struct cbe_type type = ctx->types.items[inst->temporary.type_id];
+      if (cbe_vector_role(loop, inst->elemptr.pointer) !=
+              CBE_VECTOR_INVARIANT ||
+          inst->elemptr.pointer.tag != CBE_VALUE_VARIABLE ||
+          cbe_vector_role(loop, inst->elemptr.index) != CBE_VECTOR_COUNTER ||
+          type.tag != CBE_TYPE_PTR || !cbe_vector_is_lane_type(loop, type.ptr))
+        return false;
+      role = CBE_VECTOR_ADDRESS;
+    } break;
+
+    case CBE_INST_LOAD:
+      if (!cbe_vector_is_lane_type(loop, inst->temporary.type_id))
+        return false;
+      if (cbe_vector_role(loop, inst->load.pointer) == CBE_VECTOR_ADDRESS)
+        break;
+      if (cbe_vector_role(loop, inst->load.pointer) != CBE_VECTOR_SLOT ||
+          inst->load.pointer.variable == loop->induction)
+        return false;
+      struct cbe_vector_reduction *reduction =
+          cbe_vector_find_reduction(loop, inst->load.pointer.variable);
+      if (reduction == NULL || reduction->load != SIZE_MAX)
+        return false;
+      reduction->load = inst->temporary.name_index;
+      reduction->type_id = inst->temporary.type_id;
+      reduction->slot_type = inst->load.pointer.type_id;
+      break;
+
+    case CBE_INST_STORE: {
+      struct cbe_value pointer = inst->store.pointer;
+      struct cbe_value value = inst->store.value;
+      if (cbe_vector_role(loop, pointer) == CBE_VECTOR_SLOT &&
+          pointer.variable == loop->induction) {
+        if (stepped || cbe_vector_role(loop, value) != CBE_VECTOR_STEP)
+          return false;
+        stepped = true;
+      } else if (cbe_vector_role(loop, pointer) == CBE_VECTOR_SLOT) {
+        struct cbe_vector_reduction *reduction =
+            cbe_vector_find_reduction(loop, pointer.variable);
+        if (reduction == NULL || reduction->op != SIZE_MAX ||
+            cbe_vector_role(loop, value) != CBE_VECTOR_LANES)
+          return false;
+        reduction->op = value.variable;
+      } else if (cbe_vector_role(loop, pointer) != CBE_VECTOR_ADDRESS ||
+                 !cbe_vector_is_operand(loop, value)) {
+        return false;
+      }
+    } break;
+
+    case CBE_INST_ADD:
+      if ((cbe_vector_role(loop, inst->binary.lhs) == CBE_VECTOR_COUNTER &&
+           inst->binary.rhs.tag == CBE_VALUE_INTEGER &&
+           inst->binary.rhs.integer == 1) ||
+          (cbe_vector_role(loop, inst->binary.rhs) == CBE_VECTOR_COUNTER &&
+           inst->binary.lhs.tag == CBE_VALUE_INTEGER &&
+           inst->binary.lhs.integer == 1)) {
+        role = CBE_VECTOR_STEP;
+        break;
+      }
+      // fallthrough
+    case CBE_INST_SUB:
+    case CBE_INST_MUL:
+    case CBE_INST_DIV:
+    case CBE_INST_AND:
+    case CBE_INST_OR:
+    case CBE_INST_XOR:
+      if (!cbe_vector_is_lane_type(loop, inst->temporary.type_id) ||
+          !cbe_vector_is_operand(loop, inst->binary.lhs) ||
+          !cbe_vector_is_operand(loop, inst->binary.rhs))
+        return false;
+      break;
+
+    case CBE_INST_CMP:
+      if (!cbe_vector_is_operand(loop, inst->cmp.lhs) ||
+          !cbe_vector_is_operand(loop, inst->cmp.rhs))
+        return false;
+      role = CBE_VECTOR_MASK;
+      break;
+
+    case CBE_INST_SELECT:
+      if (cbe_vector_role(loop, inst->select.condition) != CBE_VECTOR_MASK ||
+          !cbe_vector_is_lane_type(loop, inst->temporary.type_id) ||
+          !cbe_vector_is_operand(loop, inst->select.then_value) ||
+          !cbe_vector_is_operand(loop, inst->select.else_value))
+        return false;
+      break;
+
+    default:
+      return false;
+    }
+    if (inst->has_temporary)
+      loop->roles[inst->temporary.name_index] = role;
+    if (inst->tag == CBE_INST_ELEMPTR)
+      continue;
+    // Remember which arrays are read and written, for the overlap check.
+    for (usz k = 0; k < cbe_instruction_operand_count(inst); k++) {
+      struct cbe_value *value = cbe_instruction_operand(inst, k);
+      if (cbe_vector_role(loop, *value) != CBE_VECTOR_ADDRESS)
+        continue;
+      struct cbe_instruction *address = NULL;
+      for (usz j = 0; address == NULL && j < i; j++) {
+        struct cbe_instruction *other = &body->instructions.items[j];
+        if (other->has_temporary &&
+            other->temporary.name_index == value->variable)
+          address = other;
+      }
+      CBE_ASSERT(*ctx, address != NULL);
+      if (inst->tag == CBE_INST_STORE)
+        cbe_vector_add_base(loop->stored_bases, &loop->stored_count,
+                            address->elemptr.pointer);
+      else
+        cbe_vector_add_base(loop->loaded_bases, &loop->loaded_count,
+                            address->elemptr.pointer);
+      if (loop->stored_count == CBE_VECTOR_MAX_VALUES ||
+          loop->loaded_count == CBE_VECTOR_MAX_VALUES)
+        return false;
+    }
+  }
+  return stepped && loop->element_size != 0;
+}
+
+// Checks how the values of the loop are used: accumulators may only be
+// updated in place, masks only select, and nothing defined in the loop may be
+// read after it (other than the counter, which the epilogue redefines).
+static bool cbe_vector_check_uses(struct cbe_vector_loop *loop) {
+  push_stack_frame(loop->ctx);
+  struct cbe_context *ctx = loop->ctx;
+  struct cbe_function *fn = loop->fn;
+  usz names = ctx->symbol_table.size;
+  usz *uses = CBE_ALLOC(sizeof(usz) * names);
+  memset(uses, 0, sizeof(usz) * names);
+  bool ok = true;
+  for (usz b = 0; ok && b < fn->blocks.size; b++) {
+    struct cbe_block *block = &fn->blocks.items[b];
+    bool in_loop = b == loop->header || b == loop->body;
+    for (usz i = 0; ok && i < block->instructions.size; i++) {
+      struct cbe_instruction *inst = &block->instructions.items[i];
+      for (usz k = 0; ok && k < cbe_instruction_operand_count(inst); k++) {
+        struct cbe_value *value = cbe_instruction_operand(inst, k);
+        if (value->tag != CBE_VALUE_VARIABLE)
+          continue;
+        enum cbe_vector_role role = loop->roles[value->variable];
+        uses[value->variable]++;
+        // Slots must not escape, or stores through the arrays could reach
+        // them.
+        if (role == CBE_VECTOR_SLOT)
+          ok = (inst->tag == CBE_INST_LOAD && value == &inst->load.pointer) ||
+               (inst->tag == CBE_INST_STORE && value == &inst->store.pointer);
+        else if (role == CBE_VECTOR_MASK)
+          ok = inst->tag == CBE_INST_SELECT &&
+               value == &inst->select.condition;
+        else if (!in_loop)
+          ok = role == CBE_VECTOR_INVARIANT || role == CBE_VECTOR_COUNTER;
+      }
+    }
+  }
+
+  for (usz i = 0; ok && i < loop->reduction_count; i++) {
+    struct cbe_vector_reduction *reduction = &loop->reductions[i];
+    ok = reduction->load != SIZE_MAX && reduction->op != SIZE_MAX &&
+         uses[reduction->load] == 1 && uses[reduction->op] == 1 &&
+         ctx->types.items[reduction->type_id].tag != CBE_TYPE_FLOAT &&
+         ctx->types.items[reduction->type_id].tag != CBE_TYPE_DOUBLE;
+    // The only use of the loaded value is the update, which has to be an
+    // associative operation on it.
+    struct cbe_block *body = &fn->blocks.items[loop->body];
+    for (usz j = 0; ok && j < body->instructions.size; j++) {
+      struct cbe_instruction *inst = &body->instructions.items[j];
+      if (!inst->has_temporary ||
+          inst->temporary.name_index != reduction->op)
+        continue;
+      ok = (inst->tag == CBE_INST_ADD || inst->tag == CBE_INST_MUL ||
+            inst->tag == CBE_INST_AND || inst->tag == CBE_INST_OR ||
+            inst->tag == CBE_INST_XOR) &&
+           ((inst->binary.lhs.tag == CBE_VALUE_VARIABLE &&
+             inst->binary.lhs.variable == reduction->load) ||
+            (inst->binary.rhs.tag == CBE_VALUE_VARIABLE &&
+             inst->binary.rhs.variable == reduction->load));
+      reduction->tag = inst->tag;
+    }
+  }
+  pop_stack_frame(loop->ctx);
+  return ok;
+}
+
+static void cbe_vector_push(struct cbe_vector_loop *loop,
+                            struct cbe_block *block,
+                            struct cbe_instruction inst) {
+  if (cbe_validate_instruction(loop->ctx, &inst, NULL) != CBE_VALID_OK)
+    loop->supported = false;
+  slice_push(&block->instructions, inst);
+}
+
+// The vector counterpart of a lane operand. Invariants are broadcast once,
+// before the loop.
+static struct cbe_value cbe_vector_operand(struct cbe_vector_loop *loop,
+                                           struct cbe_value value) {
+  if (value.tag == CBE_VALUE_VARIABLE &&
+      loop->vector_names[value.variable] != SIZE_MAX)
+    return cbe_vector_variable(cbe_vector_type(loop, value.type_id),
+                               loop->vector_names[value.variable]);
+  for (usz i = 0; i < loop->broadcast_count; i++) {
+    struct cbe_value other = loop->broadcasts[i];
+    if (other.tag == value.tag && other.type_id == value.type_id &&
+        other.integer == value.integer)
+      return cbe_vector_variable(cbe_vector_type(loop, value.type_id),
+                                 loop->broadcast_names[i]);
+  }
+  if (loop->broadcast_count == CBE_VECTOR_MAX_VALUES) {
+    loop->supported = false;
+    return value;
+  }
+
+  usz name = cbe_vector_name(loop, loop->entry.name_index, "broadcast");
+  cbe_type_id type_id = cbe_vector_type(loop, value.type_id);
+  cbe_vector_push(loop, &loop->entry,
+                  (struct cbe_instruction){.tag = CBE_INST_BROADCAST,
+                                           .has_temporary = true,
+                                           .temporary = {name, type_id},
+                                           .broadcast = {value}});
+  loop->broadcasts[loop->broadcast_count] = value;
+  loop->broadcast_names[loop->broadcast_count++] = name;
+  return cbe_vector_variable(type_id, name);
+}
+
+static struct cbe_vector_reduction *
+cbe_vector_reduction_of_slot(struct cbe_vector_loop *loop, usz slot) {
+  for (usz i = 0; i < loop->reduction_count; i++) {
+    if (loop->reductions[i].slot == slot)
+      return &loop->reductions[i];
+  }
+  return NULL;
+}
+
+static i64 cbe_vector_identity(enum cbe_instruction_tag tag) {
+  switch (tag) {
+  case CBE_INST_MUL:
+    return 1;
+  case CBE_INST_AND:
+    return -1;
+  default:
+    return 0;
+  }
+}
+
+// Clones the body with every lane value widened to a vector.
+static void cbe_vector_build_body(struct cbe_vector_loop *loop,
+                                  struct cbe_value counter) {
+  struct cbe_block *body = &loop->fn->blocks.items[loop->body];
+  for (usz i = 0; i + 1 < body->instructions.size; i++) {
+    struct cbe_instruction inst = body->instructions.items[i];
+    usz name = inst.has_temporary ? inst.temporary.name_index : SIZE_MAX;
+    if (name != SIZE_MAX) {
+      if (loop->roles[name] == CBE_VECTOR_STEP)
+        continue;
+      loop->vector_names[name] = cbe_vector_name(loop, name, "v");
+      inst.temporary.name_index = loop->vector_names[name];
+      if (inst.tag != CBE_INST_ELEMPTR)
+        inst.temporary.type_id =
+            loop->roles[name] == CBE_VECTOR_MASK
+                ? cbe_vector_mask_type(loop)
+                : cbe_vector_type(loop, inst.temporary.type_id);
+    }
+
+    struct cbe_vector_reduction *reduction = NULL;
+    switch (inst.tag) {
+    case CBE_INST_ELEMPTR:
+      inst.elemptr.index = counter;
+      break;
+
+    case CBE_INST_LOAD:
+      reduction =
+          cbe_vector_reduction_of_slot(loop, inst.load.pointer.variable);
+      if (reduction != NULL)
+        inst.load.pointer.variable = reduction->vector;
+      else
+        inst.load.pointer.variable =
+            loop->vector_names[inst.load.pointer.variable];
+      break;
+
+    case CBE_INST_STORE:
+      if (inst.store.pointer.variable == loop->induction)
+        continue;
+      reduction =
+          cbe_vector_reduction_of_slot(loop, inst.store.pointer.variable);
+      if (reduction != NULL)
+        inst.store.pointer.variable = reduction->vector;
+      else
+        inst.store.pointer.variable =
+            loop->vector_names[inst.store.pointer.variable];
+      inst.store.value = cbe_vector_operand(loop, inst.store.value);
+      break;
+
+    case CBE_INST_SELECT:
+      inst.select.condition = cbe_vector_operand(loop, inst.select.condition);
+      inst.select.then_value = cbe_vector_operand(loop, inst.select.then_value);
+      inst.select.else_value = cbe_vector_operand(loop, inst.select.else_value);
+      break;
+
+    case CBE_INST_CMP:
+      inst.cmp.lhs = cbe_vector_operand(loop, inst.cmp.lhs);
+      inst.cmp.rhs = cbe_vector_operand(loop, inst.cmp.rhs);
+      break;
+
+    default:
+      inst.binary.lhs = cbe_vector_operand(loop, inst.binary.lhs);
+      inst.binary.rhs = cbe_vector_operand(loop, inst.binary.rhs);
+      break;
+    }
+    cbe_vector_push(loop, &loop->vector_body, inst);
+  }
+}
+
+// Two arrays overlap within a vector's width unless their distance d is 0 or
+// |d| >= width, the latter being (d + width - 1) >= 2 * width - 1 unsigned.
+static void cbe_vector_build_overlap_check(struct cbe_vector_loop *loop,
+                                           usz scalar, usz vector) {
+  struct cbe_context *ctx = loop->ctx;
+  cbe_type_id long_type =
+      cbe_vector_find_type(ctx, (struct cbe_type){CBE_TYPE_LONG});
+  cbe_type_id int_type =
+      cbe_vector_find_type(ctx, (struct cbe_type){CBE_TYPE_INT});
+  i64 width = (i64)(loop->lanes * loop->element_size);
+  struct cbe_value overlap = cbe_vector_integer(int_type, 0);
+  for (usz i = 0; i < loop->stored_count; i++) {
+    for (usz j = 0; j < loop->stored_count + loop->loaded_count; j++) {
+      struct cbe_value a = loop->stored_bases[i];
+      struct cbe_value b = j < loop->stored_count
+                               ? loop->stored_bases[j]
+                               : loop->loaded_bases[j - loop->stored_count];
+      if (a.variable == b.variable || (j < loop->stored_count && j < i))
+        continue;
+      usz entry = loop->entry.name_index;
+      usz distance = cbe_vector_name(loop, entry, "distance");
+      usz biased = cbe_vector_name(loop, entry, "biased");
+      usz near = cbe_vector_name(loop, entry, "near");
+      usz apart = cbe_vector_name(loop, entry, "apart");
+      usz both = cbe_vector_name(loop, entry, "both");
+      usz any = cbe_vector_name(loop, entry, "overlap");
+      struct cbe_instruction check[] = {
+          {.tag = CBE_INST_SUB,
+           .has_temporary = true,
+           .temporary = {distance, long_type},
+           .binary = {a, b}},
+          {.tag = CBE_INST_ADD,
+           .has_temporary = true,
+           .temporary = {biased, long_type},
+           .binary = {cbe_vector_variable(long_type, distance),
+                      cbe_vector_integer(long_type, width - 1)}},
+          {.tag = CBE_INST_CMP,
+           .has_temporary = true,
+           .temporary = {near, int_type},
+           .cmp = {CBE_PRED_ULT, cbe_vector_variable(long_type, biased),
+                   cbe_vector_integer(long_type, 2 * width - 1)}},
+          {.tag = CBE_INST_CMP,
+           .has_temporary = true,
+           .temporary = {apart, int_type},
+           .cmp = {CBE_PRED_NE, cbe_vector_variable(long_type, distance),
+                   cbe_vector_integer(long_type, 0)}},
+          {.tag = CBE_INST_AND,
+           .has_temporary = true,
+           .temporary = {both, int_type},
+           .binary = {cbe_vector_variable(int_type, near),
+                      cbe_vector_variable(int_type, apart)}},
+          {.tag = CBE_INST_OR,
+           .has_temporary = true,
+           .temporary = {any, int_type},
+           .binary = {overlap, cbe_vector_variable(int_type, both)}},
+      };
+      for (usz k = 0; k < CBE_ARRAY_LEN(check); k++)
+        cbe_vector_push(loop, &loop->entry, check[k]);
+      overlap = cbe_vector_variable(int_type, any);
+    }
+  }
+
+  if (overlap.tag == CBE_VALUE_INTEGER) {
+    cbe_vector_push(loop, &loop->entry,
+                    (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                             .jmp = {vector}});
+    return;
+  }
+  cbe_vector_push(loop, &loop->entry,
+                  (struct cbe_instruction){.tag = CBE_INST_BR,
+                                           .br = {overlap, scalar, vector}});
+}
+
+static void cbe_vector_build(struct cbe_vector_loop *loop) {
+  struct cbe_context *ctx = loop->ctx;
+  struct cbe_block *header = &loop->fn->blocks.items[loop->header];
+  struct cbe_instruction *counter_load = &header->instructions.items[0];
+  cbe_type_id counter_type = counter_load->temporary.type_id;
+  struct cbe_value induction =
+      cbe_vector_variable(counter_load->load.pointer.type_id, loop->induction);
+
+  struct cbe_block *blocks[] = {&loop->entry, &loop->head, &loop->vector_body,
+                                &loop->exit};
+  cstr suffixes[] = {"vector.entry", "vector.head", "vector.body",
+                     "vector.exit"};
+  for (usz i = 0; i < CBE_ARRAY_LEN(blocks); i++) {
+    *blocks[i] = (struct cbe_block){
+        .name_index = cbe_vector_name(loop, header->name_index, suffixes[i])};
+    slice_init(&blocks[i]->instructions);
+  }
+
+  // Start every lane of an accumulator at the operation's identity.
+  for (usz i = 0; i < loop->reduction_count; i++) {
+    struct cbe_vector_reduction *reduction = &loop->reductions[i];
+    reduction->vector = cbe_vector_name(loop, reduction->slot, "v");
+    reduction->pointer_type = cbe_vector_find_type(
+        ctx, (struct cbe_type){.tag = CBE_TYPE_PTR, .ptr = reduction->type_id});
+    cbe_vector_push(
+        loop, &loop->entry,
+        (struct cbe_instruction){
+            .tag = CBE_INST_ALLOC,
+            .has_temporary = true,
+            .temporary = {reduction->vector, reduction->pointer_type},
+            .alloc = {cbe_vector_type(loop, reduction->type_id)}});
+    struct cbe_value identity = cbe_vector_operand(
+        loop, cbe_vector_integer(reduction->type_id,
+                                 cbe_vector_identity(reduction->tag)));
+    cbe_vector_push(
+        loop, &loop->entry,
+        (struct cbe_instruction){
+            .tag = CBE_INST_STORE,
+            .store = {identity, cbe_vector_variable(reduction->pointer_type,
+                                                    reduction->vector)}});
+  }
+
+  // head: %vi = load %counter; %end = add %vi, lanes;
+  //       %more = cmp le %end, <bound>; br %more, body, exit
+  usz counter = cbe_vector_name(loop, loop->counter, "v");
+  usz end = cbe_vector_name(loop, loop->counter, "end");
+  usz more = cbe_vector_name(loop, loop->counter, "more");
+  cbe_vector_push(loop, &loop->head,
+                  (struct cbe_instruction){.tag = CBE_INST_LOAD,
+                                           .has_temporary = true,
+                                           .temporary = {counter, counter_type},
+                                           .load = {induction}});
+  cbe_vector_push(
+      loop, &loop->head,
+      (struct cbe_instruction){
+          .tag = CBE_INST_ADD,
+          .has_temporary = true,
+          .temporary = {end, counter_type},
+          .binary = {cbe_vector_variable(counter_type, counter),
+                     cbe_vector_integer(counter_type, (i64)loop->lanes)}});
+  cbe_vector_push(
+      loop, &loop->head,
+      (struct cbe_instruction){
+          .tag = CBE_INST_CMP,
+          .has_temporary = true,
+          .temporary = {more, loop->compare->temporary.type_id},
+          .cmp = {loop->compare->cmp.predicate == CBE_PRED_LT ? CBE_PRED_LE
+                                                              : CBE_PRED_ULE,
+                  cbe_vector_variable(counter_type, end),
+                  loop->compare->cmp.rhs}});
+  cbe_vector_push(
+      loop, &loop->head,
+      (struct cbe_instruction){
+          .tag = CBE_INST_BR,
+          .br = {cbe_vector_variable(loop->compare->temporary.type_id, more),
+                 loop->vector_body.name_index, loop->exit.name_index}});
+
+  cbe_vector_build_body(loop, cbe_vector_variable(counter_type, counter));
+  cbe_vector_push(loop, &loop->vector_body,
+                  (struct cbe_instruction){
+                      .tag = CBE_INST_STORE,
+                      .store = {cbe_vector_variable(counter_type, end),
+                                induction}});
+  cbe_vector_push(loop, &loop->vector_body,
+                  (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                           .jmp = {loop->head.name_index}});
+
+  // Fold the lanes of every accumulator into its scalar slot.
+  for (usz i = 0; i < loop->reduction_count; i++) {
+    struct cbe_vector_reduction *reduction = &loop->reductions[i];
+    struct cbe_value slot =
+        cbe_vector_variable(reduction->slot_type, reduction->slot);
+    usz total = cbe_vector_name(loop, reduction->slot, "total");
+    cbe_vector_push(loop, &loop->exit,
+                    (struct cbe_instruction){
+                        .tag = CBE_INST_LOAD,
+                        .has_temporary = true,
+                        .temporary = {total, reduction->type_id},
+                        .load = {slot}});
+    for (usz lane = 0; lane < loop->lanes; lane++) {
+      usz address = cbe_vector_name(loop, reduction->slot, "lane");
+      usz value = cbe_vector_name(loop, reduction->slot, "value");
+      usz sum = cbe_vector_name(loop, reduction->slot, "total");
+      cbe_type_id long_type =
+          cbe_vector_find_type(ctx, (struct cbe_type){CBE_TYPE_LONG});
+      cbe_vector_push(
+          loop, &loop->exit,
+          (struct cbe_instruction){
+              .tag = CBE_INST_ELEMPTR,
+              .has_temporary = true,
+              .temporary = {address, reduction->pointer_type},
+              .elemptr = {cbe_vector_variable(reduction->pointer_type,
+                                              reduction->vector),
+                          cbe_vector_integer(long_type, (i64)lane)}});
+      cbe_vector_push(
+          loop, &loop->exit,
+          (struct cbe_instruction){
+              .tag = CBE_INST_LOAD,
+              .has_temporary = true,
+              .temporary = {value, reduction->type_id},
+              .load = {cbe_vector_variable(reduction->pointer_type, address)}});
+      cbe_vector_push(
+          loop, &loop->exit,
+          (struct cbe_instruction){
+              .tag = reduction->tag,
+              .has_temporary = true,
+              .temporary = {sum, reduction->type_id},
+              .binary = {cbe_vector_variable(reduction->type_id, total),
+                         cbe_vector_variable(reduction->type_id, value)}});
+      total = sum;
+    }
+    cbe_vector_push(
+        loop, &loop->exit,
+        (struct cbe_instruction){
+            .tag = CBE_INST_STORE,
+            .store = {cbe_vector_variable(reduction->type_id, total), slot}});
+  }
+  cbe_vector_push(loop, &loop->exit,
+                  (struct cbe_instruction){.tag = CBE_INST_JMP,
+                                           .jmp = {header->name_index}});
+
+  cbe_vector_build_overlap_check(loop, header->name_index,
+                                 loop->head.name_index);
+}
+
+// Matches the header and latch of a counted loop at block `header`.
+static bool cbe_vector_match(struct cbe_vector_loop *loop, usz header) {
+  struct cbe_function *fn = loop->fn;
+  struct cbe_block *block = &fn->blocks.items[header];
+  if (header == 0 || block->instructions.size != 3)
+    return false;
+  struct cbe_instruction *load = &block->instructions.items[0];
+  struct cbe_instruction *compare = &block->instructions.items[1];
+  struct cbe_instruction *br = &block->instructions.items[2];
+  if (load->tag != CBE_INST_LOAD || compare->tag != CBE_INST_CMP ||
+      br->tag != CBE_INST_BR || load->load.pointer.tag != CBE_VALUE_VARIABLE ||
+      loop->roles[load->load.pointer.variable] != CBE_VECTOR_SLOT ||
+      cbe_type_size(loop->ctx, load->temporary.type_id) != 8 ||
+      (compare->cmp.predicate != CBE_PRED_LT &&
+       compare->cmp.predicate != CBE_PRED_ULT) ||
+      compare->cmp.lhs.tag != CBE_VALUE_VARIABLE ||
+      compare->cmp.lhs.variable != load->temporary.name_index ||
+      br->br.condition.tag != CBE_VALUE_VARIABLE ||
+      br->br.condition.variable != compare->temporary.name_index)
+    return false;
+
+  usz body = cbe_find_block_index(fn, br->br.then_block);
+  if (body == SIZE_MAX || body == header ||
+      br->br.else_block == br->br.then_block)
+    return false;
+  struct cbe_instruction *latch =
+      cbe_block_terminator(&fn->blocks.items[body]);
+  if (latch == NULL || latch->tag != CBE_INST_JMP ||
+      latch->jmp.block != block->name_index)
+    return false;
+
+  loop->header = header;
+  loop->body = body;
+  loop->counter = load->temporary.name_index;
+  loop->induction = load->load.pointer.variable;
+  loop->compare = compare;
+  return true;
+}
+
+void cbe_vectorize_loops(struct cbe_context *ctx, struct cbe_function *fn) {
+  push_stack_frame(ctx);
+  usz blocks = fn->blocks.size;
+  for (usz h = 0; h < blocks; h++) {
+    struct cbe_vector_loop loop = {.ctx = ctx, .fn = fn, .supported = true};
+    usz names = ctx->symbol_table.size;
+    loop.roles = CBE_ALLOC(names);
+    memset(loop.roles, CBE_VECTOR_INVARIANT, names);
+    loop.vector_names = CBE_ALLOC(sizeof(usz) * names);
+    memset(loop.vector_names, 0xff, sizeof(usz) * names);
+    for (usz b = 0; b < fn->blocks.size; b++) {
+      struct cbe_block *block = &fn->blocks.items[b];
+      for (usz i = 0; i < block->instructions.size; i++) {
+        struct cbe_instruction *inst = &block->instructions.items[i];
+        if (inst->tag == CBE_INST_ALLOC)
+          loop.roles[inst->temporary.name_index] = CBE_VECTOR_SLOT;
+      }
+    }
+    if (!cbe_vector_match(&loop, h))
+      continue;
+
+    // The bound has to be invariant, and so it is unless the loop defines it.
+    struct cbe_value bound = loop.compare->cmp.rhs;
+    struct cbe_block *body = &fn->blocks.items[loop.body];
+    for (usz i = 0; i < body->instructions.size; i++) {
+      struct cbe_instruction *inst = &body->instructions.items[i];
+      if (inst->has_temporary && bound.tag == CBE_VALUE_VARIABLE &&
+          inst->temporary.name_index == bound.variable)
+        loop.supported = false;
+    }
+    loop.roles[loop.counter] = CBE_VECTOR_COUNTER;
+    loop.roles[loop.compare->temporary.name_index] = CBE_VECTOR_CONDITION;
+    if (!loop.supported || !cbe_vector_classify(&loop) ||
+        !cbe_vector_check_uses(&loop))
+      continue;
+
+    loop.lanes = ((ctx->target_features & CBE_TARGET_AVX2) ? 32 : 16) /
+                 loop.element_size;
+    cbe_vector_build(&loop);
+    if (!loop.supported) {
+      CBE_TRACE(ctx, CBE_EVENT_SCALAR, CBE_REG_NONE, 0, 0,
+                fn->blocks.items[h].name_index, 0);
+      continue;
+    }
+
+    // Enter through the vector loop.
+    usz header_name = fn->blocks.items[h].name_index;
+    for (usz b = 0; b < fn->blocks.size; b++) {
+      struct cbe_instruction *terminator =
+          cbe_block_terminator(&fn->blocks.items[b]);
+      if (b == loop.body || terminator == NULL)
+        continue;
+      if (terminator->tag == CBE_INST_JMP &&
+          terminator->jmp.block == header_name)
+        terminator->jmp.block = loop.entry.name_index;
+      if (terminator->tag == CBE_INST_BR &&
+          terminator->br.then_block == header_name)
+        terminator->br.then_block = loop.entry.name_index;
+      if (terminator->tag == CBE_INST_BR &&
+          terminator->br.else_block == header_name)
+        terminator->br.else_block = loop.entry.name_index;
+    }
+    slice_push(&fn->blocks, loop.entry);
+    slice_push(&fn->blocks, loop.head);
+    slice_push(&fn->blocks, loop.vector_body);
+    slice_push(&fn->blocks, loop.exit);
+  }
+  pop_stack_frame(ctx);
+}